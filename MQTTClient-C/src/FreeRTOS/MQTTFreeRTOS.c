@@ -18,16 +18,30 @@
 #include "MQTTFreeRTOS.h"
 
 
+static void ThreadRun(void* parm)
+{
+	Thread* thread = (Thread*)parm;
+
+	thread->fn(thread->arg);
+	xSemaphoreGive(thread->done);
+	vTaskDelete(NULL); /* FreeRTOS tasks must not return */
+}
+
+
 int ThreadStart(Thread* thread, void (*fn)(void*), void* arg)
 {
 	int rc = 0;
 	uint16_t usTaskStackSize = (configMINIMAL_STACK_SIZE * 5);
 	UBaseType_t uxTaskPriority = uxTaskPriorityGet(NULL); /* set the priority as the same as the calling task*/
 
-	rc = xTaskCreate(fn,	/* The function that implements the task. */
+	thread->fn = fn;
+	thread->arg = arg;
+	if ((thread->done = xSemaphoreCreateBinary()) == NULL)
+		return pdFAIL;
+	rc = xTaskCreate(ThreadRun,	/* The function that implements the task. */
 		"MQTTTask",			/* Just a text name for the task to aid debugging. */
 		usTaskStackSize,	/* The stack size is defined in FreeRTOSIPConfig.h. */
-		arg,				/* The task parameter, not used in this case. */
+		thread,				/* The task parameter, which holds the function to run. */
 		uxTaskPriority,		/* The priority assigned to the task is defined in FreeRTOSConfig.h. */
 		&thread->task);		/* The task handle is not used. */
 
@@ -35,6 +49,53 @@ int ThreadStart(Thread* thread, void (*fn)(void*), void* arg)
 }
 
 
+int ThreadJoin(Thread* thread)
+{
+	int rc = xSemaphoreTake(thread->done, portMAX_DELAY);
+	vSemaphoreDelete(thread->done);
+	return rc;
+}
+
+
+void ConditionInit(Condition* cond)
+{
+	cond->sem = xSemaphoreCreateCounting(0x7FFF, 0);
+	cond->waiters = 0;
+}
+
+
+/* A semaphore can hand a broadcast to the wrong waiter, so don't sleep for more than 100ms
+ * at a time: callers check what they are waiting for after each return anyway. */
+int ConditionWait(Condition* cond, Mutex* mutex, Timer* timer)
+{
+	TickType_t xTicksToWait = pdMS_TO_TICKS(100);
+	int rc;
+
+	if (timer != NULL)
+	{
+		if (TimerIsExpired(timer))
+			return -1;
+		if (timer->xTicksToWait < xTicksToWait)
+			xTicksToWait = timer->xTicksToWait;
+	}
+	cond->waiters++;
+	MutexUnlock(mutex);
+	rc = xSemaphoreTake(cond->sem, xTicksToWait);
+	MutexLock(mutex);
+	cond->waiters--;
+	return (rc == pdTRUE) ? 0 : -1;
+}
+
+
+void ConditionBroadcast(Condition* cond)
+{
+	int i;
+
+	for (i = 0; i < cond->waiters; ++i)
+		xSemaphoreGive(cond->sem);
+}
+
+
 void MutexInit(Mutex* mutex)
 {
 	mutex->sem = xSemaphoreCreateMutex();
@@ -45,6 +106,12 @@ int MutexLock(Mutex* mutex)
 	return xSemaphoreTake(mutex->sem, portMAX_DELAY);
 }
 
+/* @return 1 if the mutex was taken, 0 if somebody else has it */
+int MutexTryLock(Mutex* mutex)
+{
+	return xSemaphoreTake(mutex->sem, 0) == pdTRUE;
+}
+
 int MutexUnlock(Mutex* mutex)
 {
 	return xSemaphoreGive(mutex->sem);
@@ -58,6 +125,12 @@ void TimerCountdownMS(Timer* timer, unsigned int timeout_ms)
 }
 
 
+void TimerCountdownUS(Timer* timer, unsigned int timeout_us)
+{
+	TimerCountdownMS(timer, (timeout_us + 999) / 1000); /* the tick is the best resolution we have */
+}
+
+
 void TimerCountdown(Timer* timer, unsigned int timeout) 
 {
 	TimerCountdownMS(timer, timeout * 1000);
@@ -42,6 +42,7 @@ struct Network
 void TimerInit(Timer*);
 char TimerIsExpired(Timer*);
 void TimerCountdownMS(Timer*, unsigned int);
+void TimerCountdownUS(Timer*, unsigned int);
 void TimerCountdown(Timer*, unsigned int);
 int TimerLeftMS(Timer*);
 
@@ -52,14 +53,29 @@ typedef struct Mutex
 
 void MutexInit(Mutex*);
 int MutexLock(Mutex*);
+int MutexTryLock(Mutex*);
 int MutexUnlock(Mutex*);
 
 typedef struct Thread
 {
 	TaskHandle_t task;
+	void (*fn)(void*);
+	void* arg;
+	SemaphoreHandle_t done;
 } Thread;
 
 int ThreadStart(Thread*, void (*fn)(void*), void* arg);
+int ThreadJoin(Thread*);
+
+typedef struct Condition
+{
+	SemaphoreHandle_t sem;
+	int waiters;
+} Condition;
+
+void ConditionInit(Condition*);
+int ConditionWait(Condition*, Mutex*, Timer*);
+void ConditionBroadcast(Condition*);
 
 int FreeRTOS_read(Network*, unsigned char*, int, int);
 int FreeRTOS_write(Network*, unsigned char*, int, int);
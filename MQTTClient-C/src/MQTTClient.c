@@ -16,10 +16,18 @@
  *   Ian Craggs - add ability to set message handler separately #6
  *******************************************************************************/
 #include "MQTTClient.h"
+#if defined(MQTT_TASK)
+#include "MQTTDispatch.h"
+#endif
 
 #include <stdio.h>
 #include <string.h>
 
+#if !defined(MQTT_TIMER_CACHE) /* the platform reads the clock every time */
+#define TimerCacheStart()
+#define TimerCacheStop()
+#endif
+
 static void NewMessageData(MessageData* md, MQTTString* aTopicName, MQTTMessage* aMessage) {
     md->topicName = aTopicName;
     md->message = aMessage;
@@ -31,17 +39,19 @@ static int getNextPacketId(MQTTClient *c) {
 }
 
 
-static int sendPacket(MQTTClient* c, int length, Timer* timer)
+static int writePacket(MQTTClient* c, unsigned char* buf, int length, Timer* timer)
 {
     int rc = FAILURE,
         sent = 0;
 
-    while (sent < length && !TimerIsExpired(timer))
+    while (sent < length)
     {
-        rc = c->ipstack->mqttwrite(c->ipstack, &c->buf[sent], length, TimerLeftMS(timer));
+        rc = c->ipstack->mqttwrite(c->ipstack, &buf[sent], length - sent, TimerLeftMS(timer));
         if (rc < 0)  // there was an error writing the data
             break;
         sent += rc;
+        if (TimerIsExpired(timer)) // only check expiry after at least one attempt to write
+            break;
     }
     if (sent == length)
     {
@@ -54,6 +64,306 @@ static int sendPacket(MQTTClient* c, int length, Timer* timer)
 }
 
 
+/* write out any coalesced packets */
+static int flushPackets(MQTTClient* c, Timer* timer)
+{
+    int rc = SUCCESS;
+
+    if (c->coalesce_len > 0)
+    {
+        rc = writePacket(c, c->coalescebuf, c->coalesce_len, timer);
+        c->coalesce_len = 0;
+    }
+    return rc;
+}
+
+
+static int sendPacket(MQTTClient* c, int length, Timer* timer)
+{
+    if (c->coalesce_len > 0)
+    {   /* anything sent this way is needed on the wire now, so take the coalesced packets with it */
+        if (c->coalesce_len + length <= c->coalescebuf_size)
+        {
+            memcpy(&c->coalescebuf[c->coalesce_len], c->buf, length);
+            c->coalesce_len += length;
+            return flushPackets(c, timer);
+        }
+        if (flushPackets(c, timer) != SUCCESS)
+            return FAILURE;
+    }
+    return writePacket(c, c->buf, length, timer);
+}
+
+
+/* add the packet in c->buf to the coalescing buffer, writing it out when full or over the time budget */
+static int coalescePacket(MQTTClient* c, int length, Timer* timer)
+{
+    if (c->coalesce_len + length > c->coalescebuf_size && flushPackets(c, timer) != SUCCESS)
+        return FAILURE;
+    if (length > c->coalescebuf_size)
+        return writePacket(c, c->buf, length, timer);
+
+    if (c->coalesce_len == 0)
+        TimerCountdownUS(&c->coalesce_timer, c->coalesce_budget_us);
+    memcpy(&c->coalescebuf[c->coalesce_len], c->buf, length);
+    c->coalesce_len += length;
+
+    if (c->coalesce_len == c->coalescebuf_size || TimerIsExpired(&c->coalesce_timer))
+        return flushPackets(c, timer);
+    if (c->coalesce_len == length && c->deadline_changed)
+        c->deadline_changed(c->deadline_context); /* the coalesce timer was just started */
+    return SUCCESS;
+}
+
+
+#if defined(MQTT_ZEROCOPY)
+/* Where the payload of a publish comes from, when it isn't serialized into buf with the rest */
+typedef struct MQTTBody
+{
+    int fd;                       /* the file to send it from, or -1 to send it from the message's payload */
+    off_t offset;
+} MQTTBody;
+
+
+/* write the payload of a publish whose header has just been sent */
+static int writeBody(MQTTClient* c, MQTTMessage* message, MQTTBody* body, Timer* timer)
+{
+    int rc = FAILURE,
+        sent = 0;
+
+    while (sent < message->payloadlen)
+    {
+        if (body->fd >= 0)
+            rc = c->ipstack->mqttsendfile(c->ipstack, body->fd, body->offset + sent, message->payloadlen - sent,
+                  TimerLeftMS(timer));
+        else
+            rc = c->ipstack->mqttwritezerocopy(c->ipstack, (unsigned char*)message->payload + sent,
+                  message->payloadlen - sent, TimerLeftMS(timer));
+        if (rc < 0)
+            break;
+        sent += rc;
+        if (TimerIsExpired(timer))
+            break;
+    }
+    if (sent == message->payloadlen)
+    {
+        TimerCountdown(&c->last_sent, c->keepAliveInterval);
+        rc = SUCCESS;
+    }
+    else
+        rc = FAILURE;
+    return rc;
+}
+#else
+struct MQTTBody;
+#endif
+
+
+/* The length of the packet at offset from the oldest in the offline buffer.  Its header may wrap
+ * around the end of the buffer. */
+static size_t offlinePacketLen(MQTTClient* c, size_t offset)
+{
+    unsigned char header[5];
+    int i = 0,
+      rem_len = 0;
+
+    for (i = 0; i < sizeof(header) && offset + i < c->offline_len; ++i)
+        header[i] = c->offlinebuf[(c->offline_head + offset + i) % c->offlinebuf_size];
+    return 1 + MQTTPacket_decodeBuf(&header[1], &rem_len) + rem_len;
+}
+
+
+static void offlineRemove(MQTTClient* c, size_t len)
+{
+    c->offline_head = (c->offline_head + len) % c->offlinebuf_size;
+    c->offline_len -= len;
+    c->offline_metrics.count--;
+    if (c->offline_len == 0)
+        c->offline_head = 0; /* so the next packets are more likely to be contiguous */
+}
+
+
+/* Keep the publish serialized in buf, which is len long, for when the client connects again */
+static int storeOffline(MQTTClient* c, int len)
+{
+    size_t tail = 0,
+      first = 0;
+
+    if (len > c->offlinebuf_size)
+        return BUFFER_OVERFLOW;
+    while (c->offline_len + len > c->offlinebuf_size && c->offline_policy == OFFLINE_DROP_OLDEST)
+    {
+        offlineRemove(c, offlinePacketLen(c, 0));
+        c->offline_metrics.dropped++;
+    }
+    if (c->offline_len + len > c->offlinebuf_size)
+    {
+        c->offline_metrics.rejected++;
+        return FAILURE;
+    }
+
+    tail = (c->offline_head + c->offline_len) % c->offlinebuf_size;
+    first = (tail + len > c->offlinebuf_size) ? c->offlinebuf_size - tail : len;
+    memcpy(&c->offlinebuf[tail], c->buf, first);
+    memcpy(c->offlinebuf, &c->buf[first], len - first); /* the rest wraps around to the start */
+    c->offline_len += len;
+    c->offline_metrics.count++;
+    c->offline_metrics.stored++;
+    if (c->offline_len > c->offline_metrics.high_water)
+        c->offline_metrics.high_water = c->offline_len;
+    return SUCCESS;
+}
+
+
+/* Send the publishes kept while the client was disconnected, oldest first.  Whole packets are
+ * written together straight from the buffer, and only one which wraps around is copied to buf. */
+static int drainOffline(MQTTClient* c, Timer* timer)
+{
+    int rc = SUCCESS;
+
+    while (rc == SUCCESS && c->offline_len > 0)
+    {
+        size_t len = 0,
+          count = 0,
+          packet_len = 0;
+
+        while (len < c->offline_len)
+        {
+            size_t end = c->offline_head + len + (packet_len = offlinePacketLen(c, len));
+            if (end > c->offlinebuf_size)
+                break; /* this one wraps around */
+            len += packet_len;
+            ++count;
+            if (end == c->offlinebuf_size)
+                break; /* the next starts again at the beginning of the buffer */
+        }
+
+        if (count > 0)
+            rc = writePacket(c, &c->offlinebuf[c->offline_head], len, timer);
+        else
+        {
+            size_t first = c->offlinebuf_size - c->offline_head;
+            len = packet_len;
+            memcpy(c->buf, &c->offlinebuf[c->offline_head], first);
+            memcpy(&c->buf[first], c->offlinebuf, len - first);
+            rc = writePacket(c, c->buf, len, timer);
+            count = 1;
+        }
+        if (rc == SUCCESS)
+        {
+            c->offline_head = (c->offline_head + len) % c->offlinebuf_size;
+            c->offline_len -= len;
+            c->offline_metrics.count -= count;
+            c->offline_metrics.sent += count;
+        }
+    }
+    if (c->offline_len == 0)
+        c->offline_head = 0;
+    return rc;
+}
+
+
+#if defined(MQTT_PUBLISH_QUEUE)
+/* Each queue slot starts with this header, followed by the serialized packet.  The sequence number
+ * says whose turn it is: a producer may fill the slot for position pos when seq == pos, and the
+ * packet is ready to be written out when seq == pos + 1.  This makes a bounded queue which any
+ * number of threads can add to without a lock, and one thread at a time takes from. */
+typedef struct MQTTQueueSlot
+{
+    unsigned int seq;
+    int len;
+} MQTTQueueSlot;
+
+#define QUEUE_SLOT(c, pos) ((MQTTQueueSlot*)&(c)->queuebuf[((pos) & ((c)->queue_slots - 1)) * (c)->queue_slot_size])
+
+
+static int queueReady(MQTTClient* c)
+{
+    unsigned int head = __atomic_load_n(&c->queue_head, __ATOMIC_RELAXED);
+
+    return c->queuebuf != NULL && __atomic_load_n(&QUEUE_SLOT(c, head)->seq, __ATOMIC_ACQUIRE) == head + 1;
+}
+
+
+/* Write out the queued packets, batched in buf.  The caller must be the only consumer. */
+static int drainQueue(MQTTClient* c, Timer* timer)
+{
+    int rc = SUCCESS,
+        len = 0;
+
+    while (rc == SUCCESS)
+    {
+        MQTTQueueSlot* slot = (c->queuebuf == NULL) ? NULL : QUEUE_SLOT(c, c->queue_head);
+        int ready = queueReady(c);
+
+        if (len > 0 && (!ready || len + slot->len > (int)c->buf_size))
+        {   /* write out the batch so far */
+            rc = writePacket(c, c->buf, len, timer);
+            len = 0;
+        }
+        else if (!ready)
+            break;
+        else
+        {
+            if (slot->len > (int)c->buf_size) /* too big to batch */
+                rc = writePacket(c, (unsigned char*)(slot + 1), slot->len, timer);
+            else
+            {
+                memcpy(&c->buf[len], slot + 1, slot->len);
+                len += slot->len;
+            }
+            __atomic_store_n(&slot->seq, c->queue_head + c->queue_slots, __ATOMIC_RELEASE); /* free the slot */
+            __atomic_store_n(&c->queue_head, c->queue_head + 1, __ATOMIC_RELAXED);
+        }
+    }
+    return rc;
+}
+#endif
+
+
+#if defined(MQTT_TASK)
+/* Release write_mutex.  A thread which queues a publish while write_mutex is held leaves it to the
+ * holder, so the holder writes out the queue before letting go, and again if more arrives as it does. */
+static void unlockWrite(MQTTClient* c)
+{
+#if defined(MQTT_PUBLISH_QUEUE)
+    do
+    {
+        if (c->isconnected && queueReady(c))
+        {
+            Timer timer;
+
+            TimerInit(&timer);
+            TimerCountdownMS(&timer, c->command_timeout_ms);
+            drainQueue(c, &timer);
+        }
+        MutexUnlock(&c->write_mutex);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST); /* pairs with the fence in MQTTEnqueuePublish */
+    } while (c->isconnected && queueReady(c) && MutexTryLock(&c->write_mutex));
+#else
+    MutexUnlock(&c->write_mutex);
+#endif
+}
+#endif
+
+
+static int sendAck(MQTTClient* c, unsigned char packet_type, unsigned short packetid, Timer* timer)
+{
+    int len = 0,
+        rc = FAILURE;
+
+#if defined(MQTT_TASK)
+    MutexLock(&c->write_mutex);
+#endif
+    if ((len = MQTTSerialize_ack(c->buf, c->buf_size, packet_type, 0, packetid)) > 0)
+        rc = sendPacket(c, len, timer);
+#if defined(MQTT_TASK)
+    unlockWrite(c);
+#endif
+    return rc;
+}
+
+
 void MQTTClientInit(MQTTClient* c, Network* network, unsigned int command_timeout_ms,
 		unsigned char* sendbuf, size_t sendbuf_size, unsigned char* readbuf, size_t readbuf_size)
 {
@@ -61,7 +371,10 @@ void MQTTClientInit(MQTTClient* c, Network* network, unsigned int command_timeou
     c->ipstack = network;
 
     for (i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
+    {
         c->messageHandlers[i].topicFilter = 0;
+        c->messageHandlers[i].qos = SUBFAIL;
+    }
     c->command_timeout_ms = command_timeout_ms;
     c->buf = sendbuf;
     c->buf_size = sendbuf_size;
@@ -72,75 +385,113 @@ void MQTTClientInit(MQTTClient* c, Network* network, unsigned int command_timeou
     c->ping_outstanding = 0;
     c->defaultMessageHandler = NULL;
 	  c->next_packetid = 1;
+    c->coalescebuf = NULL;
+    c->coalescebuf_size = c->coalesce_len = 0;
+    c->coalesce_budget_us = 0;
+    TimerInit(&c->coalesce_timer);
+    c->offlinebuf = NULL;
+    c->offlinebuf_size = c->offline_head = c->offline_len = 0;
+    c->offline_policy = OFFLINE_REJECT;
+    memset(&c->offline_metrics, '\0', sizeof(c->offline_metrics));
+    c->persistence = NULL;
+    c->deadline_changed = NULL;
+    c->network_changed = NULL;
+    c->deadline_context = NULL;
+#if defined(MQTT_PUBLISH_QUEUE)
+    c->queuebuf = NULL;
+    c->queue_slots = c->queue_slot_size = c->queue_head = c->queue_tail = 0;
+#endif
+    c->read_len = 0;
+    c->read_packet_len = -1;
     TimerInit(&c->last_sent);
     TimerInit(&c->last_received);
+    c->waiters = NULL;
+    c->connect_count = 0;
+    c->reconnect_options = NULL;
+    c->reconnect = NULL;
+    c->reconnect_context = NULL;
+    c->reconnect_min_ms = c->reconnect_max_ms = c->reconnect_ms = c->reconnect_seed = 0;
+    TimerInit(&c->reconnect_timer);
+    c->reconnect_wanted = 0;
 #if defined(MQTT_TASK)
 	  MutexInit(&c->mutex);
+	  MutexInit(&c->write_mutex);
+	  ConditionInit(&c->cond);
+	  c->handover = NULL;
+	  c->task_running = c->task_stop = 0;
+	  c->dispatch = NULL;
 #endif
 }
 
 
-static int decodePacket(MQTTClient* c, int* value, int timeout)
+/* Read a packet into readbuf.  A packet which is not complete when the timer expires is kept,
+ * and the next call carries on where this one left off.
+ * @return the MQTT packet type, 0 if no complete packet yet, negative on error */
+static int readPacket(MQTTClient* c, Timer* timer)
 {
-    unsigned char i;
-    int multiplier = 1;
-    int len = 0;
+    MQTTHeader header = {0};
     const int MAX_NO_OF_REMAINING_LENGTH_BYTES = 4;
+    int rc = 0;
 
-    *value = 0;
-    do
+    /* 1. read the header byte.  This has the packet type in it */
+    if (c->read_len == 0)
     {
-        int rc = MQTTPACKET_READ_ERROR;
+        if ((rc = c->ipstack->mqttread(c->ipstack, c->readbuf, 1, TimerLeftMS(timer))) != 1)
+            goto exit;
+        c->read_len = 1;
+    }
 
-        if (++len > MAX_NO_OF_REMAINING_LENGTH_BYTES)
+    /* 2. read the remaining length.  This is variable in itself */
+    while (c->read_packet_len < 0)
+    {
+        if (c->read_len > MAX_NO_OF_REMAINING_LENGTH_BYTES)
         {
             rc = MQTTPACKET_READ_ERROR; /* bad data */
             goto exit;
         }
-        rc = c->ipstack->mqttread(c->ipstack, &i, 1, timeout);
-        if (rc != 1)
+        if ((rc = c->ipstack->mqttread(c->ipstack, &c->readbuf[c->read_len], 1, TimerLeftMS(timer))) != 1)
             goto exit;
-        *value += (i & 127) * multiplier;
-        multiplier *= 128;
-    } while ((i & 128) != 0);
-exit:
-    return len;
-}
-
-
-static int readPacket(MQTTClient* c, Timer* timer)
-{
-    MQTTHeader header = {0};
-    int len = 0;
-    int rem_len = 0;
-
-    /* 1. read the header byte.  This has the packet type in it */
-    int rc = c->ipstack->mqttread(c->ipstack, c->readbuf, 1, TimerLeftMS(timer));
-    if (rc != 1)
-        goto exit;
-
-    len = 1;
-    /* 2. read the remaining length.  This is variable in itself */
-    decodePacket(c, &rem_len, TimerLeftMS(timer));
-    len += MQTTPacket_encode(c->readbuf + 1, rem_len); /* put the original remaining length back into the buffer */
+        if ((c->readbuf[c->read_len++] & 128) == 0)
+        {
+            int i, multiplier = 1, rem_len = 0;
 
-    if (rem_len > (c->readbuf_size - len))
-    {
-        rc = BUFFER_OVERFLOW;
-        goto exit;
+            for (i = 1; i < c->read_len; ++i, multiplier *= 128)
+                rem_len += (c->readbuf[i] & 127) * multiplier;
+            if (rem_len > (c->readbuf_size - c->read_len))
+            {
+                rc = BUFFER_OVERFLOW;
+                goto exit;
+            }
+            c->read_packet_len = c->read_len + rem_len;
+        }
     }
 
     /* 3. read the rest of the buffer using a callback to supply the rest of the data */
-    if (rem_len > 0 && (rc = c->ipstack->mqttread(c->ipstack, c->readbuf + len, rem_len, TimerLeftMS(timer)) != rem_len)) {
-        rc = 0;
-        goto exit;
+    if (c->read_len < c->read_packet_len)
+    {
+        rc = c->ipstack->mqttread(c->ipstack, &c->readbuf[c->read_len], c->read_packet_len - c->read_len, TimerLeftMS(timer));
+        if (rc < 0)
+            goto exit;
+        c->read_len += rc;
+        if (c->read_len < c->read_packet_len)
+        {
+            rc = 0;
+            goto exit;
+        }
     }
 
     header.byte = c->readbuf[0];
     rc = header.bits.type;
+    c->read_len = 0;
+    c->read_packet_len = -1;
     if (c->keepAliveInterval > 0)
         TimerCountdown(&c->last_received, c->keepAliveInterval); // record the fact that we have successfully received a packet
 exit:
+    if (rc < 0)
+    {
+        c->read_len = 0;
+        c->read_packet_len = -1;
+    }
     return rc;
 }
 
@@ -176,6 +527,22 @@ static char isTopicMatched(char* topicFilter, MQTTString* topicName)
 }
 
 
+static void callHandler(MQTTClient* c, messageHandler fp, MQTTString* topicName, MQTTMessage* message)
+{
+    MessageData md;
+
+#if defined(MQTT_TASK)
+    /* the background thread holds the state mutex.  If the message couldn't be queued, too big for a
+     * pool slot say, run the handler here rather than acknowledge a message nobody has had */
+    if (c->dispatch && c->task_running &&
+            MQTTDispatchMessage(c->dispatch, &c->mutex, fp, topicName, message) == SUCCESS)
+        return;
+#endif
+    NewMessageData(&md, topicName, message);
+    fp(&md);
+}
+
+
 int deliverMessage(MQTTClient* c, MQTTString* topicName, MQTTMessage* message)
 {
     int i;
@@ -189,9 +556,7 @@ int deliverMessage(MQTTClient* c, MQTTString* topicName, MQTTMessage* message)
         {
             if (c->messageHandlers[i].fp != NULL)
             {
-                MessageData md;
-                NewMessageData(&md, topicName, message);
-                c->messageHandlers[i].fp(&md);
+                callHandler(c, c->messageHandlers[i].fp, topicName, message);
                 rc = SUCCESS;
             }
         }
@@ -199,9 +564,7 @@ int deliverMessage(MQTTClient* c, MQTTString* topicName, MQTTMessage* message)
 
     if (rc == FAILURE && c->defaultMessageHandler != NULL)
     {
-        MessageData md;
-        NewMessageData(&md, topicName, message);
-        c->defaultMessageHandler(&md);
+        callHandler(c, c->defaultMessageHandler, topicName, message);
         rc = SUCCESS;
     }
 
@@ -216,6 +579,9 @@ int keepalive(MQTTClient* c)
     if (c->keepAliveInterval == 0)
         goto exit;
 
+#if defined(MQTT_TASK)
+    MutexLock(&c->write_mutex); /* last_sent is updated by whoever writes */
+#endif
     if (TimerIsExpired(&c->last_sent) || TimerIsExpired(&c->last_received))
     {
         if (c->ping_outstanding)
@@ -227,15 +593,73 @@ int keepalive(MQTTClient* c)
             TimerCountdownMS(&timer, 1000);
             int len = MQTTSerialize_pingreq(c->buf, c->buf_size);
             if (len > 0 && (rc = sendPacket(c, len, &timer)) == SUCCESS) // send the ping packet
+            {
                 c->ping_outstanding = 1;
+                TimerCountdown(&c->last_received, c->keepAliveInterval); /* the server has this long to respond */
+            }
         }
     }
+#if defined(MQTT_TASK)
+    unlockWrite(c);
+#endif
 
 exit:
     return rc;
 }
 
 
+/* An API call waiting for the reply to its request */
+typedef struct MQTTWaiter
+{
+    int packet_type;
+    unsigned short packetid;
+    char failed,
+      released;                   /* a QoS 2 publish which has had its PUBREC */
+    MQTTString* topic;            /* a publish, to be sent again if the client reconnects */
+    MQTTMessage* message;
+    struct MQTTWaiter* next;
+} MQTTWaiter;
+
+
+/* Get ready for the reply before the request is sent, as it could arrive straight away */
+static void expect(MQTTClient* c, MQTTWaiter* w, int packet_type, unsigned short packetid)
+{
+    w->packet_type = packet_type;
+    w->packetid = packetid;
+    w->failed = w->released = 0;
+    w->topic = NULL;
+    w->message = NULL;
+    w->next = c->waiters;
+    c->waiters = w;
+#if defined(MQTT_TASK)
+    ConditionBroadcast(&c->cond); /* the reader thread could be idle */
+#endif
+}
+
+
+/* Stop waiting for the reply, whether it arrived or not */
+static void forget(MQTTClient* c, MQTTWaiter* w)
+{
+    MQTTWaiter** pw = NULL;
+
+    for (pw = &c->waiters; *pw != NULL; pw = &(*pw)->next)
+    {
+        if (*pw == w)
+        {
+            *pw = w->next;
+            break;
+        }
+    }
+}
+
+
+/* The client is reconnected automatically if the application has asked for it */
+static int autoReconnect(MQTTClient* c)
+{
+    return c->reconnect != NULL && c->reconnect_wanted;
+}
+
+
 void MQTTCleanSession(MQTTClient* c)
 {
     int i = 0;
@@ -247,19 +671,41 @@ void MQTTCleanSession(MQTTClient* c)
 
 void MQTTCloseSession(MQTTClient* c)
 {
+#if defined(MQTT_TASK)
+    MutexLock(&c->write_mutex);
+    c->coalesce_len = 0;
+    unlockWrite(c);
+#else
+    c->coalesce_len = 0;
+#endif
     c->ping_outstanding = 0;
     c->isconnected = 0;
-    if (c->cleansession)
+    if (c->cleansession && !autoReconnect(c)) /* the handlers are needed to subscribe again */
         MQTTCleanSession(c);
 }
 
 
-int cycle(MQTTClient* c, Timer* timer)
+/* Record an acknowledgement of one of our publishes in the persistence layer */
+static void persist(MQTTClient* c, int packet_type, unsigned short packetid)
 {
-    int len = 0,
-        rc = SUCCESS;
+#if defined(MQTT_TASK)
+    MutexLock(&c->write_mutex);
+#endif
+    if (packet_type == PUBREC)
+        c->persistence->release(c->persistence, packetid);
+    else
+        c->persistence->remove(c->persistence, packetid);
+#if defined(MQTT_TASK)
+    unlockWrite(c);
+#endif
+}
 
-    int packet_type = readPacket(c, timer);     /* read the socket, see what work is due */
+
+/* Act on the packet readPacket returned, and send a keepalive if one is due.
+ * @return the packet type, or a negative value if the session has failed */
+static int processPacket(MQTTClient* c, int packet_type, Timer* timer)
+{
+    int rc = SUCCESS;
 
     switch (packet_type)
     {
@@ -270,10 +716,19 @@ int cycle(MQTTClient* c, Timer* timer)
         case 0: /* timed out reading packet */
             break;
         case CONNACK:
-        case PUBACK:
         case SUBACK:
         case UNSUBACK:
             break;
+        case PUBACK:
+        case PUBCOMP:
+            if (c->persistence != NULL)
+            {
+                unsigned short mypacketid;
+                unsigned char dup, type;
+                if (MQTTDeserialize_ack(&type, &dup, &mypacketid, c->readbuf, c->readbuf_size) == 1)
+                    persist(c, PUBCOMP, mypacketid);
+            }
+            break;
         case PUBLISH:
         {
             MQTTString topicName;
@@ -287,14 +742,7 @@ int cycle(MQTTClient* c, Timer* timer)
             deliverMessage(c, &topicName, &msg);
             if (msg.qos != QOS0)
             {
-                if (msg.qos == QOS1)
-                    len = MQTTSerialize_ack(c->buf, c->buf_size, PUBACK, 0, msg.id);
-                else if (msg.qos == QOS2)
-                    len = MQTTSerialize_ack(c->buf, c->buf_size, PUBREC, 0, msg.id);
-                if (len <= 0)
-                    rc = FAILURE;
-                else
-                    rc = sendPacket(c, len, timer);
+                rc = sendAck(c, (msg.qos == QOS1) ? PUBACK : PUBREC, msg.id, timer);
                 if (rc == FAILURE)
                     goto exit; // there was a problem
             }
@@ -307,18 +755,27 @@ int cycle(MQTTClient* c, Timer* timer)
             unsigned char dup, type;
             if (MQTTDeserialize_ack(&type, &dup, &mypacketid, c->readbuf, c->readbuf_size) != 1)
                 rc = FAILURE;
-            else if ((len = MQTTSerialize_ack(c->buf, c->buf_size,
-                (packet_type == PUBREC) ? PUBREL : PUBCOMP, 0, mypacketid)) <= 0)
-                rc = FAILURE;
-            else if ((rc = sendPacket(c, len, timer)) != SUCCESS) // send the PUBREL packet
-                rc = FAILURE; // there was a problem
+            else
+            {
+                if (packet_type == PUBREC)
+                {   /* if the client reconnects, it is the PUBREL which has to be sent again */
+                    MQTTWaiter* w = NULL;
+                    for (w = c->waiters; w != NULL; w = w->next)
+                    {
+                        if (w->packet_type == PUBCOMP && w->packetid == mypacketid)
+                            w->released = 1;
+                    }
+                    if (c->persistence != NULL)
+                        persist(c, PUBREC, mypacketid); /* before the PUBREL goes, in case we are restarted */
+                }
+                if ((rc = sendAck(c, (packet_type == PUBREC) ? PUBREL : PUBCOMP, mypacketid, timer)) != SUCCESS)
+                    rc = FAILURE; // there was a problem
+            }
             if (rc == FAILURE)
                 goto exit; // there was a problem
             break;
         }
 
-        case PUBCOMP:
-            break;
         case PINGRESP:
             c->ping_outstanding = 0;
             break;
@@ -338,31 +795,466 @@ exit:
 }
 
 
-int MQTTYield(MQTTClient* c, int timeout_ms)
+/* Send the publishes which weren't acknowledged on the old connection again */
+static int resendPublishes(MQTTClient* c, Timer* timer)
+{
+    MQTTWaiter* w = NULL;
+    int rc = SUCCESS;
+
+    for (w = c->waiters; rc == SUCCESS && w != NULL; w = w->next)
+    {
+        int len = 0;
+
+        if (w->message == NULL)
+            continue;
+        if (w->released)
+        {
+            rc = sendAck(c, PUBREL, w->packetid, timer);
+            continue;
+        }
+#if defined(MQTT_TASK)
+        MutexLock(&c->write_mutex);
+#endif
+        len = MQTTSerialize_publish(c->buf, c->buf_size, 1, w->message->qos, w->message->retained, w->packetid,
+              *w->topic, (unsigned char*)w->message->payload, w->message->payloadlen);
+        rc = (len > 0) ? sendPacket(c, len, timer) : FAILURE;
+#if defined(MQTT_TASK)
+        unlockWrite(c);
+#endif
+    }
+    return rc;
+}
+
+
+/* Send the publishes kept by the persistence layer again, straight from where they are kept */
+static int resendPersisted(MQTTClient* c, Timer* timer)
+{
+    MQTTPersistence* p = c->persistence;
+    unsigned int cursor = 0;
+    unsigned short packetid = 0;
+    unsigned char* packet = NULL;
+    int released = 0,
+      len = 0,
+      rc = SUCCESS;
+
+#if defined(MQTT_TASK)
+    MutexLock(&c->write_mutex);
+#endif
+    rc = flushPackets(c, timer);
+    while (rc == SUCCESS && (len = p->next(p, &cursor, &packetid, &released, &packet)) > 0)
+    {
+        if (released)
+            rc = ((len = MQTTSerialize_ack(c->buf, c->buf_size, PUBREL, 0, packetid)) > 0) ?
+                writePacket(c, c->buf, len, timer) : FAILURE;
+        else
+        {
+            packet[0] |= 0x08; /* DUP */
+            rc = writePacket(c, packet, len, timer);
+        }
+    }
+#if defined(MQTT_TASK)
+    unlockWrite(c);
+#endif
+    return rc;
+}
+
+
+/* Subscribe again to the topics the client has handlers for, without waiting for the SUBACKs */
+static int resubscribe(MQTTClient* c, Timer* timer)
+{
+    int i = 0,
+      rc = SUCCESS;
+
+    for (i = 0; rc == SUCCESS && i < MAX_MESSAGE_HANDLERS; ++i)
+    {
+        MQTTString topic = MQTTString_initializer;
+        int qos = c->messageHandlers[i].qos,
+          len = 0;
+
+        if (c->messageHandlers[i].topicFilter == NULL || qos == SUBFAIL)
+            continue;
+        topic.cstring = (char*)c->messageHandlers[i].topicFilter;
+#if defined(MQTT_TASK)
+        MutexLock(&c->write_mutex);
+#endif
+        len = MQTTSerialize_subscribe(c->buf, c->buf_size, 0, getNextPacketId(c), 1, &topic, &qos);
+        rc = (len > 0) ? sendPacket(c, len, timer) : FAILURE;
+#if defined(MQTT_TASK)
+        unlockWrite(c);
+#endif
+    }
+    return rc;
+}
+
+
+static unsigned int nextRandom(unsigned int* seed)
+{
+    unsigned int x = *seed; /* xorshift: the jitter only has to differ between clients */
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *seed = x;
+}
+
+
+/* Make a new connection and resume the session, if an automatic reconnect is due.  Whoever reads
+ * the network calls this, with the session state locked, so the CONNACK is read here directly.
+ * @return success code - FAILURE while backing off */
+static int reconnect(MQTTClient* c)
+{
+    Timer timer;
+    MQTTConnackData data;
+    int len = 0,
+      rc = FAILURE;
+
+    if (c->isconnected || !autoReconnect(c) || !TimerIsExpired(&c->reconnect_timer))
+        return c->isconnected ? SUCCESS : FAILURE;
+
+    TimerInit(&timer);
+    TimerCountdownMS(&timer, c->command_timeout_ms);
+#if defined(MQTT_TASK)
+    /* no other thread may write to the network while it is replaced, nor before the CONNECT */
+    MutexLock(&c->write_mutex);
+#endif
+    c->read_len = 0;
+    c->read_packet_len = -1;
+    if (c->network_changed)
+        c->network_changed(c->deadline_context, 0); /* while the old socket is still open */
+    if (c->reconnect(c->ipstack, c->reconnect_context) == SUCCESS)
+    {
+        if (c->network_changed)
+            c->network_changed(c->deadline_context, 1);
+        c->keepAliveInterval = c->reconnect_options->keepAliveInterval;
+        c->cleansession = c->reconnect_options->cleansession;
+        TimerCountdown(&c->last_received, c->keepAliveInterval);
+        if ((len = MQTTSerialize_connect(c->buf, c->buf_size, c->reconnect_options)) > 0)
+            rc = sendPacket(c, len, &timer);
+    }
+#if defined(MQTT_TASK)
+    unlockWrite(c);
+#endif
+    if (rc != SUCCESS)
+        goto exit;
+
+    do
+        rc = readPacket(c, &timer); /* the server sends nothing before the CONNACK */
+    while (rc == 0 && !TimerIsExpired(&timer));
+    data.rc = data.sessionPresent = 0;
+    if (rc != CONNACK || MQTTDeserialize_connack(&data.sessionPresent, &data.rc, c->readbuf, c->readbuf_size) != 1 ||
+        data.rc != 0)
+    {
+        rc = FAILURE;
+        goto exit;
+    }
+    c->isconnected = 1;
+    c->ping_outstanding = 0;
+    c->connect_count++;
+
+    /* pipelined behind the CONNECT's round trip, without waiting for any replies */
+    rc = (data.sessionPresent && !c->cleansession) ? SUCCESS : resubscribe(c, &timer);
+    if (rc == SUCCESS)
+        rc = (c->persistence != NULL) ? resendPersisted(c, &timer) : resendPublishes(c, &timer);
+    if (rc == SUCCESS && c->offline_len > 0)
+    {
+#if defined(MQTT_TASK)
+        MutexLock(&c->write_mutex);
+#endif
+        rc = drainOffline(c, &timer);
+#if defined(MQTT_TASK)
+        unlockWrite(c);
+#endif
+    }
+    if (rc != SUCCESS)
+        MQTTCloseSession(c);
+
+exit:
+    if (rc == SUCCESS)
+        c->reconnect_ms = 0; /* the next time the session fails, reconnect straight away */
+    else
+    {   /* back off exponentially, with jitter, so that a fleet of clients doesn't come back all at once */
+        unsigned int half = 0;
+
+        c->reconnect_ms = (c->reconnect_ms == 0) ? c->reconnect_min_ms : c->reconnect_ms * 2;
+        if (c->reconnect_ms > c->reconnect_max_ms)
+            c->reconnect_ms = c->reconnect_max_ms;
+        half = c->reconnect_ms / 2;
+        TimerCountdownMS(&c->reconnect_timer, half + nextRandom(&c->reconnect_seed) % (half + 1));
+        rc = FAILURE;
+    }
+    return rc;
+}
+
+
+/* Write out anything coalesced or queued, so it isn't left waiting while we read, then read the next packet */
+static int readNext(MQTTClient* c, Timer* timer)
+{
+    int rc = SUCCESS;
+#if defined(MQTT_TASK)
+    Timer slice;
+#endif
+
+#if defined(MQTT_TASK)
+    MutexLock(&c->write_mutex);
+#endif
+    rc = flushPackets(c, timer);
+#if defined(MQTT_PUBLISH_QUEUE)
+    if (rc == SUCCESS && c->isconnected)
+        rc = drainQueue(c, timer);
+#endif
+#if defined(MQTT_TASK)
+    if (c->task_running && c->coalescebuf != NULL && c->coalesce_budget_us > 0)
+    {   /* a publisher can't wake the read, so read for no longer than what it coalesces may wait */
+        unsigned int budget_ms = (c->coalesce_budget_us + 999) / 1000;
+
+        if (TimerLeftMS(timer) > (int)budget_ms)
+        {
+            TimerInit(&slice);
+            TimerCountdownMS(&slice, budget_ms);
+            timer = &slice;
+        }
+    }
+    unlockWrite(c);
+#endif
+    if (rc == SUCCESS)
+        rc = readPacket(c, timer);     /* read the socket, see what work is due */
+    return rc;
+}
+
+
+int cycle(MQTTClient* c, Timer* timer)
+{
+    int rc;
+
+    TimerCacheStart(); /* one clock reading for the whole cycle, as far as the platform can */
+    rc = processPacket(c, readNext(c, timer), timer);
+    TimerCacheStop();
+    return rc;
+}
+
+
+int MQTTYield(MQTTClient* c, int timeout_ms)
+{
+    int rc = SUCCESS;
+    Timer timer;
+
+    TimerInit(&timer);
+    TimerCountdownMS(&timer, timeout_ms);
+
+#if defined(MQTT_TASK)
+    MutexLock(&c->mutex);
+    if (c->task_running)
+    {   /* the background thread does the work */
+        while (!TimerIsExpired(&timer))
+            ConditionWait(&c->cond, &c->mutex, &timer);
+        MutexUnlock(&c->mutex);
+        return rc;
+    }
+    MutexUnlock(&c->mutex);
+#endif
+
+	  do
+    {
+        if (cycle(c, &timer) < 0 && reconnect(c) != SUCCESS)
+        {
+            rc = FAILURE;
+            break;
+        }
+  	} while (!TimerIsExpired(&timer));
+
+    return rc;
+}
+
+int MQTTYieldNoWait(MQTTClient* c, int* next_ms)
+{
+    int rc = SUCCESS;
+    Timer timer;
+
+    TimerInit(&timer);
+    TimerCountdownMS(&timer, 0);
+    /* a packet may have brought the rest of the socket's data into the read-ahead buffer with it,
+     * where polling the socket won't see it, so carry on until there is no complete packet left */
+    do
+        rc = cycle(c, &timer);
+    while (rc > 0 && c->isconnected);
+
+    if (rc < 0 || !c->isconnected)
+        rc = reconnect(c);
+    else
+        rc = SUCCESS;
+    if (next_ms)
+        *next_ms = MQTTNextDeadline(c);
+    return rc;
+}
+
+
+int MQTTNextDeadline(MQTTClient* c)
+{
+    int left = -1;
+
+    if (!c->isconnected && autoReconnect(c))
+        return TimerLeftMS(&c->reconnect_timer);
+    if (c->keepAliveInterval > 0)
+    {
+        int sent = TimerLeftMS(&c->last_sent), received = TimerLeftMS(&c->last_received);
+        left = (sent < received) ? sent : received;
+    }
+    if (c->coalesce_len > 0)
+    {
+        int coalesce = TimerLeftMS(&c->coalesce_timer);
+        if (left == -1 || coalesce < left)
+            left = coalesce;
+    }
+#if defined(MQTT_PUBLISH_QUEUE)
+    if (queueReady(c))
+        left = 0;
+#endif
+    return left;
+}
+
+
+int MQTTIsConnected(MQTTClient* client)
+{
+  return client->isconnected;
+}
+
+
+int MQTTIsReconnecting(MQTTClient* client)
+{
+  return !client->isconnected && autoReconnect(client);
+}
+
+/* Is the reply of type packet_type in readbuf the one the waiter wants? */
+static int isReplyFor(MQTTClient* c, MQTTWaiter* w, int packet_type)
+{
+    unsigned short packetid = 0;
+
+    if (w->packet_type != packet_type)
+        return 0;
+    if (packet_type != CONNACK)
+    {   /* all the other replies start with the packet id */
+        int rem_len = 0;
+        unsigned char* ptr = &c->readbuf[1 + MQTTPacket_decodeBuf(&c->readbuf[1], &rem_len)];
+        packetid = readInt(&ptr);
+    }
+    return packet_type == CONNACK || w->packetid == packetid;
+}
+
+
+#if defined(MQTT_TASK)
+/* Hand the reply in readbuf to the API call waiting for it, if there is one.  The API call
+ * reads it before it releases the mutex, so readbuf is ours again when this returns. */
+static void handoverPacket(MQTTClient* c, int packet_type)
+{
+    MQTTWaiter* w = NULL;
+
+    for (w = c->waiters; w != NULL; w = w->next)
+    {
+        if (isReplyFor(c, w, packet_type))
+        {
+            c->handover = w;
+            ConditionBroadcast(&c->cond);
+            while (c->handover == w)
+                ConditionWait(&c->cond, &c->mutex, NULL);
+            break;
+        }
+    }
+}
+
+
+/* The reader thread has stopped, or the session has failed: nothing more will arrive, except for
+ * the publishes which will be sent again if the client reconnects */
+static void failWaiters(MQTTClient* c, int all)
+{
+    MQTTWaiter* w = NULL;
+
+    for (w = c->waiters; w != NULL; w = w->next)
+    {
+        if (all || w->message == NULL || !autoReconnect(c))
+            w->failed = 1;
+    }
+    ConditionBroadcast(&c->cond);
+}
+
+
+/* Three locks share the work, so that none is held for long:
+ *  - the reader thread owns readbuf and the read side of the socket, and holds no lock while it reads
+ *  - write_mutex covers buf, the coalescing buffer and the write side of the socket
+ *  - mutex covers the session state: it is held while a packet is processed, but not across any wait
+ * When both mutexes are needed, mutex is taken first. */
+void MQTTRun(void* parm)
+{
+	Timer timer;
+	MQTTClient* c = (MQTTClient*)parm;
+	int packet_type = 0;
+
+	TimerInit(&timer);
+
+	MutexLock(&c->mutex);
+	c->task_running = 1;
+	while (!c->task_stop)
+	{
+		TimerCacheStart();
+		if (!c->isconnected && autoReconnect(c))
+		{	/* API calls wait for the mutex until the reconnect has been tried */
+			if (!TimerIsExpired(&c->reconnect_timer))
+				ConditionWait(&c->cond, &c->mutex, &c->reconnect_timer);
+			else
+				reconnect(c);
+			continue;
+		}
+		if (!c->isconnected && c->waiters == NULL)
+		{	/* nothing to read until a connect is sent */
+			c->read_len = 0;
+			c->read_packet_len = -1;
+			ConditionWait(&c->cond, &c->mutex, NULL);
+			continue;
+		}
+		TimerCountdownMS(&timer, 500); /* Don't wait too long if no traffic is incoming */
+		MutexUnlock(&c->mutex);
+		packet_type = readNext(c, &timer);
+		MutexLock(&c->mutex);
+		if ((packet_type = processPacket(c, packet_type, &timer)) < 0)
+			failWaiters(c, 0);
+		else if (packet_type == CONNACK || packet_type == PUBACK || packet_type == SUBACK ||
+		         packet_type == UNSUBACK || packet_type == PUBCOMP)
+			handoverPacket(c, packet_type);
+	}
+	TimerCacheStop();
+	c->task_running = 0;
+	failWaiters(c, 1);
+	MutexUnlock(&c->mutex);
+}
+
+
+int MQTTStartTask(MQTTClient* client)
 {
-    int rc = SUCCESS;
-    Timer timer;
-
-    TimerInit(&timer);
-    TimerCountdownMS(&timer, timeout_ms);
+	MutexLock(&client->mutex);
+	client->task_running = 1; /* from now on, API calls wait for the reader thread */
+	client->task_stop = 0;
+	MutexUnlock(&client->mutex);
+	return ThreadStart(&client->thread, &MQTTRun, client);
+}
 
-	  do
-    {
-        if (cycle(c, &timer) < 0)
-        {
-            rc = FAILURE;
-            break;
-        }
-  	} while (!TimerIsExpired(&timer));
 
-    return rc;
+int MQTTStopTask(MQTTClient* client)
+{
+	MutexLock(&client->mutex);
+	client->task_stop = 1;
+	ConditionBroadcast(&client->cond);
+	MutexUnlock(&client->mutex);
+	return ThreadJoin(&client->thread);
 }
 
-int MQTTIsConnected(MQTTClient* client)
+
+int MQTTSetDispatch(MQTTClient* client, struct MQTTDispatch* dispatch)
 {
-  return client->isconnected;
+	MutexLock(&client->mutex);
+	client->dispatch = dispatch;
+	MutexUnlock(&client->mutex);
+	return SUCCESS;
 }
-
+#else
 void MQTTRun(void* parm)
 {
 	Timer timer;
@@ -372,37 +1264,42 @@ void MQTTRun(void* parm)
 
 	while (1)
 	{
-#if defined(MQTT_TASK)
-		MutexLock(&c->mutex);
-#endif
 		TimerCountdownMS(&timer, 500); /* Don't wait too long if no traffic is incoming */
 		cycle(c, &timer);
-#if defined(MQTT_TASK)
-		MutexUnlock(&c->mutex);
-#endif
 	}
 }
-
-
-#if defined(MQTT_TASK)
-int MQTTStartTask(MQTTClient* client)
-{
-	return ThreadStart(&client->thread, &MQTTRun, client);
-}
 #endif
 
 
-int waitfor(MQTTClient* c, int packet_type, Timer* timer)
+int waitfor(MQTTClient* c, MQTTWaiter* w, Timer* timer)
 {
     int rc = FAILURE;
 
+#if defined(MQTT_TASK)
+    if (c->task_running)
+    {   /* wait for the reader thread to hand over the reply */
+        while (c->handover != w && !w->failed && !TimerIsExpired(timer))
+            ConditionWait(&c->cond, &c->mutex, timer);
+        if (c->handover == w)
+        {
+            rc = w->packet_type; /* readbuf is ours until we release the mutex */
+            c->handover = NULL;
+            ConditionBroadcast(&c->cond);
+        }
+        forget(c, w);
+        return rc;
+    }
+#endif
     do
     {
         if (TimerIsExpired(timer))
             break; // we timed out
         rc = cycle(c, timer);
+        if (rc < 0 && w->message != NULL && reconnect(c) == SUCCESS)
+            rc = 0; /* the publish has been sent again */
     }
-    while (rc != packet_type && rc >= 0);
+    while (rc >= 0 && !isReplyFor(c, w, rc)); /* an ack for a publish sent again may come first */
+    forget(c, w);
 
     return rc;
 }
@@ -416,6 +1313,7 @@ int MQTTConnectWithResults(MQTTClient* c, MQTTPacket_connectData* options, MQTTC
     int rc = FAILURE;
     MQTTPacket_connectData default_options = MQTTPacket_connectData_initializer;
     int len = 0;
+    MQTTWaiter w;
 
 #if defined(MQTT_TASK)
 	  MutexLock(&c->mutex);
@@ -425,6 +1323,13 @@ int MQTTConnectWithResults(MQTTClient* c, MQTTPacket_connectData* options, MQTTC
 
     TimerInit(&connect_timer);
     TimerCountdownMS(&connect_timer, c->command_timeout_ms);
+#if defined(MQTT_TASK)
+    if (!c->task_running) /* otherwise the reader thread looks after the read state */
+#endif
+    {
+        c->read_len = 0;
+        c->read_packet_len = -1;
+    }
 
     if (options == 0)
         options = &default_options; /* set default options if none were supplied */
@@ -432,13 +1337,23 @@ int MQTTConnectWithResults(MQTTClient* c, MQTTPacket_connectData* options, MQTTC
     c->keepAliveInterval = options->keepAliveInterval;
     c->cleansession = options->cleansession;
     TimerCountdown(&c->last_received, c->keepAliveInterval);
-    if ((len = MQTTSerialize_connect(c->buf, c->buf_size, options)) <= 0)
-        goto exit;
-    if ((rc = sendPacket(c, len, &connect_timer)) != SUCCESS)  // send the connect packet
+    expect(c, &w, CONNACK, 0);
+#if defined(MQTT_TASK)
+    MutexLock(&c->write_mutex);
+#endif
+    if ((len = MQTTSerialize_connect(c->buf, c->buf_size, options)) > 0)
+        rc = sendPacket(c, len, &connect_timer);  // send the connect packet
+#if defined(MQTT_TASK)
+    unlockWrite(c);
+#endif
+    if (rc != SUCCESS)
+    {
+        forget(c, &w);
         goto exit; // there was a problem
+    }
 
     // this will be a blocking call, wait for the connack
-    if (waitfor(c, CONNACK, &connect_timer) == CONNACK)
+    if (waitfor(c, &w, &connect_timer) == CONNACK)
     {
         data->rc = 0;
         data->sessionPresent = 0;
@@ -455,6 +1370,23 @@ exit:
     {
         c->isconnected = 1;
         c->ping_outstanding = 0;
+        c->connect_count++;
+        c->reconnect_wanted = 1;
+        c->reconnect_ms = 0;
+        if (c->persistence != NULL || c->offline_len > 0)
+        {
+            int sent = (c->persistence != NULL) ? resendPersisted(c, &connect_timer) : SUCCESS;
+#if defined(MQTT_TASK)
+            MutexLock(&c->write_mutex);
+#endif
+            if (sent == SUCCESS)
+                sent = drainOffline(c, &connect_timer);
+#if defined(MQTT_TASK)
+            unlockWrite(c);
+#endif
+            if (sent != SUCCESS) /* connected, but the next call finds the session has failed */
+                MQTTCloseSession(c);
+        }
     }
 
 #if defined(MQTT_TASK)
@@ -472,7 +1404,214 @@ int MQTTConnect(MQTTClient* c, MQTTPacket_connectData* options)
 }
 
 
-int MQTTSetMessageHandler(MQTTClient* c, const char* topicFilter, messageHandler messageHandler)
+int MQTTSetAutoReconnect(MQTTClient* c, MQTTPacket_connectData* options, reconnectHandler reconnect,
+    void* context, unsigned int min_retry_ms, unsigned int max_retry_ms)
+{
+    unsigned int seed = 2166136261u;
+    const char* id = NULL;
+
+    if (reconnect != NULL && (options == NULL || min_retry_ms == 0 || max_retry_ms < min_retry_ms))
+        return FAILURE;
+#if defined(MQTT_TASK)
+	  MutexLock(&c->mutex);
+#endif
+    c->reconnect_options = options;
+    c->reconnect = reconnect;
+    c->reconnect_context = context;
+    c->reconnect_min_ms = min_retry_ms;
+    c->reconnect_max_ms = max_retry_ms;
+    c->reconnect_ms = 0;
+    TimerInit(&c->reconnect_timer);
+    /* seed the jitter from the client id, which differs between the clients of a fleet */
+    for (id = (options == NULL) ? NULL : options->clientID.cstring; id != NULL && *id; ++id)
+        seed = (seed ^ (unsigned char)*id) * 16777619u;
+    c->reconnect_seed = (seed == 0) ? 1 : seed;
+#if defined(MQTT_TASK)
+    ConditionBroadcast(&c->cond); /* the reader thread could be waiting for something to do */
+	  MutexUnlock(&c->mutex);
+#endif
+    return SUCCESS;
+}
+
+
+int MQTTSetOfflineBuffer(MQTTClient* c, unsigned char* buf, size_t buf_size, enum MQTTOfflinePolicy policy)
+{
+#if defined(MQTT_TASK)
+	  MutexLock(&c->write_mutex);
+#endif
+    c->offlinebuf = buf;
+    c->offlinebuf_size = (buf == NULL) ? 0 : buf_size;
+    c->offline_head = c->offline_len = 0;
+    c->offline_policy = policy;
+    memset(&c->offline_metrics, '\0', sizeof(c->offline_metrics));
+#if defined(MQTT_TASK)
+	  unlockWrite(c);
+#endif
+    return SUCCESS;
+}
+
+
+int MQTTGetOfflineMetrics(MQTTClient* c, MQTTOfflineMetrics* metrics)
+{
+#if defined(MQTT_TASK)
+	  MutexLock(&c->write_mutex);
+#endif
+    *metrics = c->offline_metrics;
+    metrics->bytes = c->offline_len;
+#if defined(MQTT_TASK)
+	  unlockWrite(c);
+#endif
+    return SUCCESS;
+}
+
+
+int MQTTSetPersistence(MQTTClient* c, MQTTPersistence* persistence)
+{
+    unsigned int cursor = 0;
+    unsigned short packetid = 0;
+    unsigned char* packet = NULL;
+    int released = 0;
+
+#if defined(MQTT_TASK)
+	  MutexLock(&c->mutex);
+    MutexLock(&c->write_mutex);
+#endif
+    c->persistence = persistence;
+    while (persistence != NULL && persistence->next(persistence, &cursor, &packetid, &released, &packet) > 0)
+        c->next_packetid = packetid; /* carry on after the newest */
+#if defined(MQTT_TASK)
+    unlockWrite(c);
+	  MutexUnlock(&c->mutex);
+#endif
+    return SUCCESS;
+}
+
+
+int MQTTSetWriteCoalescing(MQTTClient* c, unsigned char* buf, size_t buf_size, unsigned int budget_us)
+{
+    int rc = SUCCESS;
+    Timer timer;
+
+#if defined(MQTT_TASK)
+	  MutexLock(&c->write_mutex);
+#endif
+    TimerInit(&timer);
+    TimerCountdownMS(&timer, c->command_timeout_ms);
+    if (c->isconnected)
+        rc = flushPackets(c, &timer); /* don't lose anything collected in the old buffer */
+    c->coalesce_len = 0;
+    c->coalescebuf = buf;
+    c->coalescebuf_size = (buf == NULL) ? 0 : buf_size;
+    c->coalesce_budget_us = budget_us;
+#if defined(MQTT_TASK)
+	  unlockWrite(c);
+#endif
+    return rc;
+}
+
+
+#if defined(MQTT_PUBLISH_QUEUE)
+int MQTTSetPublishQueue(MQTTClient* c, unsigned char* buf, size_t buf_size, size_t slot_size)
+{
+    int rc = SUCCESS;
+    Timer timer;
+    const size_t align = sizeof(MQTTQueueSlot);
+
+#if defined(MQTT_TASK)
+	  MutexLock(&c->write_mutex);
+#endif
+    TimerInit(&timer);
+    TimerCountdownMS(&timer, c->command_timeout_ms);
+    if (c->isconnected)
+        rc = drainQueue(c, &timer); /* don't lose anything in the old queue */
+    c->queuebuf = NULL;
+    if (buf != NULL)
+    {
+        size_t skip = (align - ((size_t)buf % align)) % align; /* slot headers have to be aligned */
+        unsigned int i, slots = 1;
+
+        slot_size = (slot_size + align - 1) / align * align;
+        if (slot_size <= align || buf_size < skip + slot_size)
+            rc = FAILURE;
+        else
+        {
+            while (slots * 2 <= (buf_size - skip) / slot_size)
+                slots *= 2; /* a power of two, so that the positions can wrap around */
+            c->queue_slots = slots;
+            c->queue_slot_size = (unsigned int)slot_size;
+            c->queue_head = c->queue_tail = 0;
+            c->queuebuf = buf + skip;
+            for (i = 0; i < slots; ++i)
+                QUEUE_SLOT(c, i)->seq = i;
+        }
+    }
+#if defined(MQTT_TASK)
+	  unlockWrite(c);
+#endif
+    return rc;
+}
+
+
+int MQTTEnqueuePublish(MQTTClient* c, const char* topicName, MQTTMessage* message)
+{
+    int rc = FAILURE;
+    MQTTString topic = MQTTString_initializer;
+    MQTTQueueSlot* slot = NULL;
+    unsigned int pos = 0;
+
+    topic.cstring = (char *)topicName;
+    if (c->queuebuf == NULL || message->qos != QOS0 || !c->isconnected)
+        return FAILURE;
+
+    /* claim the slot at the tail */
+    pos = __atomic_load_n(&c->queue_tail, __ATOMIC_RELAXED);
+    while (1)
+    {
+        int diff;
+
+        slot = QUEUE_SLOT(c, pos);
+        diff = (int)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&c->queue_tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0)
+        {   /* the queue is full */
+            slot = NULL;
+            break;
+        }
+        else
+            pos = __atomic_load_n(&c->queue_tail, __ATOMIC_RELAXED);
+    }
+
+    if (slot)
+    {
+        slot->len = MQTTSerialize_publish((unsigned char*)(slot + 1), c->queue_slot_size - sizeof(MQTTQueueSlot), 0, 0,
+                  message->retained, 0, topic, (unsigned char*)message->payload, message->payloadlen);
+        if (slot->len > 0)
+            rc = SUCCESS;
+        else
+        {   /* the slot still has to be passed on, so leave it empty */
+            slot->len = 0;
+            rc = BUFFER_OVERFLOW;
+        }
+        __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    }
+
+#if defined(MQTT_TASK)
+    /* if nobody is writing, write the queue out now.  Otherwise whoever is writing does, before
+     * releasing write_mutex: the fence makes sure that either it sees the slot, or we get the lock */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (queueReady(c) && c->isconnected && MutexTryLock(&c->write_mutex))
+        unlockWrite(c);
+#endif
+    return rc;
+}
+#endif
+
+
+static int setMessageHandler(MQTTClient* c, const char* topicFilter, messageHandler messageHandler, enum QoS qos)
 {
     int rc = FAILURE;
     int i = -1;
@@ -508,37 +1647,61 @@ int MQTTSetMessageHandler(MQTTClient* c, const char* topicFilter, messageHandler
         {
             c->messageHandlers[i].topicFilter = topicFilter;
             c->messageHandlers[i].fp = messageHandler;
+            c->messageHandlers[i].qos = qos;
         }
     }
     return rc;
 }
 
 
+int MQTTSetMessageHandler(MQTTClient* c, const char* topicFilter, messageHandler messageHandler)
+{
+    return setMessageHandler(c, topicFilter, messageHandler, SUBFAIL);
+}
+
+
+
+
 int MQTTSubscribeWithResults(MQTTClient* c, const char* topicFilter, enum QoS qos,
        messageHandler messageHandler, MQTTSubackData* data)
 {
     int rc = FAILURE;
     Timer timer;
     int len = 0;
+    MQTTWaiter w;
+    unsigned int connect_count = 0;
     MQTTString topic = MQTTString_initializer;
     topic.cstring = (char *)topicFilter;
 
 #if defined(MQTT_TASK)
 	  MutexLock(&c->mutex);
 #endif
+	  connect_count = c->connect_count;
 	  if (!c->isconnected)
 		    goto exit;
 
     TimerInit(&timer);
     TimerCountdownMS(&timer, c->command_timeout_ms);
 
-    len = MQTTSerialize_subscribe(c->buf, c->buf_size, 0, getNextPacketId(c), 1, &topic, (int*)&qos);
-    if (len <= 0)
-        goto exit;
-    if ((rc = sendPacket(c, len, &timer)) != SUCCESS) // send the subscribe packet
+    expect(c, &w, SUBACK, getNextPacketId(c));
+#if defined(MQTT_TASK)
+    MutexLock(&c->write_mutex);
+    MutexUnlock(&c->mutex); /* the reader thread can carry on while we write */
+#endif
+    len = MQTTSerialize_subscribe(c->buf, c->buf_size, 0, w.packetid, 1, &topic, (int*)&qos);
+    if (len > 0)
+        rc = sendPacket(c, len, &timer); // send the subscribe packet
+#if defined(MQTT_TASK)
+    unlockWrite(c);
+    MutexLock(&c->mutex);
+#endif
+    if (rc != SUCCESS)
+    {
+        forget(c, &w);
         goto exit;             // there was a problem
+    }
 
-    if (waitfor(c, SUBACK, &timer) == SUBACK)      // wait for suback
+    if (waitfor(c, &w, &timer) == SUBACK)      // wait for suback
     {
         int count = 0;
         unsigned short mypacketid;
@@ -546,14 +1709,14 @@ int MQTTSubscribeWithResults(MQTTClient* c, const char* topicFilter, enum QoS qo
         if (MQTTDeserialize_suback(&mypacketid, 1, &count, (int*)&data->grantedQoS, c->readbuf, c->readbuf_size) == 1)
         {
             if (data->grantedQoS != 0x80)
-                rc = MQTTSetMessageHandler(c, topicFilter, messageHandler);
+                rc = setMessageHandler(c, topicFilter, messageHandler, qos);
         }
     }
     else
         rc = FAILURE;
 
 exit:
-    if (rc == FAILURE)
+    if (rc == FAILURE && connect_count == c->connect_count) /* unless it has already been replaced by a reconnect */
         MQTTCloseSession(c);
 #if defined(MQTT_TASK)
 	  MutexUnlock(&c->mutex);
@@ -577,22 +1740,37 @@ int MQTTUnsubscribe(MQTTClient* c, const char* topicFilter)
     MQTTString topic = MQTTString_initializer;
     topic.cstring = (char *)topicFilter;
     int len = 0;
+    MQTTWaiter w;
+    unsigned int connect_count = 0;
 
 #if defined(MQTT_TASK)
 	  MutexLock(&c->mutex);
 #endif
+	  connect_count = c->connect_count;
 	  if (!c->isconnected)
 		  goto exit;
 
     TimerInit(&timer);
     TimerCountdownMS(&timer, c->command_timeout_ms);
 
-    if ((len = MQTTSerialize_unsubscribe(c->buf, c->buf_size, 0, getNextPacketId(c), 1, &topic)) <= 0)
-        goto exit;
-    if ((rc = sendPacket(c, len, &timer)) != SUCCESS) // send the subscribe packet
+    expect(c, &w, UNSUBACK, getNextPacketId(c));
+#if defined(MQTT_TASK)
+    MutexLock(&c->write_mutex);
+    MutexUnlock(&c->mutex); /* the reader thread can carry on while we write */
+#endif
+    if ((len = MQTTSerialize_unsubscribe(c->buf, c->buf_size, 0, w.packetid, 1, &topic)) > 0)
+        rc = sendPacket(c, len, &timer); // send the unsubscribe packet
+#if defined(MQTT_TASK)
+    unlockWrite(c);
+    MutexLock(&c->mutex);
+#endif
+    if (rc != SUCCESS)
+    {
+        forget(c, &w);
         goto exit; // there was a problem
+    }
 
-    if (waitfor(c, UNSUBACK, &timer) == UNSUBACK)
+    if (waitfor(c, &w, &timer) == UNSUBACK)
     {
         unsigned short mypacketid;  // should be the same as the packetid above
         if (MQTTDeserialize_unsuback(&mypacketid, c->readbuf, c->readbuf_size) == 1)
@@ -605,7 +1783,7 @@ int MQTTUnsubscribe(MQTTClient* c, const char* topicFilter)
         rc = FAILURE;
 
 exit:
-    if (rc == FAILURE)
+    if (rc == FAILURE && connect_count == c->connect_count) /* unless it has already been replaced by a reconnect */
         MQTTCloseSession(c);
 #if defined(MQTT_TASK)
 	  MutexUnlock(&c->mutex);
@@ -614,48 +1792,138 @@ exit:
 }
 
 
-int MQTTPublish(MQTTClient* c, const char* topicName, MQTTMessage* message)
+/* Keep a publish made while disconnected in the offline buffer */
+static int publishOffline(MQTTClient* c, MQTTString* topic, MQTTMessage* message)
+{
+    int len = 0,
+      rc = FAILURE;
+
+    if (message->qos == QOS1 || message->qos == QOS2)
+        message->id = getNextPacketId(c);
+#if defined(MQTT_TASK)
+    MutexLock(&c->write_mutex);
+#endif
+    len = MQTTSerialize_publish(c->buf, c->buf_size, 0, message->qos, message->retained, message->id,
+              *topic, (unsigned char*)message->payload, message->payloadlen);
+    rc = (len > 0) ? storeOffline(c, len) : BUFFER_OVERFLOW;
+#if defined(MQTT_TASK)
+    unlockWrite(c);
+#endif
+    return rc;
+}
+
+
+/* Send a publish just kept by persistence once commit has stored it safely, so that a crash while
+ * it is in flight can't lose it.  Under MQTT_TASK write_mutex is released for the commit, so that
+ * publishes from other threads can share it, and the packet is serialized into buf again after.
+ * If the session has failed meanwhile, the publish is left to the reconnect, which sends what
+ * persistence keeps again with DUP set, and the ack is waited for as before. */
+static int commitPublish(MQTTClient* c, MQTTString* topic, MQTTMessage* message, int len,
+    unsigned int connect_count, Timer* timer)
+{
+    int rc = SUCCESS;
+
+    if (c->persistence->commit == NULL)
+        return sendPacket(c, len, timer);
+#if defined(MQTT_TASK)
+    unlockWrite(c);
+#endif
+    rc = c->persistence->commit(c->persistence);
+#if defined(MQTT_TASK)
+    MutexLock(&c->write_mutex);
+    if (rc == SUCCESS && (!c->isconnected || c->connect_count != connect_count))
+        return SUCCESS; /* not on this connection: the reconnect has sent it, or will */
+    if (rc == SUCCESS)
+        len = MQTTSerialize_publish(c->buf, c->buf_size, 0, message->qos, message->retained, message->id,
+              *topic, (unsigned char*)message->payload, message->payloadlen);
+#endif
+    if (rc == SUCCESS)
+        rc = (len > 0) ? sendPacket(c, len, timer) : FAILURE;
+    return rc;
+}
+
+
+/* Send a publish, and wait for it to complete.  Its payload is serialized with the rest of the
+ * packet into buf, unless body says where else to send it from. */
+static int publish(MQTTClient* c, const char* topicName, MQTTMessage* message, struct MQTTBody* body)
 {
     int rc = FAILURE;
     Timer timer;
     MQTTString topic = MQTTString_initializer;
     topic.cstring = (char *)topicName;
     int len = 0;
+    MQTTWaiter w;
+    unsigned int connect_count = 0;
 
 #if defined(MQTT_TASK)
 	  MutexLock(&c->mutex);
 #endif
+	  connect_count = c->connect_count;
 	  if (!c->isconnected)
+	  {
+	      if (c->offlinebuf != NULL && body == NULL)
+	          rc = publishOffline(c, &topic, message);
 		    goto exit;
+	  }
 
     TimerInit(&timer);
     TimerCountdownMS(&timer, c->command_timeout_ms);
 
     if (message->qos == QOS1 || message->qos == QOS2)
+    {
         message->id = getNextPacketId(c);
-
-    len = MQTTSerialize_publish(c->buf, c->buf_size, 0, message->qos, message->retained, message->id,
+        expect(c, &w, (message->qos == QOS1) ? PUBACK : PUBCOMP, message->id);
+        w.topic = &topic;
+        w.message = (body == NULL) ? message : NULL; /* a payload sent from elsewhere isn't sent again */
+    }
+#if defined(MQTT_TASK)
+    MutexLock(&c->write_mutex);
+    MutexUnlock(&c->mutex); /* the reader thread can carry on while we write */
+#endif
+    if (c->offline_len > 0 && drainOffline(c, &timer) != SUCCESS) /* the older publishes go first */
+        len = FAILURE;
+#if defined(MQTT_ZEROCOPY)
+    else if (body != NULL)
+        len = MQTTSerialize_publishHeader(c->buf, c->buf_size, 0, message->qos, message->retained, message->id,
+              topic, message->payloadlen);
+#endif
+    else
+        len = MQTTSerialize_publish(c->buf, c->buf_size, 0, message->qos, message->retained, message->id,
               topic, (unsigned char*)message->payload, message->payloadlen);
     if (len <= 0)
-        goto exit;
-    if ((rc = sendPacket(c, len, &timer)) != SUCCESS) // send the subscribe packet
-        goto exit; // there was a problem
-
-    if (message->qos == QOS1)
+        rc = FAILURE;
+#if defined(MQTT_ZEROCOPY)
+    else if (body != NULL)
     {
-        if (waitfor(c, PUBACK, &timer) == PUBACK)
-        {
-            unsigned short mypacketid;
-            unsigned char dup, type;
-            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, c->readbuf, c->readbuf_size) != 1)
-                rc = FAILURE;
-        }
-        else
-            rc = FAILURE;
+        if ((rc = sendPacket(c, len, &timer)) == SUCCESS) /* the header, with anything coalesced before it */
+            rc = writeBody(c, message, body, &timer);
+    }
+#endif
+    else if (message->qos == QOS0 && c->coalescebuf != NULL)
+        rc = coalescePacket(c, len, &timer);
+    else if (message->qos != QOS0 && c->persistence != NULL &&
+            (rc = c->persistence->add(c->persistence, message->id, c->buf, len)) != SUCCESS)
+        ; /* there's nowhere to keep it until it's complete, so it isn't sent */
+    else if (message->qos != QOS0 && c->persistence != NULL)
+        rc = commitPublish(c, &topic, message, len, connect_count, &timer);
+    else
+        rc = sendPacket(c, len, &timer); // send the publish packet
+#if defined(MQTT_TASK)
+    unlockWrite(c);
+    if (message->qos == QOS0 && rc == SUCCESS)
+        return rc; /* nothing to wait for */
+    MutexLock(&c->mutex);
+#endif
+    if (rc != SUCCESS)
+    {
+        if (message->qos != QOS0)
+            forget(c, &w);
+        goto exit; // there was a problem
     }
-    else if (message->qos == QOS2)
+
+    if (message->qos != QOS0)
     {
-        if (waitfor(c, PUBCOMP, &timer) == PUBCOMP)
+        if (waitfor(c, &w, &timer) == w.packet_type)
         {
             unsigned short mypacketid;
             unsigned char dup, type;
@@ -667,7 +1935,7 @@ int MQTTPublish(MQTTClient* c, const char* topicName, MQTTMessage* message)
     }
 
 exit:
-    if (rc == FAILURE)
+    if (rc == FAILURE && connect_count == c->connect_count) /* unless it has already been replaced by a reconnect */
         MQTTCloseSession(c);
 #if defined(MQTT_TASK)
 	  MutexUnlock(&c->mutex);
@@ -676,6 +1944,34 @@ exit:
 }
 
 
+int MQTTPublish(MQTTClient* c, const char* topicName, MQTTMessage* message)
+{
+    return publish(c, topicName, message, NULL);
+}
+
+
+#if defined(MQTT_ZEROCOPY)
+int MQTTPublishFile(MQTTClient* c, const char* topicName, MQTTMessage* message, int fd, off_t offset)
+{
+    MQTTBody body = {fd, offset};
+
+    if (fd < 0 || c->ipstack->mqttsendfile == NULL || (message->qos != QOS0 && c->persistence != NULL))
+        return FAILURE; /* the payload couldn't be kept */
+    return publish(c, topicName, message, &body);
+}
+
+
+int MQTTPublishZeroCopy(MQTTClient* c, const char* topicName, MQTTMessage* message)
+{
+    MQTTBody body = {-1, 0};
+
+    if (c->ipstack->mqttwritezerocopy == NULL || (message->qos != QOS0 && c->persistence != NULL))
+        return FAILURE;
+    return publish(c, topicName, message, &body);
+}
+#endif
+
+
 int MQTTDisconnect(MQTTClient* c)
 {
     int rc = FAILURE;
@@ -684,6 +1980,7 @@ int MQTTDisconnect(MQTTClient* c)
 
 #if defined(MQTT_TASK)
 	MutexLock(&c->mutex);
+	MutexLock(&c->write_mutex);
 #endif
     TimerInit(&timer);
     TimerCountdownMS(&timer, c->command_timeout_ms);
@@ -691,6 +1988,10 @@ int MQTTDisconnect(MQTTClient* c)
 	  len = MQTTSerialize_disconnect(c->buf, c->buf_size);
     if (len > 0)
         rc = sendPacket(c, len, &timer);            // send the disconnect packet
+#if defined(MQTT_TASK)
+	  unlockWrite(c);
+#endif
+    c->reconnect_wanted = 0;
     MQTTCloseSession(c);
 
 #if defined(MQTT_TASK)
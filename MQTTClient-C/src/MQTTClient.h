@@ -70,6 +70,7 @@ typedef struct Network
 extern void TimerInit(Timer*);
 extern char TimerIsExpired(Timer*);
 extern void TimerCountdownMS(Timer*, unsigned int);
+extern void TimerCountdownUS(Timer*, unsigned int);
 extern void TimerCountdown(Timer*, unsigned int);
 extern int TimerLeftMS(Timer*);
 
@@ -102,6 +103,43 @@ typedef struct MQTTSubackData
 
 typedef void (*messageHandler)(MessageData*);
 
+/* What to do with a publish made while disconnected when the offline buffer is full */
+enum MQTTOfflinePolicy { OFFLINE_REJECT, OFFLINE_DROP_OLDEST };
+
+typedef struct MQTTOfflineMetrics
+{
+    unsigned int count,           /* publishes waiting to be sent now */
+      bytes,                      /* and the space they take */
+      high_water,                 /* the most space they have taken */
+      stored,                     /* publishes accepted while disconnected, in all */
+      sent,
+      dropped,                    /* the oldest, to make room, with OFFLINE_DROP_OLDEST */
+      rejected;                   /* turned away, with OFFLINE_REJECT */
+} MQTTOfflineMetrics;
+
+/* Somewhere to keep QoS 1 and 2 publishes until they are complete, so they can be sent again after the
+ * client, or the whole process, is restarted.  Like Network, the platform provides an implementation. */
+typedef struct MQTTPersistence
+{
+    /* keep the serialized publish, before it is sent.  Return SUCCESS, or BUFFER_OVERFLOW if there's no room */
+    int (*add)(struct MQTTPersistence*, unsigned short id, unsigned char* packet, int len);
+    /* PUBREC has arrived, so it is the PUBREL which has to be sent again */
+    void (*release)(struct MQTTPersistence*, unsigned short id);
+    /* PUBACK or PUBCOMP has arrived */
+    void (*remove)(struct MQTTPersistence*, unsigned short id);
+    /* the publishes kept, oldest first, starting with *cursor == 0.  The client sets the DUP flag of the
+     * packet in place when it sends it again.  Return the packet's length, or 0 after the last */
+    int (*next)(struct MQTTPersistence*, unsigned int* cursor, unsigned short* id, int* released, unsigned char** packet);
+    /* wait until everything kept so far is safely stored.  Called after add and before the publish is
+     * sent, with no lock held, so that publishes from several threads can share one commit.  NULL if
+     * add stores each publish safely by itself */
+    int (*commit)(struct MQTTPersistence*);
+} MQTTPersistence;
+
+/* Called to make a new network connection when the client reconnects automatically.  It should
+ * close the old connection first.  Return SUCCESS once connected. */
+typedef int (*reconnectHandler)(Network*, void*);
+
 typedef struct MQTTClient
 {
     unsigned int next_packetid,
@@ -110,6 +148,8 @@ typedef struct MQTTClient
       readbuf_size;
     unsigned char *buf,
       *readbuf;
+    int read_len,         /* progress of a partly read packet in readbuf */
+      read_packet_len;
     unsigned int keepAliveInterval;
     char ping_outstanding;
     int isconnected;
@@ -119,15 +159,58 @@ typedef struct MQTTClient
     {
         const char* topicFilter;
         void (*fp) (MessageData*);
+        enum QoS qos;             /* to subscribe again with, or SUBFAIL if the client didn't subscribe */
     } messageHandlers[MAX_MESSAGE_HANDLERS];      /* Message handlers are indexed by subscription topic */
 
     void (*defaultMessageHandler) (MessageData*);
 
+    unsigned char *coalescebuf;   /* outbound packets waiting to be written together */
+    size_t coalescebuf_size,
+      coalesce_len;
+    unsigned int coalesce_budget_us;
+    Timer coalesce_timer;
+    unsigned char *offlinebuf;    /* a ring of publishes made while disconnected, serialized back to back */
+    size_t offlinebuf_size,
+      offline_head,               /* the oldest packet */
+      offline_len;
+    enum MQTTOfflinePolicy offline_policy;
+    MQTTOfflineMetrics offline_metrics;
+    MQTTPersistence* persistence; /* QoS 1 and 2 publishes until they complete, when set */
+    void (*deadline_changed)(void*); /* set by an event loop, to be told when timed work is brought forward */
+    void (*network_changed)(void*, int); /* and when reconnecting replaces the network: 0 before, 1 after */
+    void* deadline_context;       /* passed to both */
+
+#if defined(MQTT_PUBLISH_QUEUE)
+    unsigned char *queuebuf;      /* QoS 0 publishes serialized by any thread, written by the one doing the I/O */
+    unsigned int queue_slots,
+      queue_slot_size,
+      queue_head,                 /* the next slot to be written out */
+      queue_tail;                 /* the next slot to be filled, claimed atomically */
+#endif
+
     Network* ipstack;
     Timer last_sent, last_received;
+    struct MQTTWaiter *waiters;   /* API calls waiting for a reply from the server */
+    unsigned int connect_count;   /* how many times the client has connected, so a command can tell its session has been replaced */
+
+    MQTTPacket_connectData* reconnect_options; /* automatic reconnect, when set */
+    reconnectHandler reconnect;
+    void* reconnect_context;
+    unsigned int reconnect_min_ms,
+      reconnect_max_ms,
+      reconnect_ms,               /* the current backoff interval, 0 when the last attempt succeeded */
+      reconnect_seed;
+    Timer reconnect_timer;        /* no attempt until this expires */
+    char reconnect_wanted;        /* connected by the application, and not disconnected by it since */
 #if defined(MQTT_TASK)
-    Mutex mutex;
+    Mutex mutex,                  /* the session state */
+      write_mutex;                /* buf, the coalescing buffer, and writing to the network */
     Thread thread;
+    Condition cond;               /* signalled when the reader thread hands over a packet, or fails */
+    struct MQTTWaiter *handover;  /* the waiter whose reply is in readbuf */
+    char task_running,
+      task_stop;
+    struct MQTTDispatch* dispatch; /* worker threads to run the message handlers, if any */
 #endif
 } MQTTClient;
 
@@ -159,7 +242,8 @@ DLLExport int MQTTConnectWithResults(MQTTClient* client, MQTTPacket_connectData*
  */
 DLLExport int MQTTConnect(MQTTClient* client, MQTTPacket_connectData* options);
 
-/** MQTT Publish - send an MQTT publish packet and wait for all acks to complete for all QoSs
+/** MQTT Publish - send an MQTT publish packet and wait for all acks to complete for all QoSs.
+ *  While disconnected, the publish is kept in the offline buffer if there is one.
  *  @param client - the client object to use
  *  @param topic - the topic to publish to
  *  @param message - the message to send
@@ -167,6 +251,103 @@ DLLExport int MQTTConnect(MQTTClient* client, MQTTPacket_connectData* options);
  */
 DLLExport int MQTTPublish(MQTTClient* client, const char*, MQTTMessage*);
 
+#if defined(MQTT_ZEROCOPY)
+/** MQTT PublishFile - send an MQTT publish whose payload is message->payloadlen bytes of a file,
+ *  and wait for all acks to complete for all QoSs.  The header goes through the send buffer as
+ *  usual, but the payload is written to the network straight from the file, so it can be much
+ *  larger than the buffer.  The file shouldn't change while the publish is in flight.  The payload
+ *  isn't kept anywhere, so the publish fails if the client is disconnected, if it has a persistence
+ *  layer and the QoS is 1 or 2, or if the connection is lost before the publish completes.
+ *  @param client - the client object to use
+ *  @param topic - the topic to publish to
+ *  @param message - the message to send: its payload is not used
+ *  @param fd - the file to send the payload from
+ *  @param offset - where the payload starts in the file
+ *  @return success code
+ */
+DLLExport int MQTTPublishFile(MQTTClient* client, const char* topic, MQTTMessage* message, int fd, off_t offset);
+
+/** MQTT PublishZeroCopy - send an MQTT publish whose payload is written to the network straight from
+ *  message->payload, rather than copied into the send buffer first, and wait for all acks to complete
+ *  for all QoSs.  Where the network can, large payloads are not copied into the kernel either: their
+ *  pages are pinned until it has sent them, and this returns only once it has finished with them, so
+ *  the payload can be changed or freed straight after.  It fails in the same cases as MQTTPublishFile.
+ *  @param client - the client object to use
+ *  @param topic - the topic to publish to
+ *  @param message - the message to send
+ *  @return success code
+ */
+DLLExport int MQTTPublishZeroCopy(MQTTClient* client, const char* topic, MQTTMessage* message);
+#endif
+
+/** MQTT SetWriteCoalescing - collect QoS 0 publishes in a buffer and write them to the network together.
+ *  The buffer is written when it is full, when the oldest packet in it has waited for the time budget,
+ *  or when any other packet is sent or the client waits for incoming data (MQTTYield, or any blocking call).
+ *  The budget is kept, to the millisecond, by the reader thread of MQTTStartTask, which reads in slices
+ *  no longer than the budget while coalescing is on.  Without a reader thread, the budget can only be
+ *  checked when the client is called: call MQTTYieldNoWait by MQTTNextDeadline, as MQTTEpollRun does,
+ *  or a lone publish waits until the next call on the client.
+ *  @param client - the client object to use
+ *  @param buf - the buffer to collect packets in, or NULL to stop coalescing
+ *  @param buf_size - the size of the buffer
+ *  @param budget_us - the longest time, in microseconds, a packet may wait in the buffer
+ *  @return success code
+ */
+DLLExport int MQTTSetWriteCoalescing(MQTTClient* client, unsigned char* buf, size_t buf_size, unsigned int budget_us);
+
+/** MQTT SetOfflineBuffer - keep publishes made while the client is disconnected, rather than fail
+ *  them, and send them in order once it has connected again.  They are held serialized in a ring
+ *  buffer, and written straight from it, so they go out at the speed of the network.  QoS 1 and 2
+ *  publishes are given their packet ids when they are stored, and their acknowledgements are not
+ *  waited for.
+ *  @param client - the client object to use
+ *  @param buf - the buffer to keep publishes in, or NULL to stop keeping them.  Anything kept in
+ *  the old buffer is discarded.
+ *  @param buf_size - the size of the buffer
+ *  @param policy - what to do when the buffer is full: reject the new publish, or drop the oldest
+ *  @return success code
+ */
+DLLExport int MQTTSetOfflineBuffer(MQTTClient* client, unsigned char* buf, size_t buf_size, enum MQTTOfflinePolicy policy);
+
+/** MQTT GetOfflineMetrics - how the offline buffer is being used.
+ *  @param client - the client object to use
+ *  @param metrics - returned: the occupancy and counters
+ *  @return success code
+ */
+DLLExport int MQTTGetOfflineMetrics(MQTTClient* client, MQTTOfflineMetrics* metrics);
+
+/** MQTT SetPersistence - keep QoS 1 and 2 publishes until they are complete.  Each is kept before it is
+ *  sent, and every time the client connects it sends again those which are still there, oldest first,
+ *  in place of the copies it holds in memory.  Set it before connecting, so that publishes left by an
+ *  earlier run are sent again, and new ones don't reuse their packet ids.
+ *  @param client - the client object to use
+ *  @param persistence - the store to use, or NULL to keep nothing
+ *  @return success code
+ */
+DLLExport int MQTTSetPersistence(MQTTClient* client, MQTTPersistence* persistence);
+
+#if defined(MQTT_PUBLISH_QUEUE)
+/** MQTT SetPublishQueue - give the client a lock-free queue for QoS 0 publishes from many threads.
+ *  The buffer is divided into slots, each holding one serialized publish.
+ *  @param client - the client object to use
+ *  @param buf - the buffer for the queue, or NULL to stop queueing
+ *  @param buf_size - the size of the buffer
+ *  @param slot_size - the space for each packet, which limits the size of a queued publish
+ *  @return success code
+ */
+DLLExport int MQTTSetPublishQueue(MQTTClient* client, unsigned char* buf, size_t buf_size, size_t slot_size);
+
+/** MQTT EnqueuePublish - serialize a QoS 0 publish into a free queue slot, without taking any lock.
+ *  The queue is written out in batches by the thread doing the client's I/O, at the start of each
+ *  cycle.  With MQTT_TASK, the publishing thread writes the queue out itself if nobody else is writing.
+ *  @param client - the client object to use
+ *  @param topic - the topic to publish to
+ *  @param message - the message to send, which must be QoS 0
+ *  @return success code.  FAILURE if the queue is full, BUFFER_OVERFLOW if the message is too large
+ */
+DLLExport int MQTTEnqueuePublish(MQTTClient* client, const char* topic, MQTTMessage* message);
+#endif
+
 /** MQTT SetMessageHandler - set or remove a per topic message handler
  *  @param client - the client object to use
  *  @param topicFilter - the topic filter set the message handler for
@@ -205,6 +386,24 @@ DLLExport int MQTTUnsubscribe(MQTTClient* client, const char* topicFilter);
  */
 DLLExport int MQTTDisconnect(MQTTClient* client);
 
+/** MQTT SetAutoReconnect - reconnect by itself when the session fails, rather than leave it to the
+ *  application.  Attempts back off exponentially between the two limits, with random jitter so that
+ *  many clients don't reconnect all at once.  On reconnecting, the client subscribes again to the
+ *  topics it has handlers for if the server has no session for it, and sends the QoS 1 and 2
+ *  publishes still waiting for acknowledgements again, with the DUP flag set.  The reconnect is made
+ *  by whoever reads the network: the background thread, or MQTTYield, which returns FAILURE while
+ *  it is backing off.  MQTTDisconnect stops it.
+ *  @param client - the client object to use
+ *  @param options - the connect options to reconnect with, which must stay valid
+ *  @param reconnect - makes the new network connection, or NULL to stop reconnecting automatically
+ *  @param context - passed to the reconnect handler
+ *  @param min_retry_ms - the interval before the second attempt, the first being made straight away
+ *  @param max_retry_ms - the longest interval between attempts
+ *  @return success code
+ */
+DLLExport int MQTTSetAutoReconnect(MQTTClient* client, MQTTPacket_connectData* options, reconnectHandler reconnect,
+    void* context, unsigned int min_retry_ms, unsigned int max_retry_ms);
+
 /** MQTT Yield - MQTT background
  *  @param client - the client object to use
  *  @param time - the time, in milliseconds, to yield for
@@ -212,18 +411,59 @@ DLLExport int MQTTDisconnect(MQTTClient* client);
  */
 DLLExport int MQTTYield(MQTTClient* client, int time);
 
+/** MQTT YieldNoWait - process everything which has already arrived, and any keepalive which is due,
+ *  without waiting for more.  This lets the client be driven from an application's own poll loop:
+ *  call it when the network's socket (my_socket on Linux) is readable, or when next_ms has passed.
+ *  Not for use with MQTTStartTask.
+ *  @param client - the client object to use
+ *  @param next_ms - returned: milliseconds until the client next has timed work to do, or -1 if none
+ *  @return success code - on failure, this means the client has disconnected.  If MQTTIsReconnecting,
+ *  call again by next_ms, and watch the new socket once it has reconnected.
+ */
+DLLExport int MQTTYieldNoWait(MQTTClient* client, int* next_ms);
+
+/** MQTT NextDeadline - how long until the client has timed work to do: a keepalive, or coalesced or
+ *  queued packets to write.  This changes when anything is sent, so check it again before waiting.
+ *  @param client - the client object to use
+ *  @return milliseconds, or -1 if nothing is scheduled
+ */
+DLLExport int MQTTNextDeadline(MQTTClient* client);
+
 /** MQTT isConnected
  *  @param client - the client object to use
  *  @return truth value indicating whether the client is connected to the server
  */
 DLLExport int MQTTIsConnected(MQTTClient* client);
 
+/** MQTT IsReconnecting - is the client disconnected, but going to reconnect by itself?  Then a
+ *  failure from MQTTYield or MQTTYieldNoWait only means that it is backing off.
+ *  @param client - the client object to use
+ *  @return truth value
+ */
+DLLExport int MQTTIsReconnecting(MQTTClient* client);
+
 #if defined(MQTT_TASK)
-/** MQTT start background thread for a client.  After this, MQTTYield should not be called.
+/** MQTT start background thread for a client.  The thread reads everything the server sends,
+*  and API calls from other threads wait for their replies to be handed to them.  After this,
+*  MQTTYield just waits.
 *  @param client - the client object to use
 *  @return success code
 */
 DLLExport int MQTTStartTask(MQTTClient* client);
+
+/** MQTT stop the background thread for a client, and wait for it to finish.
+*  @param client - the client object to use
+*  @return success code
+*/
+DLLExport int MQTTStopTask(MQTTClient* client);
+
+/** MQTT set dispatch - hand incoming messages to worker threads to run the message handlers, rather
+*  than running them on the background thread.  Only used while the background thread is running.
+*  @param client - the client object to use
+*  @param dispatch - a started dispatch object (see MQTTDispatch.h), or NULL to run handlers inline
+*  @return success code
+*/
+DLLExport int MQTTSetDispatch(MQTTClient* client, struct MQTTDispatch* dispatch);
 #endif
 
 #if defined(__cplusplus)
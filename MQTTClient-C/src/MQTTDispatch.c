@@ -0,0 +1,193 @@
+/*******************************************************************************
+ * Copyright (c) 2014, 2023 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+#include "MQTTDispatch.h"
+
+#include <string.h>
+
+#if defined(MQTT_TASK)
+
+static void MQTTDispatch_work(void* parm)
+{
+    MQTTDispatchWorker* w = (MQTTDispatchWorker*)parm;
+    MQTTDispatch* d = w->dispatch;
+
+    MutexLock(&d->mutex);
+    while (1)
+    {
+        MQTTDispatchItem* item = NULL;
+        MessageData md;
+
+        while (w->count == 0 && !d->stop)
+            ConditionWait(&w->cond, &d->mutex, NULL);
+        if (w->count == 0)
+            break; /* stopped, and everything queued has been handled */
+
+        item = &w->items[w->head];
+        MutexUnlock(&d->mutex); /* the item stays ours until we take it off the queue */
+        md.topicName = &item->topicName;
+        md.message = &item->message;
+        item->fp(&md);
+        MutexLock(&d->mutex);
+
+        w->head = (w->head + 1) % MQTT_DISPATCH_QUEUE_DEPTH;
+        w->count--;
+        ConditionBroadcast(&w->cond); /* there is room for the reader */
+    }
+    MutexUnlock(&d->mutex);
+}
+
+
+int MQTTDispatchStart(MQTTDispatch* d, int workers, unsigned char* pool, size_t pool_size)
+{
+    int i, j, rc = SUCCESS;
+
+    if (workers <= 0 || workers > MQTT_DISPATCH_MAX_WORKERS)
+        return FAILURE;
+    MutexInit(&d->mutex);
+    d->workers = workers;
+    d->stop = 0;
+    d->slot_size = pool_size / (workers * MQTT_DISPATCH_QUEUE_DEPTH);
+    d->dispatched = d->overflowed = d->full_waits = 0;
+    for (i = 0; i < workers; ++i)
+    {
+        MQTTDispatchWorker* w = &d->worker[i];
+
+        w->dispatch = d;
+        w->head = w->count = w->high_water = 0;
+        ConditionInit(&w->cond);
+        for (j = 0; j < MQTT_DISPATCH_QUEUE_DEPTH; ++j)
+            w->items[j].buf = &pool[(i * MQTT_DISPATCH_QUEUE_DEPTH + j) * d->slot_size];
+    }
+    for (i = 0; i < workers && rc == SUCCESS; ++i)
+    {
+        if (ThreadStart(&d->worker[i].thread, MQTTDispatch_work, &d->worker[i]) != 0)
+            rc = FAILURE;
+    }
+    if (rc != SUCCESS)
+    {
+        d->workers = i - 1; /* only stop the ones which started */
+        MQTTDispatchStop(d);
+    }
+    return rc;
+}
+
+
+int MQTTDispatchStop(MQTTDispatch* d)
+{
+    int i;
+
+    MutexLock(&d->mutex);
+    d->stop = 1;
+    for (i = 0; i < d->workers; ++i)
+        ConditionBroadcast(&d->worker[i].cond);
+    MutexUnlock(&d->mutex);
+    for (i = 0; i < d->workers; ++i)
+        ThreadJoin(&d->worker[i].thread);
+    d->workers = 0;
+    return SUCCESS;
+}
+
+
+/* FNV-1a, so that one topic always goes to the same worker */
+static unsigned int MQTTDispatch_hash(const char* data, int len)
+{
+    unsigned int hash = 2166136261u;
+    int i;
+
+    for (i = 0; i < len; ++i)
+        hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+    return hash;
+}
+
+
+int MQTTDispatchMessage(MQTTDispatch* d, Mutex* held, messageHandler fp, MQTTString* topicName, MQTTMessage* message)
+{
+    int rc = SUCCESS;
+    const char* topic = topicName->cstring ? topicName->cstring : topicName->lenstring.data;
+    int topiclen = topicName->cstring ? (int)strlen(topicName->cstring) : topicName->lenstring.len;
+    MQTTDispatchWorker* w = NULL;
+    MQTTDispatchItem* item = NULL;
+
+    MutexLock(&d->mutex);
+    if (d->workers == 0)
+    {
+        rc = FAILURE;
+        goto exit;
+    }
+    w = &d->worker[MQTTDispatch_hash(topic, topiclen) % d->workers];
+    if (topiclen + message->payloadlen > d->slot_size)
+    {   /* the caller runs the handler itself, once the worker has handled the topic's earlier messages */
+        d->overflowed++;
+        rc = BUFFER_OVERFLOW;
+    }
+    else if (w->count == MQTT_DISPATCH_QUEUE_DEPTH)
+        d->full_waits++;
+    while (((rc == BUFFER_OVERFLOW) ? w->count > 0 : w->count == MQTT_DISPATCH_QUEUE_DEPTH) && !d->stop)
+    {   /* the handlers may be calling the API, so let go of the caller's lock while we wait */
+        if (held)
+            MutexUnlock(held);
+        ConditionWait(&w->cond, &d->mutex, NULL);
+        if (held)
+        {   /* take the locks in the same order as before */
+            MutexUnlock(&d->mutex);
+            MutexLock(held);
+            MutexLock(&d->mutex);
+        }
+    }
+    if (rc != SUCCESS)
+        goto exit;
+    if (d->stop)
+    {
+        rc = FAILURE;
+        goto exit;
+    }
+
+    item = &w->items[(w->head + w->count) % MQTT_DISPATCH_QUEUE_DEPTH];
+    item->fp = fp;
+    item->message = *message;
+    memcpy(item->buf, topic, topiclen);
+    memcpy(&item->buf[topiclen], message->payload, message->payloadlen);
+    item->topicName.cstring = NULL;
+    item->topicName.lenstring.data = (char*)item->buf;
+    item->topicName.lenstring.len = topiclen;
+    item->message.payload = &item->buf[topiclen];
+
+    if (++w->count > w->high_water)
+        w->high_water = w->count;
+    d->dispatched++;
+    ConditionBroadcast(&w->cond);
+exit:
+    MutexUnlock(&d->mutex);
+    return rc;
+}
+
+
+void MQTTDispatchGetMetrics(MQTTDispatch* d, MQTTDispatchMetrics* metrics)
+{
+    int i;
+
+    memset(metrics, '\0', sizeof(*metrics));
+    MutexLock(&d->mutex);
+    for (i = 0; i < d->workers; ++i)
+    {
+        metrics->depth[i] = d->worker[i].count;
+        metrics->high_water[i] = d->worker[i].high_water;
+    }
+    metrics->dispatched = d->dispatched;
+    metrics->overflowed = d->overflowed;
+    metrics->full_waits = d->full_waits;
+    MutexUnlock(&d->mutex);
+}
+
+#endif
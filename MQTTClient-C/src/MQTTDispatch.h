@@ -0,0 +1,115 @@
+/*******************************************************************************
+ * Copyright (c) 2014, 2023 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+#if !defined(__MQTT_DISPATCH_)
+#define __MQTT_DISPATCH_
+
+#include "MQTTClient.h"
+
+#if defined(__cplusplus)
+ extern "C" {
+#endif
+
+#if defined(MQTT_TASK)
+
+#if !defined(MQTT_DISPATCH_MAX_WORKERS)
+#define MQTT_DISPATCH_MAX_WORKERS 8 /* redefinable - how many threads can run message handlers */
+#endif
+
+#if !defined(MQTT_DISPATCH_QUEUE_DEPTH)
+#define MQTT_DISPATCH_QUEUE_DEPTH 32 /* redefinable - how many messages can wait for each worker */
+#endif
+
+/* An incoming message waiting for a worker, copied into its own buffer from the pool */
+typedef struct MQTTDispatchItem
+{
+    messageHandler fp;
+    MQTTString topicName;
+    MQTTMessage message;
+    unsigned char* buf;
+} MQTTDispatchItem;
+
+typedef struct MQTTDispatchWorker
+{
+    struct MQTTDispatch* dispatch;
+    Thread thread;
+    Condition cond;               /* signalled when a message is added, or one is finished with */
+    int head, count;
+    int high_water;
+    MQTTDispatchItem items[MQTT_DISPATCH_QUEUE_DEPTH];
+} MQTTDispatchWorker;
+
+typedef struct MQTTDispatch
+{
+    Mutex mutex;                  /* the queues and metrics */
+    int workers;
+    char stop;
+    size_t slot_size;
+    unsigned long dispatched, overflowed, full_waits;
+    MQTTDispatchWorker worker[MQTT_DISPATCH_MAX_WORKERS];
+} MQTTDispatch;
+
+typedef struct MQTTDispatchMetrics
+{
+    int depth[MQTT_DISPATCH_MAX_WORKERS];      /* messages waiting for each worker now */
+    int high_water[MQTT_DISPATCH_MAX_WORKERS]; /* the most there have ever been */
+    unsigned long dispatched;                  /* messages handed to the workers */
+    unsigned long overflowed;                  /* messages too large for a pool buffer, handled by the reader thread */
+    unsigned long full_waits;                  /* how often the reader had to wait for room in a queue */
+} MQTTDispatchMetrics;
+
+/** MQTT DispatchStart - start worker threads to run message handlers, so that a slow handler does not
+ *  hold up reading, keepalive and acknowledgements.  Messages on the same topic always go to the same
+ *  worker, so they are handled in the order they arrived.
+ *  @param d - the dispatch object to initialize
+ *  @param workers - the number of worker threads, up to MQTT_DISPATCH_MAX_WORKERS
+ *  @param pool - buffer space for the waiting messages, one slot for each queue entry.  A slot the size
+ *  of the client's read buffer always holds a message: a larger message is handled on the reader thread.
+ *  @param pool_size - the size of the pool
+ *  @return success code
+ */
+DLLExport int MQTTDispatchStart(MQTTDispatch* d, int workers, unsigned char* pool, size_t pool_size);
+
+/** MQTT DispatchStop - let the workers finish the messages already queued, then stop them.  Detach
+ *  the dispatch object from any clients first.
+ *  @param d - the dispatch object to stop
+ *  @return success code
+ */
+DLLExport int MQTTDispatchStop(MQTTDispatch* d);
+
+/** MQTT DispatchMessage - copy a message into a worker's queue, waiting for room if it is full.
+ *  Called by the client for each matching handler.
+ *  @param d - the dispatch object to use
+ *  @param held - a mutex the caller holds, released while waiting for room, or NULL
+ *  @param fp - the message handler to call
+ *  @param topicName - the topic the message arrived on
+ *  @param message - the message
+ *  @return success code.  BUFFER_OVERFLOW if the message does not fit a pool slot: then this returns
+ *  once the worker has handled the topic's earlier messages, so that the caller can run the handler
+ *  itself, in order.  FAILURE if the workers are stopped.
+ */
+DLLExport int MQTTDispatchMessage(MQTTDispatch* d, Mutex* held, messageHandler fp, MQTTString* topicName, MQTTMessage* message);
+
+/** MQTT DispatchGetMetrics - take a snapshot of the queue depths and counters.
+ *  @param d - the dispatch object to use
+ *  @param metrics - returned
+ */
+DLLExport void MQTTDispatchGetMetrics(MQTTDispatch* d, MQTTDispatchMetrics* metrics);
+
+#endif
+
+#if defined(__cplusplus)
+     }
+#endif
+
+#endif
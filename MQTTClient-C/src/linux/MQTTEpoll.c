@@ -0,0 +1,192 @@
+/*******************************************************************************
+ * Copyright (c) 2014, 2023 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+#include "MQTTEpoll.h"
+
+#include <sys/epoll.h>
+
+
+static void MQTTEpoll_service(MQTTEpollSlot* s);
+
+
+/* The client's timed work has been brought forward, so move its deadline on the wheel */
+static void MQTTEpoll_rearm(void* context)
+{
+    MQTTEpollSlot* s = (MQTTEpollSlot*)context;
+    int left = MQTTNextDeadline(s->client);
+
+    if (left == -1)
+        MQTTTimerWheelCancel(&s->loop->wheel, &s->timer);
+    else
+        MQTTTimerWheelAdd(&s->loop->wheel, &s->timer, left);
+}
+
+
+/* Watch the client's socket, or stop watching it */
+static int MQTTEpoll_watch(MQTTEpollSlot* s, int watch)
+{
+    struct epoll_event event;
+
+    if (s->fd != -1)
+        epoll_ctl(s->loop->epfd, EPOLL_CTL_DEL, s->fd, NULL);
+    s->fd = -1;
+    if (!watch)
+        return SUCCESS;
+    event.events = EPOLLIN; /* level triggered, so data left in the socket is reported again */
+    event.data.ptr = s;
+    if (epoll_ctl(s->loop->epfd, EPOLL_CTL_ADD, s->client->ipstack->my_socket, &event) == -1)
+        return FAILURE;
+    s->fd = s->client->ipstack->my_socket;
+    return SUCCESS;
+}
+
+
+/* Reconnecting is about to replace the client's socket, or has just done so */
+static void MQTTEpoll_renetwork(void* context, int connected)
+{
+    MQTTEpoll_watch((MQTTEpollSlot*)context, connected);
+}
+
+
+static void MQTTEpoll_expired(MQTTTimerEntry* timer, void* context)
+{
+    MQTTEpoll_service((MQTTEpollSlot*)context);
+}
+
+
+int MQTTEpollInit(MQTTEpoll* e, epollDisconnectedHandler disconnected, void* context)
+{
+    int i;
+
+    e->count = 0;
+    e->free_slots = NULL;
+    for (i = MQTT_EPOLL_MAX_CLIENTS - 1; i >= 0; --i)
+    {
+        e->slots[i].client = NULL;
+        e->slots[i].fd = -1;
+        e->slots[i].loop = e;
+        MQTTTimerEntryInit(&e->slots[i].timer, MQTTEpoll_expired, &e->slots[i]);
+        e->slots[i].next_free = e->free_slots;
+        e->free_slots = &e->slots[i];
+    }
+    MQTTTimerWheelInit(&e->wheel);
+    e->disconnected = disconnected;
+    e->context = context;
+    e->epfd = epoll_create1(EPOLL_CLOEXEC);
+    return (e->epfd == -1) ? FAILURE : SUCCESS;
+}
+
+
+int MQTTEpollAdd(MQTTEpoll* e, MQTTClient* c)
+{
+    MQTTEpollSlot* s = e->free_slots;
+
+    if (s == NULL)
+        return FAILURE;
+    s->client = c;
+    if (MQTTEpoll_watch(s, 1) != SUCCESS)
+    {
+        s->client = NULL;
+        return FAILURE;
+    }
+    e->free_slots = s->next_free;
+    e->count++;
+    c->deadline_changed = MQTTEpoll_rearm;
+    c->network_changed = MQTTEpoll_renetwork;
+    c->deadline_context = s;
+    MQTTEpoll_rearm(s);
+    return SUCCESS;
+}
+
+
+int MQTTEpollRemove(MQTTEpoll* e, MQTTClient* c)
+{
+    MQTTEpollSlot* s = (MQTTEpollSlot*)c->deadline_context;
+
+    if (c->deadline_changed != MQTTEpoll_rearm || s == NULL || s->loop != e)
+        return FAILURE;
+    MQTTEpoll_watch(s, 0);
+    MQTTTimerWheelCancel(&e->wheel, &s->timer);
+    c->deadline_changed = NULL;
+    c->network_changed = NULL;
+    c->deadline_context = NULL;
+    s->client = NULL;
+    s->next_free = e->free_slots;
+    e->free_slots = s;
+    e->count--;
+    return SUCCESS;
+}
+
+
+void MQTTEpollClose(MQTTEpoll* e)
+{
+    int i;
+
+    for (i = 0; i < MQTT_EPOLL_MAX_CLIENTS; ++i)
+    {
+        if (e->slots[i].client)
+            MQTTEpollRemove(e, e->slots[i].client);
+    }
+    if (e->epfd != -1)
+        close(e->epfd);
+    e->epfd = -1;
+}
+
+
+/* Do whatever the client has to do now, and put its next deadline on the wheel */
+static void MQTTEpoll_service(MQTTEpollSlot* s)
+{
+    MQTTEpoll* e = s->loop;
+    MQTTClient* c = s->client;
+    int next = -1;
+
+    if (MQTTYieldNoWait(c, &next) != SUCCESS)
+    {
+        if (!MQTTIsReconnecting(c))
+        {
+            MQTTEpollRemove(e, c);
+            if (e->disconnected)
+                e->disconnected(c, e->context);
+            return;
+        }
+        MQTTEpoll_watch(s, 0); /* the old socket stays readable, at its end, so wait for the next attempt on the wheel */
+    }
+    if (next == -1)
+        MQTTTimerWheelCancel(&e->wheel, &s->timer);
+    else
+        MQTTTimerWheelAdd(&e->wheel, &s->timer, next);
+}
+
+
+int MQTTEpollRun(MQTTEpoll* e, int timeout_ms)
+{
+    struct epoll_event events[MQTT_EPOLL_MAX_EVENTS];
+    int i, rc,
+      left = MQTTTimerWheelNext(&e->wheel);
+
+    if (left != -1 && (timeout_ms < 0 || left < timeout_ms))
+        timeout_ms = left; /* wake up in time for the next deadline, even when told to wait forever */
+
+    if ((rc = epoll_wait(e->epfd, events, MQTT_EPOLL_MAX_EVENTS, timeout_ms)) == -1)
+        return (errno == EINTR) ? SUCCESS : FAILURE;
+
+    for (i = 0; i < rc; ++i)
+    {
+        MQTTEpollSlot* s = (MQTTEpollSlot*)events[i].data.ptr;
+        if (s->client) /* could have been dropped by an earlier event's handlers */
+            MQTTEpoll_service(s);
+    }
+
+    MQTTTimerWheelRun(&e->wheel); /* only the clients whose deadlines have passed */
+    return SUCCESS;
+}
@@ -0,0 +1,107 @@
+/*******************************************************************************
+ * Copyright (c) 2014, 2023 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+#if !defined(__MQTT_EPOLL_)
+#define __MQTT_EPOLL_
+
+#include "MQTTClient.h"
+#include "MQTTTimerWheel.h"
+
+#if defined(__cplusplus)
+ extern "C" {
+#endif
+
+#if !defined(MQTT_EPOLL_MAX_CLIENTS)
+#define MQTT_EPOLL_MAX_CLIENTS 1024 /* redefinable - how many clients can one event loop serve? */
+#endif
+
+#if !defined(MQTT_EPOLL_MAX_EVENTS)
+#define MQTT_EPOLL_MAX_EVENTS 64 /* redefinable - how many ready sockets are taken from the kernel at once */
+#endif
+
+/* Called from MQTTEpollRun when a client's session has ended, and it is not reconnecting by itself,
+ * after the client has been removed from the event loop.  The network connection is still open, so
+ * the callback should close it. */
+typedef void (*epollDisconnectedHandler)(MQTTClient*, void*);
+
+struct MQTTEpoll;
+
+/* A client's place in the event loop: what epoll reports, and its next deadline on the timer wheel */
+typedef struct MQTTEpollSlot
+{
+    MQTTClient* client;           /* NULL when the slot is free */
+    int fd;                       /* the socket being watched, or -1 while the client reconnects */
+    struct MQTTEpoll* loop;
+    MQTTTimerEntry timer;
+    struct MQTTEpollSlot* next_free;
+} MQTTEpollSlot;
+
+typedef struct MQTTEpoll
+{
+    int epfd;
+    int count;
+    MQTTEpollSlot slots[MQTT_EPOLL_MAX_CLIENTS],
+      *free_slots;
+    MQTTTimerWheel wheel;         /* keepalive and coalescing deadlines, so waking up doesn't scan every client */
+    epollDisconnectedHandler disconnected;
+    void* context;
+} MQTTEpoll;
+
+/** MQTT EpollInit - create an event loop which serves many connected clients from one thread.
+ *  @param e - the event loop object to initialize
+ *  @param disconnected - called when a client's session ends, can be NULL
+ *  @param context - passed to the disconnected callback
+ *  @return success code
+ */
+DLLExport int MQTTEpollInit(MQTTEpoll* e, epollDisconnectedHandler disconnected, void* context);
+
+/** MQTT EpollAdd - serve a connected client from the event loop.  From now on, MQTTEpollRun does
+ *  the work MQTTYield would have done for it.  Other calls on the client (publish, subscribe...)
+ *  must be made from the thread which calls MQTTEpollRun.  Publishes queued by MQTTEnqueuePublish
+ *  from other threads are written out the next time the client has something to do.  A client with
+ *  MQTTSetAutoReconnect stays in the loop while it reconnects, and its new socket is watched.  The
+ *  reconnect itself is made in the loop, which waits for it: up to the reconnect handler's connect
+ *  timeout and the client's command timeout, so keep those short for clients which share a loop.
+ *  @param e - the event loop object to use
+ *  @param client - the connected client to add
+ *  @return success code
+ */
+DLLExport int MQTTEpollAdd(MQTTEpoll* e, MQTTClient* client);
+
+/** MQTT EpollRemove - stop serving a client from the event loop.  Call this before closing its
+ *  network connection.
+ *  @param e - the event loop object to use
+ *  @param client - the client to remove
+ *  @return success code
+ */
+DLLExport int MQTTEpollRemove(MQTTEpoll* e, MQTTClient* client);
+
+/** MQTT EpollRun - wait for incoming data on any client, or for the next keepalive to fall due,
+ *  and process it.  No call blocks on one client while others have work to do.
+ *  @param e - the event loop object to use
+ *  @param timeout_ms - the longest time to wait for something to happen, or -1 to wait until it does.
+ *  Either way, the wait ends in time for the next keepalive or other deadline.
+ *  @return success code
+ */
+DLLExport int MQTTEpollRun(MQTTEpoll* e, int timeout_ms);
+
+/** MQTT EpollClose - free the event loop's resources.  The clients are not disconnected.
+ *  @param e - the event loop object to close
+ */
+DLLExport void MQTTEpollClose(MQTTEpoll* e);
+
+#if defined(__cplusplus)
+     }
+#endif
+
+#endif
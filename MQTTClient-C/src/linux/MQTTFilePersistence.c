@@ -0,0 +1,254 @@
+/*******************************************************************************
+ * Copyright (c) 2014, 2023 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* sync_file_range */
+#endif
+
+#include "MQTTFilePersistence.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define PERSIST_MAGIC "MQTTPS01"
+#define PERSIST_HEADER_SIZE 64
+
+typedef struct
+{
+    char magic[8];
+    unsigned int slots,
+      slot_size;
+} FileHeader;
+
+enum { SLOT_FREE, SLOT_SENT, SLOT_RELEASED };
+
+/* The start of each slot, followed by the packet.  state is written last, so a slot is only in
+ * use once everything else in it is there. */
+typedef struct
+{
+    unsigned int seq;
+    int len;
+    unsigned short id;
+    unsigned char state,
+      reserved;
+} SlotHeader;
+
+
+static size_t slotStride(unsigned int slot_size)
+{
+    return (sizeof(SlotHeader) + slot_size + 7) & ~(size_t)7;
+}
+
+
+static SlotHeader* slotAt(MQTTFilePersistence* p, unsigned int i)
+{
+    return (SlotHeader*)&p->map[PERSIST_HEADER_SIZE + i * slotStride(p->slot_size)];
+}
+
+
+/* Get a change to the mapping on its way to the disk, as far as the durability asks */
+static int changed(MQTTFilePersistence* p, void* addr, size_t len)
+{
+    size_t offset = (unsigned char*)addr - p->map;
+    int rc = 0;
+
+    if (p->durability == PERSIST_WRITEBACK)
+        rc = sync_file_range(p->fd, offset, len, SYNC_FILE_RANGE_WRITE);
+    else if (p->durability == PERSIST_SYNC)
+    {
+        size_t start = offset & ~((size_t)sysconf(_SC_PAGESIZE) - 1);
+        rc = msync(&p->map[start], offset - start + len, MS_SYNC);
+    }
+    return (rc == 0) ? SUCCESS : FAILURE;
+}
+
+
+/* Packet ids are given out in turn, so starting at id's own slot usually finds it straight away */
+static SlotHeader* find(MQTTFilePersistence* p, unsigned short id)
+{
+    unsigned int i;
+
+    for (i = 0; i < p->slots; ++i)
+    {
+        SlotHeader* s = slotAt(p, (id + i) % p->slots);
+        if (s->state != SLOT_FREE && s->id == id)
+            return s;
+    }
+    return NULL;
+}
+
+
+static int MQTTFilePersistence_add(MQTTPersistence* persistence, unsigned short id, unsigned char* packet, int len)
+{
+    MQTTFilePersistence* p = (MQTTFilePersistence*)persistence;
+    SlotHeader* s = find(p, id);
+    unsigned int i;
+
+    if (len <= 0 || len > p->slot_size)
+        return BUFFER_OVERFLOW;
+    if (s != NULL)
+        s->state = SLOT_FREE; /* an old publish with the same id, which the server has forgotten */
+    for (i = 0; s == NULL && i < p->slots; ++i)
+    {
+        SlotHeader* free_slot = slotAt(p, (id + i) % p->slots);
+        if (free_slot->state == SLOT_FREE)
+            s = free_slot;
+    }
+    if (s == NULL)
+        return BUFFER_OVERFLOW;
+
+    memcpy(s + 1, packet, len);
+    s->seq = ++p->seq;
+    s->len = len;
+    s->id = id;
+    __atomic_store_n(&s->state, SLOT_SENT, __ATOMIC_RELEASE);
+    return changed(p, s, sizeof(SlotHeader) + len);
+}
+
+
+static void MQTTFilePersistence_release(MQTTPersistence* persistence, unsigned short id)
+{
+    MQTTFilePersistence* p = (MQTTFilePersistence*)persistence;
+    SlotHeader* s = find(p, id);
+
+    if (s != NULL)
+    {
+        s->state = SLOT_RELEASED;
+        changed(p, s, sizeof(SlotHeader));
+    }
+}
+
+
+static void MQTTFilePersistence_remove(MQTTPersistence* persistence, unsigned short id)
+{
+    MQTTFilePersistence* p = (MQTTFilePersistence*)persistence;
+    SlotHeader* s = find(p, id);
+
+    if (s != NULL)
+    {
+        s->state = SLOT_FREE;
+        changed(p, s, sizeof(SlotHeader));
+    }
+}
+
+
+/* The oldest publish kept after the one numbered *cursor */
+static int MQTTFilePersistence_next(MQTTPersistence* persistence, unsigned int* cursor, unsigned short* id,
+    int* released, unsigned char** packet)
+{
+    MQTTFilePersistence* p = (MQTTFilePersistence*)persistence;
+    SlotHeader* next = NULL;
+    unsigned int i;
+
+    for (i = 0; i < p->slots; ++i)
+    {
+        SlotHeader* s = slotAt(p, i);
+        if (s->state != SLOT_FREE && s->seq > *cursor && (next == NULL || s->seq < next->seq))
+            next = s;
+    }
+    if (next == NULL)
+        return 0;
+    *cursor = next->seq;
+    *id = next->id;
+    *released = (next->state == SLOT_RELEASED);
+    *packet = (unsigned char*)(next + 1);
+    return next->len;
+}
+
+
+int MQTTFilePersistenceOpen(MQTTFilePersistence* p, const char* path, unsigned int slots,
+    unsigned int slot_size, enum MQTTPersistDurability durability)
+{
+    FileHeader* header = NULL;
+    struct stat st;
+    int created = 0;
+    unsigned int i;
+
+    p->persistence.add = MQTTFilePersistence_add;
+    p->persistence.release = MQTTFilePersistence_release;
+    p->persistence.remove = MQTTFilePersistence_remove;
+    p->persistence.next = MQTTFilePersistence_next;
+    p->persistence.commit = NULL; /* each change is as safe as the durability makes it */
+    p->durability = durability;
+    p->map = NULL;
+    p->seq = 0;
+    if ((p->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) == -1)
+        return FAILURE;
+    if (fstat(p->fd, &st) == -1)
+        goto error;
+
+    if (st.st_size == 0)
+    {   /* a new file */
+        if (slots == 0 || slot_size == 0)
+            goto error;
+        p->map_size = PERSIST_HEADER_SIZE + slots * slotStride(slot_size);
+        if (ftruncate(p->fd, p->map_size) == -1)
+            goto error;
+        created = 1;
+    }
+    else if (st.st_size < PERSIST_HEADER_SIZE)
+        goto error;
+    else
+        p->map_size = st.st_size;
+
+    if ((p->map = mmap(NULL, p->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, p->fd, 0)) == MAP_FAILED)
+    {
+        p->map = NULL;
+        goto error;
+    }
+    header = (FileHeader*)p->map;
+    if (created)
+    {
+        header->slots = slots;
+        header->slot_size = slot_size;
+        memcpy(header->magic, PERSIST_MAGIC, sizeof(header->magic)); /* last, so a half made file isn't used */
+        if (changed(p, header, sizeof(FileHeader)) != SUCCESS)
+            goto error;
+    }
+    else if (memcmp(header->magic, PERSIST_MAGIC, sizeof(header->magic)) != 0 ||
+            p->map_size < PERSIST_HEADER_SIZE + header->slots * slotStride(header->slot_size))
+        goto error;
+    p->slots = header->slots;
+    p->slot_size = header->slot_size;
+
+    for (i = 0; i < p->slots; ++i)
+    {   /* carry on numbering after the newest publish left by the last run */
+        SlotHeader* s = slotAt(p, i);
+        if (s->state != SLOT_FREE && s->seq > p->seq)
+            p->seq = s->seq;
+    }
+    return SUCCESS;
+
+error:
+    MQTTFilePersistenceClose(p);
+    return FAILURE;
+}
+
+
+int MQTTFilePersistenceSync(MQTTFilePersistence* p)
+{
+    return (msync(p->map, p->map_size, MS_SYNC) == 0) ? SUCCESS : FAILURE;
+}
+
+
+void MQTTFilePersistenceClose(MQTTFilePersistence* p)
+{
+    if (p->map != NULL)
+        munmap(p->map, p->map_size);
+    p->map = NULL;
+    if (p->fd != -1)
+        close(p->fd);
+    p->fd = -1;
+}
@@ -0,0 +1,76 @@
+/*******************************************************************************
+ * Copyright (c) 2014, 2023 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+#if !defined(__MQTT_FILE_PERSISTENCE_)
+#define __MQTT_FILE_PERSISTENCE_
+
+#include "MQTTClient.h"
+
+#if defined(__cplusplus)
+ extern "C" {
+#endif
+
+/* How soon a change to the file has to reach the disk.  Even the first survives the process
+ * crashing, because the kernel owns the pages of the mapping. */
+enum MQTTPersistDurability
+{
+    PERSIST_PROCESS,              /* left to the kernel: lost only if the machine goes down */
+    PERSIST_WRITEBACK,            /* writing to disk is started after each change, but not waited for */
+    PERSIST_SYNC                  /* each change is on disk before the publish is sent, at the cost of a disk write */
+};
+
+/* QoS 1 and 2 publishes kept in a memory mapped file of fixed size slots, one per publish.  Each
+ * slot holds the serialized packet, its packet id and whether it has been released (PUBREC has
+ * arrived).  Keeping a publish is a copy into the mapping, and no system call unless the durability
+ * asks for one. */
+typedef struct MQTTFilePersistence
+{
+    MQTTPersistence persistence;  /* give the client &p->persistence */
+    int fd;
+    unsigned char* map;
+    size_t map_size;
+    unsigned int slots,
+      slot_size,                  /* the largest packet a slot holds */
+      seq;                        /* of the newest publish, to keep them in order */
+    enum MQTTPersistDurability durability;
+} MQTTFilePersistence;
+
+/** MQTT FilePersistenceOpen - open the file, or create it if it doesn't exist.  An existing file
+ *  keeps the number and size of slots it was created with, and the publishes in it.
+ *  @param p - the persistence object to initialize
+ *  @param path - the file to use
+ *  @param slots - how many publishes can be kept at once
+ *  @param slot_size - the largest publish packet which can be kept
+ *  @param durability - how soon changes have to reach the disk
+ *  @return success code
+ */
+DLLExport int MQTTFilePersistenceOpen(MQTTFilePersistence* p, const char* path, unsigned int slots,
+    unsigned int slot_size, enum MQTTPersistDurability durability);
+
+/** MQTT FilePersistenceSync - wait for all changes so far to reach the disk.  With PERSIST_PROCESS
+ *  or PERSIST_WRITEBACK, an application can call this at the points where it wants to be sure.
+ *  @param p - the persistence object to use
+ *  @return success code
+ */
+DLLExport int MQTTFilePersistenceSync(MQTTFilePersistence* p);
+
+/** MQTT FilePersistenceClose - unmap and close the file.  The publishes in it are kept for the next run.
+ *  @param p - the persistence object to close
+ */
+DLLExport void MQTTFilePersistenceClose(MQTTFilePersistence* p);
+
+#if defined(__cplusplus)
+     }
+#endif
+
+#endif
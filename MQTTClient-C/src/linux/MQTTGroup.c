@@ -0,0 +1,249 @@
+/*******************************************************************************
+ * Copyright (c) 2014, 2023 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* for pthread_setaffinity_np */
+#endif
+#include "MQTTGroup.h"
+
+#if defined(MQTT_TASK)
+
+#include <sched.h>
+
+
+/* FNV-1a, as MQTTDispatch uses, so that one topic always goes to the same shard */
+static unsigned int MQTTGroup_hash(const char* data)
+{
+    unsigned int hash = 2166136261u;
+
+    while (*data)
+        hash = (hash ^ (unsigned char)*data++) * 16777619u;
+    return hash;
+}
+
+
+static MQTTGroupShard* MQTTGroup_shard(MQTTGroup* g, const char* topic)
+{
+    return &g->shard[MQTTGroup_hash(topic) % g->shards];
+}
+
+
+int MQTTGroupInit(MQTTGroup* g, int shards, unsigned int command_timeout_ms,
+        unsigned char* buf, size_t buf_size, unsigned char* readbuf, size_t readbuf_size)
+{
+    int i;
+
+    if (shards < 1 || shards > MQTT_GROUP_MAX_SHARDS)
+        return FAILURE;
+    g->shards = shards;
+    buf_size /= shards;
+    readbuf_size /= shards;
+    for (i = 0; i < shards; ++i)
+    {
+        MQTTGroupShard* s = &g->shard[i];
+
+        NetworkInit(&s->net);
+        MQTTClientInit(&s->client, &s->net, command_timeout_ms, &buf[i * buf_size], buf_size,
+                &readbuf[i * readbuf_size], readbuf_size);
+        s->clientid[0] = '\0';
+        s->cpu = -1;
+        s->published = s->failed = 0;
+    }
+    return SUCCESS;
+}
+
+
+/* Close the shard's connection, and stop its thread */
+static void MQTTGroup_close(MQTTGroupShard* s)
+{
+    MQTTStopTask(&s->client);
+    NetworkDisconnect(&s->net);
+}
+
+
+int MQTTGroupConnect(MQTTGroup* g, char* host, int port, MQTTPacket_connectData* options)
+{
+    MQTTPacket_connectData data = *options;
+    MQTTString* id = &options->clientID;
+    int idlen = id->cstring ? (int)strlen(id->cstring) : id->lenstring.len;
+    int rc = SUCCESS;
+    int i;
+
+    for (i = 0; i < g->shards && rc == SUCCESS; ++i)
+    {
+        MQTTGroupShard* s = &g->shard[i];
+
+        if (idlen + 12 > MQTT_GROUP_CLIENTID_LEN)
+            rc = BUFFER_OVERFLOW;
+        else
+        {
+            snprintf(s->clientid, sizeof(s->clientid), "%.*s-%d", idlen,
+                    id->cstring ? id->cstring : id->lenstring.data, i);
+            data.clientID.cstring = s->clientid;
+            if ((rc = NetworkConnect(&s->net, host, port)) == SUCCESS)
+            {
+                if ((rc = MQTTStartTask(&s->client)) != SUCCESS)
+                    NetworkDisconnect(&s->net);
+                else if ((rc = MQTTConnect(&s->client, &data)) != SUCCESS)
+                    MQTTGroup_close(s);
+            }
+        }
+        if (rc != SUCCESS)
+        {   /* all or none */
+            while (--i >= 0)
+            {
+                MQTTDisconnect(&g->shard[i].client);
+                MQTTGroup_close(&g->shard[i]);
+            }
+        }
+    }
+    return rc;
+}
+
+
+int MQTTGroupPin(MQTTGroup* g, int first_cpu)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int rc = SUCCESS;
+    int i;
+
+    if (cpus < 1 || first_cpu < 0)
+        return FAILURE;
+    for (i = 0; i < g->shards; ++i)
+    {
+        MQTTGroupShard* s = &g->shard[i];
+        cpu_set_t set;
+
+        if (!s->client.task_running)
+        {
+            rc = FAILURE;
+            continue;
+        }
+        CPU_ZERO(&set);
+        CPU_SET((first_cpu + i) % cpus, &set);
+        if (pthread_setaffinity_np(s->client.thread.t, sizeof(set), &set) == 0)
+            s->cpu = (int)((first_cpu + i) % cpus);
+        else
+            rc = FAILURE;
+    }
+    return rc;
+}
+
+
+MQTTClient* MQTTGroupClient(MQTTGroup* g, const char* topic)
+{
+    return &MQTTGroup_shard(g, topic)->client;
+}
+
+
+int MQTTGroupPublish(MQTTGroup* g, const char* topic, MQTTMessage* message)
+{
+    MQTTGroupShard* s = MQTTGroup_shard(g, topic);
+    int rc = MQTTPublish(&s->client, topic, message);
+
+    /* publishes come from any thread, so the counters are atomic rather than under a shard's lock */
+    __atomic_add_fetch(&s->published, 1, __ATOMIC_RELAXED);
+    if (rc != SUCCESS)
+        __atomic_add_fetch(&s->failed, 1, __ATOMIC_RELAXED);
+    return rc;
+}
+
+
+int MQTTGroupSubscribe(MQTTGroup* g, const char* topicFilter, enum QoS qos, messageHandler handler,
+        enum MQTTGroupPlacement placement)
+{
+    int rc = SUCCESS;
+    int i;
+
+    if (placement == GROUP_SPREAD)
+        return MQTTSubscribe(&MQTTGroup_shard(g, topicFilter)->client, topicFilter, qos, handler);
+    for (i = 0; i < g->shards && rc == SUCCESS; ++i)
+        rc = MQTTSubscribe(&g->shard[i].client, topicFilter, qos, handler);
+    return rc;
+}
+
+
+int MQTTGroupUnsubscribe(MQTTGroup* g, const char* topicFilter)
+{
+    int rc = SUCCESS;
+    int i, j;
+
+    for (i = 0; i < g->shards; ++i)
+    {
+        MQTTClient* c = &g->shard[i].client;
+
+        for (j = 0; j < MAX_MESSAGE_HANDLERS; ++j)
+        {
+            if (c->messageHandlers[j].topicFilter != NULL && strcmp(c->messageHandlers[j].topicFilter, topicFilter) == 0)
+            {
+                if (MQTTUnsubscribe(c, topicFilter) != SUCCESS)
+                    rc = FAILURE;
+                break;
+            }
+        }
+    }
+    return rc;
+}
+
+
+int MQTTGroupDisconnect(MQTTGroup* g)
+{
+    int rc = SUCCESS;
+    int i;
+
+    for (i = 0; i < g->shards; ++i)
+    {
+        if (!g->shard[i].client.task_running)
+        {   /* never connected, or closed already */
+            rc = FAILURE;
+            continue;
+        }
+        if (MQTTDisconnect(&g->shard[i].client) != SUCCESS)
+            rc = FAILURE;
+        MQTTGroup_close(&g->shard[i]);
+    }
+    return rc;
+}
+
+
+void MQTTGroupGetMetrics(MQTTGroup* g, MQTTGroupMetrics* metrics)
+{
+    int i;
+
+    memset(metrics, '\0', sizeof(*metrics));
+    metrics->shards = g->shards;
+    for (i = 0; i < g->shards; ++i)
+    {
+        MQTTGroupShard* s = &g->shard[i];
+        MQTTOfflineMetrics offline;
+
+        if (MQTTIsConnected(&s->client))
+            metrics->connected++;
+        metrics->shard_published[i] = __atomic_load_n(&s->published, __ATOMIC_RELAXED);
+        metrics->published += metrics->shard_published[i];
+        metrics->failed += __atomic_load_n(&s->failed, __ATOMIC_RELAXED);
+        if (MQTTGetOfflineMetrics(&s->client, &offline) == SUCCESS)
+        {
+            metrics->offline.count += offline.count;
+            metrics->offline.bytes += offline.bytes;
+            if (offline.high_water > metrics->offline.high_water)
+                metrics->offline.high_water = offline.high_water;
+            metrics->offline.stored += offline.stored;
+            metrics->offline.sent += offline.sent;
+            metrics->offline.dropped += offline.dropped;
+            metrics->offline.rejected += offline.rejected;
+        }
+    }
+}
+
+#endif
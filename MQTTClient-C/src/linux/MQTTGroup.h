@@ -0,0 +1,154 @@
+/*******************************************************************************
+ * Copyright (c) 2014, 2023 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+#if !defined(__MQTT_GROUP_)
+#define __MQTT_GROUP_
+
+#include "MQTTClient.h"
+
+#if defined(__cplusplus)
+ extern "C" {
+#endif
+
+#if defined(MQTT_TASK)
+
+#if !defined(MQTT_GROUP_MAX_SHARDS)
+#define MQTT_GROUP_MAX_SHARDS 8 /* redefinable - the most connections in a group */
+#endif
+
+#if !defined(MQTT_GROUP_CLIENTID_LEN)
+#define MQTT_GROUP_CLIENTID_LEN 64 /* redefinable - room for each shard's client id, the group's with "-<shard>" added */
+#endif
+
+/* How MQTTGroupSubscribe places a subscription */
+enum MQTTGroupPlacement
+{
+    GROUP_REPLICATE,              /* on every shard: with a shared subscription ($share/...) the broker spreads
+                                     the messages across them, otherwise each shard receives every message */
+    GROUP_SPREAD                  /* on one shard, chosen by the filter, so different filters share the work */
+};
+
+/* One connection of a group, with a background thread of its own to read and acknowledge */
+typedef struct MQTTGroupShard
+{
+    Network net;
+    MQTTClient client;            /* to set options on, an offline buffer or automatic reconnect say */
+    char clientid[MQTT_GROUP_CLIENTID_LEN];
+    int cpu;                      /* the CPU its thread is pinned to, or -1 */
+    unsigned long published,      /* publishes through the group to this shard */
+      failed;                     /* of those, how many didn't succeed */
+} MQTTGroupShard;
+
+/* N clients connected to the same broker, to use more than one TCP stream and more than one core.
+ * Each topic is published on one shard, chosen by a hash of the topic, so that messages on a topic
+ * keep their order. */
+typedef struct MQTTGroup
+{
+    int shards;
+    MQTTGroupShard shard[MQTT_GROUP_MAX_SHARDS];
+} MQTTGroup;
+
+typedef struct MQTTGroupMetrics
+{
+    int shards,
+      connected;                  /* shards connected now */
+    unsigned long published,      /* publishes through the group */
+      failed;                     /* of those, how many didn't succeed */
+    unsigned long shard_published[MQTT_GROUP_MAX_SHARDS]; /* how the publishes were spread */
+    MQTTOfflineMetrics offline;   /* summed over the shards, with high_water the largest */
+} MQTTGroupMetrics;
+
+/** MQTT GroupInit - initialize a group of clients.  The buffers are divided equally between them.
+ *  @param g - the group object to initialize
+ *  @param shards - the number of connections, up to MQTT_GROUP_MAX_SHARDS
+ *  @param command_timeout_ms - as for MQTTClientInit
+ *  @param buf - the send buffers of all the shards together
+ *  @param buf_size - the size of buf
+ *  @param readbuf - the read buffers of all the shards together
+ *  @param readbuf_size - the size of readbuf
+ *  @return success code
+ */
+DLLExport int MQTTGroupInit(MQTTGroup* g, int shards, unsigned int command_timeout_ms,
+        unsigned char* buf, size_t buf_size, unsigned char* readbuf, size_t readbuf_size);
+
+/** MQTT GroupConnect - connect every shard to the broker, and start its background thread.  Each
+ *  shard's client id is the one in the options with "-<shard number>" added.  If any shard fails to
+ *  connect, those which did are disconnected again.
+ *  @param g - the group object to use
+ *  @param host - the broker's host name
+ *  @param port - the broker's port
+ *  @param options - the connect options for every shard
+ *  @return success code
+ */
+DLLExport int MQTTGroupConnect(MQTTGroup* g, char* host, int port, MQTTPacket_connectData* options);
+
+/** MQTT GroupPin - pin the shards' background threads to CPUs, one each, so that they don't move
+ *  between cores.  Shard i goes on CPU (first_cpu + i), wrapping round the CPUs online.
+ *  @param g - the connected group object to use
+ *  @param first_cpu - the CPU for the first shard
+ *  @return success code
+ */
+DLLExport int MQTTGroupPin(MQTTGroup* g, int first_cpu);
+
+/** MQTT GroupClient - the client a topic is published on, to call the other publish functions with.
+ *  @param g - the group object to use
+ *  @param topic - the topic
+ *  @return the shard's client
+ */
+DLLExport MQTTClient* MQTTGroupClient(MQTTGroup* g, const char* topic);
+
+/** MQTT GroupPublish - publish on the shard for the topic.  Can be called from any thread.
+ *  @param g - the group object to use
+ *  @param topic - the topic to publish to
+ *  @param message - the message
+ *  @return success code
+ */
+DLLExport int MQTTGroupPublish(MQTTGroup* g, const char* topic, MQTTMessage* message);
+
+/** MQTT GroupSubscribe - subscribe on every shard, or on one.
+ *  @param g - the group object to use
+ *  @param topicFilter - the topic filter
+ *  @param qos - the maximum QoS to receive
+ *  @param handler - called on the shard's background thread, or its dispatch worker if it has one
+ *  @param placement - GROUP_REPLICATE or GROUP_SPREAD
+ *  @return success code
+ */
+DLLExport int MQTTGroupSubscribe(MQTTGroup* g, const char* topicFilter, enum QoS qos, messageHandler handler,
+        enum MQTTGroupPlacement placement);
+
+/** MQTT GroupUnsubscribe - unsubscribe on every shard which has the subscription.
+ *  @param g - the group object to use
+ *  @param topicFilter - the topic filter
+ *  @return success code
+ */
+DLLExport int MQTTGroupUnsubscribe(MQTTGroup* g, const char* topicFilter);
+
+/** MQTT GroupDisconnect - disconnect every shard, and stop their background threads.
+ *  @param g - the group object to use
+ *  @return success code, FAILURE if any shard was not connected
+ */
+DLLExport int MQTTGroupDisconnect(MQTTGroup* g);
+
+/** MQTT GroupGetMetrics - take a snapshot of the group's counters.
+ *  @param g - the group object to use
+ *  @param metrics - returned
+ */
+DLLExport void MQTTGroupGetMetrics(MQTTGroup* g, MQTTGroupMetrics* metrics);
+
+#endif
+
+#if defined(__cplusplus)
+     }
+#endif
+
+#endif
@@ -15,155 +15,800 @@
  *    Ian Craggs - return codes from linux_read
  *******************************************************************************/
 
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* for ppoll */
+#endif
 #include "MQTTLinux.h"
 
+#include <sys/sendfile.h>
+#include <sys/un.h>
+#include <linux/errqueue.h>
+#include <pthread.h>
+
+/* The clock timers are measured against.  It is not set back when the system time is */
+#if defined(MQTT_LINUX_COARSE_CLOCK)
+#define LINUX_TIMER_CLOCK CLOCK_MONOTONIC_COARSE /* cheaper to read, at a few milliseconds resolution */
+#else
+#define LINUX_TIMER_CLOCK CLOCK_MONOTONIC
+#endif
+
+/* While a cycle is in progress, the thread running it reads the clock once and the timers share
+ * that reading.  Time only moves on noticeably while waiting for the network, so the reading is
+ * updated after each wait. */
+static __thread struct timespec linux_now;
+static __thread char linux_now_cached = 0;
+
+static void linux_clock(struct timespec* now)
+{
+	if (linux_now_cached)
+		*now = linux_now;
+	else
+		clock_gettime(LINUX_TIMER_CLOCK, now);
+}
+
+void TimerCacheStart(void)
+{
+	clock_gettime(LINUX_TIMER_CLOCK, &linux_now);
+	linux_now_cached = 1;
+}
+
+void TimerCacheStop(void)
+{
+	linux_now_cached = 0;
+}
+
+void TimerCacheRefresh(void)
+{
+	if (linux_now_cached)
+		clock_gettime(LINUX_TIMER_CLOCK, &linux_now);
+}
+
+
+static void linux_add(struct timespec* ts, time_t sec, long nsec)
+{
+	ts->tv_sec += sec;
+	ts->tv_nsec += nsec;
+	if (ts->tv_nsec >= 1000000000L)
+	{
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+
 void TimerInit(Timer* timer)
 {
-	timer->end_time = (struct timeval){0, 0};
+	timer->end_time = (struct timespec){0, 0};
 }
 
 char TimerIsExpired(Timer* timer)
 {
-	struct timeval now, res;
-	gettimeofday(&now, NULL);
-	timersub(&timer->end_time, &now, &res);
-	return res.tv_sec < 0 || (res.tv_sec == 0 && res.tv_usec <= 0);
+	struct timespec now;
+	linux_clock(&now);
+	return now.tv_sec > timer->end_time.tv_sec ||
+		(now.tv_sec == timer->end_time.tv_sec && now.tv_nsec >= timer->end_time.tv_nsec);
 }
 
 
 void TimerCountdownMS(Timer* timer, unsigned int timeout)
 {
-	struct timeval now;
-	gettimeofday(&now, NULL);
-	struct timeval interval = {timeout / 1000, (timeout % 1000) * 1000};
-	timeradd(&now, &interval, &timer->end_time);
+	linux_clock(&timer->end_time);
+	linux_add(&timer->end_time, timeout / 1000, (timeout % 1000) * 1000000L);
+}
+
+
+void TimerCountdownUS(Timer* timer, unsigned int timeout)
+{
+	linux_clock(&timer->end_time);
+	linux_add(&timer->end_time, timeout / 1000000, (timeout % 1000000) * 1000L);
 }
 
 
 void TimerCountdown(Timer* timer, unsigned int timeout)
 {
-	struct timeval now;
-	gettimeofday(&now, NULL);
-	struct timeval interval = {timeout, 0};
-	timeradd(&now, &interval, &timer->end_time);
+	linux_clock(&timer->end_time);
+	linux_add(&timer->end_time, timeout, 0);
 }
 
 
 int TimerLeftMS(Timer* timer)
 {
-	struct timeval now, res;
-	gettimeofday(&now, NULL);
-	timersub(&timer->end_time, &now, &res);
-	//printf("left %d ms\n", (res.tv_sec < 0) ? 0 : res.tv_sec * 1000 + res.tv_usec / 1000);
-	return (res.tv_sec < 0) ? 0 : res.tv_sec * 1000 + res.tv_usec / 1000;
+	struct timespec now;
+	long sec, nsec;
+
+	linux_clock(&now);
+	sec = timer->end_time.tv_sec - now.tv_sec;
+	nsec = timer->end_time.tv_nsec - now.tv_nsec;
+	if (nsec < 0)
+	{
+		sec--;
+		nsec += 1000000000L;
+	}
+	return (sec < 0) ? 0 : sec * 1000 + nsec / 1000000L;
 }
 
 
-int linux_read(Network* n, unsigned char* buffer, int len, int timeout_ms)
+#if defined(MQTT_TASK)
+void MutexInit(Mutex* mutex)
 {
-	struct timeval interval = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
-	if (interval.tv_sec < 0 || (interval.tv_sec == 0 && interval.tv_usec <= 0))
+	pthread_mutex_init(&mutex->m, NULL);
+}
+
+int MutexLock(Mutex* mutex)
+{
+	return pthread_mutex_lock(&mutex->m);
+}
+
+/* @return 1 if the mutex was taken, 0 if somebody else has it */
+int MutexTryLock(Mutex* mutex)
+{
+	return pthread_mutex_trylock(&mutex->m) == 0;
+}
+
+int MutexUnlock(Mutex* mutex)
+{
+	return pthread_mutex_unlock(&mutex->m);
+}
+
+
+static void* ThreadRun(void* parm)
+{
+	Thread* thread = (Thread*)parm;
+	thread->fn(thread->arg);
+	return NULL;
+}
+
+int ThreadStart(Thread* thread, void (*fn)(void*), void* arg)
+{
+	thread->fn = fn;
+	thread->arg = arg;
+	return pthread_create(&thread->t, NULL, ThreadRun, thread);
+}
+
+int ThreadJoin(Thread* thread)
+{
+	return pthread_join(thread->t, NULL);
+}
+
+
+void ConditionInit(Condition* cond)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC); /* the timers' clock, or one running at the same rate */
+	pthread_cond_init(&cond->c, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+/* Wait for the condition to be signalled, or for the timer to expire.  A NULL timer waits indefinitely.
+ * @return 0 if signalled, -1 on timeout */
+int ConditionWait(Condition* cond, Mutex* mutex, Timer* timer)
+{
+	struct timespec abstime;
+	int rc;
+
+	if (timer == NULL)
+		rc = pthread_cond_wait(&cond->c, &mutex->m) == 0 ? 0 : -1;
+	else
 	{
-		interval.tv_sec = 0;
-		interval.tv_usec = 100;
+		abstime = timer->end_time;
+		rc = pthread_cond_timedwait(&cond->c, &mutex->m, &abstime) == 0 ? 0 : -1;
 	}
+	if (linux_now_cached)
+		clock_gettime(LINUX_TIMER_CLOCK, &linux_now); /* time has moved on while we waited */
+	return rc;
+}
+
+void ConditionBroadcast(Condition* cond)
+{
+	pthread_cond_broadcast(&cond->c);
+}
+#endif
 
-	setsockopt(n->my_socket, SOL_SOCKET, SO_RCVTIMEO, (char *)&interval, sizeof(struct timeval));
 
+/* Set the deadline for a network operation.  A zero or negative timeout means
+ * don't wait at all, so that an event loop can drain a socket without blocking */
+static void linux_deadline(struct timespec* deadline, int timeout_ms)
+{
+	linux_clock(deadline);
+	if (timeout_ms > 0)
+		linux_add(deadline, timeout_ms / 1000, (timeout_ms % 1000) * 1000000L);
+}
+
+
+/* Poll until the deadline.
+ * @return the number of descriptors ready, 0 on timeout, -1 on error */
+static int linux_poll(struct pollfd* pfds, int count, struct timespec* deadline)
+{
+	struct timespec now, left;
+	int rc;
+
+	linux_clock(&now);
+	do
+	{
+		left.tv_sec = deadline->tv_sec - now.tv_sec;
+		left.tv_nsec = deadline->tv_nsec - now.tv_nsec;
+		if (left.tv_nsec < 0)
+		{
+			left.tv_sec--;
+			left.tv_nsec += 1000000000L;
+		}
+		if (left.tv_sec < 0)
+			return 0;
+		rc = ppoll(pfds, count, &left, NULL);
+		clock_gettime(LINUX_TIMER_CLOCK, &now); /* time has moved on while we waited */
+		if (linux_now_cached)
+			linux_now = now;
+	} while (rc == -1 && errno == EINTR);
+	return rc;
+}
+
+
+/* Wait for the socket to become ready until the deadline.
+ * @return 1 if ready, 0 on timeout, -1 on error */
+static int linux_wait(Network* n, short events, struct timespec* deadline)
+{
+	struct pollfd pfd = {n->my_socket, events, 0};
+	int rc = linux_poll(&pfd, 1, deadline);
+
+	if (rc > 0 && (pfd.revents & POLLERR) && n->zerocopy)
+	{	/* it may only be a zerocopy notification, on the error queue */
+		int err = 0;
+		socklen_t errlen = sizeof(err);
+
+		if (getsockopt(n->my_socket, SOL_SOCKET, SO_ERROR, &err, &errlen) == 0 && err == 0)
+			pfd.revents &= ~POLLERR;
+	}
+	if (rc > 0 && (pfd.revents & (POLLERR | POLLNVAL)))
+		rc = -1;
+	return rc;
+}
+
+
+int linux_read(Network* n, unsigned char* buffer, int len, int timeout_ms)
+{
+	struct timespec deadline;
 	int bytes = 0;
+	int deadline_set = 0;
+
 	while (bytes < len)
 	{
-		int rc = recv(n->my_socket, &buffer[bytes], (size_t)(len - bytes), 0);
+		int rc = n->readbuf_end - n->readbuf_start;
+
+		if (rc > 0)
+		{	/* serve as much as we can from the read-ahead buffer */
+			if (rc > len - bytes)
+				rc = len - bytes;
+			memcpy(&buffer[bytes], &n->readbuf[n->readbuf_start], rc);
+			n->readbuf_start += rc;
+			bytes += rc;
+			continue;
+		}
+		n->readbuf_start = n->readbuf_end = 0;
+
+		/* large reads go straight to the caller's buffer, anything else fills the read-ahead buffer */
+		if (len - bytes >= LINUX_READ_BUFFER_SIZE)
+			rc = recv(n->my_socket, &buffer[bytes], (size_t)(len - bytes), 0);
+		else
+			rc = recv(n->my_socket, n->readbuf, LINUX_READ_BUFFER_SIZE, 0);
 		if (rc == -1)
 		{
+			if (errno == EINTR)
+				continue;
 			if (errno != EAGAIN && errno != EWOULDBLOCK)
-			  bytes = -1;
-			break;
+			{
+				bytes = -1;
+				break;
+			}
+			if (!deadline_set)
+			{
+				linux_deadline(&deadline, timeout_ms);
+				deadline_set = 1;
+			}
+#if defined(TCP_QUICKACK)
+			if (n->tcp && n->options.quickack)
+			{	/* the kernel drops back to delaying acknowledgements, so ask again for what comes next */
+				int on = 1;
+				setsockopt(n->my_socket, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+			}
+#endif
+			if ((rc = linux_wait(n, POLLIN, &deadline)) <= 0)
+			{
+				if (rc < 0)
+					bytes = -1;
+				break;
+			}
 		}
 		else if (rc == 0)
+		{	/* the connection has been closed */
+			if (bytes == 0)
+				bytes = -1;
+			break;
+		}
+		else if (len - bytes >= LINUX_READ_BUFFER_SIZE)
+			bytes += rc;
+		else
+			n->readbuf_end = rc;
+	}
+	return bytes;
+}
+
+
+int linux_write(Network* n, unsigned char* buffer, int len, int timeout_ms)
+{
+	struct timespec deadline;
+	int bytes = 0;
+	int deadline_set = 0;
+
+	while (bytes < len)
+	{
+		int rc = write(n->my_socket, &buffer[bytes], (size_t)(len - bytes));
+		if (rc >= 0)
+			bytes += rc;
+		else if (errno == EINTR)
+			continue;
+		else if (errno != EAGAIN && errno != EWOULDBLOCK)
 		{
-			bytes = 0;
+			if (bytes == 0)
+				bytes = -1;
 			break;
 		}
 		else
+		{
+			if (!deadline_set)
+			{
+				linux_deadline(&deadline, timeout_ms);
+				deadline_set = 1;
+			}
+			if (linux_wait(n, POLLOUT, &deadline) <= 0)
+				break;
+		}
+	}
+	return bytes;
+}
+
+
+/* Write len bytes of the file fd from offset to the socket, without copying them through user space.
+ * @return -1 on error, or the number of bytes written, which could be less than len on a timeout */
+int linux_sendfile(Network* n, int fd, off_t offset, int len, int timeout_ms)
+{
+	struct timespec deadline;
+	int bytes = 0;
+	int deadline_set = 0;
+
+	while (bytes < len)
+	{
+		ssize_t rc = sendfile(n->my_socket, fd, &offset, (size_t)(len - bytes));
+		if (rc > 0)
 			bytes += rc;
+		else if (rc == 0 || (errno != EINTR && errno != EAGAIN))
+		{	/* the file ends before len, or can't be read */
+			if (bytes == 0)
+				bytes = -1;
+			break;
+		}
+		else if (errno == EAGAIN)
+		{
+			if (!deadline_set)
+			{
+				linux_deadline(&deadline, timeout_ms);
+				deadline_set = 1;
+			}
+			if (linux_wait(n, POLLOUT, &deadline) <= 0)
+				break;
+		}
 	}
 	return bytes;
 }
 
 
-int linux_write(Network* n, unsigned char* buffer, int len, int timeout_ms)
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+/* Read the kernel's notifications that it has finished with data sent with MSG_ZEROCOPY.
+ * @return 0, or -1 if the socket has failed */
+static int linux_zerocopy_reap(Network* n)
 {
-	struct timeval tv;
+	char control[128];
+	struct msghdr msg;
+	struct cmsghdr* cm = NULL;
 
-	tv.tv_sec = 0;  /* 30 Secs Timeout */
-	tv.tv_usec = timeout_ms * 1000;  // Not init'ing this can cause strange errors
+	while (n->zerocopy_done != n->zerocopy_sent)
+	{
+		memset(&msg, '\0', sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(n->my_socket, &msg, MSG_ERRQUEUE) == -1)
+			return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+		for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm))
+		{
+			struct sock_extended_err* err = (struct sock_extended_err*)CMSG_DATA(cm);
 
-	setsockopt(n->my_socket, SOL_SOCKET, SO_SNDTIMEO, (char *)&tv,sizeof(struct timeval));
-	int	rc = write(n->my_socket, buffer, len);
-	return rc;
+			if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+					!(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+				continue;
+			if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY || err->ee_errno != 0)
+				return -1;
+			/* each completes the sends from ee_info to ee_data, and TCP completes them in order */
+			n->zerocopy_done = err->ee_data + 1;
+			if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				n->zerocopy_copied++;
+		}
+	}
+	return 0;
+}
+#endif
+
+
+/* Write to the socket straight from the caller's buffer, and return only once the kernel has
+ * finished with it, so the caller is free to change it.  Small writes, or sockets which don't take
+ * MSG_ZEROCOPY, are copied as usual.
+ * @return -1 on error, or the number of bytes written, which could be less than len on a timeout */
+int linux_write_zerocopy(Network* n, unsigned char* buffer, int len, int timeout_ms)
+{
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+	struct timespec deadline;
+	int bytes = 0;
+
+	if (!n->zerocopy || len < LINUX_ZEROCOPY_MIN)
+		return linux_write(n, buffer, len, timeout_ms);
+	linux_deadline(&deadline, timeout_ms);
+	while (bytes < len)
+	{
+		ssize_t rc = send(n->my_socket, &buffer[bytes], (size_t)(len - bytes), MSG_ZEROCOPY);
+		if (rc >= 0)
+		{
+			bytes += rc;
+			n->zerocopy_sent++;
+		}
+		else if (errno == EINTR)
+			continue;
+		else if (errno == EAGAIN || errno == ENOBUFS)
+		{	/* the socket is full, or the pages pinned for it are at the limit */
+			if (linux_zerocopy_reap(n) != 0 || linux_wait(n, POLLOUT, &deadline) <= 0)
+				break;
+		}
+		else
+			break;
+	}
+	/* the data has been handed over, but is still being read from the buffer until it is acknowledged */
+	while (n->zerocopy_done != n->zerocopy_sent)
+	{
+		if (linux_zerocopy_reap(n) != 0)
+			return -1;
+		if (n->zerocopy_done != n->zerocopy_sent && linux_wait(n, 0, &deadline) <= 0)
+			return -1; /* it can't be said that the buffer is free */
+	}
+	return (bytes == 0) ? -1 : bytes;
+#else
+	return linux_write(n, buffer, len, timeout_ms);
+#endif
+}
+
+
+/* Set the socket options on a new socket, before it connects so that the buffer sizes are taken
+ * into account for the window offered.  Failures are ignored: each option is a preference. */
+static void linux_socket_options(NetworkSocketOptions* o, int sock, int tcp)
+{
+	int on = 1;
+
+	if (o->sndbuf > 0)
+		setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &o->sndbuf, sizeof(o->sndbuf));
+	if (o->rcvbuf > 0)
+		setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &o->rcvbuf, sizeof(o->rcvbuf));
+#if defined(SO_BUSY_POLL)
+	if (o->busy_poll_us > 0)
+		setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &o->busy_poll_us, sizeof(o->busy_poll_us));
+#endif
+	if (!tcp)
+		return;
+	if (o->nodelay)
+		setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+#if defined(TCP_QUICKACK)
+	if (o->quickack)
+		setsockopt(sock, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+#endif
+#if defined(TCP_USER_TIMEOUT)
+	if (o->user_timeout_ms > 0)
+		setsockopt(sock, IPPROTO_TCP, TCP_USER_TIMEOUT, &o->user_timeout_ms, sizeof(o->user_timeout_ms));
+#endif
 }
 
 
 void NetworkInit(Network* n)
 {
+	NetworkSocketOptions defaults = NetworkSocketOptions_initializer;
+
 	signal(SIGPIPE, SIG_IGN);
 	n->my_socket = 0;
+	n->readbuf_start = n->readbuf_end = 0;
 	n->mqttread = linux_read;
 	n->mqttwrite = linux_write;
+	n->mqttsendfile = linux_sendfile;
+	n->mqttwritezerocopy = linux_write_zerocopy;
+	n->zerocopy = 0;
+	n->options = defaults;
+	n->tcp = 0;
 }
 
 
-int NetworkConnect(Network* n, char* addr, int port)
+void NetworkSetSocketOptions(Network* n, NetworkSocketOptions* options)
 {
-	int type = SOCK_STREAM;
-	struct sockaddr_in address;
-	int rc = -1;
-	sa_family_t family = AF_INET;
-	struct addrinfo *result = NULL;
-	struct addrinfo hints = {0, AF_UNSPEC, SOCK_STREAM, IPPROTO_TCP, 0, NULL, NULL, NULL};
+	n->options = *options;
+}
+
+
+/* The addresses of a host name, IPv4 or IPv6 */
+typedef union
+{
+	struct sockaddr sa;
+	struct sockaddr_in in;
+	struct sockaddr_in6 in6;
+} linux_address;
+
+#if LINUX_DNS_CACHE_SIZE > 0
+/* The addresses of the host names connected to most recently, so that reconnecting doesn't wait for
+ * the resolver.  They are shared by all threads, as a reader thread reconnects to the host name the
+ * application thread first connected to, so the cache has a lock; getaddrinfo is called without it. */
+static struct
+{
+	char host[256];
+	struct timespec expires;
+	int count;
+	linux_address addrs[LINUX_DNS_ADDRESSES];
+} linux_dns[LINUX_DNS_CACHE_SIZE];
+static unsigned int linux_dns_next; /* the entry to replace next */
+static pthread_mutex_t linux_dns_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
 
-	if ((rc = getaddrinfo(addr, NULL, &hints, &result)) == 0)
+/* Take up to max addresses from getaddrinfo's, in the order to try them.  getaddrinfo has sorted
+ * them by preference (RFC 6724): the families are interleaved, starting with the preferred one, so
+ * that a dead family holds up the other by no more than one attempt delay (RFC 8305).
+ * @return the number of addresses */
+static int linux_interleave(struct addrinfo* result, linux_address* addrs, int max)
+{
+	struct addrinfo* next[2] = {result, result};
+	int family[2] = {AF_INET6, AF_INET};
+	int count = 0, turn = 0, exhausted = 0;
+
+	if (result != NULL && result->ai_family == AF_INET)
+	{
+		family[0] = AF_INET;
+		family[1] = AF_INET6;
+	}
+	while (count < max && exhausted < 2)
 	{
-		struct addrinfo* res = result;
+		struct addrinfo* res = next[turn];
+
+		while (res != NULL && res->ai_family != family[turn])
+			res = res->ai_next;
+		if (res != NULL && res->ai_addrlen <= sizeof(linux_address))
+		{
+			memcpy(&addrs[count++], res->ai_addr, res->ai_addrlen);
+			next[turn] = res->ai_next;
+			exhausted = 0;
+		}
+		else
+		{
+			next[turn] = NULL;
+			exhausted++;
+		}
+		turn ^= 1;
+	}
+	return count;
+}
+
+
+/* Resolve a host name, or take its addresses from the cache.
+ * @return the number of addresses, 0 if it can't be resolved */
+static int linux_resolve(const char* host, linux_address* addrs)
+{
+	struct addrinfo hints = {0, AF_UNSPEC, SOCK_STREAM, IPPROTO_TCP, 0, NULL, NULL, NULL};
+	struct addrinfo* result = NULL;
+	int count = 0;
+#if LINUX_DNS_CACHE_SIZE > 0
+	struct timespec now;
+	int i;
 
-		/* prefer ip4 addresses */
-		while (res)
+	clock_gettime(LINUX_TIMER_CLOCK, &now);
+	pthread_mutex_lock(&linux_dns_mutex);
+	for (i = 0; i < LINUX_DNS_CACHE_SIZE && count == 0; ++i)
+	{
+		if (linux_dns[i].count > 0 && strcmp(linux_dns[i].host, host) == 0)
 		{
-			if (res->ai_family == AF_INET)
+			if (now.tv_sec < linux_dns[i].expires.tv_sec)
 			{
-				result = res;
-				break;
+				count = linux_dns[i].count;
+				memcpy(addrs, linux_dns[i].addrs, sizeof(linux_address) * count);
 			}
-			res = res->ai_next;
+			else
+				linux_dns[i].count = 0; /* stale */
 		}
+	}
+	pthread_mutex_unlock(&linux_dns_mutex);
+	if (count > 0)
+		return count;
+#endif
+	if (getaddrinfo(host, NULL, &hints, &result) != 0)
+		return 0;
+	count = linux_interleave(result, addrs, LINUX_DNS_ADDRESSES);
+	freeaddrinfo(result);
+#if LINUX_DNS_CACHE_SIZE > 0
+	if (count > 0 && strlen(host) < sizeof(linux_dns[0].host))
+	{
+		pthread_mutex_lock(&linux_dns_mutex);
+		i = linux_dns_next++ % LINUX_DNS_CACHE_SIZE;
+		strcpy(linux_dns[i].host, host);
+		linux_dns[i].expires = now;
+		linux_dns[i].expires.tv_sec += LINUX_DNS_CACHE_TTL_S;
+		linux_dns[i].count = count;
+		memcpy(linux_dns[i].addrs, addrs, sizeof(linux_address) * count);
+		pthread_mutex_unlock(&linux_dns_mutex);
+	}
+#endif
+	return count;
+}
+
+
+/* Forget the cached addresses of a host name, none of which could be connected to, so that it is
+ * resolved again next time */
+static void linux_forget(const char* host)
+{
+#if LINUX_DNS_CACHE_SIZE > 0
+	int i;
+
+	pthread_mutex_lock(&linux_dns_mutex);
+	for (i = 0; i < LINUX_DNS_CACHE_SIZE; ++i)
+	{
+		if (linux_dns[i].count > 0 && strcmp(linux_dns[i].host, host) == 0)
+			linux_dns[i].count = 0;
+	}
+	pthread_mutex_unlock(&linux_dns_mutex);
+#endif
+}
 
-		if (result->ai_family == AF_INET)
+
+/* Connect to the first of the addresses that will take a connection, racing them (RFC 8305): each
+ * attempt is started when the one before it fails, or after an attempt delay if it hasn't
+ * finished, and the first to connect is kept.
+ * @return the connected socket, which is non-blocking, or -1 */
+static int linux_race(Network* n, linux_address* addrs, int count, int port)
+{
+	struct pollfd pending[LINUX_DNS_ADDRESSES];
+	struct timespec deadline, delay;
+	int npending = 0, started = 0, sock = -1, i;
+
+	linux_deadline(&deadline, LINUX_CONNECT_TIMEOUT_MS);
+	while (sock == -1)
+	{
+		struct timespec* until = &deadline;
+		int rc = 0;
+
+		if (started < count)
 		{
-			address.sin_port = htons(port);
-			address.sin_family = family = AF_INET;
-			address.sin_addr = ((struct sockaddr_in*)(result->ai_addr))->sin_addr;
+			linux_address* a = &addrs[started++];
+			socklen_t len = (a->sa.sa_family == AF_INET6) ? sizeof(a->in6) : sizeof(a->in);
+			int fd = socket(a->sa.sa_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+
+			if (a->sa.sa_family == AF_INET6)
+				a->in6.sin6_port = htons(port);
+			else
+				a->in.sin_port = htons(port);
+			if (fd == -1)
+				continue;
+			linux_socket_options(&n->options, fd, 1);
+			if (connect(fd, &a->sa, len) == 0)
+			{
+				sock = fd;
+				continue;
+			}
+			if (errno != EINPROGRESS)
+			{
+				close(fd); /* refused, or unreachable: go straight on to the next */
+				continue;
+			}
+			pending[npending].fd = fd;
+			pending[npending++].events = POLLOUT;
+			if (started < count)
+			{
+				linux_deadline(&delay, LINUX_CONNECT_ATTEMPT_DELAY_MS);
+				if (delay.tv_sec < deadline.tv_sec || (delay.tv_sec == deadline.tv_sec && delay.tv_nsec < deadline.tv_nsec))
+					until = &delay;
+			}
 		}
-		else
-			rc = -1;
+		else if (npending == 0)
+			break; /* every address has failed */
+
+		if ((rc = linux_poll(pending, npending, until)) < 0 || (rc == 0 && until == &deadline))
+			break;
+		for (i = 0; i < npending && rc > 0; ++i)
+		{
+			int err = 0;
+			socklen_t errlen = sizeof(err);
 
-		freeaddrinfo(result);
+			if (pending[i].revents == 0)
+				continue;
+			rc--;
+			if (getsockopt(pending[i].fd, SOL_SOCKET, SO_ERROR, &err, &errlen) == 0 && err == 0)
+			{
+				if (sock == -1)
+					sock = pending[i].fd;
+				else
+					close(pending[i].fd);
+			}
+			else
+				close(pending[i].fd);
+			pending[i--] = pending[--npending];
+		}
 	}
+	for (i = 0; i < npending; ++i)
+		close(pending[i].fd); /* the attempts which lost */
+	return sock;
+}
+
 
+int NetworkConnect(Network* n, char* addr, int port)
+{
+	linux_address addrs[LINUX_DNS_ADDRESSES];
+	int count = linux_resolve(addr, addrs);
+	int rc = -1;
+
+	n->readbuf_start = n->readbuf_end = 0;
+	n->zerocopy = 0;
+	n->zerocopy_sent = n->zerocopy_done = n->zerocopy_copied = 0;
+	n->tcp = 1;
+	n->my_socket = (count > 0) ? linux_race(n, addrs, count, port) : -1;
+	if (n->my_socket != -1)
+		rc = 0; /* connected, and left non-blocking: all further waiting is done in ppoll, with a deadline for each operation */
+	else if (count > 0)
+		linux_forget(addr); /* the addresses may have moved */
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
 	if (rc == 0)
 	{
-		n->my_socket = socket(family, type, 0);
-		if (n->my_socket != -1)
-			rc = connect(n->my_socket, (struct sockaddr*)&address, sizeof(address));
-		else
-			rc = -1;
+		int on = 1;
+		n->zerocopy = (setsockopt(n->my_socket, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0);
 	}
+#endif
+	return rc;
+}
+
 
+/* A stream socket to a broker on the same host skips the TCP/IP stack.  Reading and writing work
+ * as for TCP; MSG_ZEROCOPY doesn't apply, so zerocopy writes are copied. */
+int NetworkConnectUnix(Network* n, char* path)
+{
+	struct sockaddr_un address;
+	int rc = -1;
+
+	if (strlen(path) >= sizeof(address.sun_path))
+		return -1;
+	memset(&address, '\0', sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
+
+	n->readbuf_start = n->readbuf_end = 0;
+	n->zerocopy = 0;
+	n->zerocopy_sent = n->zerocopy_done = n->zerocopy_copied = 0;
+	n->my_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+	n->tcp = 0;
+	if (n->my_socket != -1)
+	{
+		linux_socket_options(&n->options, n->my_socket, 0);
+		rc = connect(n->my_socket, (struct sockaddr*)&address, sizeof(address));
+	}
+	if (rc == 0)
+		rc = fcntl(n->my_socket, F_SETFL, fcntl(n->my_socket, F_GETFL) | O_NONBLOCK);
+	else if (n->my_socket != -1)
+	{
+		close(n->my_socket);
+		n->my_socket = -1;
+	}
 	return rc;
 }
 
 
 void NetworkDisconnect(Network* n)
 {
+	n->readbuf_start = n->readbuf_end = 0;
 	close(n->my_socket);
 }
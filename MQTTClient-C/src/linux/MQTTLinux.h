@@ -33,6 +33,8 @@
 #include <sys/param.h>
 #include <sys/time.h>
 #include <sys/select.h>
+#include <poll.h>
+#include <time.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
@@ -48,27 +50,130 @@
 
 typedef struct Timer
 {
-	struct timeval end_time;
+	struct timespec end_time;   /* on CLOCK_MONOTONIC, or CLOCK_MONOTONIC_COARSE with MQTT_LINUX_COARSE_CLOCK */
 } Timer;
 
 void TimerInit(Timer*);
 char TimerIsExpired(Timer*);
 void TimerCountdownMS(Timer*, unsigned int);
+void TimerCountdownUS(Timer*, unsigned int);
 void TimerCountdown(Timer*, unsigned int);
 int TimerLeftMS(Timer*);
 
+/* Between these calls, timers on the calling thread share one reading of the clock, taken at the
+ * start and after each wait for the network.  The client brackets each cycle with them. */
+#define MQTT_TIMER_CACHE 1
+void TimerCacheStart(void);
+void TimerCacheStop(void);
+void TimerCacheRefresh(void); /* after a wait made outside this file, if the reading is being shared */
+
+#if !defined(LINUX_READ_BUFFER_SIZE)
+#define LINUX_READ_BUFFER_SIZE 1024 /* redefinable - size of the socket read-ahead buffer */
+#endif
+
+#if !defined(LINUX_ZEROCOPY_MIN)
+#define LINUX_ZEROCOPY_MIN 16384 /* redefinable - smaller writes are copied: pinning pages costs more than copying them */
+#endif
+
+#if !defined(LINUX_CONNECT_TIMEOUT_MS)
+#define LINUX_CONNECT_TIMEOUT_MS 10000 /* redefinable - the longest NetworkConnect tries the addresses of a host for */
+#endif
+
+#if !defined(LINUX_CONNECT_ATTEMPT_DELAY_MS)
+#define LINUX_CONNECT_ATTEMPT_DELAY_MS 250 /* redefinable - how long one address has before the next is tried alongside it (RFC 8305) */
+#endif
+
+#if !defined(LINUX_DNS_ADDRESSES)
+#define LINUX_DNS_ADDRESSES 8 /* redefinable - the most addresses of a host name NetworkConnect tries */
+#endif
+
+#if !defined(LINUX_DNS_CACHE_SIZE)
+#define LINUX_DNS_CACHE_SIZE 4 /* redefinable - host names whose addresses are kept, or 0 to resolve every time */
+#endif
+
+#if !defined(LINUX_DNS_CACHE_TTL_S)
+#define LINUX_DNS_CACHE_TTL_S 60 /* redefinable - how long they are kept: getaddrinfo doesn't give the records' own TTLs */
+#endif
+
+/* The payload of a large publish can be written to the socket straight from a file, or from memory
+ * the application leaves alone until the kernel has finished with it, rather than through the
+ * client's send buffer.  See MQTTPublishFile and MQTTPublishZeroCopy. */
+#define MQTT_ZEROCOPY 1
+
+/* Options for the socket, set by NetworkConnect before it connects, and by NetworkConnectUnix as far
+ * as they apply to a Unix domain socket.  Each is best effort: one the kernel doesn't have, or won't
+ * allow without privilege, is left as it was. */
+typedef struct NetworkSocketOptions
+{
+	char nodelay;                 /* TCP_NODELAY: send each packet at once, rather than hold it back for the last to be acknowledged */
+	char quickack;                /* TCP_QUICKACK: acknowledge what arrives at once rather than delay it.  Set again before each wait to read, a system call each time, so off unless latency matters most */
+	int sndbuf, rcvbuf;           /* SO_SNDBUF and SO_RCVBUF in bytes, or 0 to leave the kernel to size them */
+	unsigned int user_timeout_ms; /* TCP_USER_TIMEOUT: fail the connection when what was sent goes unacknowledged this long, or 0 for the kernel's default */
+	int busy_poll_us;             /* SO_BUSY_POLL: spin on the device queue this long when reading finds nothing, or 0 not to */
+} NetworkSocketOptions;
+
+/* the defaults set by NetworkInit: Nagle's algorithm off, with the kernel's acknowledgements, buffer sizes and timeouts */
+#define NetworkSocketOptions_initializer {1, 0, 0, 0, 0, 0}
+
 typedef struct Network
 {
 	int my_socket;
 	int (*mqttread) (struct Network*, unsigned char*, int, int);
 	int (*mqttwrite) (struct Network*, unsigned char*, int, int);
+	int (*mqttsendfile) (struct Network*, int, off_t, int, int); /* NULL if the network can't */
+	int (*mqttwritezerocopy) (struct Network*, unsigned char*, int, int); /* returns when the kernel is done with the data */
+	unsigned char readbuf[LINUX_READ_BUFFER_SIZE]; /* filled by one recv, drained by linux_read */
+	int readbuf_start, readbuf_end;
+	char zerocopy;                /* the socket takes MSG_ZEROCOPY */
+	unsigned int zerocopy_sent,   /* sends made with MSG_ZEROCOPY */
+	  zerocopy_done,              /* of those, how many the kernel has finished with */
+	  zerocopy_copied;            /* completions for which the kernel copied the data after all, as it does over loopback */
+	NetworkSocketOptions options; /* for the next connect */
+	char tcp;                     /* my_socket is TCP, which the TCP options apply to */
 } Network;
 
+#if defined(MQTT_TASK)
+#include <pthread.h>
+
+typedef struct Mutex
+{
+	pthread_mutex_t m;
+} Mutex;
+
+void MutexInit(Mutex*);
+int MutexLock(Mutex*);
+int MutexTryLock(Mutex*);
+int MutexUnlock(Mutex*);
+
+typedef struct Thread
+{
+	pthread_t t;
+	void (*fn)(void*);
+	void* arg;
+} Thread;
+
+int ThreadStart(Thread*, void (*fn)(void*), void* arg);
+int ThreadJoin(Thread*);
+
+typedef struct Condition
+{
+	pthread_cond_t c;
+} Condition;
+
+void ConditionInit(Condition*);
+int ConditionWait(Condition*, Mutex*, Timer*);
+void ConditionBroadcast(Condition*);
+#endif
+
 int linux_read(Network*, unsigned char*, int, int);
 int linux_write(Network*, unsigned char*, int, int);
+int linux_sendfile(Network*, int, off_t, int, int);
+int linux_write_zerocopy(Network*, unsigned char*, int, int);
 
 DLLExport void NetworkInit(Network*);
-DLLExport int NetworkConnect(Network*, char*, int);
+DLLExport void NetworkSetSocketOptions(Network*, NetworkSocketOptions*); /* after NetworkInit, for the next connect */
+DLLExport int NetworkConnect(Network*, char*, int); /* IPv6 or IPv4, racing the addresses of a host name */
+DLLExport int NetworkConnectUnix(Network*, char*); /* to a broker on the same host, at a Unix domain socket path */
 DLLExport void NetworkDisconnect(Network*);
 
 #endif
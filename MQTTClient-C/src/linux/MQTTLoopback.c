@@ -0,0 +1,560 @@
+/*******************************************************************************
+ * Copyright (c) 2014, 2023 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+#include "MQTTLoopback.h"
+
+#include <stdint.h>
+#include <sys/eventfd.h>
+
+#define LOOPBACK_MASK (MQTT_LOOPBACK_RING_SIZE - 1)
+#define LOOPBACK_FULL_US 100      /* how long a writer sleeps on a full ring: the taker catches up without being asked */
+#define LOOPBACK_LENGTH_BYTES 4   /* the most a remaining length can take */
+
+
+static int ringOpen(LoopbackRing* r)
+{
+    r->head = r->tail = 0;
+    r->closed = 0;
+    r->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return (r->fd == -1) ? FAILURE : SUCCESS;
+}
+
+
+static void ringRelease(LoopbackRing* r)
+{
+    if (r->fd != -1)
+        close(r->fd);
+    r->fd = -1;
+}
+
+
+static void ringSignal(LoopbackRing* r)
+{
+    uint64_t one = 1;
+
+    if (write(r->fd, &one, sizeof(one)) == -1)
+        return; /* the count can go no higher, and the fd is readable anyway */
+}
+
+
+/* Put as much of buf as there is room for.  If the taker had emptied the ring it may be waiting,
+ * so it is woken; otherwise the fd is still readable from the last time.
+ * @return the number of bytes put */
+static int ringPut(LoopbackRing* r, unsigned char* buf, int len)
+{
+    unsigned int tail = r->tail;
+    unsigned int space = MQTT_LOOPBACK_RING_SIZE - (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE));
+    unsigned int offset = tail & LOOPBACK_MASK;
+    int first = MQTT_LOOPBACK_RING_SIZE - offset;
+
+    if (len > (int)space)
+        len = (int)space;
+    if (len == 0)
+        return 0;
+    if (first > len)
+        first = len;
+    memcpy(&r->buf[offset], buf, first);
+    memcpy(r->buf, &buf[first], len - first);
+    __atomic_store_n(&r->tail, tail + len, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->head, __ATOMIC_SEQ_CST) == tail)
+        ringSignal(r);
+    return len;
+}
+
+
+/* @return the number of bytes taken, up to len */
+static int ringTake(LoopbackRing* r, unsigned char* buf, int len)
+{
+    unsigned int head = r->head;
+    unsigned int avail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) - head;
+    unsigned int offset = head & LOOPBACK_MASK;
+    int first = MQTT_LOOPBACK_RING_SIZE - offset;
+
+    if (len > (int)avail)
+        len = (int)avail;
+    if (len == 0)
+        return 0;
+    if (first > len)
+        first = len;
+    memcpy(buf, &r->buf[offset], first);
+    memcpy(&buf[first], r->buf, len - first);
+    __atomic_store_n(&r->head, head + len, __ATOMIC_SEQ_CST);
+    return len;
+}
+
+
+static void ringClose(LoopbackRing* r)
+{
+    __atomic_store_n(&r->closed, 1, __ATOMIC_RELEASE);
+    ringSignal(r);
+}
+
+
+/* Nothing more will come: the ring has been closed, and everything put before that taken */
+static int ringEnded(LoopbackRing* r)
+{
+    return __atomic_load_n(&r->closed, __ATOMIC_ACQUIRE) &&
+        __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == r->head;
+}
+
+
+/* Wait for the ring to have something in it, having found it empty.  The fd is only cleared here,
+ * so a poll loop outside sees it readable for as long as there is anything to take.
+ * @return 1 if there may be, 0 on timeout, -1 on error */
+static int ringWait(LoopbackRing* r, int timeout_ms)
+{
+    struct pollfd pfd = {r->fd, POLLIN, 0};
+    uint64_t count;
+    int rc;
+
+    if (read(r->fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+        return -1;
+    if (__atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) != r->head || __atomic_load_n(&r->closed, __ATOMIC_ACQUIRE))
+    {   /* put after the ring was found empty, and the signal cleared with the old ones */
+        ringSignal(r);
+        return 1;
+    }
+    do
+        rc = poll(&pfd, 1, timeout_ms);
+    while (rc == -1 && errno == EINTR);
+    TimerCacheRefresh(); /* time has moved on while we waited */
+    return rc;
+}
+
+
+static int loopback_read(Network* n, unsigned char* buffer, int len, int timeout_ms)
+{
+    LoopbackRing* r = &((LoopbackNetwork*)n)->to_client;
+    Timer timer;
+    int bytes = 0;
+    int timer_set = 0;
+
+    while (bytes < len)
+    {
+        int rc = ringTake(r, &buffer[bytes], len - bytes);
+
+        if (rc > 0)
+            bytes += rc;
+        else if (ringEnded(r))
+        {   /* the responder has closed the connection */
+            if (bytes == 0)
+                bytes = -1;
+            break;
+        }
+        else
+        {
+            if (!timer_set)
+            {
+                TimerInit(&timer);
+                TimerCountdownMS(&timer, (timeout_ms > 0) ? timeout_ms : 0);
+                timer_set = 1;
+            }
+            if ((rc = ringWait(r, TimerLeftMS(&timer))) <= 0)
+            {
+                if (rc < 0)
+                    bytes = -1;
+                break;
+            }
+        }
+    }
+    return bytes;
+}
+
+
+static int loopback_write(Network* n, unsigned char* buffer, int len, int timeout_ms)
+{
+    LoopbackRing* r = &((LoopbackNetwork*)n)->to_responder;
+    Timer timer;
+    int bytes = 0;
+    int timer_set = 0;
+
+    while (bytes < len)
+    {
+        int rc = 0;
+
+        if (__atomic_load_n(&r->closed, __ATOMIC_ACQUIRE))
+        {   /* the responder has gone */
+            if (bytes == 0)
+                bytes = -1;
+            break;
+        }
+        if ((rc = ringPut(r, &buffer[bytes], len - bytes)) > 0)
+            bytes += rc;
+        else
+        {
+            if (!timer_set)
+            {
+                TimerInit(&timer);
+                TimerCountdownMS(&timer, (timeout_ms > 0) ? timeout_ms : 0);
+                timer_set = 1;
+            }
+            if (TimerIsExpired(&timer))
+                break;
+            usleep(LOOPBACK_FULL_US);
+            TimerCacheRefresh();
+        }
+    }
+    return bytes;
+}
+
+
+/* Take exactly len bytes for the responder, waiting for as long as that takes
+ * @return len, or -1 if the connection has ended */
+static int responderTake(LoopbackNetwork* l, unsigned char* buf, int len)
+{
+    int bytes = 0;
+
+    while (bytes < len)
+    {
+        int rc = ringTake(&l->to_responder, &buf[bytes], len - bytes);
+
+        if (rc > 0)
+            bytes += rc;
+        else if (ringEnded(&l->to_responder) || ringWait(&l->to_responder, -1) < 0)
+            return -1;
+    }
+    return bytes;
+}
+
+
+/* @return success code: FAILURE once the client has closed the connection */
+static int responderSend(LoopbackNetwork* l, unsigned char* buf, int len)
+{
+    int bytes = 0;
+
+    if (len <= 0)
+        return FAILURE;
+    while (bytes < len)
+    {
+        if (__atomic_load_n(&l->to_client.closed, __ATOMIC_ACQUIRE))
+            return FAILURE;
+        bytes += ringPut(&l->to_client, &buf[bytes], len - bytes);
+        if (bytes < len)
+            usleep(LOOPBACK_FULL_US);
+    }
+    return SUCCESS;
+}
+
+
+/* Read the next packet into inbuf
+ * @return its length, or -1 if the connection has ended or the packet is too big to take */
+static int responderRead(LoopbackNetwork* l)
+{
+    int len = 1;
+    int rem_len = 0;
+    int multiplier = 1;
+    unsigned char c;
+
+    if (responderTake(l, l->inbuf, 1) != 1)
+        return -1;
+    do
+    {
+        if (len > LOOPBACK_LENGTH_BYTES || responderTake(l, &c, 1) != 1)
+            return -1;
+        l->inbuf[len++] = c;
+        rem_len += (c & 127) * multiplier;
+        multiplier *= 128;
+    } while (c & 128);
+    if (len + rem_len > MQTT_LOOPBACK_PACKET_SIZE || responderTake(l, &l->inbuf[len], rem_len) != rem_len)
+        return -1;
+    return len + rem_len;
+}
+
+
+/* Topic filters are matched as the client matches them to message handlers, after trying them as they are */
+static char responderMatched(char* topicFilter, MQTTString* topicName)
+{
+    char* curf = topicFilter;
+    char* curn = topicName->lenstring.data;
+    char* curn_end = curn + topicName->lenstring.len;
+
+    while (*curf && curn < curn_end)
+    {
+        if (*curn == '/' && *curf != '/')
+            break;
+        if (*curf != '+' && *curf != '#' && *curf != *curn)
+            break;
+        if (*curf == '+')
+        {   // skip until we meet the next separator, or end of string
+            char* nextpos = curn + 1;
+            while (nextpos < curn_end && *nextpos != '/')
+                nextpos = ++curn + 1;
+        }
+        else if (*curf == '#')
+            curn = curn_end - 1;    // skip until end of string
+        curf++;
+        curn++;
+    };
+
+    return (curn == curn_end) && (*curf == '\0');
+}
+
+
+static LoopbackSubscription* responderFind(LoopbackNetwork* l, MQTTString* topicFilter)
+{
+    int i;
+
+    for (i = 0; i < MQTT_LOOPBACK_SUBSCRIPTIONS; ++i)
+    {
+        if (l->subscriptions[i].topicFilter[0] != '\0' &&
+                MQTTPacket_equals(topicFilter, l->subscriptions[i].topicFilter))
+            return &l->subscriptions[i];
+    }
+    return NULL;
+}
+
+
+static void responderForget(LoopbackNetwork* l)
+{
+    memset(l->subscriptions, '\0', sizeof(l->subscriptions));
+}
+
+
+static int responderConnect(LoopbackNetwork* l, int len)
+{
+    MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+    unsigned char sessionPresent = 0;
+    int idlen = 0;
+
+    if (MQTTDeserialize_connect(&data, l->inbuf, len) != 1)
+        return FAILURE;
+    idlen = data.clientID.lenstring.len;
+    if (idlen >= MQTT_LOOPBACK_TOPIC_SIZE)
+        idlen = MQTT_LOOPBACK_TOPIC_SIZE - 1;
+    if (l->session && !data.cleansession && strlen(l->clientID) == idlen &&
+            memcmp(l->clientID, data.clientID.lenstring.data, idlen) == 0)
+        sessionPresent = 1;
+    else
+        responderForget(l);
+    memcpy(l->clientID, data.clientID.lenstring.data, idlen);
+    l->clientID[idlen] = '\0';
+    l->session = !data.cleansession;
+    l->cleansession = data.cleansession;
+    len = MQTTSerialize_connack(l->outbuf, sizeof(l->outbuf), 0, sessionPresent);
+    return responderSend(l, l->outbuf, len);
+}
+
+
+static int responderSubscribe(LoopbackNetwork* l, int len)
+{
+    MQTTString topicFilters[MQTT_LOOPBACK_SUBSCRIPTIONS];
+    int qoss[MQTT_LOOPBACK_SUBSCRIPTIONS];
+    unsigned char dup = 0;
+    unsigned short packetid = 0;
+    int count = 0;
+    int i, j;
+
+    if (MQTTDeserialize_subscribe(&dup, &packetid, MQTT_LOOPBACK_SUBSCRIPTIONS, &count, topicFilters, qoss,
+            l->inbuf, len) != 1)
+        return FAILURE;
+    for (i = 0; i < count; ++i)
+    {
+        LoopbackSubscription* s = responderFind(l, &topicFilters[i]);
+        int flen = topicFilters[i].lenstring.len;
+
+        for (j = 0; s == NULL && flen > 0 && flen < MQTT_LOOPBACK_TOPIC_SIZE && j < MQTT_LOOPBACK_SUBSCRIPTIONS; ++j)
+        {
+            if (l->subscriptions[j].topicFilter[0] == '\0')
+                s = &l->subscriptions[j];
+        }
+        if (s == NULL)
+            qoss[i] = 0x80; /* the failure return code */
+        else
+        {
+            memcpy(s->topicFilter, topicFilters[i].lenstring.data, flen);
+            s->topicFilter[flen] = '\0';
+            s->qos = qoss[i];
+        }
+    }
+    len = MQTTSerialize_suback(l->outbuf, sizeof(l->outbuf), packetid, count, qoss);
+    return responderSend(l, l->outbuf, len);
+}
+
+
+static int responderUnsubscribe(LoopbackNetwork* l, int len)
+{
+    MQTTString topicFilters[MQTT_LOOPBACK_SUBSCRIPTIONS];
+    unsigned char dup = 0;
+    unsigned short packetid = 0;
+    int count = 0;
+    int i;
+
+    if (MQTTDeserialize_unsubscribe(&dup, &packetid, MQTT_LOOPBACK_SUBSCRIPTIONS, &count, topicFilters,
+            l->inbuf, len) != 1)
+        return FAILURE;
+    for (i = 0; i < count; ++i)
+    {
+        LoopbackSubscription* s = responderFind(l, &topicFilters[i]);
+
+        if (s != NULL)
+            s->topicFilter[0] = '\0';
+    }
+    len = MQTTSerialize_unsuback(l->outbuf, sizeof(l->outbuf), packetid);
+    return responderSend(l, l->outbuf, len);
+}
+
+
+/* Acknowledge a publish, then send it back once, at the highest QoS of the subscriptions it
+ * matches but no higher than it was sent at.  QoS 2 publishes go back on arrival, not on PUBREL. */
+static int responderPublish(LoopbackNetwork* l, int len)
+{
+    MQTTString topicName = MQTTString_initializer;
+    unsigned char dup = 0, retained = 0;
+    unsigned short packetid = 0;
+    unsigned char* payload = NULL;
+    int payloadlen = 0;
+    int qos = 0;
+    int maxqos = -1;
+    int i;
+
+    if (MQTTDeserialize_publish(&dup, &qos, &retained, &packetid, &topicName, &payload, &payloadlen,
+            l->inbuf, len) != 1)
+        return FAILURE;
+    if (qos > 0)
+    {
+        len = MQTTSerialize_ack(l->outbuf, sizeof(l->outbuf), (qos == 1) ? PUBACK : PUBREC, 0, packetid);
+        if (responderSend(l, l->outbuf, len) != SUCCESS)
+            return FAILURE;
+    }
+    for (i = 0; i < MQTT_LOOPBACK_SUBSCRIPTIONS; ++i)
+    {
+        if (l->subscriptions[i].topicFilter[0] != '\0' && l->subscriptions[i].qos > maxqos &&
+                (MQTTPacket_equals(&topicName, l->subscriptions[i].topicFilter) ||
+                responderMatched(l->subscriptions[i].topicFilter, &topicName)))
+            maxqos = l->subscriptions[i].qos;
+    }
+    if (maxqos < 0)
+        return SUCCESS;
+    if (qos > maxqos)
+        qos = maxqos;
+    if (qos > 0 && ++l->next_packetid == 0)
+        l->next_packetid = 1;
+    len = MQTTSerialize_publish(l->outbuf, sizeof(l->outbuf), 0, qos, 0, l->next_packetid, topicName,
+        payload, payloadlen);
+    return responderSend(l, l->outbuf, len);
+}
+
+
+/* @return SUCCESS to carry on, FAILURE to end the connection, for a DISCONNECT or anything unexpected */
+static int responderHandle(LoopbackNetwork* l, int len)
+{
+    MQTTHeader header = {0};
+    unsigned char type = 0, dup = 0;
+    unsigned short packetid = 0;
+    int rc = FAILURE;
+
+    header.byte = l->inbuf[0];
+    switch (header.bits.type)
+    {
+        case CONNECT:
+            rc = responderConnect(l, len);
+            break;
+        case SUBSCRIBE:
+            rc = responderSubscribe(l, len);
+            break;
+        case UNSUBSCRIBE:
+            rc = responderUnsubscribe(l, len);
+            break;
+        case PUBLISH:
+            rc = responderPublish(l, len);
+            break;
+        case PUBREC:
+        case PUBREL:
+            if (MQTTDeserialize_ack(&type, &dup, &packetid, l->inbuf, len) == 1)
+            {
+                len = MQTTSerialize_ack(l->outbuf, sizeof(l->outbuf), (type == PUBREC) ? PUBREL : PUBCOMP, 0, packetid);
+                rc = responderSend(l, l->outbuf, len);
+            }
+            break;
+        case PUBACK:
+        case PUBCOMP:
+            rc = SUCCESS;
+            break;
+        case PINGREQ:
+            header.byte = 0;
+            header.bits.type = PINGRESP;
+            l->outbuf[0] = header.byte;
+            l->outbuf[1] = 0;
+            rc = responderSend(l, l->outbuf, 2);
+            break;
+    }
+    return rc;
+}
+
+
+static void* responderRun(void* parm)
+{
+    LoopbackNetwork* l = (LoopbackNetwork*)parm;
+    int len = 0;
+
+    while ((len = responderRead(l)) > 0 && responderHandle(l, len) == SUCCESS)
+        ;
+    if (l->cleansession)
+        responderForget(l);
+    ringClose(&l->to_client);     /* the client reads what was sent, then finds the end */
+    ringClose(&l->to_responder);  /* and can't write any more */
+    return NULL;
+}
+
+
+void LoopbackNetworkInit(LoopbackNetwork* l)
+{
+    l->net.my_socket = -1;
+    l->net.readbuf_start = l->net.readbuf_end = 0;
+    l->net.mqttread = loopback_read;
+    l->net.mqttwrite = loopback_write;
+    l->net.mqttsendfile = NULL;
+    l->net.mqttwritezerocopy = NULL;
+    l->net.zerocopy = 0;
+    l->to_responder.fd = l->to_client.fd = -1;
+    l->running = 0;
+    l->clientID[0] = '\0';
+    l->session = l->cleansession = 0;
+    responderForget(l);
+    l->next_packetid = 0;
+}
+
+
+int LoopbackNetworkConnect(LoopbackNetwork* l)
+{
+    if (l->running || l->net.my_socket != -1)
+        LoopbackNetworkDisconnect(l);
+    l->cleansession = 0; /* until a CONNECT says otherwise */
+    if (ringOpen(&l->to_responder) != SUCCESS || ringOpen(&l->to_client) != SUCCESS)
+        goto fail;
+    if (pthread_create(&l->responder, NULL, responderRun, l) != 0)
+        goto fail;
+    l->running = 1;
+    l->net.my_socket = l->to_client.fd;
+    return SUCCESS;
+
+fail:
+    ringRelease(&l->to_responder);
+    ringRelease(&l->to_client);
+    return FAILURE;
+}
+
+
+void LoopbackNetworkDisconnect(LoopbackNetwork* l)
+{
+    if (l->running)
+    {
+        ringClose(&l->to_responder);  /* the responder takes what was written, then finds the end */
+        ringClose(&l->to_client);     /* or gives up sending, if the client has stopped reading */
+        pthread_join(l->responder, NULL);
+        l->running = 0;
+    }
+    ringRelease(&l->to_responder);
+    ringRelease(&l->to_client);
+    l->net.my_socket = -1;
+}
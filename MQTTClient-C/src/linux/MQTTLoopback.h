@@ -0,0 +1,105 @@
+/*******************************************************************************
+ * Copyright (c) 2014, 2023 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+#if !defined(__MQTT_LOOPBACK_)
+#define __MQTT_LOOPBACK_
+
+#include "MQTTClient.h"
+#include <pthread.h>
+
+#if defined(__cplusplus)
+ extern "C" {
+#endif
+
+#if !defined(MQTT_LOOPBACK_RING_SIZE)
+#define MQTT_LOOPBACK_RING_SIZE 65536 /* redefinable - bytes each direction holds, a power of 2 */
+#endif
+
+#if !defined(MQTT_LOOPBACK_PACKET_SIZE)
+#define MQTT_LOOPBACK_PACKET_SIZE 16384 /* redefinable - the largest packet the responder takes, or sends */
+#endif
+
+#if !defined(MQTT_LOOPBACK_SUBSCRIPTIONS)
+#define MQTT_LOOPBACK_SUBSCRIPTIONS 16 /* redefinable - topic filters the responder keeps for its client */
+#endif
+
+#if !defined(MQTT_LOOPBACK_TOPIC_SIZE)
+#define MQTT_LOOPBACK_TOPIC_SIZE 128 /* redefinable - the longest topic filter or client id kept, with its terminator */
+#endif
+
+/* Bytes going one way.  One thread puts, one thread takes, and neither takes a lock: the head and
+ * tail run freely, and only their owners move them. */
+typedef struct LoopbackRing
+{
+    unsigned char buf[MQTT_LOOPBACK_RING_SIZE];
+    unsigned int head,            /* where the next byte is taken from */
+      tail;                       /* where the next byte is put */
+    int fd;                       /* an eventfd, readable whenever the ring holds data */
+    char closed;                  /* no more will be put: taking finds the end once the ring is empty */
+} LoopbackRing;
+
+typedef struct LoopbackSubscription
+{
+    char topicFilter[MQTT_LOOPBACK_TOPIC_SIZE]; /* empty if the entry is free */
+    int qos;
+} LoopbackSubscription;
+
+/* A Network to a responder on a thread of its own in the same process, with no sockets or kernel
+ * buffers in between, for measuring what the client itself costs and for testing without a broker.
+ *
+ * The responder answers CONNECT, SUBSCRIBE, UNSUBSCRIBE, PINGREQ and the QoS 1 and 2 flows, and
+ * sends each PUBLISH back if its topic matches one of the client's subscriptions.  It keeps one
+ * session, for the last client id to connect, while cleansession is 0.  It has no other clients,
+ * no retained messages and no will messages.
+ *
+ * net.my_socket is an eventfd which is readable while there is data for the client, so the network
+ * can be polled or given to MQTTEpollAdd.  With MQTT_TASK, a reading thread and writing threads can
+ * use it at once, as long as writes don't overlap each other, which the client sees to. */
+typedef struct LoopbackNetwork
+{
+    Network net;                  /* give the client &l->net */
+    LoopbackRing to_responder,
+      to_client;
+    pthread_t responder;
+    char running;                 /* the responder thread has been started, and not joined */
+    char clientID[MQTT_LOOPBACK_TOPIC_SIZE]; /* the session, kept between connections */
+    char session,                 /* subscriptions are being kept for clientID */
+      cleansession;               /* and will be forgotten when this connection ends */
+    LoopbackSubscription subscriptions[MQTT_LOOPBACK_SUBSCRIPTIONS];
+    unsigned short next_packetid; /* for publishes the responder sends */
+    unsigned char inbuf[MQTT_LOOPBACK_PACKET_SIZE],
+      outbuf[MQTT_LOOPBACK_PACKET_SIZE];
+} LoopbackNetwork;
+
+/** MQTT LoopbackNetworkInit - initialize a loopback network object, with no session.
+ *  @param l - the network object to initialize
+ */
+DLLExport void LoopbackNetworkInit(LoopbackNetwork* l);
+
+/** MQTT LoopbackNetworkConnect - start a responder and connect to it.  Any connection already made
+ *  is closed first.
+ *  @param l - the network object to use
+ *  @return success code
+ */
+DLLExport int LoopbackNetworkConnect(LoopbackNetwork* l);
+
+/** MQTT LoopbackNetworkDisconnect - close the connection and wait for the responder to finish.
+ *  @param l - the network object to use
+ */
+DLLExport void LoopbackNetworkDisconnect(LoopbackNetwork* l);
+
+#if defined(__cplusplus)
+     }
+#endif
+
+#endif
@@ -0,0 +1,340 @@
+/*******************************************************************************
+ * Copyright (c) 2014, 2023 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+#include "MQTTTLS.h"
+
+#if defined(MQTT_TLS)
+
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+#if defined(MQTT_TASK)
+#define TLS_LOCK(t) MutexLock(&(t)->mutex)
+#define TLS_UNLOCK(t) MutexUnlock(&(t)->mutex)
+#else
+#define TLS_LOCK(t)
+#define TLS_UNLOCK(t)
+#endif
+
+
+/* Wait for the socket to be ready for what OpenSSL wants to do next.
+ * @return 1 if ready, 0 on timeout, -1 on error */
+static int tlsWait(TLSNetwork* t, int err, Timer* timer)
+{
+    struct pollfd pfd = {t->net.my_socket, (err == SSL_ERROR_WANT_WRITE) ? POLLOUT : POLLIN, 0};
+    int rc;
+
+    do
+        rc = poll(&pfd, 1, TimerLeftMS(timer));
+    while (rc == -1 && errno == EINTR);
+    TimerCacheRefresh(); /* time has moved on while we waited */
+    if (rc > 0 && (pfd.revents & (POLLERR | POLLNVAL)))
+        rc = -1;
+    return rc;
+}
+
+
+/* Keep each session the server sends, replacing the last: TLS 1.3 servers send them after the
+ * handshake, so this is called while reading */
+static int tlsNewSession(SSL* ssl, SSL_SESSION* session)
+{
+    TLSNetwork* t = (TLSNetwork*)SSL_get_app_data(ssl);
+
+    if (t->session != NULL)
+        SSL_SESSION_free(t->session);
+    t->session = session;
+    return 1; /* the reference is ours now */
+}
+
+
+static int tls_read(Network* n, unsigned char* buffer, int len, int timeout_ms)
+{
+    TLSNetwork* t = (TLSNetwork*)n;
+    Timer timer;
+    int bytes = 0;
+    int timer_set = 0;
+
+    while (bytes < len)
+    {
+        size_t got = 0;
+        int rc = 0;
+
+        TLS_LOCK(t);
+        ERR_clear_error();
+        if ((rc = SSL_read_ex(t->ssl, &buffer[bytes], (size_t)(len - bytes), &got)) != 1)
+            rc = SSL_get_error(t->ssl, rc);
+        TLS_UNLOCK(t);
+        if (rc == 1)
+            bytes += (int)got;
+        else if (rc == SSL_ERROR_WANT_READ || rc == SSL_ERROR_WANT_WRITE)
+        {
+            if (!timer_set)
+            {
+                TimerInit(&timer);
+                TimerCountdownMS(&timer, (timeout_ms > 0) ? timeout_ms : 0);
+                timer_set = 1;
+            }
+            if ((rc = tlsWait(t, rc, &timer)) <= 0)
+            {
+                if (rc < 0)
+                    bytes = -1;
+                break;
+            }
+        }
+        else
+        {   /* the connection has been closed, or has failed */
+            if (bytes == 0)
+                bytes = -1;
+            break;
+        }
+    }
+    return bytes;
+}
+
+
+static int tls_write(Network* n, unsigned char* buffer, int len, int timeout_ms)
+{
+    TLSNetwork* t = (TLSNetwork*)n;
+    Timer timer;
+    int bytes = 0;
+    int timer_set = 0;
+
+    while (bytes < len)
+    {
+        size_t put = 0;
+        int rc = 0;
+
+        TLS_LOCK(t);
+        ERR_clear_error();
+        if ((rc = SSL_write_ex(t->ssl, &buffer[bytes], (size_t)(len - bytes), &put)) != 1)
+            rc = SSL_get_error(t->ssl, rc);
+        TLS_UNLOCK(t);
+        if (rc == 1)
+            bytes += (int)put;
+        else if (rc == SSL_ERROR_WANT_READ || rc == SSL_ERROR_WANT_WRITE)
+        {
+            if (!timer_set)
+            {
+                TimerInit(&timer);
+                TimerCountdownMS(&timer, (timeout_ms > 0) ? timeout_ms : 0);
+                timer_set = 1;
+            }
+            if (tlsWait(t, rc, &timer) <= 0)
+                break;
+        }
+        else
+        {
+            if (bytes == 0)
+                bytes = -1;
+            break;
+        }
+    }
+    return bytes;
+}
+
+
+/* Write len bytes of the file fd from offset: with sendfile if the kernel is encrypting, otherwise
+ * read and written a chunk at a time.
+ * @return -1 on error, or the number of bytes written, which could be less than len on a timeout */
+static int tls_sendfile(Network* n, int fd, off_t offset, int len, int timeout_ms)
+{
+    TLSNetwork* t = (TLSNetwork*)n;
+    unsigned char chunk[MQTT_TLS_SENDFILE_CHUNK];
+    int bytes = 0;
+
+#if defined(SSL_OP_ENABLE_KTLS)
+    if (t->ktls_send)
+    {
+        Timer timer;
+        int timer_set = 0;
+
+        while (bytes < len)
+        {
+            ossl_ssize_t rc = 0;
+            int err = 0;
+
+            TLS_LOCK(t);
+            ERR_clear_error();
+            if ((rc = SSL_sendfile(t->ssl, fd, offset + bytes, (size_t)(len - bytes), 0)) <= 0)
+                err = SSL_get_error(t->ssl, (int)rc);
+            TLS_UNLOCK(t);
+            if (rc > 0)
+                bytes += (int)rc;
+            else if (err == SSL_ERROR_WANT_WRITE)
+            {
+                if (!timer_set)
+                {
+                    TimerInit(&timer);
+                    TimerCountdownMS(&timer, (timeout_ms > 0) ? timeout_ms : 0);
+                    timer_set = 1;
+                }
+                if (tlsWait(t, err, &timer) <= 0)
+                    break;
+            }
+            else
+            {   /* the file ends before len, or can't be read */
+                if (bytes == 0)
+                    bytes = -1;
+                break;
+            }
+        }
+        return bytes;
+    }
+#endif
+    while (bytes < len)
+    {
+        int want = (len - bytes < (int)sizeof(chunk)) ? len - bytes : (int)sizeof(chunk);
+        ssize_t got = pread(fd, chunk, (size_t)want, offset + bytes);
+        int rc = 0;
+
+        if (got <= 0)
+        {
+            if (got == -1 && errno == EINTR)
+                continue;
+            if (bytes == 0)
+                bytes = -1;
+            break;
+        }
+        if ((rc = tls_write(n, chunk, (int)got, timeout_ms)) > 0)
+            bytes += rc;
+        if (rc != got)
+        {
+            if (bytes == 0)
+                bytes = -1;
+            break;
+        }
+    }
+    return bytes;
+}
+
+
+int TLSNetworkInit(TLSNetwork* t, const char* CAfile, int ktls)
+{
+    int rc = FAILURE;
+
+    NetworkInit(&t->net);
+    t->net.mqttread = tls_read;
+    t->net.mqttwrite = tls_write;
+    t->net.mqttsendfile = tls_sendfile;
+    t->net.mqttwritezerocopy = tls_write; /* encrypting copies it, so the buffer is free on return */
+    t->ssl = NULL;
+    t->session = NULL;
+    t->ktls = ktls;
+    t->ktls_send = t->ktls_recv = t->resumed = 0;
+#if defined(MQTT_TASK)
+    MutexInit(&t->mutex);
+#endif
+
+    if ((t->ctx = SSL_CTX_new(TLS_client_method())) == NULL)
+        goto exit;
+    SSL_CTX_set_min_proto_version(t->ctx, TLS1_2_VERSION);
+    SSL_CTX_set_verify(t->ctx, SSL_VERIFY_PEER, NULL);
+    if ((CAfile ? SSL_CTX_load_verify_locations(t->ctx, CAfile, NULL) : SSL_CTX_set_default_verify_paths(t->ctx)) != 1)
+        goto exit;
+    /* sessions are kept here, not in the context's cache, to be offered on the next connect */
+    SSL_CTX_set_session_cache_mode(t->ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(t->ctx, tlsNewSession);
+    SSL_CTX_set_mode(t->ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    SSL_CTX_set_read_ahead(t->ctx, 1); /* a read from the socket for each record, not one for its header then another */
+#if defined(SSL_OP_ENABLE_KTLS)
+    if (ktls)
+        SSL_CTX_set_options(t->ctx, SSL_OP_ENABLE_KTLS);
+#endif
+    rc = SUCCESS;
+exit:
+    if (rc != SUCCESS && t->ctx != NULL)
+    {
+        SSL_CTX_free(t->ctx);
+        t->ctx = NULL;
+    }
+    return rc;
+}
+
+
+int TLSNetworkConnect(TLSNetwork* t, char* addr, int port)
+{
+    Timer timer;
+    int rc = FAILURE;
+
+    if (t->ssl != NULL)
+        TLSNetworkDisconnect(t);
+    if (t->ctx == NULL || NetworkConnect(&t->net, addr, port) != 0)
+        return FAILURE;
+
+    if ((t->ssl = SSL_new(t->ctx)) == NULL)
+        goto exit;
+    SSL_set_app_data(t->ssl, t);
+    if (SSL_set_fd(t->ssl, t->net.my_socket) != 1)
+        goto exit;
+    if (X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(t->ssl), addr) != 1)
+    {   /* a host name, rather than an address */
+        if (SSL_set_tlsext_host_name(t->ssl, addr) != 1 || SSL_set1_host(t->ssl, addr) != 1)
+            goto exit;
+    }
+    if (t->session != NULL)
+        SSL_set_session(t->ssl, t->session);
+
+    TimerInit(&timer);
+    TimerCountdownMS(&timer, MQTT_TLS_HANDSHAKE_MS);
+    ERR_clear_error();
+    while ((rc = SSL_connect(t->ssl)) != 1)
+    {
+        rc = SSL_get_error(t->ssl, rc);
+        if ((rc != SSL_ERROR_WANT_READ && rc != SSL_ERROR_WANT_WRITE) || tlsWait(t, rc, &timer) <= 0)
+        {
+            rc = FAILURE;
+            goto exit;
+        }
+        ERR_clear_error();
+    }
+    t->resumed = SSL_session_reused(t->ssl);
+    t->ktls_send = BIO_get_ktls_send(SSL_get_wbio(t->ssl));
+    t->ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(t->ssl));
+    rc = SUCCESS;
+exit:
+    if (rc != SUCCESS)
+    {
+        if (t->ssl != NULL)
+            SSL_free(t->ssl);
+        t->ssl = NULL;
+        NetworkDisconnect(&t->net);
+    }
+    return rc;
+}
+
+
+void TLSNetworkDisconnect(TLSNetwork* t)
+{
+    if (t->ssl != NULL)
+    {
+        SSL_shutdown(t->ssl); /* send close_notify, without waiting for the server's */
+        SSL_free(t->ssl);
+        t->ssl = NULL;
+        NetworkDisconnect(&t->net);
+    }
+    t->ktls_send = t->ktls_recv = t->resumed = 0;
+}
+
+
+void TLSNetworkRelease(TLSNetwork* t)
+{
+    TLSNetworkDisconnect(t);
+    if (t->session != NULL)
+        SSL_SESSION_free(t->session);
+    t->session = NULL;
+    if (t->ctx != NULL)
+        SSL_CTX_free(t->ctx);
+    t->ctx = NULL;
+}
+
+#endif
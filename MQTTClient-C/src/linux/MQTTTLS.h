@@ -0,0 +1,96 @@
+/*******************************************************************************
+ * Copyright (c) 2014, 2023 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+#if !defined(__MQTT_TLS_)
+#define __MQTT_TLS_
+
+#if defined(MQTT_TLS)
+
+#include "MQTTClient.h"
+#include <openssl/ssl.h>
+
+#if defined(__cplusplus)
+ extern "C" {
+#endif
+
+#if !defined(MQTT_TLS_HANDSHAKE_MS)
+#define MQTT_TLS_HANDSHAKE_MS 10000 /* redefinable - the longest TLSNetworkConnect waits for the handshake */
+#endif
+
+#if !defined(MQTT_TLS_SENDFILE_CHUNK)
+#define MQTT_TLS_SENDFILE_CHUNK 16384 /* redefinable - file data read at a time to encrypt, without kernel TLS */
+#endif
+
+/* A Network over TLS, with OpenSSL.  The connection is made as by NetworkConnect, then the server's
+ * certificate is verified against the CA file and the host name connected to.
+ *
+ * The session ticket the server sends is kept, and offered on the next connect, so that
+ * reconnecting resumes the session with an abbreviated handshake rather than a full one.  An
+ * automatic reconnect handler can simply call TLSNetworkConnect on the network it is given.
+ *
+ * With kernel TLS asked for, and where the kernel and OpenSSL both have it, record encryption is
+ * done by the kernel once the handshake is over, and MQTTPublishFile sends with sendfile as it
+ * does in the clear.  Otherwise the file is read and encrypted a chunk at a time.  MQTTPublishZeroCopy
+ * is always copied, since the data is encrypted into a buffer of OpenSSL's before being sent.
+ *
+ * net.my_socket is the socket, to poll.  OpenSSL reads ahead, so when it is readable it may bring in
+ * more than one packet: MQTTYieldNoWait keeps going until none is left, and the client's read thread
+ * with MQTT_TASK reads through OpenSSL's buffer before waiting. */
+typedef struct TLSNetwork
+{
+    Network net;                  /* give the client &t->net */
+    SSL_CTX* ctx;                 /* to configure further before connecting, with a client certificate say */
+    SSL* ssl;                     /* the connection, NULL when there is none */
+    SSL_SESSION* session;         /* the latest from the server, offered on the next connect */
+    char ktls;                    /* ask for kernel TLS */
+    char ktls_send, ktls_recv;    /* the kernel encrypts, or decrypts, on this connection */
+    char resumed;                 /* this connection resumed the last session */
+#if defined(MQTT_TASK)
+    Mutex mutex;                  /* OpenSSL's calls on one connection can't overlap, though their waits can */
+#endif
+} TLSNetwork;
+
+/** MQTT TLSNetworkInit - initialize a TLS network object, creating its OpenSSL context.
+ *  @param t - the network object to initialize
+ *  @param CAfile - certificates to verify the server's against, in PEM format, or NULL for the system's
+ *  @param ktls - 1 to use kernel TLS where it is available
+ *  @return success code
+ */
+DLLExport int TLSNetworkInit(TLSNetwork* t, const char* CAfile, int ktls);
+
+/** MQTT TLSNetworkConnect - connect and make the TLS handshake, resuming the last session if there
+ *  is one.  Any connection already made is closed first.
+ *  @param t - the network object to use
+ *  @param addr - the host name to connect to, which the server's certificate must match
+ *  @param port - the port to connect to
+ *  @return success code
+ */
+DLLExport int TLSNetworkConnect(TLSNetwork* t, char* addr, int port);
+
+/** MQTT TLSNetworkDisconnect - close the connection, keeping the session to resume.
+ *  @param t - the network object to use
+ */
+DLLExport void TLSNetworkDisconnect(TLSNetwork* t);
+
+/** MQTT TLSNetworkRelease - close any connection, and free the context and session.
+ *  @param t - the network object to use
+ */
+DLLExport void TLSNetworkRelease(TLSNetwork* t);
+
+#if defined(__cplusplus)
+     }
+#endif
+
+#endif
+
+#endif
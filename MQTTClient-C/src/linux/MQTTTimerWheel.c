@@ -0,0 +1,181 @@
+/*******************************************************************************
+ * Copyright (c) 2014, 2023 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+#include "MQTTTimerWheel.h"
+
+#define MQTT_TIMER_WHEEL_MASK (MQTT_TIMER_WHEEL_SLOTS - 1)
+#define MQTT_TIMER_WHEEL_INDEX(ticks, level) (((ticks) >> ((level) * MQTT_TIMER_WHEEL_BITS)) & MQTT_TIMER_WHEEL_MASK)
+
+
+/* The current time, in ticks since the wheel was started */
+static unsigned long MQTTTimerWheel_ticks(MQTTTimerWheel* w)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((now.tv_sec - w->start.tv_sec) * 1000L + (now.tv_nsec - w->start.tv_nsec) / 1000000L) / MQTT_TIMER_WHEEL_TICK_MS;
+}
+
+
+static void MQTTTimerWheel_link(MQTTTimerEntry** head, MQTTTimerEntry* e)
+{
+    e->next = *head;
+    if (e->next)
+        e->next->pprev = &e->next;
+    e->pprev = head;
+    *head = e;
+}
+
+
+static void MQTTTimerWheel_unlink(MQTTTimerEntry* e)
+{
+    *e->pprev = e->next;
+    if (e->next)
+        e->next->pprev = e->pprev;
+    e->next = NULL;
+    e->pprev = NULL;
+}
+
+
+/* Put an entry in the slot for its expiry time, on the lowest level which reaches that far */
+static void MQTTTimerWheel_insert(MQTTTimerWheel* w, MQTTTimerEntry* e)
+{
+    unsigned long delta = e->expires - w->now;
+    int level = 0;
+
+    if ((long)delta < 0)
+        e->expires = w->now; /* overdue, so run it with the next tick */
+    else
+    {
+        while (level < MQTT_TIMER_WHEEL_LEVELS - 1 && delta >= (1UL << ((level + 1) * MQTT_TIMER_WHEEL_BITS)))
+            ++level;
+        if (level == MQTT_TIMER_WHEEL_LEVELS - 1 && delta >= (1UL << (MQTT_TIMER_WHEEL_LEVELS * MQTT_TIMER_WHEEL_BITS)))
+            e->expires = w->now + (1UL << (MQTT_TIMER_WHEEL_LEVELS * MQTT_TIMER_WHEEL_BITS)) - 1; /* as far as the wheel goes */
+    }
+    MQTTTimerWheel_link(&w->slots[level][MQTT_TIMER_WHEEL_INDEX(e->expires, level)], e);
+}
+
+
+/* Move the entries in one slot of a higher level down to where they now belong.
+ * @return the slot index, which is 0 when the level above has to be cascaded too */
+static int MQTTTimerWheel_cascade(MQTTTimerWheel* w, int level)
+{
+    int index = MQTT_TIMER_WHEEL_INDEX(w->now, level);
+    MQTTTimerEntry* e = w->slots[level][index];
+
+    w->slots[level][index] = NULL;
+    while (e)
+    {
+        MQTTTimerEntry* next = e->next;
+        MQTTTimerWheel_insert(w, e);
+        e = next;
+    }
+    return index;
+}
+
+
+void MQTTTimerWheelInit(MQTTTimerWheel* w)
+{
+    memset(w->slots, '\0', sizeof(w->slots));
+    w->now = 0;
+    w->count = 0;
+    clock_gettime(CLOCK_MONOTONIC, &w->start);
+}
+
+
+void MQTTTimerEntryInit(MQTTTimerEntry* e, timerWheelHandler fire, void* context)
+{
+    e->next = NULL;
+    e->pprev = NULL;
+    e->expires = 0;
+    e->fire = fire;
+    e->context = context;
+}
+
+
+void MQTTTimerWheelAdd(MQTTTimerWheel* w, MQTTTimerEntry* e, int timeout_ms)
+{
+    unsigned long ticks = (timeout_ms <= 0) ? 1 : (timeout_ms + MQTT_TIMER_WHEEL_TICK_MS - 1) / MQTT_TIMER_WHEEL_TICK_MS;
+    unsigned long now = MQTTTimerWheel_ticks(w);
+
+    MQTTTimerWheelCancel(w, e);
+    if (now < w->now)
+        now = w->now; /* never earlier than the tick being run, so that the entry can't fire again in it */
+    e->expires = now + ticks;
+    MQTTTimerWheel_insert(w, e);
+    w->count++;
+}
+
+
+void MQTTTimerWheelCancel(MQTTTimerWheel* w, MQTTTimerEntry* e)
+{
+    if (e->pprev)
+    {
+        MQTTTimerWheel_unlink(e);
+        w->count--;
+    }
+}
+
+
+int MQTTTimerWheelNext(MQTTTimerWheel* w)
+{
+    unsigned long ticks = 0;
+    long ms;
+    struct timespec now;
+
+    if (w->count == 0)
+        return -1;
+    /* the next lowest level slot with anything in it, or the next cascade, whichever is sooner */
+    while (ticks < MQTT_TIMER_WHEEL_SLOTS)
+    {
+        int index = (w->now + ticks) & MQTT_TIMER_WHEEL_MASK;
+        if (w->slots[0][index] || index == 0)
+            break;
+        ++ticks;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ms = (long)((w->now + ticks) * MQTT_TIMER_WHEEL_TICK_MS) -
+        ((now.tv_sec - w->start.tv_sec) * 1000L + (now.tv_nsec - w->start.tv_nsec) / 1000000L);
+    return (ms < 0) ? 0 : (int)ms;
+}
+
+
+int MQTTTimerWheelRun(MQTTTimerWheel* w)
+{
+    unsigned long target = MQTTTimerWheel_ticks(w);
+    int fired = 0;
+
+    if (w->count == 0 && w->now <= target)
+        w->now = target + 1; /* nothing to do on the way */
+    while (w->now <= target)
+    {
+        int index = w->now & MQTT_TIMER_WHEEL_MASK;
+        MQTTTimerEntry* e = NULL;
+
+        if (index == 0)
+        {
+            int level = 1;
+            while (level < MQTT_TIMER_WHEEL_LEVELS && MQTTTimerWheel_cascade(w, level) == 0)
+                ++level;
+        }
+        while ((e = w->slots[0][index]) != NULL)
+        {   /* one at a time, as the handlers may add and cancel entries */
+            MQTTTimerWheel_unlink(e);
+            w->count--;
+            e->fire(e, e->context);
+            ++fired;
+        }
+        w->now++;
+    }
+    return fired;
+}
@@ -0,0 +1,95 @@
+/*******************************************************************************
+ * Copyright (c) 2014, 2023 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+#if !defined(__MQTT_TIMER_WHEEL_)
+#define __MQTT_TIMER_WHEEL_
+
+#include "MQTTLinux.h"
+
+#if defined(__cplusplus)
+ extern "C" {
+#endif
+
+#if !defined(MQTT_TIMER_WHEEL_TICK_MS)
+#define MQTT_TIMER_WHEEL_TICK_MS 10 /* redefinable - the resolution of the timer wheel */
+#endif
+
+#define MQTT_TIMER_WHEEL_BITS 6
+#define MQTT_TIMER_WHEEL_SLOTS (1 << MQTT_TIMER_WHEEL_BITS)
+#define MQTT_TIMER_WHEEL_LEVELS 4   /* each level's slots span all of the level below: 64^4 ticks in all */
+
+struct MQTTTimerEntry;
+typedef void (*timerWheelHandler)(struct MQTTTimerEntry*, void*);
+
+/* A deadline on the wheel, embedded in whatever it belongs to.  Initialize it with
+ * MQTTTimerEntryInit before first use, and don't move it while it is pending. */
+typedef struct MQTTTimerEntry
+{
+    struct MQTTTimerEntry *next,
+      **pprev;                    /* whatever points to this entry, or NULL if it is not pending */
+    unsigned long expires;        /* in ticks */
+    timerWheelHandler fire;
+    void* context;
+} MQTTTimerEntry;
+
+typedef struct MQTTTimerWheel
+{
+    unsigned long now;            /* the next tick to be run */
+    struct timespec start;
+    int count;
+    MQTTTimerEntry* slots[MQTT_TIMER_WHEEL_LEVELS][MQTT_TIMER_WHEEL_SLOTS];
+} MQTTTimerWheel;
+
+/** MQTT TimerWheelInit - start an empty timer wheel at the current time.
+ *  @param w - the timer wheel to initialize
+ */
+DLLExport void MQTTTimerWheelInit(MQTTTimerWheel* w);
+
+/** MQTT TimerEntryInit - set what happens when an entry expires.
+ *  @param e - the entry to initialize
+ *  @param fire - called from MQTTTimerWheelRun when the entry expires, and may add or cancel any entry
+ *  @param context - passed to fire
+ */
+DLLExport void MQTTTimerEntryInit(MQTTTimerEntry* e, timerWheelHandler fire, void* context);
+
+/** MQTT TimerWheelAdd - set an entry to expire after a time, replacing any deadline it already had.
+ *  It expires at the first tick at or after the time.
+ *  @param w - the timer wheel to use
+ *  @param e - the entry to add
+ *  @param timeout_ms - how long from now it expires
+ */
+DLLExport void MQTTTimerWheelAdd(MQTTTimerWheel* w, MQTTTimerEntry* e, int timeout_ms);
+
+/** MQTT TimerWheelCancel - take an entry off the wheel, if it is pending.
+ *  @param w - the timer wheel to use
+ *  @param e - the entry to cancel
+ */
+DLLExport void MQTTTimerWheelCancel(MQTTTimerWheel* w, MQTTTimerEntry* e);
+
+/** MQTT TimerWheelNext - how long until the wheel next has to be run.
+ *  @param w - the timer wheel to use
+ *  @return milliseconds, or -1 if no entries are pending
+ */
+DLLExport int MQTTTimerWheelNext(MQTTTimerWheel* w);
+
+/** MQTT TimerWheelRun - bring the wheel up to the current time, firing the entries which expire.
+ *  @param w - the timer wheel to use
+ *  @return the number of entries fired
+ */
+DLLExport int MQTTTimerWheelRun(MQTTTimerWheel* w);
+
+#if defined(__cplusplus)
+     }
+#endif
+
+#endif
@@ -0,0 +1,567 @@
+/*******************************************************************************
+ * Copyright (c) 2014, 2023 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+#include "MQTTUring.h"
+
+#if defined(MQTT_URING)
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#define URING_ENTRIES 8           /* a receive, a send and room to spare */
+#define URING_CLOSE_MS 1000       /* how long disconnecting waits for what has been written to go */
+
+enum { URING_RECV = 1, URING_SEND };
+
+
+static int uring_setup(unsigned int entries, struct io_uring_params* p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+
+static int uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags,
+    void* arg, size_t argsz)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+
+static int uring_register(int fd, unsigned int opcode, void* arg, unsigned int nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+
+static void uringLock(UringNetwork* u)
+{
+#if defined(MQTT_TASK)
+    MutexLock(&u->mutex);
+#endif
+}
+
+
+static void uringUnlock(UringNetwork* u)
+{
+#if defined(MQTT_TASK)
+    MutexUnlock(&u->mutex);
+#endif
+}
+
+
+/* The next free submission queue entry, cleared, or NULL if the kernel hasn't taken the ones before */
+static struct io_uring_sqe* getSqe(UringNetwork* u)
+{
+    unsigned int tail = *u->sq_tail;
+    struct io_uring_sqe* sqe = NULL;
+
+    if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) < u->sq_entries)
+    {
+        sqe = &u->sqes[tail & u->sq_mask];
+        memset(sqe, '\0', sizeof(*sqe));
+    }
+    return sqe;
+}
+
+
+/* Make the entry from getSqe visible to the kernel, for the next io_uring_enter to submit */
+static void pushSqe(UringNetwork* u)
+{
+    unsigned int tail = *u->sq_tail;
+
+    u->sq_array[tail & u->sq_mask] = tail & u->sq_mask;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->pending++;
+}
+
+
+/* Give the kernel what has been queued, without waiting for anything */
+static int submit(UringNetwork* u)
+{
+    int rc = 0;
+
+    if (u->pending > 0)
+    {
+        rc = uring_enter(u->ring_fd, u->pending, 0, 0, NULL, 0);
+        u->metrics.enters++;
+        if (rc >= 0)
+            u->pending = 0;
+        else if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+            rc = 0; /* they stay queued for the next time */
+    }
+    return (rc < 0) ? -1 : 0;
+}
+
+
+/* Arm the multishot receive, which completes once for each buffer the kernel fills */
+static void armRecv(UringNetwork* u)
+{
+    struct io_uring_sqe* sqe = getSqe(u);
+
+    if (sqe == NULL)
+        return; /* the next time round */
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = u->net.my_socket;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = URING_RECV;
+    pushSqe(u);
+    u->recv_armed = 1;
+}
+
+
+/* Send the rest of the half in flight, from the registered buffer */
+static void queueSend(UringNetwork* u)
+{
+    struct io_uring_sqe* sqe = getSqe(u);
+
+    if (sqe == NULL)
+    {
+        u->error = 1; /* can't happen: there are more entries than operations we have outstanding */
+        return;
+    }
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = u->net.my_socket;
+    sqe->addr = (unsigned long)&u->sendbuf[u->inflight][u->inflight_sent];
+    sqe->len = u->inflight_len - u->inflight_sent;
+    sqe->buf_index = u->inflight;
+    sqe->user_data = URING_SEND;
+    pushSqe(u);
+    u->metrics.sends++;
+}
+
+
+/* Start sending the packets collected so far, and collect any more in the other half */
+static void startSend(UringNetwork* u)
+{
+    u->inflight = u->fill;
+    u->inflight_len = u->fill_len;
+    u->inflight_sent = 0;
+    u->fill ^= 1;
+    u->fill_len = 0;
+    queueSend(u);
+}
+
+
+/* The receive buffers follow the page holding the buffer ring */
+static unsigned char* recvBuffer(UringNetwork* u, unsigned short bid)
+{
+    return &u->mem[getpagesize() + bid * MQTT_URING_RECV_BUFFER_SIZE];
+}
+
+
+/* Give a receive buffer the client has finished with back to the kernel */
+static void recycle(UringNetwork* u, unsigned short bid)
+{
+    struct io_uring_buf* buf = &u->buf_ring->bufs[u->buf_tail & (MQTT_URING_RECV_BUFFERS - 1)];
+
+    buf->addr = (unsigned long)recvBuffer(u, bid);
+    buf->len = MQTT_URING_RECV_BUFFER_SIZE;
+    buf->bid = bid;
+    __atomic_store_n(&u->buf_ring->tail, ++u->buf_tail, __ATOMIC_RELEASE);
+}
+
+
+static void complete(UringNetwork* u, struct io_uring_cqe* cqe)
+{
+    if (cqe->user_data == URING_RECV)
+    {
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+            u->recv_armed = 0; /* the kernel is done with it, and it's armed again when next needed */
+        if (cqe->res > 0)
+        {
+            int i = (u->ready_head + u->ready_count++) % MQTT_URING_RECV_BUFFERS;
+            u->ready_bid[i] = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            u->ready_len[i] = cqe->res;
+            u->metrics.recvs++;
+        }
+        else if (cqe->res == 0)
+            u->closed = 1;
+        else if (cqe->res != -ENOBUFS && cqe->res != -EINTR && cqe->res != -ECANCELED)
+            u->error = 1; /* out of buffers, or cancelled when the thread which armed it ended, just rearm */
+    }
+    else if (cqe->user_data == URING_SEND)
+    {
+        if (cqe->res > 0)
+            u->inflight_sent += cqe->res;
+        else if (cqe->res != -EINTR && cqe->res != -EAGAIN && cqe->res != -ECANCELED)
+        {
+            u->error = 1;
+            u->inflight = -1;
+            return;
+        }
+        if (u->inflight_sent < u->inflight_len)
+            queueSend(u); /* a short write */
+        else
+        {
+            u->inflight = -1;
+            if (u->fill_len > 0)
+                startSend(u); /* everything written while that one was in flight, together */
+        }
+    }
+}
+
+
+/* Deal with everything the kernel has completed */
+static void reap(UringNetwork* u)
+{
+    unsigned int head = *u->cq_head;
+    unsigned int tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail)
+        complete(u, &u->cqes[head++ & u->cq_mask]);
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+
+/* Submit what is queued, and wait for a completion until the timer expires.  Only one thread at a
+ * time waits in the kernel, and it reaps for everyone.  The lock is held on entry and exit.
+ * @return 1 if there may be something new, 0 on timeout, -1 on error */
+static int uringWait(UringNetwork* u, Timer* timer)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned int to_submit = 0;
+    int left = TimerLeftMS(timer);
+    int rc = 0;
+
+    if (u->waiting)
+    {
+#if defined(MQTT_TASK)
+        if (submit(u) != 0)
+            return -1;
+        return (left > 0 && ConditionWait(&u->cond, &u->mutex, timer) == 0) ? 1 : 0;
+#endif
+    }
+    if (left <= 0)
+        return (submit(u) == 0) ? 0 : -1;
+
+    memset(&arg, '\0', sizeof(arg));
+    ts.tv_sec = left / 1000;
+    ts.tv_nsec = (left % 1000) * 1000000L;
+    arg.ts = (unsigned long)&ts;
+    to_submit = u->pending;
+    u->pending = 0;
+    u->waiting = 1;
+    uringUnlock(u);
+    rc = uring_enter(u->ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    TimerCacheRefresh(); /* time has moved on while we waited */
+    uringLock(u);
+    u->waiting = 0;
+    u->metrics.enters++;
+    reap(u);
+#if defined(MQTT_TASK)
+    ConditionBroadcast(&u->cond);
+#endif
+    if (rc < 0 && errno == ETIME)
+        return 0;
+    return (rc < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) ? -1 : 1;
+}
+
+
+static int uring_read(Network* n, unsigned char* buffer, int len, int timeout_ms)
+{
+    UringNetwork* u = (UringNetwork*)n;
+    Timer timer;
+    int timer_set = 0;
+    int bytes = 0;
+    int rc = 0;
+
+    uringLock(u);
+    if (u->inflight == -1 && u->fill_len > 0)
+        startSend(u); /* held by batching, to go with this read's wait */
+    while (bytes < len)
+    {
+        if (u->ready_count > 0)
+        {   /* serve as much as we can from the oldest buffer received */
+            int i = u->ready_head;
+            rc = u->ready_len[i] - u->ready_offset;
+            if (rc > len - bytes)
+                rc = len - bytes;
+            memcpy(&buffer[bytes], recvBuffer(u, u->ready_bid[i]) + u->ready_offset, rc);
+            bytes += rc;
+            if ((u->ready_offset += rc) == u->ready_len[i])
+            {
+                recycle(u, u->ready_bid[i]);
+                u->ready_head = (i + 1) % MQTT_URING_RECV_BUFFERS;
+                u->ready_count--;
+                u->ready_offset = 0;
+            }
+            continue;
+        }
+        if (!u->waiting)
+            reap(u);
+        if (u->ready_count > 0)
+            continue;
+        if (u->error || u->closed)
+        {
+            if (bytes == 0)
+                bytes = -1;
+            break;
+        }
+        if (!u->recv_armed)
+            armRecv(u);
+        if (!timer_set)
+        {
+            TimerCountdownMS(&timer, (timeout_ms > 0) ? timeout_ms : 0);
+            timer_set = 1;
+        }
+        if ((rc = uringWait(u, &timer)) <= 0)
+        {
+            if (rc < 0)
+                bytes = -1;
+            break;
+        }
+    }
+    if (submit(u) != 0)
+        bytes = -1;
+    uringUnlock(u);
+    return bytes;
+}
+
+
+static int uring_write(Network* n, unsigned char* buffer, int len, int timeout_ms)
+{
+    UringNetwork* u = (UringNetwork*)n;
+    Timer timer;
+    int timer_set = 0;
+    int bytes = 0;
+    int rc = 0;
+
+    uringLock(u);
+    u->metrics.writes++;
+    while (bytes < len && !u->error)
+    {
+        rc = MQTT_URING_SEND_BUFFER_SIZE - u->fill_len;
+        if (rc > 0)
+        {   /* collect it with anything else waiting to go */
+            if (rc > len - bytes)
+                rc = len - bytes;
+            memcpy(&u->sendbuf[u->fill][u->fill_len], &buffer[bytes], rc);
+            u->fill_len += rc;
+            bytes += rc;
+            continue;
+        }
+        if (!u->waiting)
+            reap(u);
+        if (u->inflight == -1)
+        {
+            startSend(u);
+            continue;
+        }
+        if (!timer_set)
+        {
+            TimerCountdownMS(&timer, (timeout_ms > 0) ? timeout_ms : 0);
+            timer_set = 1;
+        }
+        if (uringWait(u, &timer) <= 0)
+            break;
+    }
+    if (!u->waiting)
+        reap(u);
+    if (u->inflight == -1 && u->fill_len > 0 && (!u->batching || u->waiting))
+        startSend(u); /* if a thread is waiting for the reply, it won't be reading to send it */
+    if (submit(u) != 0 || (u->error && bytes == 0))
+        bytes = -1;
+    uringUnlock(u);
+    return bytes;
+}
+
+
+/* Map the queues the kernel shares with us, and give it the buffers */
+static int setupRing(UringNetwork* u)
+{
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    struct iovec iov[2];
+    unsigned char* sq = NULL;
+    unsigned char* cq = NULL;
+    int i;
+
+    memset(&p, '\0', sizeof(p));
+    if ((u->ring_fd = uring_setup(URING_ENTRIES, &p)) == -1)
+        return FAILURE;
+    if (!(p.features & IORING_FEAT_EXT_ARG))
+        return FAILURE; /* for the timeout on waiting */
+
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {   /* the two queues share one mapping */
+        if (u->cq_ring_size > u->sq_ring_size)
+            u->sq_ring_size = u->cq_ring_size;
+        u->cq_ring_size = 0;
+    }
+    u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED)
+    {
+        u->sq_ring = NULL;
+        return FAILURE;
+    }
+    if (u->cq_ring_size == 0)
+        u->cq_ring = u->sq_ring;
+    else if ((u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            u->ring_fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+    {
+        u->cq_ring = NULL;
+        return FAILURE;
+    }
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED)
+    {
+        u->sqes = NULL;
+        return FAILURE;
+    }
+    sq = u->sq_ring;
+    cq = u->cq_ring;
+    u->sq_head = (unsigned int*)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned int*)(sq + p.sq_off.tail);
+    u->sq_mask = *(unsigned int*)(sq + p.sq_off.ring_mask);
+    u->sq_entries = *(unsigned int*)(sq + p.sq_off.ring_entries);
+    u->sq_array = (unsigned int*)(sq + p.sq_off.array);
+    u->cq_head = (unsigned int*)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned int*)(cq + p.cq_off.tail);
+    u->cq_mask = *(unsigned int*)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+    /* one page for the buffer ring, then the receive buffers, then the two halves of the send buffer */
+    u->mem_size = getpagesize() + MQTT_URING_RECV_BUFFERS * MQTT_URING_RECV_BUFFER_SIZE + 2 * MQTT_URING_SEND_BUFFER_SIZE;
+    if ((u->mem = mmap(NULL, u->mem_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+    {
+        u->mem = NULL;
+        return FAILURE;
+    }
+    u->buf_ring = (struct io_uring_buf_ring*)u->mem;
+    memset(&reg, '\0', sizeof(reg));
+    reg.ring_addr = (unsigned long)u->buf_ring;
+    reg.ring_entries = MQTT_URING_RECV_BUFFERS;
+    reg.bgid = 0;
+    if (uring_register(u->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+        return FAILURE;
+    for (i = 0; i < MQTT_URING_RECV_BUFFERS; ++i)
+        recycle(u, i);
+
+    for (i = 0; i < 2; ++i)
+    {
+        u->sendbuf[i] = &u->mem[u->mem_size - (2 - i) * MQTT_URING_SEND_BUFFER_SIZE];
+        iov[i].iov_base = u->sendbuf[i];
+        iov[i].iov_len = MQTT_URING_SEND_BUFFER_SIZE;
+    }
+    if (uring_register(u->ring_fd, IORING_REGISTER_BUFFERS, iov, 2) != 0)
+        return FAILURE;
+    return SUCCESS;
+}
+
+
+static void releaseRing(UringNetwork* u)
+{
+    if (u->ring_fd != -1)
+        close(u->ring_fd); /* which cancels anything still outstanding */
+    u->ring_fd = -1;
+    if (u->sqes != NULL)
+        munmap(u->sqes, u->sqes_size);
+    if (u->cq_ring != NULL && u->cq_ring != u->sq_ring)
+        munmap(u->cq_ring, u->cq_ring_size);
+    if (u->sq_ring != NULL)
+        munmap(u->sq_ring, u->sq_ring_size);
+    if (u->mem != NULL)
+        munmap(u->mem, u->mem_size);
+    u->sqes = NULL;
+    u->sq_ring = u->cq_ring = NULL;
+    u->mem = NULL;
+}
+
+
+void UringNetworkInit(UringNetwork* u)
+{
+    NetworkInit(&u->net);
+    u->net.mqttread = uring_read;
+    u->net.mqttwrite = uring_write;
+    u->net.mqttsendfile = NULL; /* they would overtake what is queued in the ring */
+    u->net.mqttwritezerocopy = NULL;
+    u->ring_fd = -1;
+    u->batching = 0;
+    u->sq_ring = u->cq_ring = NULL;
+    u->sqes = NULL;
+    u->mem = NULL;
+#if defined(MQTT_TASK)
+    MutexInit(&u->mutex);
+    ConditionInit(&u->cond);
+#endif
+}
+
+
+int UringNetworkConnect(UringNetwork* u, char* addr, int port)
+{
+    u->pending = 0;
+    u->buf_tail = 0;
+    u->ready_head = u->ready_count = u->ready_offset = 0;
+    u->fill = u->fill_len = 0;
+    u->inflight = -1;
+    u->recv_armed = u->closed = u->error = u->waiting = 0;
+    memset(&u->metrics, '\0', sizeof(u->metrics));
+
+    if (NetworkConnect(&u->net, addr, port) != 0)
+        return FAILURE;
+    /* the ring does the waiting now: on a non-blocking socket it would hand EAGAIN back instead */
+    if (fcntl(u->net.my_socket, F_SETFL, fcntl(u->net.my_socket, F_GETFL) & ~O_NONBLOCK) == -1 ||
+            setupRing(u) != SUCCESS)
+    {
+        releaseRing(u);
+        NetworkDisconnect(&u->net);
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+
+#if !defined(MQTT_TASK)
+void UringNetworkSetBatching(UringNetwork* u, int batching)
+{
+    u->batching = batching;
+}
+#endif
+
+
+void UringNetworkGetMetrics(UringNetwork* u, UringMetrics* metrics)
+{
+    uringLock(u);
+    *metrics = u->metrics;
+    uringUnlock(u);
+}
+
+
+void UringNetworkDisconnect(UringNetwork* u)
+{
+    Timer timer;
+
+    uringLock(u);
+    TimerCountdownMS(&timer, URING_CLOSE_MS);
+    while (u->ring_fd != -1 && !u->error && (u->inflight != -1 || u->fill_len > 0))
+    {
+        if (!u->waiting)
+            reap(u);
+        if (u->inflight == -1 && u->fill_len > 0)
+            startSend(u);
+        else if (uringWait(u, &timer) <= 0)
+            break;
+    }
+    releaseRing(u);
+    uringUnlock(u);
+    NetworkDisconnect(&u->net);
+}
+
+#endif
@@ -0,0 +1,139 @@
+/*******************************************************************************
+ * Copyright (c) 2014, 2023 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+#if !defined(__MQTT_URING_)
+#define __MQTT_URING_
+
+#include "MQTTClient.h"
+#include <linux/io_uring.h>
+
+#if defined(__cplusplus)
+ extern "C" {
+#endif
+
+#if defined(IORING_RECV_MULTISHOT) /* the kernel headers know about multishot receive and provided buffer rings */
+#define MQTT_URING 1
+
+#if !defined(MQTT_URING_RECV_BUFFERS)
+#define MQTT_URING_RECV_BUFFERS 16 /* redefinable - buffers the kernel fills as data arrives, a power of 2 */
+#endif
+
+#if !defined(MQTT_URING_RECV_BUFFER_SIZE)
+#define MQTT_URING_RECV_BUFFER_SIZE 4096 /* redefinable - the most one receive completion can hold */
+#endif
+
+#if !defined(MQTT_URING_SEND_BUFFER_SIZE)
+#define MQTT_URING_SEND_BUFFER_SIZE 16384 /* redefinable - each half of the registered send buffer */
+#endif
+
+typedef struct UringMetrics
+{
+    unsigned int enters,          /* io_uring_enter system calls */
+      writes,                     /* calls from the client to write */
+      sends,                      /* writes to the socket, each of which may hold many packets */
+      recvs;                      /* completions from the multishot receive */
+} UringMetrics;
+
+/* A Network which uses io_uring instead of a system call for each read and write.
+ *
+ * One multishot receive stays armed on the socket, and the kernel completes it into buffers from
+ * a ring provided here, so while data keeps arriving reading it costs no system calls at all.
+ *
+ * Outbound packets are copied into one half of a send buffer registered with the kernel.  When no
+ * send is in flight that half is submitted straight away.  While one is, further packets collect
+ * in the other half and go out together in one send when the first completes, so a fast publisher
+ * pays for one submission per batch rather than per packet.  That completion is noticed the next
+ * time the network is read or written, which MQTTYield or the background thread does.  With
+ * batching on, packets wait for the next read even when nothing is in flight, and are submitted in
+ * the same system call as its wait.
+ *
+ * With MQTT_TASK, a reading thread and writing threads can use the network at once.  Don't give
+ * the client to MQTTEpollAdd: data is taken from the socket before epoll would see it. */
+typedef struct UringNetwork
+{
+    Network net;                  /* give the client &u->net */
+    int ring_fd;
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+    unsigned int *sq_head, *sq_tail, *sq_array, sq_mask, sq_entries,
+      *cq_head, *cq_tail, cq_mask;
+    struct io_uring_cqe* cqes;
+    unsigned int pending;         /* submission queue entries made ready, not yet given to the kernel */
+    unsigned char* mem;           /* the provided buffer ring, the receive buffers and the send buffer */
+    size_t mem_size;
+    struct io_uring_buf_ring* buf_ring;
+    unsigned short buf_tail;
+    unsigned short ready_bid[MQTT_URING_RECV_BUFFERS]; /* received, in order, not yet read by the client */
+    int ready_len[MQTT_URING_RECV_BUFFERS],
+      ready_head, ready_count, ready_offset;
+    unsigned char* sendbuf[2];
+    int fill, fill_len,           /* the half collecting packets */
+      inflight, inflight_len, inflight_sent; /* the half being sent, -1 for none */
+    char recv_armed, closed, error, waiting,
+      batching;                   /* hold writes for the next read */
+#if defined(MQTT_TASK)
+    Mutex mutex;
+    Condition cond;               /* the thread waiting for completions has reaped some */
+#endif
+    UringMetrics metrics;
+} UringNetwork;
+
+/** MQTT UringNetworkInit - initialize an io_uring network object.
+ *  @param u - the network object to initialize
+ */
+DLLExport void UringNetworkInit(UringNetwork* u);
+
+/** MQTT UringNetworkConnect - connect the socket, and set up its ring and buffers.  Fails if the
+ *  kernel doesn't support io_uring with provided buffer rings (5.19 and later), in which case
+ *  NetworkInit and NetworkConnect can be used on u->net instead.
+ *  @param u - the network object to use
+ *  @param addr - the host to connect to
+ *  @param port - the port to connect to
+ *  @return success code
+ */
+DLLExport int UringNetworkConnect(UringNetwork* u, char* addr, int port);
+
+#if !defined(MQTT_TASK)
+/** MQTT UringNetworkSetBatching - hold what is written until the network is next read, or until
+ *  half the send buffer is full, for bursts of QoS 0 publishes.  MQTTYield must be called
+ *  regularly to send publishes made on their own.  Not with MQTT_TASK, where the background thread
+ *  is usually waiting in the kernel already, and held writes would only wait for it to wake up.
+ *  @param u - the network object to use
+ *  @param batching - 1 to hold writes, 0 to submit them straight away
+ */
+DLLExport void UringNetworkSetBatching(UringNetwork* u, int batching);
+#endif
+
+/** MQTT UringNetworkGetMetrics - how many system calls and socket operations have been made.
+ *  @param u - the network object to use
+ *  @param metrics - returned: the counters
+ */
+DLLExport void UringNetworkGetMetrics(UringNetwork* u, UringMetrics* metrics);
+
+/** MQTT UringNetworkDisconnect - finish sending what has been written, then release the ring and
+ *  buffers and close the socket.
+ *  @param u - the network object to use
+ */
+DLLExport void UringNetworkDisconnect(UringNetwork* u);
+
+#endif
+
+#if defined(__cplusplus)
+     }
+#endif
+
+#endif
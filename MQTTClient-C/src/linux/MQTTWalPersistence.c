@@ -0,0 +1,478 @@
+/*******************************************************************************
+ * Copyright (c) 2014, 2023 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+#include "MQTTWalPersistence.h"
+
+#if defined(MQTT_TASK)
+
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+enum { WAL_ADD = 1, WAL_RELEASE, WAL_REMOVE };
+
+/* Each record in the log starts with this, followed by the packet for WAL_ADD.  A record torn by
+ * a crash fails its checksum, and ends the log. */
+typedef struct
+{
+    unsigned int sum;
+    int len;
+    unsigned short id;
+    unsigned char type,
+      reserved;
+} RecordHeader;
+
+enum { SLOT_FREE, SLOT_SENT, SLOT_RELEASED };
+
+/* A live publish in the table, followed by the packet */
+typedef struct
+{
+    unsigned int seq;
+    int len;
+    unsigned short id;
+    unsigned char state,
+      reserved;
+} SlotHeader;
+
+
+static size_t slotStride(unsigned int slot_size)
+{
+    return (sizeof(SlotHeader) + slot_size + 7) & ~(size_t)7;
+}
+
+
+static SlotHeader* slotAt(MQTTWalPersistence* w, unsigned int i)
+{
+    return (SlotHeader*)&w->table[i * slotStride(w->slot_size)];
+}
+
+
+static SlotHeader* find(MQTTWalPersistence* w, unsigned short id)
+{
+    unsigned int i;
+
+    for (i = 0; i < w->slots; ++i)
+    {
+        SlotHeader* s = slotAt(w, (id + i) % w->slots);
+        if (s->state != SLOT_FREE && s->id == id)
+            return s;
+    }
+    return NULL;
+}
+
+
+/* FNV-1a, over everything in the record after the checksum */
+static unsigned int checksum(RecordHeader* h, unsigned char* packet)
+{
+    unsigned char* ptr = (unsigned char*)&h->len;
+    unsigned int sum = 2166136261u;
+    int i;
+
+    for (i = 0; i < sizeof(RecordHeader) - sizeof(h->sum); ++i)
+        sum = (sum ^ ptr[i]) * 16777619u;
+    for (i = 0; i < h->len; ++i)
+        sum = (sum ^ packet[i]) * 16777619u;
+    return sum;
+}
+
+
+/* Make the change a record describes to the table of live publishes */
+static int apply(MQTTWalPersistence* w, int type, unsigned short id, unsigned char* packet, int len)
+{
+    SlotHeader* s = find(w, id);
+    unsigned int i;
+
+    if (type == WAL_ADD)
+    {   /* an old publish with the same id is one the server has forgotten */
+        for (i = 0; s == NULL && i < w->slots; ++i)
+        {
+            SlotHeader* free_slot = slotAt(w, (id + i) % w->slots);
+            if (free_slot->state == SLOT_FREE)
+                s = free_slot;
+        }
+        if (s == NULL)
+            return BUFFER_OVERFLOW;
+        memcpy(s + 1, packet, len);
+        s->seq = ++w->seq;
+        s->len = len;
+        s->id = id;
+        s->state = SLOT_SENT;
+    }
+    else if (s == NULL)
+        return FAILURE; /* not one of ours */
+    else
+        s->state = (type == WAL_RELEASE) ? SLOT_RELEASED : SLOT_FREE;
+    return SUCCESS;
+}
+
+
+static int writeAll(int fd, unsigned char* buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t rc = write(fd, buf, len);
+        if (rc == 0 || (rc < 0 && errno != EINTR))
+            return FAILURE; /* nothing written, as when the disk is full */
+        if (rc > 0)
+        {
+            buf += rc;
+            len -= rc;
+        }
+    }
+    return SUCCESS;
+}
+
+
+/* Write out the records collected in logbuf */
+static int flushLog(MQTTWalPersistence* w, int fd)
+{
+    int rc = writeAll(fd, w->logbuf, w->log_len);
+
+    if (rc == SUCCESS)
+    {
+        w->log_size += w->log_len;
+        w->written = w->appended;
+        w->log_len = 0;
+    }
+    return rc;
+}
+
+
+/* Put a record into buf, which has room for it
+ * @return the size of the record */
+static size_t encodeRecord(unsigned char* buf, int type, unsigned short id, unsigned char* packet, int len)
+{
+    RecordHeader h;
+
+    h.len = len;
+    h.id = id;
+    h.type = type;
+    h.reserved = 0;
+    h.sum = checksum(&h, packet);
+    memcpy(buf, &h, sizeof(h));
+    if (len > 0)
+        memcpy(&buf[sizeof(h)], packet, len);
+    return sizeof(h) + len;
+}
+
+
+static int appendRecord(MQTTWalPersistence* w, int fd, int type, unsigned short id, unsigned char* packet, int len)
+{
+    size_t size = sizeof(RecordHeader) + len;
+    int rc = SUCCESS;
+
+    if (w->log_len + size > sizeof(w->logbuf))
+        rc = flushLog(w, fd);
+    if (rc == SUCCESS)
+    {
+        w->log_len += encodeRecord(&w->logbuf[w->log_len], type, id, packet, len);
+        w->appended += size;
+        w->metrics.records++;
+    }
+    return rc;
+}
+
+
+/* Change the table, and log the change */
+static int logChange(MQTTWalPersistence* w, int type, unsigned short id, unsigned char* packet, int len)
+{
+    int rc = FAILURE;
+
+    MutexLock(&w->mutex);
+    while (w->checkpointing && w->log_len + sizeof(RecordHeader) + len > sizeof(w->logbuf))
+        ConditionWait(&w->cond, &w->mutex, NULL); /* the records have to follow the snapshot into the new log */
+    if ((rc = apply(w, type, id, packet, len)) == SUCCESS)
+        rc = appendRecord(w, w->fd, type, id, packet, len);
+    MutexUnlock(&w->mutex);
+    return rc;
+}
+
+
+static int MQTTWalPersistence_add(MQTTPersistence* persistence, unsigned short id, unsigned char* packet, int len)
+{
+    MQTTWalPersistence* w = (MQTTWalPersistence*)persistence;
+
+    if (len <= 0 || len > w->slot_size)
+        return BUFFER_OVERFLOW;
+    return logChange(w, WAL_ADD, id, packet, len);
+}
+
+
+static void MQTTWalPersistence_release(MQTTPersistence* persistence, unsigned short id)
+{
+    logChange((MQTTWalPersistence*)persistence, WAL_RELEASE, id, NULL, 0);
+}
+
+
+static void MQTTWalPersistence_remove(MQTTPersistence* persistence, unsigned short id)
+{
+    logChange((MQTTWalPersistence*)persistence, WAL_REMOVE, id, NULL, 0);
+}
+
+
+/* The oldest publish in the table after the one numbered *cursor */
+static int MQTTWalPersistence_next(MQTTPersistence* persistence, unsigned int* cursor, unsigned short* id,
+    int* released, unsigned char** packet)
+{
+    MQTTWalPersistence* w = (MQTTWalPersistence*)persistence;
+    SlotHeader* next = NULL;
+    unsigned int i;
+
+    for (i = 0; i < w->slots; ++i)
+    {
+        SlotHeader* s = slotAt(w, i);
+        if (s->state != SLOT_FREE && s->seq > *cursor && (next == NULL || s->seq < next->seq))
+            next = s;
+    }
+    if (next == NULL)
+        return 0;
+    *cursor = next->seq;
+    *id = next->id;
+    *released = (next->state == SLOT_RELEASED);
+    *packet = (unsigned char*)(next + 1);
+    return next->len;
+}
+
+
+/* Rewrite the log with only the live publishes, from the table, and swap it for the old one.  Called
+ * with the mutex held, which is let go for the file I/O, so that publishing carries on: the snapshot
+ * is taken from the table under the mutex a buffer at a time, and written without it.  The table
+ * already has everything in logbuf, so that is dropped, and the records made from here on follow the
+ * snapshot into the new log.  A publish newer than the snapshot's start is left to its record, and
+ * one which changes between buffers is taken as it is then: replaying its records after that changes
+ * nothing more. */
+static int checkpoint(MQTTWalPersistence* w)
+{
+    char newpath[PATH_MAX],
+      dir[PATH_MAX];
+    const char* slash = strrchr(w->path, '/');
+    unsigned int cursor = 0,
+      next = 0,
+      last = w->seq;
+    unsigned short id = 0;
+    unsigned char* packet = NULL;
+    unsigned long long end = 0;
+    size_t snap_len = 0;
+    int fd = -1,
+      dirfd = -1,
+      released = 0,
+      len = 0,
+      rc = SUCCESS;
+
+    snprintf(newpath, sizeof(newpath), "%s.new", w->path);
+    if ((fd = open(newpath, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600)) == -1)
+        return FAILURE;
+    w->checkpointing = 1;
+    w->log_len = 0;
+    w->log_size = 0;
+    do
+    {
+        snap_len = 0;
+        next = cursor;
+        while ((len = MQTTWalPersistence_next(&w->persistence, &next, &id, &released, &packet)) > 0 && next <= last &&
+                snap_len + 2 * sizeof(RecordHeader) + len <= sizeof(w->snapbuf))
+        {
+            snap_len += encodeRecord(&w->snapbuf[snap_len], WAL_ADD, id, packet, len);
+            if (released)
+                snap_len += encodeRecord(&w->snapbuf[snap_len], WAL_RELEASE, id, NULL, 0);
+            cursor = next;
+        }
+        MutexUnlock(&w->mutex);
+        rc = writeAll(fd, w->snapbuf, snap_len);
+        MutexLock(&w->mutex);
+        w->log_size += snap_len;
+    } while (rc == SUCCESS && len > 0 && next <= last);
+    if (rc == SUCCESS)
+        rc = flushLog(w, fd); /* the records made while the snapshot was written */
+    end = w->written;
+    MutexUnlock(&w->mutex);
+    if (rc == SUCCESS && (fdatasync(fd) != 0 || rename(newpath, w->path) != 0))
+        rc = FAILURE;
+    if (rc == SUCCESS)
+    {
+        snprintf(dir, sizeof(dir), "%.*s", slash ? (int)(slash - w->path + 1) : 1, slash ? w->path : ".");
+        if ((dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) != -1)
+        {   /* so the rename itself survives a crash */
+            fsync(dirfd);
+            close(dirfd);
+        }
+    }
+    MutexLock(&w->mutex);
+    w->checkpointing = 0;
+    ConditionBroadcast(&w->cond);
+    if (rc != SUCCESS)
+    {
+        close(fd);
+        return rc;
+    }
+    close(w->fd);
+    w->fd = fd; /* which the records made since the snapshot was synced go to */
+    if (end > w->durable)
+        w->durable = end;
+    w->metrics.checkpoints++;
+    return SUCCESS;
+}
+
+
+/* Rebuild the table from the log left by the last run */
+static int replay(MQTTWalPersistence* w)
+{
+    struct stat st;
+    unsigned char* map = NULL;
+    size_t pos = 0;
+    int rc = SUCCESS;
+
+    if (fstat(w->fd, &st) == -1)
+        return FAILURE;
+    if (st.st_size == 0)
+        return SUCCESS;
+    if ((map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, w->fd, 0)) == MAP_FAILED)
+        return FAILURE;
+    while (rc == SUCCESS && pos + sizeof(RecordHeader) <= st.st_size)
+    {
+        RecordHeader h;
+
+        memcpy(&h, &map[pos], sizeof(h));
+        if (h.len < 0 || h.len > w->slot_size || pos + sizeof(h) + h.len > st.st_size ||
+                h.type < WAL_ADD || h.type > WAL_REMOVE || h.sum != checksum(&h, &map[pos + sizeof(h)]))
+            break; /* torn by a crash while it was written, and nothing after it was */
+        if (apply(w, h.type, h.id, &map[pos + sizeof(h)], h.len) == BUFFER_OVERFLOW)
+            rc = BUFFER_OVERFLOW;
+        pos += sizeof(h) + h.len;
+    }
+    munmap(map, st.st_size);
+    return rc;
+}
+
+
+static int MQTTWalPersistence_commit(MQTTPersistence* persistence)
+{
+    MQTTWalPersistence* w = (MQTTWalPersistence*)persistence;
+    unsigned long long target = 0;
+    int rc = SUCCESS;
+
+    MutexLock(&w->mutex);
+    target = w->appended;
+    while (rc == SUCCESS && w->durable < target)
+    {
+        unsigned long long end = 0;
+
+        if (w->committing)
+        {   /* the commit under way may take our records with it, or we may have to make the next */
+            ConditionWait(&w->cond, &w->mutex, NULL);
+            continue;
+        }
+        w->committing = 1;
+        if (w->commit_us > 0)
+        {   /* let other publishes join this commit */
+            Timer timer;
+            TimerInit(&timer);
+            TimerCountdownUS(&timer, w->commit_us);
+            while (!TimerIsExpired(&timer))
+                ConditionWait(&w->cond, &w->mutex, &timer);
+        }
+        rc = flushLog(w, w->fd);
+        end = w->written;
+        MutexUnlock(&w->mutex); /* others can append while we wait for the disk */
+        if (rc == SUCCESS && fdatasync(w->fd) != 0)
+            rc = FAILURE;
+        MutexLock(&w->mutex);
+        if (rc == SUCCESS)
+        {
+            if (end > w->durable)
+                w->durable = end;
+            w->metrics.commits++;
+            if (w->log_size > MQTT_WAL_CHECKPOINT_SIZE)
+                rc = checkpoint(w);
+        }
+        w->committing = 0;
+        ConditionBroadcast(&w->cond);
+    }
+    MutexUnlock(&w->mutex);
+    return rc;
+}
+
+
+int MQTTWalPersistenceOpen(MQTTWalPersistence* w, const char* path, unsigned char* buf, size_t buf_size,
+    unsigned int slot_size, unsigned int commit_us)
+{
+    int rc = FAILURE;
+
+    w->persistence.add = MQTTWalPersistence_add;
+    w->persistence.release = MQTTWalPersistence_release;
+    w->persistence.remove = MQTTWalPersistence_remove;
+    w->persistence.next = MQTTWalPersistence_next;
+    w->persistence.commit = MQTTWalPersistence_commit;
+    w->path = path;
+    w->fd = -1;
+    w->table = buf;
+    w->slot_size = slot_size;
+    w->slots = (slot_size == 0) ? 0 : buf_size / slotStride(slot_size);
+    w->seq = 0;
+    w->commit_us = commit_us;
+    w->log_len = 0;
+    w->log_size = w->appended = w->written = w->durable = 0;
+    w->committing = 0;
+    w->checkpointing = 0;
+    memset(&w->metrics, '\0', sizeof(w->metrics));
+    MutexInit(&w->mutex);
+    ConditionInit(&w->cond);
+
+    if (w->slots == 0 || slot_size + 2 * sizeof(RecordHeader) > sizeof(w->snapbuf))
+        return FAILURE;
+    memset(buf, '\0', w->slots * slotStride(slot_size));
+    if ((w->fd = open(path, O_RDONLY | O_CREAT | O_CLOEXEC, 0600)) == -1)
+        return FAILURE;
+    if ((rc = replay(w)) == SUCCESS)
+    {
+        MutexLock(&w->mutex);
+        rc = checkpoint(w); /* which drops any torn record at the end, and starts appending after it */
+        MutexUnlock(&w->mutex);
+    }
+    if (rc != SUCCESS)
+    {
+        close(w->fd);
+        w->fd = -1;
+    }
+    memset(&w->metrics, '\0', sizeof(w->metrics)); /* count from here */
+    return rc;
+}
+
+
+int MQTTWalPersistenceGetMetrics(MQTTWalPersistence* w, MQTTWalMetrics* metrics)
+{
+    MutexLock(&w->mutex);
+    *metrics = w->metrics;
+    MutexUnlock(&w->mutex);
+    return SUCCESS;
+}
+
+
+void MQTTWalPersistenceClose(MQTTWalPersistence* w)
+{
+    MutexLock(&w->mutex);
+    while (w->committing)
+        ConditionWait(&w->cond, &w->mutex, NULL);
+    if (w->fd != -1)
+    {
+        if (flushLog(w, w->fd) == SUCCESS)
+            fdatasync(w->fd);
+        close(w->fd);
+    }
+    w->fd = -1;
+    MutexUnlock(&w->mutex);
+}
+
+#endif
@@ -0,0 +1,103 @@
+/*******************************************************************************
+ * Copyright (c) 2014, 2023 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+#if !defined(__MQTT_WAL_PERSISTENCE_)
+#define __MQTT_WAL_PERSISTENCE_
+
+#include "MQTTClient.h"
+
+#if defined(__cplusplus)
+ extern "C" {
+#endif
+
+#if defined(MQTT_TASK)
+
+#if !defined(MQTT_WAL_BUFFER_SIZE)
+#define MQTT_WAL_BUFFER_SIZE 65536 /* redefinable - log records collected before they are written to the file, and of a checkpoint's snapshot */
+#endif
+
+#if !defined(MQTT_WAL_CHECKPOINT_SIZE)
+#define MQTT_WAL_CHECKPOINT_SIZE (8 * 1024 * 1024) /* redefinable - the log is rewritten with only the live publishes when it grows past this */
+#endif
+
+typedef struct MQTTWalMetrics
+{
+    unsigned int records,         /* appended to the log */
+      commits,                    /* fdatasyncs, each of which made all the records before it durable */
+      checkpoints;                /* times the log has been rewritten */
+} MQTTWalMetrics;
+
+/* QoS 1 and 2 publishes kept in a write-ahead log, for messages which must never be lost.  Keeping a
+ * publish, or its PUBREC or ack, appends a record to a buffer in memory.  A publish is only sent once
+ * commit has made its record durable, so a crash while it is in flight can't lose it; the records of
+ * acks go out with the next commit, and a publish whose ack was lost is sent again.  One thread at a
+ * time commits, writing out the buffer and calling fdatasync for the records of every publish made so
+ * far, so many threads publishing at once share each disk write (group commit).  The live publishes
+ * are also kept in a table in memory, in the caller's buffer, to be sent again and to rewrite the log
+ * from. */
+typedef struct MQTTWalPersistence
+{
+    MQTTPersistence persistence;  /* give the client &w->persistence */
+    const char* path;
+    int fd;
+    unsigned char* table;
+    unsigned int slots,
+      slot_size,                  /* the largest packet a slot holds */
+      seq,                        /* of the newest publish, to keep them in order */
+      commit_us;
+    unsigned char logbuf[MQTT_WAL_BUFFER_SIZE],
+      snapbuf[MQTT_WAL_BUFFER_SIZE]; /* the live publishes, being written to the new log by a checkpoint */
+    size_t log_len;               /* of the records in logbuf */
+    unsigned long long log_size,  /* of the file */
+      appended,                   /* positions in the log, as if it had never been rewritten */
+      written,
+      durable;
+    char committing,              /* one thread is writing and syncing the log for everyone */
+      checkpointing;              /* and rewriting it: records are held in logbuf for the new log */
+    Mutex mutex;
+    Condition cond;
+    MQTTWalMetrics metrics;
+} MQTTWalPersistence;
+
+/** MQTT WalPersistenceOpen - open the log, or create it if it doesn't exist.  The publishes in an
+ *  existing log are read into the table, and the log is rewritten with only those.
+ *  @param w - the persistence object to initialize
+ *  @param path - the log file.  It must stay valid until the log is closed.
+ *  @param buf - the table of live publishes, aligned for an int
+ *  @param buf_size - the size of buf, which sets how many publishes can be kept at once
+ *  @param slot_size - the largest publish packet which can be kept
+ *  @param commit_us - how long the thread committing waits for other publishes to join it, 0 for not at all
+ *  @return success code
+ */
+DLLExport int MQTTWalPersistenceOpen(MQTTWalPersistence* w, const char* path, unsigned char* buf, size_t buf_size,
+    unsigned int slot_size, unsigned int commit_us);
+
+/** MQTT WalPersistenceGetMetrics - how the log is being used.
+ *  @param w - the persistence object to use
+ *  @param metrics - returned: the counters
+ *  @return success code
+ */
+DLLExport int MQTTWalPersistenceGetMetrics(MQTTWalPersistence* w, MQTTWalMetrics* metrics);
+
+/** MQTT WalPersistenceClose - write out and close the log.  The publishes in it are kept for the next run.
+ *  @param w - the persistence object to close
+ */
+DLLExport void MQTTWalPersistenceClose(MQTTWalPersistence* w);
+
+#endif
+
+#if defined(__cplusplus)
+     }
+#endif
+
+#endif
@@ -0,0 +1,667 @@
+/*******************************************************************************
+ * Copyright (c) 2014, 2023 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+#include "MQTTClient.h"
+
+#define SIM_NEVER (~0ULL)
+#define SIM_MASK (MQTT_SIM_RING_SIZE - 1)
+#define SIM_SEGMENT_MASK (MQTT_SIM_SEGMENTS - 1)
+#define SIM_RETRIES 15            /* the most times one segment is lost, as with tcp_retries2 */
+#define SIM_LENGTH_BYTES 4        /* the most a remaining length can take */
+
+static unsigned long long sim_now_us = 0;
+
+
+unsigned long long SimClockNow(void)
+{
+	return sim_now_us;
+}
+
+
+void SimClockAdvance(unsigned long long us)
+{
+	sim_now_us += us;
+}
+
+
+void TimerInit(Timer* timer)
+{
+	timer->end_us = 0;
+}
+
+
+char TimerIsExpired(Timer* timer)
+{
+	return sim_now_us >= timer->end_us;
+}
+
+
+void TimerCountdownMS(Timer* timer, unsigned int timeout)
+{
+	timer->end_us = sim_now_us + timeout * 1000ULL;
+}
+
+
+void TimerCountdownUS(Timer* timer, unsigned int timeout)
+{
+	timer->end_us = sim_now_us + timeout;
+}
+
+
+void TimerCountdown(Timer* timer, unsigned int timeout)
+{
+	timer->end_us = sim_now_us + timeout * 1000000ULL;
+}
+
+
+int TimerLeftMS(Timer* timer)
+{
+	if (sim_now_us >= timer->end_us)
+		return 0;
+	return (int)((timer->end_us - sim_now_us + 999) / 1000);
+}
+
+
+static unsigned int simRandom(SimNetwork* s)
+{
+	unsigned int x = s->seed; /* xorshift, as the client's reconnect jitter */
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return s->seed = x;
+}
+
+
+static void linkOpen(SimLink* l)
+{
+	l->head = l->delivered = l->tail = 0;
+	l->seg_head = l->seg_tail = 0;
+	l->free_us = l->last_us = sim_now_us;
+	l->closed_us = SIM_NEVER;
+}
+
+
+/* Lose everything in flight, and end the connection at time at */
+static void linkDrop(SimLink* l, unsigned long long at)
+{
+	l->head = l->delivered = l->tail;
+	l->seg_head = l->seg_tail;
+	if (at < l->closed_us)
+		l->closed_us = at;
+}
+
+
+static int linkFits(SimLink* l, int len)
+{
+	return MQTT_SIM_RING_SIZE - (l->tail - l->head) >= (unsigned int)len &&
+		MQTT_SIM_SEGMENTS - (l->seg_tail - l->seg_head) >= (unsigned int)((len + MQTT_SIM_MSS - 1) / MQTT_SIM_MSS);
+}
+
+
+/* Send data from time at, a segment at a time
+ * @return the number of bytes put, which is less than len if the link is full */
+static int linkPut(SimNetwork* s, SimLink* l, unsigned long long at, unsigned char* buf, int len)
+{
+	int bytes = 0;
+
+	while (bytes < len && l->seg_tail - l->seg_head < MQTT_SIM_SEGMENTS)
+	{
+		unsigned int space = MQTT_SIM_RING_SIZE - (l->tail - l->head);
+		unsigned int offset = l->tail & SIM_MASK;
+		unsigned long long rto = l->options.rto_us;
+		SimSegment* seg = NULL;
+		int seglen = len - bytes;
+		int first = MQTT_SIM_RING_SIZE - offset;
+		int retries = 0;
+
+		if (seglen > MQTT_SIM_MSS)
+			seglen = MQTT_SIM_MSS;
+		if (seglen > (int)space)
+			seglen = (int)space;
+		if (seglen == 0)
+			break;
+		if (first > seglen)
+			first = seglen;
+		memcpy(&l->buf[offset], &buf[bytes], first);
+		memcpy(l->buf, &buf[bytes + first], seglen - first);
+		l->tail += seglen;
+
+		if (l->free_us < at)
+			l->free_us = at;
+		if (l->options.bandwidth > 0)
+			l->free_us += (unsigned long long)seglen * 1000000 / l->options.bandwidth;
+		seg = &l->segments[l->seg_tail++ & SIM_SEGMENT_MASK];
+		seg->arrival_us = l->free_us + l->options.latency_us;
+		if (l->options.jitter_us > 0)
+			seg->arrival_us += simRandom(s) % (l->options.jitter_us + 1);
+		while (l->options.loss_ppm > 0 && retries++ < SIM_RETRIES && simRandom(s) % 1000000 < l->options.loss_ppm)
+		{
+			seg->arrival_us += rto;
+			rto *= 2;
+			l->lost++;
+		}
+		if (seg->arrival_us < l->last_us)
+			seg->arrival_us = l->last_us; /* held back until the segment before it has arrived */
+		l->last_us = seg->arrival_us;
+		seg->end = l->tail;
+		l->bytes += seglen;
+		l->segments_sent++;
+		bytes += seglen;
+	}
+	return bytes;
+}
+
+
+/* Deliver the segments which have arrived by now
+ * @return when the next one arrives, or SIM_NEVER if none is in flight */
+static unsigned long long linkArrive(SimLink* l)
+{
+	while (l->seg_head != l->seg_tail)
+	{
+		SimSegment* seg = &l->segments[l->seg_head & SIM_SEGMENT_MASK];
+
+		if (seg->arrival_us > sim_now_us)
+			return seg->arrival_us;
+		l->delivered = seg->end;
+		l->seg_head++;
+	}
+	return SIM_NEVER;
+}
+
+
+static void brokerForget(SimNetwork* s)
+{
+	memset(s->subscriptions, '\0', sizeof(s->subscriptions));
+}
+
+
+/* The broker closes the connection at time at: the client finds the end after the data sent before it */
+static void brokerClose(SimNetwork* s, unsigned long long at)
+{
+	linkDrop(&s->to_broker, at);
+	at += s->to_client.options.latency_us;
+	if (at < s->to_client.last_us)
+		at = s->to_client.last_us;
+	if (at < s->to_client.closed_us)
+		s->to_client.closed_us = at;
+	if (s->cleansession)
+		brokerForget(s);
+	s->cleansession = 0;
+}
+
+
+/* @return success code: FAILURE if the link has no room, and the broker should close the connection */
+static int brokerSend(SimNetwork* s, unsigned char* buf, int len)
+{
+	if (len <= 0 || s->to_client.closed_us != SIM_NEVER || !linkFits(&s->to_client, len))
+		return FAILURE;
+	linkPut(s, &s->to_client, s->now_us, buf, len);
+	return SUCCESS;
+}
+
+
+/* Topic filters are matched as the client matches them to message handlers, after trying them as they are */
+static char brokerMatched(char* topicFilter, MQTTString* topicName)
+{
+	char* curf = topicFilter;
+	char* curn = topicName->lenstring.data;
+	char* curn_end = curn + topicName->lenstring.len;
+
+	while (*curf && curn < curn_end)
+	{
+		if (*curn == '/' && *curf != '/')
+			break;
+		if (*curf != '+' && *curf != '#' && *curf != *curn)
+			break;
+		if (*curf == '+')
+		{   // skip until we meet the next separator, or end of string
+			char* nextpos = curn + 1;
+			while (nextpos < curn_end && *nextpos != '/')
+				nextpos = ++curn + 1;
+		}
+		else if (*curf == '#')
+			curn = curn_end - 1;    // skip until end of string
+		curf++;
+		curn++;
+	};
+
+	return (curn == curn_end) && (*curf == '\0');
+}
+
+
+static SimSubscription* brokerFind(SimNetwork* s, MQTTString* topicFilter)
+{
+	int i;
+
+	for (i = 0; i < MQTT_SIM_SUBSCRIPTIONS; ++i)
+	{
+		if (s->subscriptions[i].topicFilter[0] != '\0' &&
+				MQTTPacket_equals(topicFilter, s->subscriptions[i].topicFilter))
+			return &s->subscriptions[i];
+	}
+	return NULL;
+}
+
+
+static int brokerConnect(SimNetwork* s, int len)
+{
+	MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+	unsigned char sessionPresent = 0;
+	int idlen = 0;
+
+	if (MQTTDeserialize_connect(&data, s->inbuf, len) != 1)
+		return FAILURE;
+	idlen = data.clientID.lenstring.len;
+	if (idlen >= MQTT_SIM_TOPIC_SIZE)
+		idlen = MQTT_SIM_TOPIC_SIZE - 1;
+	if (s->session && !data.cleansession && strlen(s->clientID) == idlen &&
+			memcmp(s->clientID, data.clientID.lenstring.data, idlen) == 0)
+		sessionPresent = 1;
+	else
+		brokerForget(s);
+	memcpy(s->clientID, data.clientID.lenstring.data, idlen);
+	s->clientID[idlen] = '\0';
+	s->session = !data.cleansession;
+	s->cleansession = data.cleansession;
+	len = MQTTSerialize_connack(s->outbuf, sizeof(s->outbuf), 0, sessionPresent);
+	return brokerSend(s, s->outbuf, len);
+}
+
+
+static int brokerSubscribe(SimNetwork* s, int len)
+{
+	MQTTString topicFilters[MQTT_SIM_SUBSCRIPTIONS];
+	int qoss[MQTT_SIM_SUBSCRIPTIONS];
+	unsigned char dup = 0;
+	unsigned short packetid = 0;
+	int count = 0;
+	int i, j;
+
+	if (MQTTDeserialize_subscribe(&dup, &packetid, MQTT_SIM_SUBSCRIPTIONS, &count, topicFilters, qoss,
+			s->inbuf, len) != 1)
+		return FAILURE;
+	for (i = 0; i < count; ++i)
+	{
+		SimSubscription* sub = brokerFind(s, &topicFilters[i]);
+		int flen = topicFilters[i].lenstring.len;
+
+		for (j = 0; sub == NULL && flen > 0 && flen < MQTT_SIM_TOPIC_SIZE && j < MQTT_SIM_SUBSCRIPTIONS; ++j)
+		{
+			if (s->subscriptions[j].topicFilter[0] == '\0')
+				sub = &s->subscriptions[j];
+		}
+		if (sub == NULL)
+			qoss[i] = 0x80; /* the failure return code */
+		else
+		{
+			memcpy(sub->topicFilter, topicFilters[i].lenstring.data, flen);
+			sub->topicFilter[flen] = '\0';
+			sub->qos = qoss[i];
+		}
+	}
+	len = MQTTSerialize_suback(s->outbuf, sizeof(s->outbuf), packetid, count, qoss);
+	return brokerSend(s, s->outbuf, len);
+}
+
+
+static int brokerUnsubscribe(SimNetwork* s, int len)
+{
+	MQTTString topicFilters[MQTT_SIM_SUBSCRIPTIONS];
+	unsigned char dup = 0;
+	unsigned short packetid = 0;
+	int count = 0;
+	int i;
+
+	if (MQTTDeserialize_unsubscribe(&dup, &packetid, MQTT_SIM_SUBSCRIPTIONS, &count, topicFilters,
+			s->inbuf, len) != 1)
+		return FAILURE;
+	for (i = 0; i < count; ++i)
+	{
+		SimSubscription* sub = brokerFind(s, &topicFilters[i]);
+
+		if (sub != NULL)
+			sub->topicFilter[0] = '\0';
+	}
+	len = MQTTSerialize_unsuback(s->outbuf, sizeof(s->outbuf), packetid);
+	return brokerSend(s, s->outbuf, len);
+}
+
+
+/* Acknowledge a publish, then send it back once, at the highest QoS of the subscriptions it
+ * matches but no higher than it was sent at.  QoS 2 publishes go back on arrival, not on PUBREL. */
+static int brokerPublish(SimNetwork* s, int len)
+{
+	MQTTString topicName = MQTTString_initializer;
+	unsigned char dup = 0, retained = 0;
+	unsigned short packetid = 0;
+	unsigned char* payload = NULL;
+	int payloadlen = 0;
+	int qos = 0;
+	int maxqos = -1;
+	int i;
+
+	if (MQTTDeserialize_publish(&dup, &qos, &retained, &packetid, &topicName, &payload, &payloadlen,
+			s->inbuf, len) != 1)
+		return FAILURE;
+	if (qos > 0)
+	{
+		len = MQTTSerialize_ack(s->outbuf, sizeof(s->outbuf), (qos == 1) ? PUBACK : PUBREC, 0, packetid);
+		if (brokerSend(s, s->outbuf, len) != SUCCESS)
+			return FAILURE;
+	}
+	for (i = 0; i < MQTT_SIM_SUBSCRIPTIONS; ++i)
+	{
+		if (s->subscriptions[i].topicFilter[0] != '\0' && s->subscriptions[i].qos > maxqos &&
+				(MQTTPacket_equals(&topicName, s->subscriptions[i].topicFilter) ||
+				brokerMatched(s->subscriptions[i].topicFilter, &topicName)))
+			maxqos = s->subscriptions[i].qos;
+	}
+	if (maxqos < 0)
+		return SUCCESS;
+	if (qos > maxqos)
+		qos = maxqos;
+	if (qos > 0 && ++s->next_packetid == 0)
+		s->next_packetid = 1;
+	len = MQTTSerialize_publish(s->outbuf, sizeof(s->outbuf), 0, qos, 0, s->next_packetid, topicName,
+		payload, payloadlen);
+	return brokerSend(s, s->outbuf, len);
+}
+
+
+/* @return SUCCESS to carry on, FAILURE to close the connection, for a DISCONNECT or anything unexpected */
+static int brokerHandle(SimNetwork* s, int len)
+{
+	MQTTHeader header = {0};
+	unsigned char type = 0, dup = 0;
+	unsigned short packetid = 0;
+	int rc = FAILURE;
+
+	header.byte = s->inbuf[0];
+	s->received[header.bits.type]++;
+	if (s->script != NULL && (rc = s->script(s, s->inbuf, len, s->script_context)) != SIM_RESPOND)
+		return (rc == SIM_IGNORE) ? SUCCESS : FAILURE;
+	rc = FAILURE;
+	switch (header.bits.type)
+	{
+		case CONNECT:
+			rc = brokerConnect(s, len);
+			break;
+		case SUBSCRIBE:
+			rc = brokerSubscribe(s, len);
+			break;
+		case UNSUBSCRIBE:
+			rc = brokerUnsubscribe(s, len);
+			break;
+		case PUBLISH:
+			rc = brokerPublish(s, len);
+			break;
+		case PUBREC:
+		case PUBREL:
+			if (MQTTDeserialize_ack(&type, &dup, &packetid, s->inbuf, len) == 1)
+			{
+				len = MQTTSerialize_ack(s->outbuf, sizeof(s->outbuf), (type == PUBREC) ? PUBREL : PUBCOMP, 0, packetid);
+				rc = brokerSend(s, s->outbuf, len);
+			}
+			break;
+		case PUBACK:
+		case PUBCOMP:
+			rc = SUCCESS;
+			break;
+		case PINGREQ:
+			header.byte = 0;
+			header.bits.type = PINGRESP;
+			s->outbuf[0] = header.byte;
+			s->outbuf[1] = 0;
+			rc = brokerSend(s, s->outbuf, 2);
+			break;
+	}
+	return rc;
+}
+
+
+/* Add the next byte from the client to the packet being received, and handle the packet once it is complete
+ * @return success code: FAILURE to close the connection */
+static int brokerTake(SimNetwork* s, unsigned char c)
+{
+	int rc = SUCCESS;
+
+	s->inbuf[s->inlen++] = c;
+	if (s->inlen > 1 && s->packet_len == 0)
+	{   /* the remaining length */
+		if ((c & 128) == 0)
+		{
+			int i, multiplier = 1, rem_len = 0;
+
+			for (i = 1; i < s->inlen; ++i, multiplier *= 128)
+				rem_len += (s->inbuf[i] & 127) * multiplier;
+			s->packet_len = s->inlen + rem_len;
+			if (s->packet_len > MQTT_SIM_PACKET_SIZE)
+				return FAILURE;
+		}
+		else if (s->inlen > SIM_LENGTH_BYTES)
+			return FAILURE;
+	}
+	if (s->packet_len > 0 && s->inlen == s->packet_len)
+	{
+		rc = brokerHandle(s, s->inlen);
+		s->inlen = s->packet_len = 0;
+	}
+	return rc;
+}
+
+
+/* The broker handles what has arrived from the client by time until, a segment at a time so that
+ * it responds at the time each arrived */
+static void brokerRun(SimNetwork* s, unsigned long long until)
+{
+	SimLink* l = &s->to_broker;
+
+	while (l->seg_head != l->seg_tail)
+	{
+		SimSegment* seg = &l->segments[l->seg_head & SIM_SEGMENT_MASK];
+
+		if (seg->arrival_us > until)
+			break;
+		l->seg_head++;
+		s->now_us = seg->arrival_us;
+		s->handling = 1;
+		while (l->head != seg->end)
+		{
+			if (brokerTake(s, l->buf[l->head++ & SIM_MASK]) != SUCCESS)
+			{
+				brokerClose(s, s->now_us);
+				break;
+			}
+		}
+		s->handling = 0;
+	}
+}
+
+
+/* @return when the broker next has something to handle, or SIM_NEVER */
+static unsigned long long brokerNext(SimNetwork* s)
+{
+	SimLink* l = &s->to_broker;
+
+	return (l->seg_head == l->seg_tail) ? SIM_NEVER : l->segments[l->seg_head & SIM_SEGMENT_MASK].arrival_us;
+}
+
+
+static int sim_read(Network* n, unsigned char* buffer, int len, int timeout_ms)
+{
+	SimNetwork* s = (SimNetwork*)n;
+	SimLink* l = &s->to_client;
+	unsigned long long deadline = sim_now_us + ((timeout_ms > 0) ? timeout_ms : 0) * 1000ULL;
+	int bytes = 0;
+
+	if (!s->connected)
+		return -1;
+	while (bytes < len)
+	{
+		unsigned long long next, broker;
+
+		brokerRun(s, sim_now_us);
+		next = linkArrive(l);
+		while (bytes < len && l->head != l->delivered)
+			buffer[bytes++] = l->buf[l->head++ & SIM_MASK];
+		if (bytes == len)
+			break;
+		if (sim_now_us >= l->closed_us)
+		{   /* the connection has been closed, and everything sent before that read */
+			if (bytes == 0)
+				bytes = -1;
+			break;
+		}
+		/* wait for whatever happens next, by jumping to it */
+		if ((broker = brokerNext(s)) < next)
+			next = broker;
+		if (l->closed_us < next)
+			next = l->closed_us;
+		if (next > deadline)
+		{
+			sim_now_us = deadline;
+			break;
+		}
+		sim_now_us = next;
+	}
+	return bytes;
+}
+
+
+static int sim_write(Network* n, unsigned char* buffer, int len, int timeout_ms)
+{
+	SimNetwork* s = (SimNetwork*)n;
+	unsigned long long deadline = sim_now_us + ((timeout_ms > 0) ? timeout_ms : 0) * 1000ULL;
+	int bytes = 0;
+
+	if (!s->connected)
+		return -1;
+	while (bytes < len)
+	{
+		unsigned long long next;
+		int rc = 0;
+
+		brokerRun(s, sim_now_us);
+		if (sim_now_us >= s->to_client.closed_us)
+		{   /* the client has seen the connection close */
+			if (bytes == 0)
+				bytes = -1;
+			break;
+		}
+		if (s->to_broker.closed_us != SIM_NEVER)
+		{   /* the broker has stopped reading, though the client doesn't know yet */
+			bytes = len;
+			break;
+		}
+		if ((rc = linkPut(s, &s->to_broker, sim_now_us, &buffer[bytes], len - bytes)) > 0)
+			bytes += rc;
+		else
+		{   /* the link is full until the broker takes the next segment */
+			if ((next = brokerNext(s)) > deadline)
+			{
+				sim_now_us = deadline;
+				break;
+			}
+			sim_now_us = next;
+		}
+	}
+	return bytes;
+}
+
+
+void SimNetworkInit(SimNetwork* s, unsigned int seed)
+{
+	SimLinkOptions options = SimLinkOptions_initializer;
+
+	memset(s, '\0', sizeof(*s));
+	s->net.mqttread = sim_read;
+	s->net.mqttwrite = sim_write;
+	s->to_broker.options = s->to_client.options = options;
+	s->seed = (seed == 0) ? 1 : seed;
+	linkOpen(&s->to_broker);
+	linkOpen(&s->to_client);
+}
+
+
+void SimNetworkSetLinks(SimNetwork* s, SimLinkOptions* to_broker, SimLinkOptions* to_client)
+{
+	if (to_broker)
+		s->to_broker.options = *to_broker;
+	if (to_client)
+		s->to_client.options = *to_client;
+}
+
+
+void SimNetworkSetScript(SimNetwork* s, SimScript script, void* context)
+{
+	s->script = script;
+	s->script_context = context;
+}
+
+
+int SimNetworkConnect(SimNetwork* s)
+{
+	if (s->connected)
+		SimNetworkDisconnect(s);
+	/* the SYN and SYN-ACK */
+	sim_now_us += s->to_broker.options.latency_us + s->to_client.options.latency_us;
+	if (s->unreachable)
+		return FAILURE;
+	linkOpen(&s->to_broker);
+	linkOpen(&s->to_client);
+	s->inlen = s->packet_len = 0;
+	s->cleansession = 0; /* until a CONNECT says otherwise */
+	s->connected = 1;
+	s->connects++;
+	return SUCCESS;
+}
+
+
+int SimNetworkSend(SimNetwork* s, unsigned char* packet, int len)
+{
+	if (!s->connected)
+		return FAILURE;
+	if (!s->handling)
+	{   /* the broker catches up first, so that what it sends is in time order */
+		brokerRun(s, sim_now_us);
+		s->now_us = sim_now_us;
+	}
+	return brokerSend(s, packet, len);
+}
+
+
+void SimNetworkBreak(SimNetwork* s)
+{
+	if (s->connected)
+	{
+		brokerRun(s, sim_now_us);
+		linkDrop(&s->to_client, sim_now_us);
+		brokerClose(s, sim_now_us);
+	}
+}
+
+
+void SimNetworkDisconnect(SimNetwork* s)
+{
+	if (s->connected)
+	{
+		brokerRun(s, SIM_NEVER);
+		if (s->cleansession)
+			brokerForget(s);
+		s->cleansession = 0;
+		s->connected = 0;
+	}
+	linkOpen(&s->to_broker);
+	linkOpen(&s->to_client);
+}
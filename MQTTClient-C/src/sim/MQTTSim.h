@@ -0,0 +1,235 @@
+/*******************************************************************************
+ * Copyright (c) 2014, 2023 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+#if !defined(__MQTT_SIM_)
+#define __MQTT_SIM_
+
+#if defined(WIN32_DLL) || defined(WIN64_DLL)
+  #define DLLImport __declspec(dllimport)
+  #define DLLExport __declspec(dllexport)
+#elif defined(LINUX_SO)
+  #define DLLImport extern
+  #define DLLExport  __attribute__ ((visibility ("default")))
+#else
+  #define DLLImport
+  #define DLLExport
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* A platform for testing the client without a broker, a network or the passage of real time:
+ * build MQTTClient.c with MQTTCLIENT_PLATFORM_HEADER=MQTTSim.h.
+ *
+ * Timers run on a virtual clock, which only moves when the client waits for the network with
+ * nothing due before its deadline, and then jumps straight to whatever happens next.  An hour of
+ * keepalives takes as long as the packets take to handle, and a run with the same options and seed
+ * gives the same packets at the same virtual times every time.  There is one clock for the process,
+ * and no threads: MQTT_TASK isn't available on this platform. */
+
+typedef struct Timer
+{
+	unsigned long long end_us;    /* on the virtual clock */
+} Timer;
+
+void TimerInit(Timer*);
+char TimerIsExpired(Timer*);
+void TimerCountdownMS(Timer*, unsigned int);
+void TimerCountdownUS(Timer*, unsigned int);
+void TimerCountdown(Timer*, unsigned int);
+int TimerLeftMS(Timer*);          /* rounded up, so that waiting that long reaches the deadline */
+
+/** MQTT SimClockNow - the virtual time.
+ *  @return microseconds since the process started
+ */
+DLLExport unsigned long long SimClockNow(void);
+
+/** MQTT SimClockAdvance - move the virtual clock on, as the application doing other work would.
+ *  @param us - microseconds
+ */
+DLLExport void SimClockAdvance(unsigned long long us);
+
+typedef struct Network
+{
+	int (*mqttread) (struct Network*, unsigned char*, int, int);
+	int (*mqttwrite) (struct Network*, unsigned char*, int, int);
+} Network;
+
+#if !defined(MQTT_SIM_RING_SIZE)
+#define MQTT_SIM_RING_SIZE 65536 /* redefinable - bytes in flight each way, a power of 2 */
+#endif
+
+#if !defined(MQTT_SIM_SEGMENTS)
+#define MQTT_SIM_SEGMENTS 1024 /* redefinable - segments in flight each way, a power of 2 */
+#endif
+
+#if !defined(MQTT_SIM_MSS)
+#define MQTT_SIM_MSS 1460 /* redefinable - the most data one segment carries */
+#endif
+
+#if !defined(MQTT_SIM_PACKET_SIZE)
+#define MQTT_SIM_PACKET_SIZE 16384 /* redefinable - the largest packet the broker takes, or sends */
+#endif
+
+#if !defined(MQTT_SIM_SUBSCRIPTIONS)
+#define MQTT_SIM_SUBSCRIPTIONS 16 /* redefinable - topic filters the broker keeps for its client */
+#endif
+
+#if !defined(MQTT_SIM_TOPIC_SIZE)
+#define MQTT_SIM_TOPIC_SIZE 128 /* redefinable - the longest topic filter or client id kept, with its terminator */
+#endif
+
+/* How one direction of the connection behaves.  Data is cut into segments of MQTT_SIM_MSS, which
+ * leave one after another at the bandwidth, and arrive the latency later.  Jitter and retransmission
+ * let a segment arrive after the ones behind it, but like TCP the link delivers them in order, so
+ * those have to wait for it. */
+typedef struct SimLinkOptions
+{
+	unsigned int latency_us;      /* one way, for every segment */
+	unsigned int jitter_us;       /* up to this much longer, at random */
+	unsigned long bandwidth;      /* bytes per second, or 0 for no limit */
+	unsigned int loss_ppm;        /* segments lost in a million, each sent again after the retransmission timeout */
+	unsigned int rto_us;          /* the retransmission timeout, doubled each time the same segment is lost again */
+} SimLinkOptions;
+
+/* the defaults set by SimNetworkInit: instant, with nothing lost */
+#define SimLinkOptions_initializer {0, 0, 0, 0, 200000}
+
+typedef struct SimSegment
+{
+	unsigned long long arrival_us;
+	unsigned int end;             /* the ring position after its last byte */
+} SimSegment;
+
+/* One direction of the connection */
+typedef struct SimLink
+{
+	SimLinkOptions options;
+	unsigned char buf[MQTT_SIM_RING_SIZE];
+	SimSegment segments[MQTT_SIM_SEGMENTS];
+	unsigned int head,            /* where the next byte is taken from */
+	  delivered,                  /* the end of the data which has arrived */
+	  tail,                       /* where the next byte is put */
+	  seg_head, seg_tail;         /* the segments still in flight */
+	unsigned long long free_us,   /* when the data given to the link so far has all left */
+	  last_us,                    /* when the last segment arrives, which those after it can't arrive before */
+	  closed_us;                  /* when the end of the connection arrives, or ~0 */
+	unsigned long bytes,          /* sent over the link, in all */
+	  segments_sent,
+	  lost;                       /* of those, how many had to be sent again, counting each time */
+} SimLink;
+
+/* What the broker does with a packet, as a script decides */
+enum SimAction
+{
+	SIM_RESPOND,                  /* as a broker would, the same as having no script */
+	SIM_IGNORE,                   /* nothing: the script may have responded itself with SimNetworkSend */
+	SIM_CLOSE                     /* close the connection without responding */
+};
+
+struct SimNetwork;
+
+/* Called with each packet the broker receives, at the virtual time it arrives.
+ * @return a SimAction */
+typedef int (*SimScript)(struct SimNetwork*, unsigned char* packet, int len, void* context);
+
+typedef struct SimSubscription
+{
+	char topicFilter[MQTT_SIM_TOPIC_SIZE]; /* empty if the entry is free */
+	int qos;
+} SimSubscription;
+
+/* A Network to a simulated broker over a simulated link.  The broker answers CONNECT, SUBSCRIBE,
+ * UNSUBSCRIBE, PINGREQ and the QoS 1 and 2 flows, and sends each PUBLISH back if its topic matches
+ * one of the client's subscriptions.  It keeps one session, for the last client id to connect, while
+ * cleansession is 0.  A script can change what it does with any packet, to hold back
+ * acknowledgements, send them out of order or stop answering pings, say.
+ *
+ * The broker handles each packet when it arrives, as reading the client's network catches up with
+ * the virtual time.  If the data for the client would overflow the link, the broker closes the
+ * connection, as one does to a client which falls too far behind. */
+typedef struct SimNetwork
+{
+	Network net;                  /* give the client &s->net */
+	SimLink to_broker,
+	  to_client;
+	char connected;               /* connected, and not yet disconnected by the client */
+	char unreachable;             /* set to make SimNetworkConnect fail, as if the broker were down */
+	SimScript script;
+	void* script_context;
+	unsigned int seed;            /* for jitter and loss */
+	unsigned long long now_us;    /* the time the packet the broker is handling arrived */
+	char handling;
+	char clientID[MQTT_SIM_TOPIC_SIZE]; /* the session, kept between connections */
+	char session,                 /* subscriptions are being kept for clientID */
+	  cleansession;               /* and will be forgotten when this connection ends */
+	SimSubscription subscriptions[MQTT_SIM_SUBSCRIPTIONS];
+	unsigned short next_packetid; /* for publishes the broker sends */
+	unsigned char inbuf[MQTT_SIM_PACKET_SIZE],
+	  outbuf[MQTT_SIM_PACKET_SIZE];
+	int inlen,                    /* received so far of the next packet */
+	  packet_len;                 /* its length, or 0 until the remaining length has been read */
+	unsigned int connects,        /* successful calls to SimNetworkConnect */
+	  received[16];               /* packets the broker has had, by type */
+} SimNetwork;
+
+/** MQTT SimNetworkInit - initialize a simulated network object, with instant links and no session.
+ *  @param s - the network object to initialize
+ *  @param seed - for the random jitter and loss: the same seed gives the same run
+ */
+DLLExport void SimNetworkInit(SimNetwork* s, unsigned int seed);
+
+/** MQTT SimNetworkSetLinks - set how the links behave, for the data sent from now on.
+ *  @param s - the network object to use
+ *  @param to_broker - options for the link from the client, or NULL to leave them
+ *  @param to_client - options for the link from the broker, or NULL to leave them
+ */
+DLLExport void SimNetworkSetLinks(SimNetwork* s, SimLinkOptions* to_broker, SimLinkOptions* to_client);
+
+/** MQTT SimNetworkSetScript - set the script the broker follows.
+ *  @param s - the network object to use
+ *  @param script - called with each packet the broker receives, or NULL to respond to them all
+ *  @param context - passed to the script
+ */
+DLLExport void SimNetworkSetScript(SimNetwork* s, SimScript script, void* context);
+
+/** MQTT SimNetworkConnect - connect to the broker, which takes a round trip of virtual time.  Any
+ *  connection already made is closed first.
+ *  @param s - the network object to use
+ *  @return success code: FAILURE if the broker has been made unreachable
+ */
+DLLExport int SimNetworkConnect(SimNetwork* s);
+
+/** MQTT SimNetworkSend - send a packet from the broker to the client.  From a script, it leaves at
+ *  the time the packet being handled arrived, otherwise now.
+ *  @param s - the network object to use
+ *  @param packet - the serialized packet
+ *  @param len - its length
+ *  @return success code
+ */
+DLLExport int SimNetworkSend(SimNetwork* s, unsigned char* packet, int len);
+
+/** MQTT SimNetworkBreak - break the connection now, losing whatever is in flight, as when the broker
+ *  restarts.  The client finds out when it next reads or writes.
+ *  @param s - the network object to use
+ */
+DLLExport void SimNetworkBreak(SimNetwork* s);
+
+/** MQTT SimNetworkDisconnect - close the connection from the client's end.  The broker still gets
+ *  what was in flight, a DISCONNECT say, but sends nothing back.
+ *  @param s - the network object to use
+ */
+DLLExport void SimNetworkDisconnect(SimNetwork* s);
+
+#endif
@@ -22,14 +22,24 @@
 
 
 #include "MQTTClient.h"
+#include "MQTTEpoll.h"
+#include "MQTTDispatch.h"
+#include "MQTTGroup.h"
+#include "MQTTFilePersistence.h"
+#include "MQTTWalPersistence.h"
+#include "MQTTUring.h"
+#include "MQTTLoopback.h"
+#include "MQTTTLS.h"
 #include <string.h>
 #include <stdlib.h>
 
 #if !defined(_WINDOWS)
   #include <sys/time.h>
   #include <sys/socket.h>
+  #include <sys/wait.h>
   #include <unistd.h>
   #include <errno.h>
+  #include <signal.h>
 #else
   #include <windows.h>
   #define setenv(a, b, c) _putenv_s(a, b)
@@ -49,6 +59,8 @@ struct Options
   int port;
 	char* proxy_host;
   int proxy_port;
+	char* unix_path;    /**< a Unix domain socket the broker also listens on, if any */
+	int loopback;       /**< run what can run against the in-process responder, without a broker */
 	int verbose;
 	int test_no;
 	int MQTTVersion;
@@ -59,6 +71,8 @@ struct Options
   1883,
 	"localhost",
 	1885,
+	NULL,
+	0, //loopback
 	0, //verbose
 	0, //test_no
 	4,
@@ -118,6 +132,21 @@ void getopts(int argc, char** argv)
       else
         usage();
     }
+		else if (strcmp(argv[count], "--unix_path") == 0)
+		{
+			if (++count < argc)
+			{
+				options.unix_path = argv[count];
+				printf("\nSetting unix_path to %s\n", options.unix_path);
+			}
+			else
+				usage();
+		}
+		else if (strcmp(argv[count], "--loopback") == 0)
+		{
+			options.loopback = 1;
+			printf("\nSetting loopback on\n");
+		}
 		else if (strcmp(argv[count], "--MQTTversion") == 0)
 		{
 			if (++count < argc)
@@ -280,6 +309,42 @@ void myassert(char* filename, int lineno, char* description, int value, char* fo
 }
 
 
+/* The network for tests which need nothing more than an echo of what they publish: TCP to the
+ * broker, or with --loopback the in-process responder, so that they can run offline */
+static Network test_tcp;
+static LoopbackNetwork test_loopback;
+
+Network* testNetworkInit(void)
+{
+  if (options.loopback)
+  {
+    if (test_loopback.net.mqttread != NULL)
+      LoopbackNetworkDisconnect(&test_loopback); /* in case the last test left it connected */
+    LoopbackNetworkInit(&test_loopback);
+    return &test_loopback.net;
+  }
+  NetworkInit(&test_tcp);
+  return &test_tcp;
+}
+
+
+int testNetworkConnect(Network* n)
+{
+  if (options.loopback)
+    return LoopbackNetworkConnect(&test_loopback);
+  return NetworkConnect(n, options.host, options.port);
+}
+
+
+void testNetworkDisconnect(Network* n)
+{
+  if (options.loopback)
+    LoopbackNetworkDisconnect(&test_loopback);
+  else
+    NetworkDisconnect(n);
+}
+
+
 static volatile MessageData* test1_message_data = NULL;
 static MQTTMessage pubmsg;
 
@@ -349,7 +414,7 @@ void test1_sendAndReceive(MQTTClient* c, int qos, char* test_topic)
 int test1(struct Options options)
 {
 	int subsqos = 2;
-  Network n;
+  Network* n = testNetworkInit();
 	MQTTClient c;
 	int rc = 0;
 	char* test_topic = "C client test1";
@@ -363,9 +428,8 @@ int test1(struct Options options)
 	failures = 0;
 	MyLog(LOGA_INFO, "Starting test 1 - single threaded client using receive");
 
-  NetworkInit(&n);
-  NetworkConnect(&n, options.host, options.port);
-  MQTTClientInit(&c, &n, 1000, buf, 100, readbuf, 100);
+  testNetworkConnect(n);
+  MQTTClientInit(&c, n, 1000, buf, 100, readbuf, 100);
 
   MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
   data.willFlag = 1;
@@ -403,11 +467,12 @@ int test1(struct Options options)
 	assert("Disconnect successful", rc == SUCCESS, "rc was %d", rc);
 
 	/* Just to make sure we can connect again */
-  NetworkConnect(&n, options.host, options.port);
+  testNetworkConnect(n);
   rc = MQTTConnect(&c, &data);
 	assert("Connect successful",  rc == SUCCESS, "rc was %d", rc);
 	rc = MQTTDisconnect(&c);
 	assert("Disconnect successful", rc == SUCCESS, "rc was %d", rc);
+  testNetworkDisconnect(n);
 
 exit:
 	MyLog(LOGA_INFO, "TEST1: test %s. %d tests run, %d failures.",
@@ -427,7 +492,7 @@ sessionPresent
 int test2(struct Options options)
 {
 	int subsqos = 2;
-  Network n;
+  Network* n = testNetworkInit();
 	MQTTClient c;
 	int rc = 0;
 	char* test_topic = "C client test2";
@@ -442,9 +507,8 @@ int test2(struct Options options)
 	failures = 0;
 	MyLog(LOGA_INFO, "Starting test 2 - connack return data");
 
-  NetworkInit(&n);
-  NetworkConnect(&n, options.host, options.port);
-  MQTTClientInit(&c, &n, 1000, buf, 100, readbuf, 100);
+  testNetworkConnect(n);
+  MQTTClientInit(&c, n, 1000, buf, 100, readbuf, 100);
 
   MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
   data.willFlag = 1;
@@ -469,10 +533,10 @@ int test2(struct Options options)
 
 	rc = MQTTDisconnect(&c);
 	assert("Disconnect successful", rc == SUCCESS, "rc was %d", rc);
-  NetworkDisconnect(&n);
+  testNetworkDisconnect(n);
 
   /* now connect cleansession false */
-  NetworkConnect(&n, options.host, options.port);
+  testNetworkConnect(n);
   data.cleansession = 0;
   rc = MQTTConnectWithResults(&c, &data, &connack);
   assert("Good rc from connect", rc == SUCCESS, "rc was %d", rc);
@@ -489,10 +553,10 @@ int test2(struct Options options)
 
   rc = MQTTDisconnect(&c);
   assert("Disconnect successful", rc == SUCCESS, "rc was %d", rc);
-  NetworkDisconnect(&n);
+  testNetworkDisconnect(n);
 
 	/* Connect and check sessionPresent */
-  NetworkConnect(&n, options.host, options.port);
+  testNetworkConnect(n);
   rc = MQTTConnectWithResults(&c, &data, &connack);
 	assert("Connect successful",  rc == SUCCESS, "rc was %d", rc);
 
@@ -502,11 +566,11 @@ int test2(struct Options options)
 
 	rc = MQTTDisconnect(&c);
 	assert("Disconnect successful", rc == SUCCESS, "rc was %d", rc);
-  NetworkDisconnect(&n);
+  testNetworkDisconnect(n);
 
   /* Connect and check sessionPresent is cleared */
   data.cleansession = 1;
-  NetworkConnect(&n, options.host, options.port);
+  testNetworkConnect(n);
   rc = MQTTConnectWithResults(&c, &data, &connack);
   assert("Connect successful",  rc == SUCCESS, "rc was %d", rc);
 
@@ -516,7 +580,7 @@ int test2(struct Options options)
 
   rc = MQTTDisconnect(&c);
   assert("Disconnect successful", rc == SUCCESS, "rc was %d", rc);
-  NetworkDisconnect(&n);
+  testNetworkDisconnect(n);
 
 exit:
 	MyLog(LOGA_INFO, "TEST1: test %s. %d tests run, %d failures.",
@@ -599,6 +663,12 @@ int test3(struct Options options)
   failures = 0;
   MyLog(LOGA_INFO, "Starting test 3 - session state");
 
+  if (options.loopback)
+  {
+    MyLog(LOGA_INFO, "Needs a broker, skipping with --loopback");
+    goto exit;
+  }
+
   NetworkInit(&n);
   MQTTClientInit(&c, &n, 1000, buf, 100, readbuf, 100);
 
@@ -764,202 +834,3008 @@ exit:
   return failures;
 }
 
-#if 0
 /*********************************************************************
 
-Test 4: connectionLost and will message
+Test 4: write coalescing
 
 *********************************************************************/
-MQTTClient test6_c1, test6_c2;
-volatile int test6_will_message_arrived = 0;
-volatile int test6_connection_lost_called = 0;
+static int test4_arrived = 0;
+static int test4_in_order = 1;
 
-void test6_connectionLost(void* context, char* cause)
+void test4_messageArrived(MessageData* md)
 {
-	MQTTClient c = (MQTTClient)context;
-	printf("%s -> Callback: connection lost\n", (c == test6_c1) ? "Client-1" : "Client-2");
-	test6_connection_lost_called = 1;
-}
+  char expected[20];
 
-void test6_deliveryComplete(void* context, MQTTClient_deliveryToken token)
-{
-	printf("Client-2 -> Callback: publish complete for token %d\n", token);
+  sprintf(expected, "coalesce %d", test4_arrived++);
+  if (md->message->payloadlen != strlen(expected) ||
+      memcmp(md->message->payload, expected, md->message->payloadlen) != 0)
+    test4_in_order = 0;
 }
 
-char* test6_will_topic = "C Test 2: will topic";
-char* test6_will_message = "will message from Client-1";
 
-int test6_messageArrived(void* context, char* topicName, int topicLen, MQTTClient_message* m)
+int test4(struct Options options)
 {
-	MQTTClient c = (MQTTClient)context;
-	printf("%s -> Callback: message received on topic '%s' is '%.*s'.\n",
-			 (c == test6_c1) ? "Client-1" : "Client-2", topicName, m->payloadlen, (char*)(m->payload));
-	if (c == test6_c2 && strcmp(topicName, test6_will_topic) == 0 && memcmp(m->payload, test6_will_message, m->payloadlen) == 0)
-		test6_will_message_arrived = 1;
-	MQTTClient_free(topicName);
-	MQTTClient_freeMessage(&m);
-	return 1;
-}
+  Network* n = testNetworkInit();
+  MQTTClient c;
+  int rc = 0;
+  int i = 0;
+  char* test_topic = "C client test4";
+  char payload[20];
+  unsigned char buf[100];
+  unsigned char readbuf[100];
+  unsigned char coalescebuf[1000];
+  int wait_seconds = 0;
+#if defined(MQTT_TASK)
+  START_TIME_TYPE start;
+#endif
 
+  fprintf(xml, "<testcase classname=\"test4\" name=\"write coalescing\"");
+  global_start_time = start_clock();
+  failures = 0;
+  MyLog(LOGA_INFO, "Starting test 4 - write coalescing");
 
-int test6(struct Options options)
-{
-	char* testname = "test6";
-	MQTTClient_connectOptions opts = MQTTClient_connectOptions_initializer;
-	MQTTClient_willOptions wopts =  MQTTClient_willOptions_initializer;
-	MQTTClient_connectOptions opts2 = MQTTClient_connectOptions_initializer;
-	int rc, count;
-	char* mqttsas_topic = "MQTTSAS topic";
+  rc = testNetworkConnect(n);
+  assert("Good rc from TCP connect", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto exit;
+  MQTTClientInit(&c, n, 1000, buf, 100, readbuf, 100);
 
-	failures = 0;
-	MyLog(LOGA_INFO, "Starting test 6 - connectionLost and will messages");
-	fprintf(xml, "<testcase classname=\"test1\" name=\"connectionLost and will messages\"");
-	global_start_time = start_clock();
+  MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+  data.MQTTVersion = options.MQTTVersion;
+  data.clientID.cstring = "write-coalescing-test";
+  data.keepAliveInterval = 20;
+  data.cleansession = 1;
 
-	opts.keepAliveInterval = 2;
-	opts.cleansession = 1;
-	opts.MQTTVersion = MQTTVERSION_3_1_1;
-	opts.will = &wopts;
-	opts.will->message = test6_will_message;
-	opts.will->qos = 1;
-	opts.will->retained = 0;
-	opts.will->topicName = test6_will_topic;
-	if (options.haconnections != NULL)
-	{
-		opts.serverURIs = options.haconnections;
-		opts.serverURIcount = options.hacount;
-	}
+  rc = MQTTConnect(&c, &data);
+  assert("Good rc from connect", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto exit;
 
-	/* Client-1 with Will options */
-	rc = MQTTClient_create(&test6_c1, options.proxy_connection, "Client_1", MQTTCLIENT_PERSISTENCE_DEFAULT, NULL);
-	assert("good rc from create", rc == MQTTCLIENT_SUCCESS, "rc was %d\n", rc);
-	if (rc != MQTTCLIENT_SUCCESS)
-		goto exit;
+  rc = MQTTSubscribe(&c, test_topic, QOS0, test4_messageArrived);
+  assert("Good rc from subscribe", rc == SUCCESS, "rc was %d", rc);
 
-	rc = MQTTClient_setCallbacks(test6_c1, (void*)test6_c1, test6_connectionLost, test6_messageArrived, test6_deliveryComplete);
-	assert("good rc from setCallbacks",  rc == MQTTCLIENT_SUCCESS, "rc was %d\n", rc);
-	if (rc != MQTTCLIENT_SUCCESS)
-		goto exit;
+  rc = MQTTSetWriteCoalescing(&c, coalescebuf, sizeof(coalescebuf), 5000);
+  assert("Good rc from set write coalescing", rc == SUCCESS, "rc was %d", rc);
 
-	/* Connect to the broker */
-	rc = MQTTClient_connect(test6_c1, &opts);
-	assert("good rc from connect",  rc == MQTTCLIENT_SUCCESS, "rc was %d\n", rc);
-	if (rc != MQTTCLIENT_SUCCESS)
-		goto exit;
+  memset(&pubmsg, '\0', sizeof(pubmsg));
+  pubmsg.payload = payload;
+  pubmsg.qos = QOS0;
+  for (i = 0; i < 100; ++i)
+  {
+    sprintf(payload, "coalesce %d", i);
+    pubmsg.payloadlen = strlen(payload);
+    if (i == 50)
+      pubmsg.qos = QOS1; /* a blocking publish has to take the coalesced ones with it */
+    rc = MQTTPublish(&c, test_topic, &pubmsg);
+    assert("Good rc from publish", rc == SUCCESS, "rc was %d", rc);
+    pubmsg.qos = QOS0;
+  }
 
-	/* Client - 2 (multi-threaded) */
-	rc = MQTTClient_create(&test6_c2, options.connection, "Client_2", MQTTCLIENT_PERSISTENCE_DEFAULT, NULL);
-	assert("good rc from create",  rc == MQTTCLIENT_SUCCESS, "rc was %d\n", rc);
+  wait_seconds = 50;
+  while (test4_arrived < 100 && wait_seconds-- > 0)
+    MQTTYield(&c, 100);
+  assert("All messages arrived", test4_arrived == 100, "arrived was %d", test4_arrived);
+  assert("Messages arrived in order", test4_in_order == 1, "in order was %d", test4_in_order);
+
+#if defined(MQTT_TASK)
+  /* a lone publish, with nothing after it to take it out: the reader thread writes it within the budget */
+  rc = MQTTStartTask(&c);
+  assert("Good rc from start task", rc == SUCCESS, "rc was %d", rc);
+  MQTTYield(&c, 100); /* the reader is waiting for data */
+  start = start_clock();
+  sprintf(payload, "coalesce %d", i);
+  pubmsg.payloadlen = strlen(payload);
+  rc = MQTTPublish(&c, test_topic, &pubmsg);
+  assert("Good rc from publish", rc == SUCCESS, "rc was %d", rc);
+  while (test4_arrived < 101 && elapsed(start) < 5000)
+    MQTTYield(&c, 1);
+  assert("The lone message arrived", test4_arrived == 101, "arrived was %d", test4_arrived);
+  assert("Written by the reader within the budget", elapsed(start) < 200, "took %ld ms", elapsed(start));
+  MQTTStopTask(&c);
+#endif
 
-	/* Set the callback functions for the client */
-	rc = MQTTClient_setCallbacks(test6_c2, (void*)test6_c2, test6_connectionLost, test6_messageArrived, test6_deliveryComplete);
-	assert("good rc from setCallbacks",  rc == MQTTCLIENT_SUCCESS, "rc was %d\n", rc);
+  rc = MQTTSetWriteCoalescing(&c, NULL, 0, 0);
+  assert("Good rc from set write coalescing", rc == SUCCESS, "rc was %d", rc);
 
-	/* Connect to the broker */
-	opts2.keepAliveInterval = 20;
-	opts2.cleansession = 1;
-	MyLog(LOGA_INFO, "Connecting Client_2 ...");
-	rc = MQTTClient_connect(test6_c2, &opts2);
-	assert("Good rc from connect", rc == MQTTCLIENT_SUCCESS, "rc was %d\n", rc);
+  rc = MQTTDisconnect(&c);
+  assert("Disconnect successful", rc == SUCCESS, "rc was %d", rc);
+  testNetworkDisconnect(n);
 
-	rc = MQTTClient_subscribe(test6_c2, test6_will_topic, 2);
-	assert("Good rc from subscribe", rc == MQTTCLIENT_SUCCESS, "rc was %d\n", rc);
+exit:
+  MyLog(LOGA_INFO, "TEST4: test %s. %d tests run, %d failures.",
+      (failures == 0) ? "passed" : "failed", tests, failures);
+  write_test_result();
+  return failures;
+}
 
-	/* now send the command which will break the connection and cause the will message to be sent */
-	rc = MQTTClient_publish(test6_c1, mqttsas_topic, (int)strlen("TERMINATE"), "TERMINATE", 0, 0, NULL);
-	assert("Good rc from publish", rc == MQTTCLIENT_SUCCESS, "rc was %d\n", rc);
+/*********************************************************************
 
-	MyLog(LOGA_INFO, "Waiting to receive the will message");
-	count = 0;
-	while (++count < 40)
-	{
-		#if defined(WIN32)
-			Sleep(1000L);
-		#else
-			sleep(1);
-		#endif
-		if (test6_will_message_arrived == 1 && test6_connection_lost_called == 1)
-			break;
-	}
-	assert("will message arrived", test6_will_message_arrived == 1,
-							"will_message_arrived was %d\n", test6_will_message_arrived);
-	assert("connection lost called", test6_connection_lost_called == 1,
-			         "connection_lost_called %d\n", test6_connection_lost_called);
+Test 5: many clients served by one epoll event loop
 
-	rc = MQTTClient_unsubscribe(test6_c2, test6_will_topic);
-	assert("Good rc from unsubscribe", rc == MQTTCLIENT_SUCCESS, "rc was %d", rc);
+*********************************************************************/
+#define TEST5_CLIENTS 20
+#define TEST5_MESSAGES 10
+static int test5_arrived = 0;
+static int test5_disconnected = 0;
 
-	rc = MQTTClient_isConnected(test6_c2);
-	assert("Client-2 still connected", rc == 1, "isconnected is %d", rc);
+void test5_messageArrived(MessageData* md)
+{
+  ++test5_arrived;
+}
 
-	rc = MQTTClient_isConnected(test6_c1);
-	assert("Client-1 not connected", rc == 0, "isconnected is %d", rc);
 
-	rc = MQTTClient_disconnect(test6_c2, 100L);
-	assert("Good rc from disconnect", rc == MQTTCLIENT_SUCCESS, "rc was %d", rc);
+void test5_disconnected_handler(MQTTClient* c, void* context)
+{
+  ++test5_disconnected;
+  NetworkDisconnect(c->ipstack);
+}
 
-	MQTTClient_destroy(&test6_c1);
-	MQTTClient_destroy(&test6_c2);
 
-exit:
-	MyLog(LOGA_INFO, "%s: test %s. %d tests run, %d failures.\n",
-			(failures == 0) ? "passed" : "failed", testname, tests, failures);
-	write_test_result();
-	return failures;
+static int test5_reconnects = 0;
+
+int test5_reconnect(Network* n, void* context)
+{
+  struct Options* o = (struct Options*)context;
+
+  NetworkDisconnect(n);
+  if (++test5_reconnects == 1)
+    return FAILURE; /* so that the client backs off first, still in the loop */
+  return NetworkConnect(n, o->host, o->port);
 }
 
 
-int test6a(struct Options options)
+int test5(struct Options options)
 {
-	char* testname = "test6a";
-	MQTTClient_connectOptions opts = MQTTClient_connectOptions_initializer;
-	MQTTClient_willOptions wopts =  MQTTClient_willOptions_initializer;
-	MQTTClient_connectOptions opts2 = MQTTClient_connectOptions_initializer;
-	int rc, count;
-	char* mqttsas_topic = "MQTTSAS topic";
+  MQTTEpoll e;
+  Network n[TEST5_CLIENTS];
+  MQTTClient c[TEST5_CLIENTS];
+  unsigned char buf[TEST5_CLIENTS][100];
+  unsigned char readbuf[TEST5_CLIENTS][100];
+  char clientid[TEST5_CLIENTS][30];
+  char* test_topic = "C client test5";
+  char payload[20];
+  Timer idle;
+  MQTTPacket_connectData reconnect_data = MQTTPacket_connectData_initializer;
+  int connected = 0;
+  int rc = 0;
+  int i = 0;
+  int wait_count = 0;
+
+  fprintf(xml, "<testcase classname=\"test5\" name=\"epoll event loop\"");
+  global_start_time = start_clock();
+  failures = 0;
+  MyLog(LOGA_INFO, "Starting test 5 - epoll event loop");
 
-	failures = 0;
-	MyLog(LOGA_INFO, "Starting test 6 - connectionLost and binary will messages");
-	fprintf(xml, "<testcase classname=\"test1\" name=\"connectionLost and binary will messages\"");
-	global_start_time = start_clock();
+  if (options.loopback)
+  {
+    MyLog(LOGA_INFO, "Needs a broker, skipping with --loopback");
+    goto skip;
+  }
 
-	opts.keepAliveInterval = 2;
-	opts.cleansession = 1;
-	opts.MQTTVersion = MQTTVERSION_3_1_1;
-	opts.will = &wopts;
-	opts.will->payload.data = test6_will_message;
-	opts.will->payload.len = strlen(test6_will_message) + 1;
-	opts.will->qos = 1;
-	opts.will->retained = 0;
-	opts.will->topicName = test6_will_topic;
-	if (options.haconnections != NULL)
-	{
-		opts.serverURIs = options.haconnections;
-		opts.serverURIcount = options.hacount;
-	}
+  test5_arrived = test5_disconnected = test5_reconnects = 0;
+  rc = MQTTEpollInit(&e, test5_disconnected_handler, NULL);
+  assert("Good rc from epoll init", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto exit;
 
-	/* Client-1 with Will options */
-	rc = MQTTClient_create(&test6_c1, options.proxy_connection, "Client_1", MQTTCLIENT_PERSISTENCE_DEFAULT, NULL);
-	assert("good rc from create", rc == MQTTCLIENT_SUCCESS, "rc was %d\n", rc);
-	if (rc != MQTTCLIENT_SUCCESS)
-		goto exit;
+  for (connected = 0; connected < TEST5_CLIENTS; ++connected)
+  {
+    MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+
+    i = connected;
+    NetworkInit(&n[i]);
+    rc = NetworkConnect(&n[i], options.host, options.port);
+    assert("Good rc from TCP connect", rc == SUCCESS, "rc was %d", rc);
+    if (rc != SUCCESS)
+      break;
+    MQTTClientInit(&c[i], &n[i], 1000, buf[i], 100, readbuf[i], 100);
+
+    sprintf(clientid[i], "epoll-test-%d", i);
+    data.MQTTVersion = options.MQTTVersion;
+    data.clientID.cstring = clientid[i];
+    data.keepAliveInterval = 2;
+    data.cleansession = 1;
+    rc = MQTTConnect(&c[i], &data);
+    assert("Good rc from connect", rc == SUCCESS, "rc was %d", rc);
+    if (rc == SUCCESS)
+      rc = MQTTSubscribe(&c[i], test_topic, QOS0, test5_messageArrived);
+    assert("Good rc from subscribe", rc == SUCCESS, "rc was %d", rc);
+    if (rc == SUCCESS)
+      rc = MQTTEpollAdd(&e, &c[i]);
+    assert("Good rc from epoll add", rc == SUCCESS, "rc was %d", rc);
+    if (rc != SUCCESS)
+    {
+      NetworkDisconnect(&n[i]);
+      break;
+    }
+  }
+  if (rc != SUCCESS)
+    goto exit;
 
-	rc = MQTTClient_setCallbacks(test6_c1, (void*)test6_c1, test6_connectionLost, test6_messageArrived, test6_deliveryComplete);
-	assert("good rc from setCallbacks",  rc == MQTTCLIENT_SUCCESS, "rc was %d\n", rc);
-	if (rc != MQTTCLIENT_SUCCESS)
-		goto exit;
+  memset(&pubmsg, '\0', sizeof(pubmsg));
+  pubmsg.payload = payload;
+  pubmsg.qos = QOS0;
+  for (i = 0; i < TEST5_MESSAGES; ++i)
+  {
+    sprintf(payload, "epoll %d", i);
+    pubmsg.payloadlen = strlen(payload);
+    rc = MQTTPublish(&c[i % TEST5_CLIENTS], test_topic, &pubmsg);
+    assert("Good rc from publish", rc == SUCCESS, "rc was %d", rc);
+  }
 
-	/* Connect to the broker */
-	rc = MQTTClient_connect(test6_c1, &opts);
-	assert("good rc from connect",  rc == MQTTCLIENT_SUCCESS, "rc was %d\n", rc);
-	if (rc != MQTTCLIENT_SUCCESS)
-		goto exit;
+  /* for as long, not as many runs: each returns as soon as any client has something to read */
+  TimerInit(&idle);
+  TimerCountdown(&idle, 5);
+  while (test5_arrived < TEST5_CLIENTS * TEST5_MESSAGES && !TimerIsExpired(&idle))
+    MQTTEpollRun(&e, 100);
+  assert("All messages arrived", test5_arrived == TEST5_CLIENTS * TEST5_MESSAGES,
+      "arrived was %d", test5_arrived);
+
+  MyLog(LOGA_INFO, "Idling for longer than the keepalive interval");
+  TimerInit(&idle);
+  TimerCountdown(&idle, 5);
+  while (!TimerIsExpired(&idle))
+    MQTTEpollRun(&e, -1); /* no timeout: the keepalive deadlines wake it */
+  assert("Keepalive kept all clients connected", e.count == TEST5_CLIENTS, "count was %d", e.count);
+  assert("No clients were disconnected", test5_disconnected == 0, "disconnected was %d", test5_disconnected);
+
+  /* a closed connection is reported through the callback */
+  shutdown(n[0].my_socket, SHUT_RDWR);
+  wait_count = 50;
+  while (test5_disconnected == 0 && wait_count-- > 0)
+    MQTTEpollRun(&e, 100);
+  assert("Closed connection reported", test5_disconnected == 1, "disconnected was %d", test5_disconnected);
+  assert("Closed connection removed", e.count == TEST5_CLIENTS - 1, "count was %d", e.count);
+
+  /* a client which reconnects by itself stays in the loop, which watches its new socket */
+  reconnect_data.MQTTVersion = options.MQTTVersion;
+  reconnect_data.clientID.cstring = clientid[1];
+  reconnect_data.keepAliveInterval = 2;
+  reconnect_data.cleansession = 1; /* so it has to subscribe again */
+  rc = MQTTSetAutoReconnect(&c[1], &reconnect_data, test5_reconnect, &options, 100, 2000);
+  assert("Good rc from set auto reconnect", rc == SUCCESS, "rc was %d", rc);
+  shutdown(n[1].my_socket, SHUT_RDWR);
+  wait_count = 50;
+  while ((test5_reconnects < 2 || !MQTTIsConnected(&c[1])) && wait_count-- > 0)
+    MQTTEpollRun(&e, 100);
+  assert("Reconnected, after backing off", test5_reconnects == 2 && MQTTIsConnected(&c[1]),
+      "reconnects were %d", test5_reconnects);
+  assert("Reconnecting client kept", e.count == TEST5_CLIENTS - 1, "count was %d", e.count);
+  assert("Reconnecting client not reported", test5_disconnected == 1, "disconnected was %d", test5_disconnected);
+
+  test5_arrived = 0;
+  sprintf(payload, "epoll reconnected");
+  pubmsg.payloadlen = strlen(payload);
+  rc = MQTTPublish(&c[1], test_topic, &pubmsg); /* after its subscribe, on the same connection */
+  assert("Good rc from publish", rc == SUCCESS, "rc was %d", rc);
+  wait_count = 50;
+  while (test5_arrived < TEST5_CLIENTS - 1 && wait_count-- > 0)
+    MQTTEpollRun(&e, 100);
+  assert("Message arrived at every client, over the new socket too", test5_arrived == TEST5_CLIENTS - 1,
+      "arrived was %d", test5_arrived);
 
-	/* Client - 2 (multi-threaded) */
-	rc = MQTTClient_create(&test6_c2, options.connection, "Client_2", MQTTCLIENT_PERSISTENCE_DEFAULT, NULL);
-	assert("good rc from create",  rc == MQTTCLIENT_SUCCESS, "rc was %d\n", rc);
+exit:
+  for (i = 0; i < connected; ++i)
+  {
+    if (!MQTTIsConnected(&c[i]))
+      continue;
+    MQTTEpollRemove(&e, &c[i]);
+    rc = MQTTDisconnect(&c[i]);
+    assert("Disconnect successful", rc == SUCCESS, "rc was %d", rc);
+    NetworkDisconnect(&n[i]);
+  }
+  MQTTEpollClose(&e);
 
-	/* Set the callback functions for the client */
+skip:
+  MyLog(LOGA_INFO, "TEST5: test %s. %d tests run, %d failures.",
+      (failures == 0) ? "passed" : "failed", tests, failures);
+  write_test_result();
+  return failures;
+}
+
+#if defined(MQTT_TASK)
+/*********************************************************************
+
+Test 6: background reader thread, with API calls from several threads
+
+*********************************************************************/
+#define TEST6_THREADS 4
+#define TEST6_MESSAGES 10
+static int test6_arrived = 0;
+
+void test6_messageArrived(MessageData* md)
+{
+  ++test6_arrived; /* only called on the reader thread */
+}
+
+
+struct test6_publisher
+{
+  MQTTClient* c;
+  int id;
+  int failures;
+};
+
+void test6_publish(void* parm)
+{
+  struct test6_publisher* p = (struct test6_publisher*)parm;
+  MQTTMessage msg;
+  char payload[30];
+  int i = 0;
+
+  memset(&msg, '\0', sizeof(msg));
+  msg.payload = payload;
+  for (i = 0; i < TEST6_MESSAGES; ++i)
+  {
+    sprintf(payload, "thread %d message %d", p->id, i);
+    msg.payloadlen = strlen(payload);
+    msg.qos = (i % 2) ? QOS2 : QOS1;
+    if (MQTTPublish(p->c, "C client test6", &msg) != SUCCESS)
+      p->failures++;
+  }
+}
+
+
+int test6(struct Options options)
+{
+  Network* n = testNetworkInit();
+  MQTTClient c;
+  Thread threads[TEST6_THREADS];
+  struct test6_publisher publishers[TEST6_THREADS];
+  int rc = 0;
+  int i = 0;
+  char* test_topic = "C client test6";
+  unsigned char buf[100];
+  unsigned char readbuf[100];
+  int wait_seconds = 0;
+  START_TIME_TYPE start;
+
+  fprintf(xml, "<testcase classname=\"test6\" name=\"background reader thread\"");
+  global_start_time = start_clock();
+  failures = 0;
+  MyLog(LOGA_INFO, "Starting test 6 - background reader thread");
+
+  test6_arrived = 0;
+  rc = testNetworkConnect(n);
+  assert("Good rc from TCP connect", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto exit;
+  MQTTClientInit(&c, n, 1000, buf, 100, readbuf, 100);
+
+  rc = MQTTStartTask(&c);
+  assert("Good rc from start task", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto exit;
+
+  MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+  data.MQTTVersion = options.MQTTVersion;
+  data.clientID.cstring = "reader-thread-test";
+  data.keepAliveInterval = 20;
+  data.cleansession = 1;
+
+  rc = MQTTConnect(&c, &data);
+  assert("Good rc from connect", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto stop;
+
+  rc = MQTTSubscribe(&c, test_topic, QOS2, test6_messageArrived);
+  assert("Good rc from subscribe", rc == SUCCESS, "rc was %d", rc);
+
+  for (i = 0; i < TEST6_THREADS; ++i)
+  {
+    publishers[i].c = &c;
+    publishers[i].id = i;
+    publishers[i].failures = 0;
+    rc = ThreadStart(&threads[i], test6_publish, &publishers[i]);
+    assert("Good rc from thread start", rc == SUCCESS, "rc was %d", rc);
+  }
+  for (i = 0; i < TEST6_THREADS; ++i)
+  {
+    ThreadJoin(&threads[i]);
+    assert("All publishes succeeded", publishers[i].failures == 0, "failures was %d", publishers[i].failures);
+  }
+
+  wait_seconds = 50;
+  while (test6_arrived < TEST6_THREADS * TEST6_MESSAGES && wait_seconds-- > 0)
+    MQTTYield(&c, 100);
+  assert("All messages arrived", test6_arrived == TEST6_THREADS * TEST6_MESSAGES,
+      "arrived was %d", test6_arrived);
+
+  /* the reader thread is now waiting for data, which must not hold up a publish */
+  MQTTYield(&c, 100);
+  memset(&pubmsg, '\0', sizeof(pubmsg));
+  pubmsg.payload = "not held up";
+  pubmsg.payloadlen = strlen(pubmsg.payload);
+  pubmsg.qos = QOS0;
+  start = start_clock();
+  rc = MQTTPublish(&c, test_topic, &pubmsg);
+  assert("Good rc from publish", rc == SUCCESS, "rc was %d", rc);
+  assert("Publish not held up by the reader thread", elapsed(start) < 100, "elapsed was %ld ms", elapsed(start));
+
+  rc = MQTTUnsubscribe(&c, test_topic);
+  assert("Unsubscribe successful", rc == SUCCESS, "rc was %d", rc);
+  rc = MQTTDisconnect(&c);
+  assert("Disconnect successful", rc == SUCCESS, "rc was %d", rc);
+
+stop:
+  rc = MQTTStopTask(&c);
+  assert("Good rc from stop task", rc == SUCCESS, "rc was %d", rc);
+  testNetworkDisconnect(n);
+
+exit:
+  MyLog(LOGA_INFO, "TEST6: test %s. %d tests run, %d failures.",
+      (failures == 0) ? "passed" : "failed", tests, failures);
+  write_test_result();
+  return failures;
+}
+
+
+#if defined(MQTT_PUBLISH_QUEUE)
+/*********************************************************************
+
+Test 7: QoS 0 publishes from several threads through the lock-free queue
+
+*********************************************************************/
+#define TEST7_THREADS 4
+#define TEST7_MESSAGES 500
+static int test7_arrived = 0;
+static int test7_next[TEST7_THREADS];
+static int test7_out_of_order = 0;
+
+void test7_messageArrived(MessageData* md)
+{
+  int producer = -1, seq = -1;
+  char payload[30];
+
+  snprintf(payload, sizeof(payload), "%.*s", (int)md->message->payloadlen, (char*)md->message->payload);
+  if (sscanf(payload, "producer %d message %d", &producer, &seq) != 2 ||
+      producer < 0 || producer >= TEST7_THREADS || seq != test7_next[producer])
+    ++test7_out_of_order;
+  else
+    ++test7_next[producer];
+  ++test7_arrived;
+}
+
+
+void test7_produce(void* parm)
+{
+  struct test6_publisher* p = (struct test6_publisher*)parm;
+  MQTTMessage msg;
+  char payload[30];
+  int i = 0;
+
+  memset(&msg, '\0', sizeof(msg));
+  msg.payload = payload;
+  msg.qos = QOS0;
+  for (i = 0; i < TEST7_MESSAGES; ++i)
+  {
+    Timer timer;
+    int rc;
+
+    sprintf(payload, "producer %d message %d", p->id, i);
+    msg.payloadlen = strlen(payload);
+    TimerInit(&timer);
+    TimerCountdown(&timer, 5);
+    while ((rc = MQTTEnqueuePublish(p->c, "C client test7", &msg)) == FAILURE && !TimerIsExpired(&timer))
+      ; /* the queue is full, so wait for it to be written out */
+    if (rc != SUCCESS)
+      p->failures++;
+  }
+}
+
+
+int test7(struct Options options)
+{
+  Network* n = testNetworkInit();
+  MQTTClient c;
+  Thread threads[TEST7_THREADS];
+  struct test6_publisher producers[TEST7_THREADS];
+  int rc = 0;
+  int i = 0;
+  char* test_topic = "C client test7";
+  unsigned char buf[1000];
+  unsigned char readbuf[100];
+  unsigned char queuebuf[256 * 64];
+  int wait_seconds = 0;
+
+  fprintf(xml, "<testcase classname=\"test7\" name=\"publish queue\"");
+  global_start_time = start_clock();
+  failures = 0;
+  MyLog(LOGA_INFO, "Starting test 7 - publish queue");
+
+  test7_arrived = test7_out_of_order = 0;
+  memset(test7_next, '\0', sizeof(test7_next));
+  rc = testNetworkConnect(n);
+  assert("Good rc from TCP connect", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto exit;
+  MQTTClientInit(&c, n, 1000, buf, sizeof(buf), readbuf, sizeof(readbuf));
+
+  rc = MQTTSetPublishQueue(&c, queuebuf, sizeof(queuebuf), 64);
+  assert("Good rc from set publish queue", rc == SUCCESS, "rc was %d", rc);
+
+  rc = MQTTStartTask(&c);
+  assert("Good rc from start task", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto exit;
+
+  MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+  data.MQTTVersion = options.MQTTVersion;
+  data.clientID.cstring = "publish-queue-test";
+  data.keepAliveInterval = 20;
+  data.cleansession = 1;
+
+  rc = MQTTConnect(&c, &data);
+  assert("Good rc from connect", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto stop;
+
+  rc = MQTTSubscribe(&c, test_topic, QOS0, test7_messageArrived);
+  assert("Good rc from subscribe", rc == SUCCESS, "rc was %d", rc);
+
+  memset(&pubmsg, '\0', sizeof(pubmsg));
+  pubmsg.payload = "too large for a queue slot, which holds 64 bytes including its header";
+  pubmsg.payloadlen = strlen(pubmsg.payload);
+  pubmsg.qos = QOS0;
+  rc = MQTTEnqueuePublish(&c, test_topic, &pubmsg);
+  assert("Buffer overflow from enqueue", rc == BUFFER_OVERFLOW, "rc was %d", rc);
+  pubmsg.qos = QOS1;
+  rc = MQTTEnqueuePublish(&c, test_topic, &pubmsg);
+  assert("Failure from enqueue QoS 1", rc == FAILURE, "rc was %d", rc);
+
+  for (i = 0; i < TEST7_THREADS; ++i)
+  {
+    producers[i].c = &c;
+    producers[i].id = i;
+    producers[i].failures = 0;
+    rc = ThreadStart(&threads[i], test7_produce, &producers[i]);
+    assert("Good rc from thread start", rc == SUCCESS, "rc was %d", rc);
+  }
+  for (i = 0; i < TEST7_THREADS; ++i)
+  {
+    ThreadJoin(&threads[i]);
+    assert("All publishes queued", producers[i].failures == 0, "failures was %d", producers[i].failures);
+  }
+
+  wait_seconds = 100;
+  while (test7_arrived < TEST7_THREADS * TEST7_MESSAGES && wait_seconds-- > 0)
+    MQTTYield(&c, 100);
+  assert("All messages arrived", test7_arrived == TEST7_THREADS * TEST7_MESSAGES,
+      "arrived was %d", test7_arrived);
+  assert("Messages from each producer arrived in order", test7_out_of_order == 0,
+      "out of order was %d", test7_out_of_order);
+
+  rc = MQTTDisconnect(&c);
+  assert("Disconnect successful", rc == SUCCESS, "rc was %d", rc);
+
+stop:
+  rc = MQTTStopTask(&c);
+  assert("Good rc from stop task", rc == SUCCESS, "rc was %d", rc);
+  testNetworkDisconnect(n);
+
+exit:
+  MyLog(LOGA_INFO, "TEST7: test %s. %d tests run, %d failures.",
+      (failures == 0) ? "passed" : "failed", tests, failures);
+  write_test_result();
+  return failures;
+}
+#endif
+
+
+/*********************************************************************
+
+Test 8: message handlers run by worker threads, in order for each topic
+
+*********************************************************************/
+#define TEST8_TOPICS 8
+#define TEST8_MESSAGES 50
+static Mutex test8_mutex;
+static int test8_arrived = 0;
+static int test8_next[TEST8_TOPICS];
+static int test8_out_of_order = 0;
+static int test8_slow_done = 0;
+
+void test8_messageArrived(MessageData* md)
+{
+  int topic = -1, seq = -1;
+  char buf[30];
+
+  snprintf(buf, sizeof(buf), "%.*s", md->topicName->lenstring.len, md->topicName->lenstring.data);
+  if (strcmp(buf, "C client test8/slow") == 0)
+  {
+    usleep(2000000L); /* must not hold up anything else */
+    MutexLock(&test8_mutex);
+    test8_slow_done = 1;
+    MutexUnlock(&test8_mutex);
+    return;
+  }
+  sscanf(buf, "C client test8/%d", &topic);
+  snprintf(buf, sizeof(buf), "%.*s", (int)md->message->payloadlen, (char*)md->message->payload);
+  sscanf(buf, "message %d", &seq);
+  MutexLock(&test8_mutex);
+  if (topic < 0 || topic >= TEST8_TOPICS || seq != test8_next[topic])
+    ++test8_out_of_order;
+  else
+    ++test8_next[topic];
+  ++test8_arrived;
+  MutexUnlock(&test8_mutex);
+}
+
+
+int test8(struct Options options)
+{
+  Network* n = testNetworkInit();
+  MQTTClient c;
+  MQTTDispatch d;
+  MQTTDispatchMetrics metrics;
+  int rc = 0;
+  int i = 0, j = 0;
+  unsigned char buf[200];
+  unsigned char readbuf[200];
+  unsigned char pool[4 * MQTT_DISPATCH_QUEUE_DEPTH * 100];
+  char topic[30];
+  char payload[120];
+  int wait_seconds = 0;
+  int arrived = 0, slow_done = 0;
+  START_TIME_TYPE start;
+
+  fprintf(xml, "<testcase classname=\"test8\" name=\"worker dispatch\"");
+  global_start_time = start_clock();
+  failures = 0;
+  MyLog(LOGA_INFO, "Starting test 8 - worker dispatch");
+
+  MutexInit(&test8_mutex);
+  test8_arrived = test8_out_of_order = test8_slow_done = 0;
+  memset(test8_next, '\0', sizeof(test8_next));
+  rc = testNetworkConnect(n);
+  assert("Good rc from TCP connect", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto exit;
+  MQTTClientInit(&c, n, 1000, buf, sizeof(buf), readbuf, sizeof(readbuf));
+
+  rc = MQTTDispatchStart(&d, 4, pool, sizeof(pool));
+  assert("Good rc from dispatch start", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto exit;
+  MQTTSetDispatch(&c, &d);
+
+  rc = MQTTStartTask(&c);
+  assert("Good rc from start task", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto dispatch_stop;
+
+  MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+  data.MQTTVersion = options.MQTTVersion;
+  data.clientID.cstring = "worker-dispatch-test";
+  data.keepAliveInterval = 20;
+  data.cleansession = 1;
+
+  rc = MQTTConnect(&c, &data);
+  assert("Good rc from connect", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto stop;
+
+  rc = MQTTSubscribe(&c, "C client test8/#", QOS1, test8_messageArrived);
+  assert("Good rc from subscribe", rc == SUCCESS, "rc was %d", rc);
+
+  /* a slow handler on one worker must not stop the client reading */
+  memset(&pubmsg, '\0', sizeof(pubmsg));
+  pubmsg.payload = "slow";
+  pubmsg.payloadlen = strlen(pubmsg.payload);
+  pubmsg.qos = QOS1;
+  rc = MQTTPublish(&c, "C client test8/slow", &pubmsg);
+  assert("Good rc from publish", rc == SUCCESS, "rc was %d", rc);
+  MQTTYield(&c, 100);
+  start = start_clock();
+  rc = MQTTSubscribe(&c, "C client test8 other", QOS0, test8_messageArrived);
+  assert("Good rc from subscribe", rc == SUCCESS, "rc was %d", rc);
+  assert("Subscribe not held up by the slow handler", elapsed(start) < 1000, "elapsed was %ld ms", elapsed(start));
+
+  /* a worker's queue is bounded, so a handler which stays slow does hold up reading, in the end */
+  wait_seconds = 50;
+  do
+  {
+    MQTTYield(&c, 100);
+    MutexLock(&test8_mutex);
+    slow_done = test8_slow_done;
+    MutexUnlock(&test8_mutex);
+  } while (!slow_done && wait_seconds-- > 0);
+  assert("Slow handler finished", slow_done == 1, "slow_done was %d", slow_done);
+
+  for (i = 0; i < TEST8_MESSAGES; ++i)
+  {
+    for (j = 0; j < TEST8_TOPICS; ++j)
+    {
+      sprintf(topic, "C client test8/%d", j);
+      sprintf(payload, "message %d", i);
+      if (j == 1 && i == TEST8_MESSAGES / 2)
+      { /* too big for a pool slot: handled on the reader thread, still in order, and not lost */
+        memset(&payload[strlen(payload)], ' ', 100);
+        payload[100] = '\0';
+      }
+      pubmsg.payload = payload;
+      pubmsg.payloadlen = strlen(payload);
+      pubmsg.qos = (j % 2) ? QOS1 : QOS0;
+      rc = MQTTPublish(&c, topic, &pubmsg);
+      assert("Good rc from publish", rc == SUCCESS, "rc was %d", rc);
+    }
+  }
+
+  wait_seconds = 50;
+  do
+  {
+    MQTTYield(&c, 100);
+    MutexLock(&test8_mutex);
+    arrived = test8_arrived;
+    MutexUnlock(&test8_mutex);
+  } while (arrived < TEST8_TOPICS * TEST8_MESSAGES && wait_seconds-- > 0);
+  assert("All messages arrived", arrived == TEST8_TOPICS * TEST8_MESSAGES, "arrived was %d", arrived);
+  assert("Messages on each topic arrived in order", test8_out_of_order == 0,
+      "out of order was %d", test8_out_of_order);
+
+  MQTTDispatchGetMetrics(&d, &metrics);
+  assert("All messages dispatched", metrics.dispatched == TEST8_TOPICS * TEST8_MESSAGES,
+      "dispatched was %lu", metrics.dispatched);
+  assert("The large message overflowed", metrics.overflowed == 1, "overflowed was %lu", metrics.overflowed);
+  for (i = 0; i < 4; ++i)
+    assert("Queues are empty", metrics.depth[i] == 0, "depth was %d", metrics.depth[i]);
+
+  rc = MQTTDisconnect(&c);
+  assert("Disconnect successful", rc == SUCCESS, "rc was %d", rc);
+
+stop:
+  rc = MQTTStopTask(&c);
+  assert("Good rc from stop task", rc == SUCCESS, "rc was %d", rc);
+  testNetworkDisconnect(n);
+dispatch_stop:
+  MQTTSetDispatch(&c, NULL);
+  MQTTDispatchStop(&d);
+
+exit:
+  MyLog(LOGA_INFO, "TEST8: test %s. %d tests run, %d failures.",
+      (failures == 0) ? "passed" : "failed", tests, failures);
+  write_test_result();
+  return failures;
+}
+#endif
+
+
+/*********************************************************************
+
+Test 9: driving the client from the application's own poll loop
+
+*********************************************************************/
+#define TEST9_MESSAGES 20
+static int test9_arrived = 0;
+
+void test9_messageArrived(MessageData* md)
+{
+  ++test9_arrived;
+}
+
+
+int test9(struct Options options)
+{
+  Network* n = testNetworkInit();
+  MQTTClient c;
+  int rc = 0;
+  int i = 0;
+  char* test_topic = "C client test9";
+  unsigned char buf[100];
+  unsigned char readbuf[100];
+  int next_ms = 0;
+  Timer timer;
+  START_TIME_TYPE start;
+
+  fprintf(xml, "<testcase classname=\"test9\" name=\"yield without waiting\"");
+  global_start_time = start_clock();
+  failures = 0;
+  MyLog(LOGA_INFO, "Starting test 9 - yield without waiting");
+
+  test9_arrived = 0;
+  rc = testNetworkConnect(n);
+  assert("Good rc from TCP connect", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto exit;
+  MQTTClientInit(&c, n, 1000, buf, sizeof(buf), readbuf, sizeof(readbuf));
+
+  MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+  data.MQTTVersion = options.MQTTVersion;
+  data.clientID.cstring = "yield-no-wait-test";
+  data.keepAliveInterval = 2;
+  data.cleansession = 1;
+
+  rc = MQTTConnect(&c, &data);
+  assert("Good rc from connect", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto exit;
+
+  rc = MQTTSubscribe(&c, test_topic, QOS1, test9_messageArrived);
+  assert("Good rc from subscribe", rc == SUCCESS, "rc was %d", rc);
+
+  /* with nothing to read, it returns straight away, and says when the keepalive is due */
+  start = start_clock();
+  rc = MQTTYieldNoWait(&c, &next_ms);
+  assert("Good rc from yield no wait", rc == SUCCESS, "rc was %d", rc);
+  assert("Yield did not wait", elapsed(start) < 50, "elapsed was %ld ms", elapsed(start));
+  assert("Next deadline is the keepalive", next_ms > 0 && next_ms <= 2000, "next_ms was %d", next_ms);
+
+  memset(&pubmsg, '\0', sizeof(pubmsg));
+  pubmsg.payload = "poll loop";
+  pubmsg.payloadlen = strlen(pubmsg.payload);
+  for (i = 0; i < TEST9_MESSAGES; ++i)
+  {
+    pubmsg.qos = QOS0;
+    rc = MQTTPublish(&c, test_topic, &pubmsg);
+    assert("Good rc from publish", rc == SUCCESS, "rc was %d", rc);
+  }
+
+  /* the loop an application would run, for long enough to need keepalives */
+  TimerInit(&timer);
+  TimerCountdown(&timer, 5);
+  while (!TimerIsExpired(&timer) && rc == SUCCESS)
+  {
+    struct pollfd pfd = {n->my_socket, POLLIN, 0};
+    int left = TimerLeftMS(&timer);
+
+    if (next_ms >= 0 && next_ms < left)
+      left = next_ms;
+    if (poll(&pfd, 1, left) >= 0)
+      rc = MQTTYieldNoWait(&c, &next_ms);
+  }
+  assert("Good rc from yield no wait", rc == SUCCESS, "rc was %d", rc);
+  assert("All messages arrived", test9_arrived == TEST9_MESSAGES, "arrived was %d", test9_arrived);
+  assert("Still connected after the keepalive interval", MQTTIsConnected(&c), "connected was %d", MQTTIsConnected(&c));
+
+  rc = MQTTDisconnect(&c);
+  assert("Disconnect successful", rc == SUCCESS, "rc was %d", rc);
+  testNetworkDisconnect(n);
+
+exit:
+  MyLog(LOGA_INFO, "TEST9: test %s. %d tests run, %d failures.",
+      (failures == 0) ? "passed" : "failed", tests, failures);
+  write_test_result();
+  return failures;
+}
+
+
+/*********************************************************************
+
+Test 10: automatic reconnect, resubscribing, and sending publishes again
+
+*********************************************************************/
+static volatile int test10_arrived = 0;
+static volatile int test10_reconnects = 0;
+
+void test10_messageArrived(MessageData* md)
+{
+  ++test10_arrived;
+}
+
+
+/* The first connection is through the proxy, so that it can be broken.  Reconnects go straight
+ * to the server, where the publish which broke it can be sent again harmlessly. */
+int test10_reconnect(Network* n, void* context)
+{
+  struct Options* o = (struct Options*)context;
+
+  ++test10_reconnects;
+  NetworkDisconnect(n);
+  return NetworkConnect(n, o->host, o->port);
+}
+
+
+/* Wait for something to happen, driving the client if there is no background thread */
+static void test10_wait(MQTTClient* c, volatile int* count, int target)
+{
+  int wait_count = 100;
+
+  while ((*count < target || !MQTTIsConnected(c)) && wait_count-- > 0)
+  {
+#if defined(MQTT_TASK)
+    usleep(10000L);
+#else
+    MQTTYield(c, 10);
+#endif
+  }
+}
+
+
+int test10(struct Options options)
+{
+  Network n;
+  MQTTClient c;
+  int rc = 0;
+  char* test_topic = "C client test10";
+  char* mqttsas_topic = "MQTTSAS topic";
+  unsigned char buf[100];
+  unsigned char readbuf[100];
+  START_TIME_TYPE start;
+  long reconnect_ms = 0;
+
+  fprintf(xml, "<testcase classname=\"test10\" name=\"automatic reconnect\"");
+  global_start_time = start_clock();
+  failures = 0;
+  MyLog(LOGA_INFO, "Starting test 10 - automatic reconnect");
+
+  if (options.loopback)
+  {
+    MyLog(LOGA_INFO, "Needs a broker, skipping with --loopback");
+    goto exit;
+  }
+
+  test10_arrived = test10_reconnects = 0;
+  NetworkInit(&n);
+  rc = NetworkConnect(&n, options.proxy_host, options.proxy_port);
+  assert("Good rc from TCP connect", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto exit;
+  MQTTClientInit(&c, &n, 5000, buf, sizeof(buf), readbuf, sizeof(readbuf));
+
+  MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+  data.MQTTVersion = options.MQTTVersion;
+  data.clientID.cstring = "auto-reconnect-test";
+  data.keepAliveInterval = 5;
+  data.cleansession = 1; /* so the server forgets the subscriptions, and the client has to make them again */
+
+  rc = MQTTSetAutoReconnect(&c, &data, test10_reconnect, &options, 100, 2000);
+  assert("Good rc from set auto reconnect", rc == SUCCESS, "rc was %d", rc);
+  rc = MQTTConnect(&c, &data);
+  assert("Good rc from connect", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto exit;
+#if defined(MQTT_TASK)
+  rc = MQTTStartTask(&c);
+  assert("Good rc from start task", rc == SUCCESS, "rc was %d", rc);
+#endif
+
+  rc = MQTTSubscribe(&c, test_topic, QOS1, test10_messageArrived);
+  assert("Good rc from subscribe", rc == SUCCESS, "rc was %d", rc);
+  rc = MQTTSubscribe(&c, mqttsas_topic, QOS1, test10_messageArrived);
+  assert("Good rc from subscribe", rc == SUCCESS, "rc was %d", rc);
+
+  /* the proxy drops the connection instead of passing this on, so it is left waiting for its
+   * PUBACK, and is sent again once the client has reconnected and subscribed again */
+  memset(&pubmsg, '\0', sizeof(pubmsg));
+  pubmsg.payload = "TERMINATE";
+  pubmsg.payloadlen = strlen(pubmsg.payload);
+  pubmsg.qos = QOS1;
+  rc = MQTTPublish(&c, mqttsas_topic, &pubmsg);
+  assert("Publish completed on the new connection", rc == SUCCESS, "rc was %d", rc);
+  assert("Reconnected", test10_reconnects == 1, "reconnects were %d", test10_reconnects);
+  test10_wait(&c, &test10_arrived, 1);
+  assert("Publish sent again arrived", test10_arrived == 1, "arrived was %d", test10_arrived);
+
+  /* break the connection under the client */
+  start = start_clock();
+  shutdown(n.my_socket, SHUT_RDWR);
+  test10_wait(&c, &test10_reconnects, 2);
+  reconnect_ms = elapsed(start);
+  assert("Reconnected again", test10_reconnects == 2 && MQTTIsConnected(&c),
+      "reconnects were %d", test10_reconnects);
+  MyLog(LOGA_INFO, "Reconnected in %ld ms", reconnect_ms);
+  assert("Reconnected straight away", reconnect_ms < 1000, "reconnect took %ld ms", reconnect_ms);
+
+  pubmsg.payload = "after reconnect";
+  pubmsg.payloadlen = strlen(pubmsg.payload);
+  rc = MQTTPublish(&c, test_topic, &pubmsg);
+  assert("Good rc from publish", rc == SUCCESS, "rc was %d", rc);
+  test10_wait(&c, &test10_arrived, 2);
+  assert("Message arrived after reconnect", test10_arrived == 2, "arrived was %d", test10_arrived);
+
+  rc = MQTTDisconnect(&c);
+  assert("Disconnect successful", rc == SUCCESS, "rc was %d", rc);
+#if defined(MQTT_TASK)
+  usleep(200000L);
+  MQTTStopTask(&c);
+#else
+  MQTTYield(&c, 200);
+#endif
+  assert("No reconnect after disconnect", !MQTTIsConnected(&c) && test10_reconnects == 2,
+      "reconnects were %d", test10_reconnects);
+  NetworkDisconnect(&n);
+
+exit:
+  MyLog(LOGA_INFO, "TEST10: test %s. %d tests run, %d failures.",
+      (failures == 0) ? "passed" : "failed", tests, failures);
+  write_test_result();
+  return failures;
+}
+
+
+/*********************************************************************
+
+Test 11: publishes kept in the offline buffer while disconnected
+
+*********************************************************************/
+static char test11_arrived[10];
+static volatile int test11_count = 0;
+
+void test11_messageArrived(MessageData* md)
+{
+  if (test11_count < sizeof(test11_arrived) - 1 && md->message->payloadlen == 1)
+    test11_arrived[test11_count++] = *(char*)md->message->payload;
+}
+
+
+static int test11_publish(MQTTClient* c, char* topic, char* payload)
+{
+  memset(&pubmsg, '\0', sizeof(pubmsg));
+  pubmsg.payload = payload;
+  pubmsg.payloadlen = strlen(payload);
+  pubmsg.qos = QOS1;
+  return MQTTPublish(c, topic, &pubmsg);
+}
+
+
+int test11(struct Options options)
+{
+  Network* n = testNetworkInit();
+  MQTTClient c;
+  int rc = 0;
+  int wait_count = 100;
+  char* test_topic = "C client test11";
+  unsigned char buf[100];
+  unsigned char readbuf[100];
+  unsigned char offlinebuf[64]; /* room for two of this test's publishes */
+  MQTTOfflineMetrics metrics;
+  char payload[2] = "1";
+
+  fprintf(xml, "<testcase classname=\"test11\" name=\"offline buffer\"");
+  global_start_time = start_clock();
+  failures = 0;
+  MyLog(LOGA_INFO, "Starting test 11 - offline buffer");
+
+  memset(test11_arrived, '\0', sizeof(test11_arrived));
+  test11_count = 0;
+  rc = testNetworkConnect(n);
+  assert("Good rc from TCP connect", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto exit;
+  MQTTClientInit(&c, n, 1000, buf, sizeof(buf), readbuf, sizeof(readbuf));
+
+  MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+  data.MQTTVersion = options.MQTTVersion;
+  data.clientID.cstring = "offline-buffer-test";
+  data.keepAliveInterval = 20;
+  data.cleansession = 0; /* the server keeps the subscription while we are away */
+
+  rc = MQTTConnect(&c, &data);
+  assert("Good rc from connect", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto exit;
+  rc = MQTTSubscribe(&c, test_topic, QOS1, test11_messageArrived);
+  assert("Good rc from subscribe", rc == SUCCESS, "rc was %d", rc);
+  rc = MQTTDisconnect(&c);
+  assert("Disconnect successful", rc == SUCCESS, "rc was %d", rc);
+  testNetworkDisconnect(n);
+
+  rc = test11_publish(&c, test_topic, payload);
+  assert("Publish fails without an offline buffer", rc == FAILURE, "rc was %d", rc);
+
+  /* reject the newest when full */
+  MQTTSetOfflineBuffer(&c, offlinebuf, sizeof(offlinebuf), OFFLINE_REJECT);
+  for (payload[0] = '1'; payload[0] <= '3'; ++payload[0])
+  {
+    rc = test11_publish(&c, test_topic, payload);
+    assert("Good rc from offline publish", rc == ((payload[0] == '3') ? FAILURE : SUCCESS), "rc was %d", rc);
+  }
+  MQTTGetOfflineMetrics(&c, &metrics);
+  assert("Two publishes kept", metrics.count == 2 && metrics.stored == 2, "count was %u", metrics.count);
+  assert("One publish rejected", metrics.rejected == 1 && metrics.dropped == 0, "rejected was %u", metrics.rejected);
+  assert("High water mark", metrics.high_water == metrics.bytes && metrics.bytes <= sizeof(offlinebuf),
+      "high water was %u", metrics.high_water);
+
+  /* drop the oldest when full, which wraps around the end of the buffer */
+  MQTTSetOfflineBuffer(&c, offlinebuf, sizeof(offlinebuf), OFFLINE_DROP_OLDEST);
+  for (payload[0] = '1'; payload[0] <= '5'; ++payload[0])
+  {
+    rc = test11_publish(&c, test_topic, payload);
+    assert("Good rc from offline publish", rc == SUCCESS, "rc was %d", rc);
+  }
+  MQTTGetOfflineMetrics(&c, &metrics);
+  assert("Two publishes kept", metrics.count == 2 && metrics.stored == 5, "count was %u", metrics.count);
+  assert("Three publishes dropped", metrics.dropped == 3 && metrics.rejected == 0, "dropped was %u", metrics.dropped);
+
+  /* connecting again sends them before anything else */
+  rc = testNetworkConnect(n);
+  assert("Good rc from TCP connect", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto exit;
+  rc = MQTTConnect(&c, &data);
+  assert("Good rc from connect", rc == SUCCESS, "rc was %d", rc);
+  MQTTGetOfflineMetrics(&c, &metrics);
+  assert("Offline buffer drained", metrics.count == 0 && metrics.bytes == 0 && metrics.sent == 2,
+      "sent was %u", metrics.sent);
+  payload[0] = '6';
+  rc = test11_publish(&c, test_topic, payload);
+  assert("Good rc from publish", rc == SUCCESS, "rc was %d", rc);
+  while (test11_count < 3 && wait_count-- > 0)
+    MQTTYield(&c, 10);
+  assert("Messages arrived in order", strcmp(test11_arrived, "456") == 0, "arrived were %s", test11_arrived);
+
+  data.cleansession = 1; /* and leave nothing behind on the server */
+  MQTTDisconnect(&c);
+  testNetworkDisconnect(n);
+  if (testNetworkConnect(n) == SUCCESS && MQTTConnect(&c, &data) == SUCCESS)
+    MQTTDisconnect(&c);
+  testNetworkDisconnect(n);
+
+exit:
+  MyLog(LOGA_INFO, "TEST11: test %s. %d tests run, %d failures.",
+      (failures == 0) ? "passed" : "failed", tests, failures);
+  write_test_result();
+  return failures;
+}
+
+
+/*********************************************************************
+
+Test 12: QoS 1 and 2 publishes kept in a file over a restart
+
+*********************************************************************/
+static char test12_arrived[10];
+static int test12_count = 0;
+
+void test12_messageArrived(MessageData* md)
+{
+  if (test12_count < sizeof(test12_arrived) - 1 && md->message->payloadlen == 1)
+    test12_arrived[test12_count++] = *(char*)md->message->payload;
+}
+
+
+static int test12_kept(MQTTFilePersistence* p)
+{
+  unsigned int cursor = 0;
+  unsigned short id = 0;
+  unsigned char* packet = NULL;
+  int released = 0,
+    count = 0;
+
+  while (p->persistence.next(&p->persistence, &cursor, &id, &released, &packet) > 0)
+    ++count;
+  return count;
+}
+
+
+int test12(struct Options options)
+{
+  Network n, sub_n;
+  MQTTClient c, sub;
+  MQTTFilePersistence p;
+  int rc = 0;
+  int len = 0;
+  int wait_count = 100;
+  char* test_topic = "C client test12";
+  char* path = "test12.persist";
+  unsigned char buf[100];
+  unsigned char readbuf[100];
+  unsigned char sub_buf[100];
+  unsigned char sub_readbuf[100];
+  MQTTString topic = MQTTString_initializer;
+
+  fprintf(xml, "<testcase classname=\"test12\" name=\"persistence\"");
+  global_start_time = start_clock();
+  failures = 0;
+  MyLog(LOGA_INFO, "Starting test 12 - persistence");
+
+  if (options.loopback)
+  {
+    MyLog(LOGA_INFO, "Needs a broker, skipping with --loopback");
+    goto exit;
+  }
+
+  memset(test12_arrived, '\0', sizeof(test12_arrived));
+  test12_count = 0;
+  unlink(path);
+  NetworkInit(&sub_n);
+  rc = NetworkConnect(&sub_n, options.host, options.port);
+  assert("Good rc from TCP connect", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto exit;
+  MQTTClientInit(&sub, &sub_n, 1000, sub_buf, sizeof(sub_buf), sub_readbuf, sizeof(sub_readbuf));
+
+  MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+  data.MQTTVersion = options.MQTTVersion;
+  data.clientID.cstring = "persistence-test-subscriber";
+  data.cleansession = 1;
+  rc = MQTTConnect(&sub, &data);
+  assert("Good rc from connect", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto exit;
+  rc = MQTTSubscribe(&sub, test_topic, QOS2, test12_messageArrived);
+  assert("Good rc from subscribe", rc == SUCCESS, "rc was %d", rc);
+
+  /* what an earlier run left behind: a QoS 1 publish not acknowledged, and a QoS 2 one released */
+  rc = MQTTFilePersistenceOpen(&p, path, 4, sizeof(buf), PERSIST_WRITEBACK);
+  assert("Good rc from persistence open", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto exit;
+  topic.cstring = test_topic;
+  len = MQTTSerialize_publish(buf, sizeof(buf), 0, QOS1, 0, 7, topic, (unsigned char*)"1", 1);
+  rc = p.persistence.add(&p.persistence, 7, buf, len);
+  assert("Good rc from persistence add", rc == SUCCESS, "rc was %d", rc);
+  len = MQTTSerialize_publish(buf, sizeof(buf), 0, QOS2, 0, 8, topic, (unsigned char*)"2", 1);
+  rc = p.persistence.add(&p.persistence, 8, buf, len);
+  assert("Good rc from persistence add", rc == SUCCESS, "rc was %d", rc);
+  p.persistence.release(&p.persistence, 8);
+  MQTTFilePersistenceClose(&p);
+
+  /* and this run finds them */
+  rc = MQTTFilePersistenceOpen(&p, path, 0, 0, PERSIST_SYNC);
+  assert("Good rc from persistence open", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto exit;
+  assert("Publishes kept over the restart", test12_kept(&p) == 2, "kept were %d", test12_kept(&p));
+
+  NetworkInit(&n);
+  rc = NetworkConnect(&n, options.host, options.port);
+  assert("Good rc from TCP connect", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto exit;
+  MQTTClientInit(&c, &n, 1000, buf, sizeof(buf), readbuf, sizeof(readbuf));
+  MQTTSetPersistence(&c, &p.persistence);
+  data.clientID.cstring = "persistence-test";
+  rc = MQTTConnect(&c, &data);
+  assert("Good rc from connect", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto exit;
+
+  memset(&pubmsg, '\0', sizeof(pubmsg));
+  pubmsg.payload = "3";
+  pubmsg.payloadlen = 1;
+  pubmsg.qos = QOS1;
+  rc = MQTTPublish(&c, test_topic, &pubmsg);
+  assert("Good rc from publish", rc == SUCCESS, "rc was %d", rc);
+  assert("Packet ids carry on from the last run", pubmsg.id == 9, "id was %d", pubmsg.id);
+  assert("Nothing kept once acknowledged", test12_kept(&p) == 0, "kept were %d", test12_kept(&p));
+
+  while (test12_count < 2 && wait_count-- > 0)
+    MQTTYield(&sub, 10);
+  assert("Publishes arrived in order, without the released one",
+      strcmp(test12_arrived, "13") == 0, "arrived were %s", test12_arrived);
+
+  MQTTDisconnect(&c);
+  NetworkDisconnect(&n);
+  MQTTFilePersistenceClose(&p);
+  MQTTDisconnect(&sub);
+  NetworkDisconnect(&sub_n);
+  unlink(path);
+
+exit:
+  MyLog(LOGA_INFO, "TEST12: test %s. %d tests run, %d failures.",
+      (failures == 0) ? "passed" : "failed", tests, failures);
+  write_test_result();
+  return failures;
+}
+
+
+#if defined(MQTT_TASK)
+/*********************************************************************
+
+Test 13: QoS 1 publishes from several threads made durable by group commit
+
+*********************************************************************/
+#define TEST13_THREADS 4
+#define TEST13_MESSAGES 20
+
+struct test13_publisher
+{
+  MQTTClient* c;
+  int id;
+  int failures;
+};
+
+void test13_publish(void* parm)
+{
+  struct test13_publisher* p = (struct test13_publisher*)parm;
+  MQTTMessage msg;
+  char payload[30];
+  int i = 0;
+
+  memset(&msg, '\0', sizeof(msg));
+  msg.payload = payload;
+  msg.qos = QOS1;
+  for (i = 0; i < TEST13_MESSAGES; ++i)
+  {
+    sprintf(payload, "thread %d message %d", p->id, i);
+    msg.payloadlen = strlen(payload);
+    if (MQTTPublish(p->c, "C client test13", &msg) != SUCCESS)
+      p->failures++;
+  }
+}
+
+
+static int test13_kept(MQTTWalPersistence* w, char* order)
+{
+  unsigned int cursor = 0;
+  unsigned short id = 0;
+  unsigned char* packet = NULL;
+  int released = 0,
+    count = 0;
+
+  while (w->persistence.next(&w->persistence, &cursor, &id, &released, &packet) > 0)
+    if (order != NULL)
+      order[count++] = '0' + id % 10;
+    else
+      ++count;
+  return count;
+}
+
+
+/* A commit during which the connection breaks, and the client reconnects and sends the publishes
+ * being committed again */
+static int (*test13_commit)(MQTTPersistence*) = NULL;
+static MQTTClient* test13_client = NULL;
+static Network* test13_network = NULL;
+static volatile int test13_arrived = 0;
+
+int test13_break(MQTTPersistence* p)
+{
+  if (test13_network != NULL)
+  {
+    unsigned int connect_count = test13_client->connect_count;
+    int wait_count = 500;
+
+    shutdown(test13_network->my_socket, SHUT_RDWR);
+    test13_network = NULL;
+    while (test13_client->connect_count == connect_count && wait_count-- > 0)
+      usleep(10000L);
+  }
+  return test13_commit(p);
+}
+
+
+int test13_reconnect(Network* n, void* context)
+{
+  struct Options* o = (struct Options*)context;
+
+  NetworkDisconnect(n);
+  return NetworkConnect(n, o->host, o->port);
+}
+
+
+void test13_messageArrived(MessageData* md)
+{
+  ++test13_arrived;
+}
+
+
+/* A publisher adding and removing one publish over and over, with two more kept the while, of which
+ * the second is removed at the end: the log grows past its checkpoint size, and is rewritten while
+ * the other publishers carry on */
+#define TEST13_CHURN 40000
+
+struct test13_churner
+{
+  MQTTWalPersistence* w;
+  int id;
+  int failures;
+};
+
+void test13_churn(void* parm)
+{
+  struct test13_churner* p = (struct test13_churner*)parm;
+  MQTTString topic = MQTTString_initializer;
+  unsigned char packet[100];
+  unsigned short id = p->id * 10;
+  int i = 0;
+  int len = 0;
+
+  topic.cstring = "C client test13 checkpoint";
+  len = MQTTSerialize_publish(packet, sizeof(packet), 0, QOS1, 0, id, topic, (unsigned char*)"churn", 5);
+  if (p->w->persistence.add(&p->w->persistence, id + 2, packet, len) != SUCCESS ||
+      p->w->persistence.add(&p->w->persistence, id + 3, packet, len) != SUCCESS)
+    p->failures++;
+  for (i = 0; i < TEST13_CHURN; ++i)
+  {
+    if (p->w->persistence.add(&p->w->persistence, id + 1, packet, len) != SUCCESS)
+      p->failures++;
+    p->w->persistence.remove(&p->w->persistence, id + 1);
+    if (i % 1000 == 0 && p->w->persistence.commit(&p->w->persistence) != SUCCESS)
+      p->failures++;
+  }
+  p->w->persistence.remove(&p->w->persistence, id + 3);
+  if (p->w->persistence.commit(&p->w->persistence) != SUCCESS)
+    p->failures++;
+}
+
+
+/* The publisher killed while its publish is in flight: connect to the test's own listener, which
+ * never acknowledges the publish */
+static void test13_crash(const char* path, int port, unsigned int* table, int table_size)
+{
+  Network n;
+  MQTTClient c;
+  MQTTWalPersistence w;
+  MQTTMessage msg;
+  unsigned char buf[100];
+  unsigned char readbuf[100];
+  MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+
+  NetworkInit(&n);
+  if (MQTTWalPersistenceOpen(&w, path, (unsigned char*)table, table_size, sizeof(buf), 0) == SUCCESS &&
+      NetworkConnect(&n, "127.0.0.1", port) == SUCCESS)
+  {
+    MQTTClientInit(&c, &n, 5000, buf, sizeof(buf), readbuf, sizeof(readbuf));
+    MQTTSetPersistence(&c, &w.persistence);
+    data.clientID.cstring = "wal-crash";
+    if (MQTTStartTask(&c) == SUCCESS && MQTTConnect(&c, &data) == SUCCESS)
+    {
+      memset(&msg, '\0', sizeof(msg));
+      msg.payload = "in flight";
+      msg.payloadlen = strlen(msg.payload);
+      msg.qos = QOS1;
+      MQTTPublish(&c, "C client test13", &msg);
+    }
+  }
+  _exit(1); /* not killed before the publish was sent */
+}
+
+
+int test13(struct Options options)
+{
+  Network* n = testNetworkInit();
+  MQTTClient c;
+  MQTTWalPersistence w;
+  MQTTWalMetrics metrics;
+  Thread threads[TEST13_THREADS];
+  struct test13_publisher publishers[TEST13_THREADS];
+  struct test13_churner churners[TEST13_THREADS];
+  Network reconnecting;
+  int rc = 0;
+  int i = 0;
+  int len = 0;
+  char* path = "test13.wal";
+  char order[10];
+  struct sockaddr_in address;
+  socklen_t address_len = sizeof(address);
+  int listener = -1;
+  int fd = -1;
+  pid_t pid = 0;
+  static unsigned int table[1024];
+  unsigned char buf[100];
+  unsigned char readbuf[100];
+  MQTTString topic = MQTTString_initializer;
+  FILE* f = NULL;
+
+  fprintf(xml, "<testcase classname=\"test13\" name=\"write-ahead log\"");
+  global_start_time = start_clock();
+  failures = 0;
+  MyLog(LOGA_INFO, "Starting test 13 - write-ahead log with group commit");
+
+  unlink(path);
+  rc = MQTTWalPersistenceOpen(&w, path, (unsigned char*)table, sizeof(table), sizeof(buf), 1000);
+  assert("Good rc from log open", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto exit;
+
+  rc = testNetworkConnect(n);
+  assert("Good rc from TCP connect", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto close;
+  MQTTClientInit(&c, n, 1000, buf, sizeof(buf), readbuf, sizeof(readbuf));
+  MQTTSetPersistence(&c, &w.persistence);
+  rc = MQTTStartTask(&c);
+  assert("Good rc from start task", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto close;
+
+  MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+  data.MQTTVersion = options.MQTTVersion;
+  data.clientID.cstring = "wal-test";
+  data.cleansession = 1;
+  rc = MQTTConnect(&c, &data);
+  assert("Good rc from connect", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto stop;
+
+  for (i = 0; i < TEST13_THREADS; ++i)
+  {
+    publishers[i].c = &c;
+    publishers[i].id = i;
+    publishers[i].failures = 0;
+    rc = ThreadStart(&threads[i], test13_publish, &publishers[i]);
+    assert("Good rc from thread start", rc == SUCCESS, "rc was %d", rc);
+  }
+  for (i = 0; i < TEST13_THREADS; ++i)
+  {
+    ThreadJoin(&threads[i]);
+    assert("All publishes succeeded", publishers[i].failures == 0, "failures was %d", publishers[i].failures);
+  }
+
+  MQTTWalPersistenceGetMetrics(&w, &metrics);
+  MyLog(LOGA_INFO, "%u records, %u commits", metrics.records, metrics.commits);
+  assert("A record for each publish and its ack", metrics.records == 2 * TEST13_THREADS * TEST13_MESSAGES,
+      "records were %u", metrics.records);
+  assert("Publishes shared commits", metrics.commits < TEST13_THREADS * TEST13_MESSAGES,
+      "commits were %u", metrics.commits);
+  assert("Nothing kept once acknowledged", test13_kept(&w, NULL) == 0, "kept were %d", test13_kept(&w, NULL));
+
+  rc = MQTTDisconnect(&c);
+  assert("Disconnect successful", rc == SUCCESS, "rc was %d", rc);
+
+stop:
+  MQTTStopTask(&c);
+  testNetworkDisconnect(n);
+close:
+  MQTTWalPersistenceClose(&w);
+
+  rc = MQTTWalPersistenceOpen(&w, path, (unsigned char*)table, sizeof(table), sizeof(buf), 0);
+  assert("Good rc from log open", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto exit;
+  assert("Nothing kept over the restart", test13_kept(&w, NULL) == 0, "kept were %d", test13_kept(&w, NULL));
+
+  /* two publishes left behind, and a record torn by a crash after them */
+  topic.cstring = "C client test13";
+  for (i = 1; i <= 2; ++i)
+  {
+    len = MQTTSerialize_publish(buf, sizeof(buf), 0, QOS1, 0, i, topic, (unsigned char*)"x", 1);
+    rc = w.persistence.add(&w.persistence, i, buf, len);
+    assert("Good rc from log add", rc == SUCCESS, "rc was %d", rc);
+  }
+  MQTTWalPersistenceClose(&w);
+  if ((f = fopen(path, "ab")) != NULL)
+  {
+    fwrite("torn record", 1, 11, f);
+    fclose(f);
+  }
+
+  rc = MQTTWalPersistenceOpen(&w, path, (unsigned char*)table, sizeof(table), sizeof(buf), 0);
+  assert("Good rc from log open", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto exit;
+  memset(order, '\0', sizeof(order));
+  rc = test13_kept(&w, order);
+  assert("Publishes kept over the restart, in order", rc == 2 && strcmp(order, "12") == 0,
+      "kept were %s", order);
+  MQTTWalPersistenceClose(&w);
+  unlink(path);
+
+  /* killed after the publish was sent, before its PUBACK */
+  memset(&address, '\0', sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  listener = socket(AF_INET, SOCK_STREAM, 0);
+  if (listener == -1 || bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+      listen(listener, 1) != 0 || getsockname(listener, (struct sockaddr*)&address, &address_len) != 0)
+  {
+    assert("Good listener", 0, "errno was %d", errno);
+    goto exit;
+  }
+  len = 0;
+  if ((pid = fork()) == 0)
+    test13_crash(path, ntohs(address.sin_port), table, sizeof(table));
+  if ((fd = accept(listener, NULL, NULL)) != -1)
+  {
+    struct timeval tv = {5, 0};
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (recv(fd, buf, sizeof(buf), 0) > 0 && buf[0] == 0x10 && send(fd, "\x20\x02\x00\x00", 4, 0) == 4)
+      len = recv(fd, buf, sizeof(buf), 0); /* the CONNECT answered, here comes the publish */
+  }
+  assert("Publish sent", fd != -1 && len > 0 && (buf[0] & 0xF0) == 0x30, "len was %d", len);
+  kill(pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+  if (fd != -1)
+    close(fd);
+  close(listener);
+
+  rc = MQTTWalPersistenceOpen(&w, path, (unsigned char*)table, sizeof(table), sizeof(buf), 0);
+  assert("Good rc from log open", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto exit;
+  rc = test13_kept(&w, NULL);
+  assert("Publish in flight kept over the crash", rc == 1, "kept were %d", rc);
+  MQTTWalPersistenceClose(&w);
+  unlink(path);
+
+  /* a reconnect while a publish is committed sends it, so the publisher mustn't send it again */
+  if (options.loopback)
+    goto checkpoints;
+  rc = MQTTWalPersistenceOpen(&w, path, (unsigned char*)table, sizeof(table), sizeof(buf), 0);
+  assert("Good rc from log open", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto exit;
+  NetworkInit(&reconnecting);
+  rc = NetworkConnect(&reconnecting, options.host, options.port);
+  assert("Good rc from TCP connect", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto exit;
+  MQTTClientInit(&c, &reconnecting, 5000, buf, sizeof(buf), readbuf, sizeof(readbuf));
+  MQTTSetPersistence(&c, &w.persistence);
+  data.clientID.cstring = "wal-reconnect";
+  rc = MQTTSetAutoReconnect(&c, &data, test13_reconnect, &options, 100, 2000);
+  assert("Good rc from set auto reconnect", rc == SUCCESS, "rc was %d", rc);
+  if (rc == SUCCESS)
+    rc = MQTTConnect(&c, &data);
+  assert("Good rc from connect", rc == SUCCESS, "rc was %d", rc);
+  if (rc == SUCCESS)
+    rc = MQTTStartTask(&c);
+  assert("Good rc from start task", rc == SUCCESS, "rc was %d", rc);
+  if (rc == SUCCESS)
+    rc = MQTTSubscribe(&c, "C client test13 reconnect", QOS1, test13_messageArrived);
+  assert("Good rc from subscribe", rc == SUCCESS, "rc was %d", rc);
+  if (rc == SUCCESS)
+  {
+    test13_arrived = 0;
+    test13_client = &c;
+    test13_network = &reconnecting;
+    test13_commit = w.persistence.commit;
+    w.persistence.commit = test13_break;
+    memset(&pubmsg, '\0', sizeof(pubmsg));
+    pubmsg.payload = "committed across a reconnect";
+    pubmsg.payloadlen = strlen(pubmsg.payload);
+    pubmsg.qos = QOS1;
+    rc = MQTTPublish(&c, "C client test13 reconnect", &pubmsg);
+    assert("Good rc from publish", rc == SUCCESS, "rc was %d", rc);
+    for (i = 0; i < 50 && test13_arrived < 2; ++i)
+      usleep(10000L); /* for a second copy to arrive, if one was sent */
+    assert("The publish arrived once", test13_arrived == 1, "arrived was %d", test13_arrived);
+    MQTTDisconnect(&c);
+  }
+  MQTTStopTask(&c);
+  NetworkDisconnect(&reconnecting);
+  MQTTWalPersistenceClose(&w);
+  unlink(path);
+
+checkpoints:
+  /* checkpoints while the others publish */
+  rc = MQTTWalPersistenceOpen(&w, path, (unsigned char*)table, sizeof(table), sizeof(buf), 0);
+  assert("Good rc from log open", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto exit;
+  for (i = 0; i < TEST13_THREADS; ++i)
+  {
+    churners[i].w = &w;
+    churners[i].id = i + 1;
+    churners[i].failures = 0;
+    rc = ThreadStart(&threads[i], test13_churn, &churners[i]);
+    assert("Good rc from thread start", rc == SUCCESS, "rc was %d", rc);
+  }
+  for (i = 0; i < TEST13_THREADS; ++i)
+  {
+    ThreadJoin(&threads[i]);
+    assert("All log changes succeeded", churners[i].failures == 0, "failures was %d", churners[i].failures);
+  }
+  MQTTWalPersistenceGetMetrics(&w, &metrics);
+  MyLog(LOGA_INFO, "%u records, %u commits, %u checkpoints", metrics.records, metrics.commits, metrics.checkpoints);
+  assert("The log was rewritten", metrics.checkpoints > 0, "checkpoints were %u", metrics.checkpoints);
+  MQTTWalPersistenceClose(&w);
+
+  rc = MQTTWalPersistenceOpen(&w, path, (unsigned char*)table, sizeof(table), sizeof(buf), 0);
+  assert("Good rc from log open", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto exit;
+  memset(order, '\0', sizeof(order));
+  rc = test13_kept(&w, order);
+  assert("Only the publishes left kept over the checkpoints", rc == TEST13_THREADS &&
+      strspn(order, "2") == TEST13_THREADS, "kept were %s", order);
+  MQTTWalPersistenceClose(&w);
+  unlink(path);
+
+exit:
+  MyLog(LOGA_INFO, "TEST13: test %s. %d tests run, %d failures.",
+      (failures == 0) ? "passed" : "failed", tests, failures);
+  write_test_result();
+  return failures;
+}
+#endif
+
+
+#if defined(MQTT_URING)
+/*********************************************************************
+
+Test 14: the io_uring network
+
+*********************************************************************/
+#define TEST14_MESSAGES 200
+#define TEST14_LARGE 20000 /* more than a receive buffer, and more than half the send buffer */
+static volatile int test14_arrived = 0;
+static volatile int test14_large_arrived = 0;
+
+void test14_messageArrived(MessageData* md)
+{
+  if (md->message->payloadlen == TEST14_LARGE)
+    test14_large_arrived++;
+  else
+    test14_arrived++;
+}
+
+
+int test14(struct Options options)
+{
+  UringNetwork u;
+  UringMetrics metrics;
+  MQTTClient c;
+  int rc = 0;
+  int i = 0;
+  int wait_count = 0;
+  char* test_topic = "C client test14";
+  static unsigned char buf[TEST14_LARGE + 100];
+  static unsigned char readbuf[TEST14_LARGE + 100];
+  static char large[TEST14_LARGE];
+
+  fprintf(xml, "<testcase classname=\"test14\" name=\"io_uring network\"");
+  global_start_time = start_clock();
+  failures = 0;
+  MyLog(LOGA_INFO, "Starting test 14 - io_uring network");
+
+  if (options.loopback)
+  {
+    MyLog(LOGA_INFO, "Needs a broker, skipping with --loopback");
+    goto exit;
+  }
+
+  test14_arrived = test14_large_arrived = 0;
+  UringNetworkInit(&u);
+  rc = UringNetworkConnect(&u, options.host, options.port);
+  if (rc != SUCCESS)
+  {
+    Network n;
+
+    NetworkInit(&n);
+    if (NetworkConnect(&n, options.host, options.port) == SUCCESS)
+    {   /* the server is there, so it's the kernel which can't */
+      NetworkDisconnect(&n);
+      MyLog(LOGA_INFO, "io_uring is not available, skipping");
+      goto exit;
+    }
+  }
+  assert("Good rc from io_uring connect", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto exit;
+  MQTTClientInit(&c, &u.net, 1000, buf, sizeof(buf), readbuf, sizeof(readbuf));
+#if defined(MQTT_TASK)
+  rc = MQTTStartTask(&c);
+  assert("Good rc from start task", rc == SUCCESS, "rc was %d", rc);
+#endif
+
+  MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+  data.MQTTVersion = options.MQTTVersion;
+  data.clientID.cstring = "io_uring-test";
+  data.keepAliveInterval = 20;
+  data.cleansession = 1;
+  rc = MQTTConnect(&c, &data);
+  assert("Good rc from connect", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto stop;
+
+  rc = MQTTSubscribe(&c, test_topic, QOS2, test14_messageArrived);
+  assert("Good rc from subscribe", rc == SUCCESS, "rc was %d", rc);
+
+  /* a burst of QoS 0 publishes, which can go out in fewer sends than there are packets */
+#if !defined(MQTT_TASK)
+  UringNetworkSetBatching(&u, 1);
+#endif
+  memset(&pubmsg, '\0', sizeof(pubmsg));
+  pubmsg.payload = "io_uring message";
+  pubmsg.payloadlen = strlen(pubmsg.payload);
+  pubmsg.qos = QOS0;
+  for (i = 0; i < TEST14_MESSAGES; ++i)
+  {
+    rc = MQTTPublish(&c, test_topic, &pubmsg);
+    assert("Good rc from publish", rc == SUCCESS, "rc was %d", rc);
+  }
+  wait_count = 100;
+  while (test14_arrived < TEST14_MESSAGES && wait_count-- > 0)
+    MQTTYield(&c, 100);
+  assert("All messages arrived", test14_arrived == TEST14_MESSAGES, "arrived was %d", test14_arrived);
+
+  UringNetworkGetMetrics(&u, &metrics);
+  MyLog(LOGA_INFO, "%u writes in %u sends, %u receive completions, %u system calls",
+      metrics.writes, metrics.sends, metrics.recvs, metrics.enters);
+#if defined(MQTT_TASK)
+  assert("No more sends than writes", metrics.sends <= metrics.writes, "sends were %u", metrics.sends);
+#else
+  assert("Writes batched into fewer sends", metrics.sends < metrics.writes / 2, "sends were %u", metrics.sends);
+  UringNetworkSetBatching(&u, 0);
+#endif
+  assert("Data was received through the ring", metrics.recvs > 0, "recvs were %u", metrics.recvs);
+
+  test14_arrived = 0;
+  for (i = 1; i <= TEST14_MESSAGES / 10; ++i)
+  {
+    pubmsg.qos = (i % 2) ? QOS1 : QOS2;
+    rc = MQTTPublish(&c, test_topic, &pubmsg);
+    assert("Good rc from publish", rc == SUCCESS, "rc was %d", rc);
+  }
+
+  memset(large, 'L', sizeof(large));
+  pubmsg.payload = large;
+  pubmsg.payloadlen = sizeof(large);
+  pubmsg.qos = QOS1;
+  rc = MQTTPublish(&c, test_topic, &pubmsg);
+  assert("Good rc from large publish", rc == SUCCESS, "rc was %d", rc);
+
+  wait_count = 100;
+  while ((test14_arrived < TEST14_MESSAGES / 10 || test14_large_arrived < 1) && wait_count-- > 0)
+    MQTTYield(&c, 100);
+  assert("All messages arrived", test14_arrived == TEST14_MESSAGES / 10, "arrived was %d", test14_arrived);
+  assert("Large message arrived", test14_large_arrived == 1, "arrived was %d", test14_large_arrived);
+
+  rc = MQTTDisconnect(&c);
+  assert("Disconnect successful", rc == SUCCESS, "rc was %d", rc);
+
+stop:
+#if defined(MQTT_TASK)
+  MQTTStopTask(&c);
+#endif
+  UringNetworkDisconnect(&u);
+
+exit:
+  MyLog(LOGA_INFO, "TEST14: test %s. %d tests run, %d failures.",
+      (failures == 0) ? "passed" : "failed", tests, failures);
+  write_test_result();
+  return failures;
+}
+#endif
+
+#if defined(MQTT_ZEROCOPY)
+/*********************************************************************
+
+Test 15: large payloads sent from a file, and without copying
+
+*********************************************************************/
+#define TEST15_LARGE (1024 * 1024)
+static unsigned char* test15_expected = NULL;
+static volatile int test15_arrived = 0;
+static volatile int test15_matched = 0;
+static volatile int test15_len = 0;
+
+void test15_messageArrived(MessageData* md)
+{
+  test15_len = md->message->payloadlen;
+  if (test15_expected != NULL && memcmp(md->message->payload, test15_expected, md->message->payloadlen) == 0)
+    test15_matched++;
+  test15_arrived++;
+}
+
+
+int test15(struct Options options)
+{
+  Network n;
+  MQTTClient c;
+  int rc = 0;
+  int i = 0;
+  int fd = -1;
+  int wait_count = 0;
+  char* test_topic = "C client test15";
+  char* path = "test15.bin";
+  static unsigned char buf[200];
+  static unsigned char readbuf[TEST15_LARGE + 200];
+  static unsigned char pattern[TEST15_LARGE];
+
+  fprintf(xml, "<testcase classname=\"test15\" name=\"large payloads from a file and without copying\"");
+  global_start_time = start_clock();
+  failures = 0;
+  MyLog(LOGA_INFO, "Starting test 15 - large payloads from a file and without copying");
+
+  if (options.loopback)
+  {
+    MyLog(LOGA_INFO, "Needs a broker, skipping with --loopback");
+    goto exit;
+  }
+
+  for (i = 0; i < TEST15_LARGE; ++i)
+    pattern[i] = (unsigned char)(i * 7 + i / 256);
+  fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  assert("Good fd from open", fd >= 0, "fd was %d", fd);
+  if (fd < 0)
+    goto exit;
+  rc = (write(fd, pattern, sizeof(pattern)) == sizeof(pattern)) ? SUCCESS : FAILURE;
+  assert("File written", rc == SUCCESS, "rc was %d", rc);
+
+  NetworkInit(&n);
+  rc = NetworkConnect(&n, options.host, options.port);
+  assert("Good rc from TCP connect", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto close;
+  MQTTClientInit(&c, &n, 5000, buf, sizeof(buf), readbuf, sizeof(readbuf));
+#if defined(MQTT_TASK)
+  rc = MQTTStartTask(&c);
+  assert("Good rc from start task", rc == SUCCESS, "rc was %d", rc);
+#endif
+
+  MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+  data.MQTTVersion = options.MQTTVersion;
+  data.clientID.cstring = "zerocopy-test";
+  data.keepAliveInterval = 20;
+  data.cleansession = 1;
+  rc = MQTTConnect(&c, &data);
+  assert("Good rc from connect", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto stop;
+  rc = MQTTSubscribe(&c, test_topic, QOS1, test15_messageArrived);
+  assert("Good rc from subscribe", rc == SUCCESS, "rc was %d", rc);
+
+  /* the whole file, and then a piece from the middle of it, much larger than the send buffer */
+  memset(&pubmsg, '\0', sizeof(pubmsg));
+  for (i = 0; i < 2; ++i)
+  {
+    off_t offset = (i == 0) ? 0 : 1000;
+
+    test15_arrived = test15_matched = 0;
+    test15_expected = &pattern[offset];
+    pubmsg.payloadlen = (i == 0) ? TEST15_LARGE : 5000;
+    pubmsg.qos = (i == 0) ? QOS1 : QOS0;
+    rc = MQTTPublishFile(&c, test_topic, &pubmsg, fd, offset);
+    assert("Good rc from publish file", rc == SUCCESS, "rc was %d", rc);
+    wait_count = 100;
+    while (test15_arrived < 1 && wait_count-- > 0)
+      MQTTYield(&c, 100);
+    assert("Message arrived from the file", test15_arrived == 1 && test15_matched == 1,
+        "length was %d", test15_len);
+  }
+
+  /* straight from memory, which can be changed as soon as the publish returns */
+  test15_arrived = test15_matched = 0;
+  test15_expected = pattern;
+  pubmsg.payload = pattern;
+  pubmsg.payloadlen = TEST15_LARGE;
+  pubmsg.qos = QOS1;
+  rc = MQTTPublishZeroCopy(&c, test_topic, &pubmsg);
+  assert("Good rc from publish zero copy", rc == SUCCESS, "rc was %d", rc);
+  MyLog(LOGA_INFO, "MSG_ZEROCOPY %s: %u sends, %u completed, %u of them copied",
+      n.zerocopy ? "on" : "off", n.zerocopy_sent, n.zerocopy_done, n.zerocopy_copied);
+  assert("All zerocopy sends completed", n.zerocopy_done == n.zerocopy_sent, "done was %u", n.zerocopy_done);
+  assert("Zerocopy sends made", !n.zerocopy || n.zerocopy_sent > 0, "sent was %u", n.zerocopy_sent);
+  wait_count = 100;
+  while (test15_arrived < 1 && wait_count-- > 0)
+    MQTTYield(&c, 100);
+  assert("Message arrived from memory", test15_arrived == 1 && test15_matched == 1,
+      "length was %d", test15_len);
+
+  rc = MQTTDisconnect(&c);
+  assert("Disconnect successful", rc == SUCCESS, "rc was %d", rc);
+
+stop:
+#if defined(MQTT_TASK)
+  MQTTStopTask(&c);
+#endif
+  NetworkDisconnect(&n);
+close:
+  close(fd);
+  unlink(path);
+
+exit:
+  MyLog(LOGA_INFO, "TEST15: test %s. %d tests run, %d failures.",
+      (failures == 0) ? "passed" : "failed", tests, failures);
+  write_test_result();
+  return failures;
+}
+#endif
+
+/*********************************************************************
+
+Test 16: connecting over a Unix domain socket
+
+*********************************************************************/
+#define TEST16_MESSAGES 30
+static volatile int test16_arrived = 0;
+
+void test16_messageArrived(MessageData* md)
+{
+  test16_arrived++;
+}
+
+
+int test16(struct Options options)
+{
+  Network n;
+  MQTTClient c;
+  int rc = 0;
+  int i = 0;
+  int wait_count = 0;
+  char* test_topic = "C client test16";
+  unsigned char buf[100];
+  unsigned char readbuf[100];
+
+  fprintf(xml, "<testcase classname=\"test16\" name=\"unix domain socket\"");
+  global_start_time = start_clock();
+  failures = 0;
+  MyLog(LOGA_INFO, "Starting test 16 - unix domain socket");
+
+  if (options.loopback)
+  {
+    MyLog(LOGA_INFO, "Needs a broker, skipping with --loopback");
+    goto exit;
+  }
+
+  if (options.unix_path == NULL)
+  {
+    MyLog(LOGA_INFO, "No --unix_path for the broker, skipping");
+    goto exit;
+  }
+
+  test16_arrived = 0;
+  NetworkInit(&n);
+  rc = NetworkConnectUnix(&n, options.unix_path);
+  assert("Good rc from unix connect", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto exit;
+  MQTTClientInit(&c, &n, 1000, buf, sizeof(buf), readbuf, sizeof(readbuf));
+#if defined(MQTT_TASK)
+  rc = MQTTStartTask(&c);
+  assert("Good rc from start task", rc == SUCCESS, "rc was %d", rc);
+#endif
+
+  MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+  data.MQTTVersion = options.MQTTVersion;
+  data.clientID.cstring = "unix-socket-test";
+  data.keepAliveInterval = 20;
+  data.cleansession = 1;
+  rc = MQTTConnect(&c, &data);
+  assert("Good rc from connect", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto stop;
+
+  rc = MQTTSubscribe(&c, test_topic, QOS2, test16_messageArrived);
+  assert("Good rc from subscribe", rc == SUCCESS, "rc was %d", rc);
+
+  memset(&pubmsg, '\0', sizeof(pubmsg));
+  pubmsg.payload = "over a unix domain socket";
+  pubmsg.payloadlen = strlen(pubmsg.payload);
+  for (i = 0; i < TEST16_MESSAGES; ++i)
+  {
+    pubmsg.qos = i % 3;
+    rc = MQTTPublish(&c, test_topic, &pubmsg);
+    assert("Good rc from publish", rc == SUCCESS, "rc was %d", rc);
+  }
+  wait_count = 100;
+  while (test16_arrived < TEST16_MESSAGES && wait_count-- > 0)
+    MQTTYield(&c, 100);
+  assert("All messages arrived", test16_arrived == TEST16_MESSAGES, "arrived was %d", test16_arrived);
+
+  rc = MQTTDisconnect(&c);
+  assert("Disconnect successful", rc == SUCCESS, "rc was %d", rc);
+
+stop:
+#if defined(MQTT_TASK)
+  MQTTStopTask(&c);
+#endif
+  NetworkDisconnect(&n);
+
+exit:
+  MyLog(LOGA_INFO, "TEST16: test %s. %d tests run, %d failures.",
+      (failures == 0) ? "passed" : "failed", tests, failures);
+  write_test_result();
+  return failures;
+}
+
+#if defined(MQTT_TLS)
+/*********************************************************************
+
+Test 17: TLS, resuming the session when reconnecting
+
+A stand-in for a TLS broker runs on a thread here.  It makes a
+certificate for localhost, which the client is given as its CA, takes
+TLS connections one at a time, and passes what they carry to and from
+the broker in the clear.
+
+*********************************************************************/
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+
+#define TEST17_LARGE (100 * 1024)
+static SSL_CTX* test17_ctx = NULL;
+static int test17_listener = -1;
+static int test17_stopping = 0;
+static volatile int test17_handshakes = 0;
+static volatile int test17_resumed = 0;
+static struct Options test17_options;
+static unsigned char* test17_expected = NULL;
+static volatile int test17_arrived = 0;
+static volatile int test17_matched = 0;
+
+void test17_messageArrived(MessageData* md)
+{
+  if (test17_expected != NULL && md->message->payloadlen == TEST17_LARGE &&
+      memcmp(md->message->payload, test17_expected, TEST17_LARGE) == 0)
+    test17_matched++;
+  test17_arrived++;
+}
+
+
+/* a key, and a certificate for it which signs itself, for the stand-in to use and the client to trust */
+static int test17_certify(char* CAfile)
+{
+  EVP_PKEY* key = EVP_EC_gen("P-256");
+  X509* cert = X509_new();
+  X509_EXTENSION* ext = NULL;
+  FILE* f = NULL;
+  int rc = FAILURE;
+
+  if (key == NULL || cert == NULL)
+    goto exit;
+  X509_set_version(cert, 2);
+  ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+  X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+  X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+  X509_set_pubkey(cert, key);
+  X509_NAME_add_entry_by_txt(X509_get_subject_name(cert), "CN", MBSTRING_ASC, (unsigned char*)"localhost", -1, -1, 0);
+  X509_set_issuer_name(cert, X509_get_subject_name(cert));
+  if ((ext = X509V3_EXT_conf_nid(NULL, NULL, NID_subject_alt_name, "DNS:localhost,IP:127.0.0.1")) == NULL)
+    goto exit;
+  X509_add_ext(cert, ext, -1);
+  X509_EXTENSION_free(ext);
+  if (X509_sign(cert, key, EVP_sha256()) == 0 || (f = fopen(CAfile, "w")) == NULL)
+    goto exit;
+  rc = (PEM_write_X509(f, cert) == 1) ? SUCCESS : FAILURE;
+  fclose(f);
+  if (rc == SUCCESS && ((test17_ctx = SSL_CTX_new(TLS_server_method())) == NULL ||
+      SSL_CTX_use_certificate(test17_ctx, cert) != 1 || SSL_CTX_use_PrivateKey(test17_ctx, key) != 1))
+    rc = FAILURE;
+exit:
+  X509_free(cert);
+  EVP_PKEY_free(key);
+  return rc;
+}
+
+
+/* pass one TLS connection's data to and from the broker, until either end closes */
+static void test17_relay(SSL* ssl, int client)
+{
+  Network broker;
+  unsigned char buf[4096];
+
+  NetworkInit(&broker);
+  if (NetworkConnect(&broker, test17_options.host, test17_options.port) != 0)
+    return;
+  while (!__atomic_load_n(&test17_stopping, __ATOMIC_ACQUIRE))
+  {
+    struct pollfd pfds[2] = {{client, POLLIN, 0}, {broker.my_socket, POLLIN, 0}};
+    int len = 0;
+
+    if (SSL_pending(ssl) == 0 && poll(pfds, 2, 100) <= 0)
+      continue;
+    if (SSL_pending(ssl) > 0 || pfds[0].revents)
+    {
+      if ((len = SSL_read(ssl, buf, sizeof(buf))) <= 0 || linux_write(&broker, buf, len, 1000) != len)
+        break;
+    }
+    if (pfds[1].revents)
+    {
+      if ((len = recv(broker.my_socket, buf, sizeof(buf), 0)) == -1 && errno == EAGAIN)
+        continue;
+      if (len <= 0 || SSL_write(ssl, buf, len) != len)
+        break;
+    }
+  }
+  NetworkDisconnect(&broker);
+}
+
+
+static void* test17_serve(void* parm)
+{
+  while (!__atomic_load_n(&test17_stopping, __ATOMIC_ACQUIRE))
+  {
+    struct pollfd pfd = {test17_listener, POLLIN, 0};
+    SSL* ssl = NULL;
+    int client = -1;
+
+    if (poll(&pfd, 1, 100) <= 0 || (client = accept(test17_listener, NULL, NULL)) == -1)
+      continue;
+    if ((ssl = SSL_new(test17_ctx)) != NULL && SSL_set_fd(ssl, client) == 1 && SSL_accept(ssl) == 1)
+    {
+      test17_handshakes++;
+      if (SSL_session_reused(ssl))
+        test17_resumed++;
+      test17_relay(ssl, client);
+      SSL_shutdown(ssl);
+    }
+    SSL_free(ssl);
+    close(client);
+  }
+  return NULL;
+}
+
+
+int test17(struct Options options)
+{
+  TLSNetwork t;
+  TLSNetwork untrusted;
+  MQTTClient c;
+  pthread_t server;
+  struct sockaddr_in address;
+  socklen_t addrlen = sizeof(address);
+  int rc = 0;
+  int i = 0;
+  int fd = -1;
+  int port = 0;
+  int connection = 0;
+  int wait_count = 0;
+  char* test_topic = "C client test17";
+  char* CAfile = "test17_ca.pem";
+  char* path = "test17.bin";
+  static unsigned char buf[TEST17_LARGE + 200];
+  static unsigned char readbuf[TEST17_LARGE + 200];
+  static unsigned char pattern[TEST17_LARGE];
+
+  fprintf(xml, "<testcase classname=\"test17\" name=\"TLS with session resumption\"");
+  global_start_time = start_clock();
+  failures = 0;
+  MyLog(LOGA_INFO, "Starting test 17 - TLS with session resumption");
+
+  if (options.loopback)
+  {
+    MyLog(LOGA_INFO, "Needs a broker, skipping with --loopback");
+    goto exit;
+  }
+
+  test17_options = options;
+  test17_stopping = test17_handshakes = test17_resumed = 0;
+  rc = test17_certify(CAfile);
+  assert("Certificate made", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto exit;
+  memset(&address, '\0', sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if ((test17_listener = socket(AF_INET, SOCK_STREAM, 0)) == -1 ||
+      bind(test17_listener, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(test17_listener, 4) != 0 ||
+      getsockname(test17_listener, (struct sockaddr*)&address, &addrlen) != 0 ||
+      pthread_create(&server, NULL, test17_serve, NULL) != 0)
+  {
+    assert("TLS stand-in started", 0, "errno was %d", errno);
+    goto free;
+  }
+  port = ntohs(address.sin_port);
+
+  for (i = 0; i < TEST17_LARGE; ++i)
+    pattern[i] = (unsigned char)(i * 13 + i / 512);
+  fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  rc = (fd >= 0 && write(fd, pattern, sizeof(pattern)) == sizeof(pattern)) ? SUCCESS : FAILURE;
+  assert("File written", rc == SUCCESS, "rc was %d", rc);
+
+  rc = TLSNetworkInit(&t, CAfile, 1);
+  assert("Good rc from TLS init", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto stop;
+
+  /* the second connection resumes the first's session */
+  for (connection = 0; connection < 2; ++connection)
+  {
+    rc = TLSNetworkConnect(&t, "localhost", port);
+    assert("Good rc from TLS connect", rc == SUCCESS, "rc was %d", rc);
+    if (rc != SUCCESS)
+      break;
+    assert("Session resumed on reconnecting", t.resumed == connection, "resumed was %d", t.resumed);
+    MyLog(LOGA_INFO, "Connection %d: %s handshake, kernel TLS %s", connection + 1,
+        t.resumed ? "abbreviated" : "full", t.ktls_send ? "on" : "off");
+
+    MQTTClientInit(&c, &t.net, 5000, buf, sizeof(buf), readbuf, sizeof(readbuf));
+#if defined(MQTT_TASK)
+    rc = MQTTStartTask(&c);
+    assert("Good rc from start task", rc == SUCCESS, "rc was %d", rc);
+#endif
+    MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+    data.MQTTVersion = options.MQTTVersion;
+    data.clientID.cstring = "tls-test";
+    data.keepAliveInterval = 20;
+    data.cleansession = 1;
+    rc = MQTTConnect(&c, &data);
+    assert("Good rc from connect", rc == SUCCESS, "rc was %d", rc);
+    if (rc == SUCCESS)
+      rc = MQTTSubscribe(&c, test_topic, QOS2, test17_messageArrived);
+    assert("Good rc from subscribe", rc == SUCCESS, "rc was %d", rc);
+
+    /* a large payload from the file, then from memory, at each QoS */
+    test17_arrived = test17_matched = 0;
+    test17_expected = pattern;
+    memset(&pubmsg, '\0', sizeof(pubmsg));
+    pubmsg.payload = pattern;
+    pubmsg.payloadlen = TEST17_LARGE;
+    pubmsg.qos = QOS0;
+    rc = MQTTPublishFile(&c, test_topic, &pubmsg, fd, 0);
+    assert("Good rc from publish file", rc == SUCCESS, "rc was %d", rc);
+    rc = MQTTPublishZeroCopy(&c, test_topic, &pubmsg);
+    assert("Good rc from publish zero copy", rc == SUCCESS, "rc was %d", rc);
+    for (pubmsg.qos = QOS0; pubmsg.qos <= QOS2; ++pubmsg.qos)
+    {
+      rc = MQTTPublish(&c, test_topic, &pubmsg);
+      assert("Good rc from publish", rc == SUCCESS, "rc was %d", rc);
+    }
+    wait_count = 100;
+    while (test17_arrived < 5 && wait_count-- > 0)
+      MQTTYield(&c, 100);
+    assert("All messages arrived intact", test17_arrived == 5 && test17_matched == 5,
+        "arrived was %d", test17_arrived);
+
+    rc = MQTTDisconnect(&c);
+    assert("Disconnect successful", rc == SUCCESS, "rc was %d", rc);
+#if defined(MQTT_TASK)
+    MQTTStopTask(&c);
+#endif
+    TLSNetworkDisconnect(&t);
+  }
+  TLSNetworkRelease(&t);
+
+  /* nor is a server trusted which the system's certificates don't vouch for */
+  rc = TLSNetworkInit(&untrusted, NULL, 0);
+  assert("Good rc from TLS init", rc == SUCCESS, "rc was %d", rc);
+  if (rc == SUCCESS)
+  {
+    rc = TLSNetworkConnect(&untrusted, "localhost", port);
+    assert("Untrusted server refused", rc == FAILURE, "rc was %d", rc);
+    TLSNetworkRelease(&untrusted);
+  }
+  MyLog(LOGA_INFO, "%d handshakes, %d of them resumed", test17_handshakes, test17_resumed);
+
+stop:
+  __atomic_store_n(&test17_stopping, 1, __ATOMIC_RELEASE);
+  pthread_join(server, NULL);
+  if (fd >= 0)
+    close(fd);
+  unlink(path);
+free:
+  if (test17_listener != -1)
+    close(test17_listener);
+  test17_listener = -1;
+  SSL_CTX_free(test17_ctx);
+  test17_ctx = NULL;
+  unlink(CAfile);
+
+exit:
+  MyLog(LOGA_INFO, "TEST17: test %s. %d tests run, %d failures.",
+      (failures == 0) ? "passed" : "failed", tests, failures);
+  write_test_result();
+  return failures;
+}
+#endif
+
+/*********************************************************************
+
+Test 18: socket options
+
+*********************************************************************/
+static int test18_option(Network* n, int level, int name)
+{
+  int value = -1;
+  socklen_t len = sizeof(value);
+
+  if (getsockopt(n->my_socket, level, name, &value, &len) != 0)
+    return -1;
+  return value;
+}
+
+
+int test18(struct Options options)
+{
+  Network n;
+  MQTTClient c;
+  int rc = 0;
+  int i = 0;
+  unsigned char buf[100];
+  unsigned char readbuf[100];
+  NetworkSocketOptions defaults = NetworkSocketOptions_initializer;
+  NetworkSocketOptions tuned = NetworkSocketOptions_initializer;
+
+  fprintf(xml, "<testcase classname=\"test18\" name=\"socket options\"");
+  global_start_time = start_clock();
+  failures = 0;
+  MyLog(LOGA_INFO, "Starting test 18 - socket options");
+
+  if (options.loopback)
+  {
+    MyLog(LOGA_INFO, "Needs a broker, skipping with --loopback");
+    goto exit;
+  }
+
+  /* the defaults turn Nagle's algorithm off; then Nagle on, with buffer sizes and a user timeout */
+  tuned.nodelay = 0;
+  tuned.sndbuf = tuned.rcvbuf = 65536;
+  tuned.user_timeout_ms = 20000;
+  for (i = 0; i < 2; ++i)
+  {
+    NetworkSocketOptions* o = (i == 0) ? &defaults : &tuned;
+
+    NetworkInit(&n);
+    if (i == 1)
+      NetworkSetSocketOptions(&n, &tuned);
+    rc = NetworkConnect(&n, options.host, options.port);
+    assert("Good rc from TCP connect", rc == SUCCESS, "rc was %d", rc);
+    if (rc != SUCCESS)
+      goto exit;
+
+    rc = test18_option(&n, IPPROTO_TCP, TCP_NODELAY);
+    assert("TCP_NODELAY as asked", (rc != 0) == o->nodelay, "TCP_NODELAY was %d", rc);
+    if (o->sndbuf > 0)
+    {
+      rc = test18_option(&n, SOL_SOCKET, SO_SNDBUF);
+      assert("SO_SNDBUF at least as asked", rc >= o->sndbuf, "SO_SNDBUF was %d", rc);
+      rc = test18_option(&n, SOL_SOCKET, SO_RCVBUF);
+      assert("SO_RCVBUF at least as asked", rc >= o->rcvbuf, "SO_RCVBUF was %d", rc);
+    }
+#if defined(TCP_USER_TIMEOUT)
+    rc = test18_option(&n, IPPROTO_TCP, TCP_USER_TIMEOUT);
+    assert("TCP_USER_TIMEOUT as asked", rc == (int)o->user_timeout_ms, "TCP_USER_TIMEOUT was %d", rc);
+#endif
+
+    /* and the connection works as before */
+    MQTTClientInit(&c, &n, 1000, buf, sizeof(buf), readbuf, sizeof(readbuf));
+#if defined(MQTT_TASK)
+    rc = MQTTStartTask(&c);
+    assert("Good rc from start task", rc == SUCCESS, "rc was %d", rc);
+#endif
+    MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+    data.MQTTVersion = options.MQTTVersion;
+    data.clientID.cstring = "socket-options-test";
+    data.keepAliveInterval = 20;
+    data.cleansession = 1;
+    rc = MQTTConnect(&c, &data);
+    assert("Good rc from connect", rc == SUCCESS, "rc was %d", rc);
+    if (rc == SUCCESS)
+    {
+      memset(&pubmsg, '\0', sizeof(pubmsg));
+      pubmsg.payload = "socket options";
+      pubmsg.payloadlen = 14;
+      pubmsg.qos = QOS1;
+      rc = MQTTPublish(&c, "C client test18", &pubmsg);
+      assert("Good rc from publish", rc == SUCCESS, "rc was %d", rc);
+      rc = MQTTDisconnect(&c);
+      assert("Disconnect successful", rc == SUCCESS, "rc was %d", rc);
+    }
+#if defined(MQTT_TASK)
+    MQTTStopTask(&c);
+#endif
+    NetworkDisconnect(&n);
+  }
+
+exit:
+  MyLog(LOGA_INFO, "TEST18: test %s. %d tests run, %d failures.",
+      (failures == 0) ? "passed" : "failed", tests, failures);
+  write_test_result();
+  return failures;
+}
+
+
+/*********************************************************************
+
+Test 19: IPv6, and racing the addresses of a host name
+
+The test listens on the loopback addresses itself: a TCP connect is
+complete once the listener's kernel has answered, before any accept.
+A listener whose queue is full doesn't answer at all, as for a host
+which has gone away.
+
+*********************************************************************/
+static int test19_listen(int family, int port, int backlog)
+{
+  union
+  {
+    struct sockaddr sa;
+    struct sockaddr_in in;
+    struct sockaddr_in6 in6;
+  } a;
+  socklen_t len = (family == AF_INET6) ? sizeof(a.in6) : sizeof(a.in);
+  int fd = socket(family, SOCK_STREAM, 0);
+
+  memset(&a, '\0', sizeof(a));
+  if (family == AF_INET6)
+  {
+    a.in6.sin6_family = AF_INET6;
+    a.in6.sin6_addr = in6addr_loopback;
+    a.in6.sin6_port = htons(port);
+  }
+  else
+  {
+    a.in.sin_family = AF_INET;
+    a.in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    a.in.sin_port = htons(port);
+  }
+  if (fd != -1 && (bind(fd, &a.sa, len) != 0 || listen(fd, backlog) != 0))
+  {
+    close(fd);
+    fd = -1;
+  }
+  return fd;
+}
+
+
+static int test19_port(int fd)
+{
+  struct sockaddr_in6 a;
+  socklen_t len = sizeof(a);
+
+  getsockname(fd, (struct sockaddr*)&a, &len);
+  return ntohs(a.sin6_port); /* at the same place as sin_port */
+}
+
+
+static int test19_family(Network* n)
+{
+  struct sockaddr_in6 a;
+  socklen_t len = sizeof(a);
+
+  a.sin6_family = AF_UNSPEC;
+  getpeername(n->my_socket, (struct sockaddr*)&a, &len);
+  return a.sin6_family;
+}
+
+
+/* fill the listener's queue with connections it doesn't accept, until one goes unanswered.
+ * @return the number of sockets used */
+static int test19_fill(int port, int family, int* fds, int max)
+{
+  int count = 0;
+
+  while (count < max)
+  {
+    struct pollfd pfd = {-1, POLLOUT, 0};
+    struct sockaddr_in6 a;
+    int err = 0;
+    socklen_t errlen = sizeof(err);
+
+    memset(&a, '\0', sizeof(a));
+    a.sin6_family = AF_INET6;
+    a.sin6_addr = in6addr_loopback;
+    a.sin6_port = htons(port);
+    if (family != AF_INET6)
+    {
+      struct sockaddr_in* in = (struct sockaddr_in*)&a;
+      in->sin_family = AF_INET;
+      in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    }
+    if ((pfd.fd = fds[count++] = socket(family, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1)
+      break;
+    if (connect(pfd.fd, (struct sockaddr*)&a, (family == AF_INET6) ? sizeof(a) : sizeof(struct sockaddr_in)) != 0 &&
+        (errno != EINPROGRESS || poll(&pfd, 1, 200) == 0))
+      break; /* unanswered */
+    if (getsockopt(pfd.fd, SOL_SOCKET, SO_ERROR, &err, &errlen) != 0 || err != 0)
+      break;
+  }
+  return count;
+}
+
+
+int test19(struct Options options)
+{
+  Network n;
+  int rc = 0;
+  int live = -1, dead = -1, port = 0;
+  int fillers[8];
+  int nfillers = 0;
+  int i = 0;
+  long ms = 0;
+  START_TIME_TYPE start;
+  struct addrinfo hints = {0, AF_UNSPEC, SOCK_STREAM, IPPROTO_TCP, 0, NULL, NULL, NULL};
+  struct addrinfo *result = NULL, *res = NULL;
+  int families[2] = {AF_UNSPEC, AF_UNSPEC};
+
+  fprintf(xml, "<testcase classname=\"test19\" name=\"IPv6 and racing addresses\"");
+  global_start_time = start_clock();
+  failures = 0;
+  MyLog(LOGA_INFO, "Starting test 19 - IPv6, and racing the addresses of a host name");
+
+  NetworkInit(&n);
+  if ((live = test19_listen(AF_INET6, 0, 5)) == -1)
+    MyLog(LOGA_INFO, "No IPv6 loopback address, not connecting over IPv6");
+  else
+  {
+    port = test19_port(live);
+    rc = NetworkConnect(&n, "::1", port);
+    assert("Good rc from IPv6 connect", rc == SUCCESS, "rc was %d", rc);
+    if (rc == SUCCESS)
+    {
+      assert("Connected over IPv6", test19_family(&n) == AF_INET6, "family was %d", test19_family(&n));
+      NetworkDisconnect(&n);
+    }
+    close(live);
+  }
+
+  /* nothing listening: refused at once, not waited on */
+  live = test19_listen(AF_INET, 0, 5);
+  port = test19_port(live);
+  close(live);
+  start = start_clock();
+  rc = NetworkConnect(&n, "127.0.0.1", port);
+  ms = elapsed(start);
+  assert("Connect refused", rc != SUCCESS, "rc was %d", rc);
+  assert("Refused without waiting", ms < 1000, "took %ld ms", ms);
+
+  /* the first address of localhost unanswered: the next is tried after the attempt delay */
+  if (getaddrinfo("localhost", NULL, &hints, &result) == 0)
+  {
+    families[0] = result->ai_family;
+    for (res = result; res; res = res->ai_next)
+    {
+      if (res->ai_family != families[0] && (res->ai_family == AF_INET || res->ai_family == AF_INET6))
+        families[1] = res->ai_family;
+    }
+    freeaddrinfo(result);
+  }
+  if (families[1] == AF_UNSPEC)
+  {
+    MyLog(LOGA_INFO, "localhost has addresses in one family, not racing them");
+    goto exit;
+  }
+  live = test19_listen(families[1], 0, 5);
+  port = test19_port(live);
+  if ((dead = test19_listen(families[0], port, 0)) == -1)
+  {
+    MyLog(LOGA_INFO, "Port %d in use for the other family, not racing", port);
+    goto close;
+  }
+  nfillers = test19_fill(port, families[0], fillers, ARRAY_SIZE(fillers));
+  start = start_clock();
+  rc = NetworkConnect(&n, "localhost", port);
+  ms = elapsed(start);
+  assert("Good rc from connect", rc == SUCCESS, "rc was %d", rc);
+  MyLog(LOGA_INFO, "Connected in %ld ms, past an unanswered first address", ms);
+  if (rc == SUCCESS)
+  {
+    assert("Connected to the second family", test19_family(&n) == families[1], "family was %d", test19_family(&n));
+    NetworkDisconnect(&n);
+  }
+  assert("Connected soon after the attempt delay", ms >= LINUX_CONNECT_ATTEMPT_DELAY_MS - 50 && ms < LINUX_CONNECT_ATTEMPT_DELAY_MS + 1000,
+      "took %ld ms", ms);
+
+  for (i = 0; i < nfillers; ++i)
+    close(fillers[i]);
+  close(dead);
+close:
+  close(live);
+exit:
+  MyLog(LOGA_INFO, "TEST19: test %s. %d tests run, %d failures.",
+      (failures == 0) ? "passed" : "failed", tests, failures);
+  write_test_result();
+  return failures;
+}
+
+
+#if defined(MQTT_TASK)
+/*********************************************************************
+
+Test 20: a group of connections, with topics sharded across them
+
+*********************************************************************/
+#define TEST20_SHARDS 4
+#define TEST20_TOPICS 8
+#define TEST20_MESSAGES 50
+static MQTTGroup test20_group;
+static volatile int test20_arrived = 0;
+static volatile int test20_out_of_order = 0;
+static int test20_next[TEST20_TOPICS];
+
+void test20_messageArrived(MessageData* md)
+{
+  char payload[20];
+  int topic = -1, seq = -1;
+
+  /* the payload isn't terminated */
+  snprintf(payload, sizeof(payload), "%.*s", (int)md->message->payloadlen, (char*)md->message->payload);
+  /* one shard has the subscription, so this is only ever called on its thread */
+  if (sscanf(payload, "%d %d", &topic, &seq) == 2 && topic >= 0 && topic < TEST20_TOPICS)
+  {
+    if (seq != test20_next[topic])
+      test20_out_of_order++;
+    test20_next[topic] = seq + 1;
+  }
+  test20_arrived++;
+}
+
+
+struct test20_publisher
+{
+  int first;                      /* publishes the topics first, first + TEST20_SHARDS, ... */
+  int failures;
+};
+
+void test20_publish(void* parm)
+{
+  struct test20_publisher* p = (struct test20_publisher*)parm;
+  MQTTMessage msg;
+  char topic[40];
+  char payload[20];
+  int i, t;
+
+  memset(&msg, '\0', sizeof(msg));
+  msg.payload = payload;
+  for (i = 0; i < TEST20_MESSAGES; ++i)
+  {
+    for (t = p->first; t < TEST20_TOPICS; t += TEST20_SHARDS)
+    {
+      sprintf(topic, "C client test20/%d", t);
+      sprintf(payload, "%d %d", t, i);
+      msg.payloadlen = strlen(payload);
+      msg.qos = (enum QoS)(i % 3);
+      if (MQTTGroupPublish(&test20_group, topic, &msg) != SUCCESS)
+        p->failures++;
+    }
+  }
+}
+
+
+int test20(struct Options options)
+{
+  static unsigned char buf[TEST20_SHARDS * 100];
+  static unsigned char readbuf[TEST20_SHARDS * 100];
+  struct test20_publisher publishers[TEST20_SHARDS];
+  Thread threads[TEST20_SHARDS];
+  MQTTGroupMetrics metrics;
+  char* filter = "C client test20/#";
+  int rc = 0;
+  int i = 0;
+  int used = 0;
+  int wait_count = 0;
+
+  fprintf(xml, "<testcase classname=\"test20\" name=\"connection group\"");
+  global_start_time = start_clock();
+  failures = 0;
+  MyLog(LOGA_INFO, "Starting test 20 - a group of connections, with topics sharded across them");
+
+  if (options.loopback)
+  {
+    MyLog(LOGA_INFO, "Needs a broker, skipping with --loopback");
+    goto exit;
+  }
+
+  rc = MQTTGroupInit(&test20_group, TEST20_SHARDS, 5000, buf, sizeof(buf), readbuf, sizeof(readbuf));
+  assert("Good rc from group init", rc == SUCCESS, "rc was %d", rc);
+  MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+  data.MQTTVersion = options.MQTTVersion;
+  data.clientID.cstring = "group-test";
+  data.keepAliveInterval = 20;
+  data.cleansession = 1;
+  rc = MQTTGroupConnect(&test20_group, options.host, options.port, &data);
+  assert("Good rc from group connect", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto exit;
+  assert("Shard client ids numbered", strcmp(test20_group.shard[3].clientid, "group-test-3") == 0,
+      "client id was %s", test20_group.shard[3].clientid);
+  rc = MQTTGroupPin(&test20_group, 0);
+  assert("Good rc from pin", rc == SUCCESS, "rc was %d", rc);
+
+  /* spread: the subscription is on one shard, which receives every message */
+  memset(test20_next, '\0', sizeof(test20_next));
+  test20_arrived = test20_out_of_order = 0;
+  rc = MQTTGroupSubscribe(&test20_group, filter, QOS2, test20_messageArrived, GROUP_SPREAD);
+  assert("Good rc from group subscribe", rc == SUCCESS, "rc was %d", rc);
+
+  for (i = 0; i < TEST20_SHARDS; ++i)
+  {
+    publishers[i].first = i;
+    publishers[i].failures = 0;
+    ThreadStart(&threads[i], test20_publish, &publishers[i]);
+  }
+  for (i = 0; i < TEST20_SHARDS; ++i)
+  {
+    ThreadJoin(&threads[i]);
+    assert("All publishes succeeded", publishers[i].failures == 0, "failures were %d", publishers[i].failures);
+  }
+  wait_count = 100;
+  while (test20_arrived < TEST20_TOPICS * TEST20_MESSAGES && wait_count-- > 0)
+    usleep(50000L);
+  assert("All messages arrived", test20_arrived == TEST20_TOPICS * TEST20_MESSAGES, "arrived was %d", test20_arrived);
+  assert("Each topic's messages arrived in order", test20_out_of_order == 0, "out of order were %d", test20_out_of_order);
+
+  MQTTGroupGetMetrics(&test20_group, &metrics);
+  for (i = 0; i < TEST20_SHARDS; ++i)
+  {
+    MyLog(LOGA_INFO, "Shard %d on CPU %d: %lu publishes", i, test20_group.shard[i].cpu, metrics.shard_published[i]);
+    if (metrics.shard_published[i] > 0)
+      used++;
+  }
+  assert("All shards connected", metrics.connected == TEST20_SHARDS, "connected was %d", metrics.connected);
+  assert("Publishes counted", metrics.published == TEST20_TOPICS * TEST20_MESSAGES && metrics.failed == 0,
+      "published was %lu", metrics.published);
+  assert("Topics spread over the shards", used > 1, "shards used were %d", used);
+  /* each topic on one shard, so its count is a multiple of the messages on a topic */
+  for (i = 0; i < TEST20_SHARDS; ++i)
+    assert("Whole topics on each shard", metrics.shard_published[i] % TEST20_MESSAGES == 0,
+        "publishes were %lu", metrics.shard_published[i]);
+
+  rc = MQTTGroupUnsubscribe(&test20_group, filter);
+  assert("Good rc from group unsubscribe", rc == SUCCESS, "rc was %d", rc);
+  rc = MQTTGroupDisconnect(&test20_group);
+  assert("Good rc from group disconnect", rc == SUCCESS, "rc was %d", rc);
+
+exit:
+  MyLog(LOGA_INFO, "TEST20: test %s. %d tests run, %d failures.",
+      (failures == 0) ? "passed" : "failed", tests, failures);
+  write_test_result();
+  return failures;
+}
+#endif
+
+#if 0
+/*********************************************************************
+
+Test 4: connectionLost and will message
+
+*********************************************************************/
+MQTTClient test6_c1, test6_c2;
+volatile int test6_will_message_arrived = 0;
+volatile int test6_connection_lost_called = 0;
+
+void test6_connectionLost(void* context, char* cause)
+{
+	MQTTClient c = (MQTTClient)context;
+	printf("%s -> Callback: connection lost\n", (c == test6_c1) ? "Client-1" : "Client-2");
+	test6_connection_lost_called = 1;
+}
+
+void test6_deliveryComplete(void* context, MQTTClient_deliveryToken token)
+{
+	printf("Client-2 -> Callback: publish complete for token %d\n", token);
+}
+
+char* test6_will_topic = "C Test 2: will topic";
+char* test6_will_message = "will message from Client-1";
+
+int test6_messageArrived(void* context, char* topicName, int topicLen, MQTTClient_message* m)
+{
+	MQTTClient c = (MQTTClient)context;
+	printf("%s -> Callback: message received on topic '%s' is '%.*s'.\n",
+			 (c == test6_c1) ? "Client-1" : "Client-2", topicName, m->payloadlen, (char*)(m->payload));
+	if (c == test6_c2 && strcmp(topicName, test6_will_topic) == 0 && memcmp(m->payload, test6_will_message, m->payloadlen) == 0)
+		test6_will_message_arrived = 1;
+	MQTTClient_free(topicName);
+	MQTTClient_freeMessage(&m);
+	return 1;
+}
+
+
+int test6(struct Options options)
+{
+	char* testname = "test6";
+	MQTTClient_connectOptions opts = MQTTClient_connectOptions_initializer;
+	MQTTClient_willOptions wopts =  MQTTClient_willOptions_initializer;
+	MQTTClient_connectOptions opts2 = MQTTClient_connectOptions_initializer;
+	int rc, count;
+	char* mqttsas_topic = "MQTTSAS topic";
+
+	failures = 0;
+	MyLog(LOGA_INFO, "Starting test 6 - connectionLost and will messages");
+	fprintf(xml, "<testcase classname=\"test1\" name=\"connectionLost and will messages\"");
+	global_start_time = start_clock();
+
+	opts.keepAliveInterval = 2;
+	opts.cleansession = 1;
+	opts.MQTTVersion = MQTTVERSION_3_1_1;
+	opts.will = &wopts;
+	opts.will->message = test6_will_message;
+	opts.will->qos = 1;
+	opts.will->retained = 0;
+	opts.will->topicName = test6_will_topic;
+	if (options.haconnections != NULL)
+	{
+		opts.serverURIs = options.haconnections;
+		opts.serverURIcount = options.hacount;
+	}
+
+	/* Client-1 with Will options */
+	rc = MQTTClient_create(&test6_c1, options.proxy_connection, "Client_1", MQTTCLIENT_PERSISTENCE_DEFAULT, NULL);
+	assert("good rc from create", rc == MQTTCLIENT_SUCCESS, "rc was %d\n", rc);
+	if (rc != MQTTCLIENT_SUCCESS)
+		goto exit;
+
+	rc = MQTTClient_setCallbacks(test6_c1, (void*)test6_c1, test6_connectionLost, test6_messageArrived, test6_deliveryComplete);
+	assert("good rc from setCallbacks",  rc == MQTTCLIENT_SUCCESS, "rc was %d\n", rc);
+	if (rc != MQTTCLIENT_SUCCESS)
+		goto exit;
+
+	/* Connect to the broker */
+	rc = MQTTClient_connect(test6_c1, &opts);
+	assert("good rc from connect",  rc == MQTTCLIENT_SUCCESS, "rc was %d\n", rc);
+	if (rc != MQTTCLIENT_SUCCESS)
+		goto exit;
+
+	/* Client - 2 (multi-threaded) */
+	rc = MQTTClient_create(&test6_c2, options.connection, "Client_2", MQTTCLIENT_PERSISTENCE_DEFAULT, NULL);
+	assert("good rc from create",  rc == MQTTCLIENT_SUCCESS, "rc was %d\n", rc);
+
+	/* Set the callback functions for the client */
+	rc = MQTTClient_setCallbacks(test6_c2, (void*)test6_c2, test6_connectionLost, test6_messageArrived, test6_deliveryComplete);
+	assert("good rc from setCallbacks",  rc == MQTTCLIENT_SUCCESS, "rc was %d\n", rc);
+
+	/* Connect to the broker */
+	opts2.keepAliveInterval = 20;
+	opts2.cleansession = 1;
+	MyLog(LOGA_INFO, "Connecting Client_2 ...");
+	rc = MQTTClient_connect(test6_c2, &opts2);
+	assert("Good rc from connect", rc == MQTTCLIENT_SUCCESS, "rc was %d\n", rc);
+
+	rc = MQTTClient_subscribe(test6_c2, test6_will_topic, 2);
+	assert("Good rc from subscribe", rc == MQTTCLIENT_SUCCESS, "rc was %d\n", rc);
+
+	/* now send the command which will break the connection and cause the will message to be sent */
+	rc = MQTTClient_publish(test6_c1, mqttsas_topic, (int)strlen("TERMINATE"), "TERMINATE", 0, 0, NULL);
+	assert("Good rc from publish", rc == MQTTCLIENT_SUCCESS, "rc was %d\n", rc);
+
+	MyLog(LOGA_INFO, "Waiting to receive the will message");
+	count = 0;
+	while (++count < 40)
+	{
+		#if defined(WIN32)
+			Sleep(1000L);
+		#else
+			sleep(1);
+		#endif
+		if (test6_will_message_arrived == 1 && test6_connection_lost_called == 1)
+			break;
+	}
+	assert("will message arrived", test6_will_message_arrived == 1,
+							"will_message_arrived was %d\n", test6_will_message_arrived);
+	assert("connection lost called", test6_connection_lost_called == 1,
+			         "connection_lost_called %d\n", test6_connection_lost_called);
+
+	rc = MQTTClient_unsubscribe(test6_c2, test6_will_topic);
+	assert("Good rc from unsubscribe", rc == MQTTCLIENT_SUCCESS, "rc was %d", rc);
+
+	rc = MQTTClient_isConnected(test6_c2);
+	assert("Client-2 still connected", rc == 1, "isconnected is %d", rc);
+
+	rc = MQTTClient_isConnected(test6_c1);
+	assert("Client-1 not connected", rc == 0, "isconnected is %d", rc);
+
+	rc = MQTTClient_disconnect(test6_c2, 100L);
+	assert("Good rc from disconnect", rc == MQTTCLIENT_SUCCESS, "rc was %d", rc);
+
+	MQTTClient_destroy(&test6_c1);
+	MQTTClient_destroy(&test6_c2);
+
+exit:
+	MyLog(LOGA_INFO, "%s: test %s. %d tests run, %d failures.\n",
+			(failures == 0) ? "passed" : "failed", testname, tests, failures);
+	write_test_result();
+	return failures;
+}
+
+
+int test6a(struct Options options)
+{
+	char* testname = "test6a";
+	MQTTClient_connectOptions opts = MQTTClient_connectOptions_initializer;
+	MQTTClient_willOptions wopts =  MQTTClient_willOptions_initializer;
+	MQTTClient_connectOptions opts2 = MQTTClient_connectOptions_initializer;
+	int rc, count;
+	char* mqttsas_topic = "MQTTSAS topic";
+
+	failures = 0;
+	MyLog(LOGA_INFO, "Starting test 6 - connectionLost and binary will messages");
+	fprintf(xml, "<testcase classname=\"test1\" name=\"connectionLost and binary will messages\"");
+	global_start_time = start_clock();
+
+	opts.keepAliveInterval = 2;
+	opts.cleansession = 1;
+	opts.MQTTVersion = MQTTVERSION_3_1_1;
+	opts.will = &wopts;
+	opts.will->payload.data = test6_will_message;
+	opts.will->payload.len = strlen(test6_will_message) + 1;
+	opts.will->qos = 1;
+	opts.will->retained = 0;
+	opts.will->topicName = test6_will_topic;
+	if (options.haconnections != NULL)
+	{
+		opts.serverURIs = options.haconnections;
+		opts.serverURIcount = options.hacount;
+	}
+
+	/* Client-1 with Will options */
+	rc = MQTTClient_create(&test6_c1, options.proxy_connection, "Client_1", MQTTCLIENT_PERSISTENCE_DEFAULT, NULL);
+	assert("good rc from create", rc == MQTTCLIENT_SUCCESS, "rc was %d\n", rc);
+	if (rc != MQTTCLIENT_SUCCESS)
+		goto exit;
+
+	rc = MQTTClient_setCallbacks(test6_c1, (void*)test6_c1, test6_connectionLost, test6_messageArrived, test6_deliveryComplete);
+	assert("good rc from setCallbacks",  rc == MQTTCLIENT_SUCCESS, "rc was %d\n", rc);
+	if (rc != MQTTCLIENT_SUCCESS)
+		goto exit;
+
+	/* Connect to the broker */
+	rc = MQTTClient_connect(test6_c1, &opts);
+	assert("good rc from connect",  rc == MQTTCLIENT_SUCCESS, "rc was %d\n", rc);
+	if (rc != MQTTCLIENT_SUCCESS)
+		goto exit;
+
+	/* Client - 2 (multi-threaded) */
+	rc = MQTTClient_create(&test6_c2, options.connection, "Client_2", MQTTCLIENT_PERSISTENCE_DEFAULT, NULL);
+	assert("good rc from create",  rc == MQTTCLIENT_SUCCESS, "rc was %d\n", rc);
+
+	/* Set the callback functions for the client */
 	rc = MQTTClient_setCallbacks(test6_c2, (void*)test6_c2, test6_connectionLost, test6_messageArrived, test6_deliveryComplete);
 	assert("good rc from setCallbacks",  rc == MQTTCLIENT_SUCCESS, "rc was %d\n", rc);
 
@@ -1020,7 +3896,47 @@ exit:
 int main(int argc, char** argv)
 {
 	int rc = 0;
- 	int (*tests[])() = {NULL, test1, test2, test3};
+ 	int (*tests[])() = {NULL, test1, test2, test3, test4, test5,
+#if defined(MQTT_TASK)
+		test6,
+#if defined(MQTT_PUBLISH_QUEUE)
+		test7,
+#else
+		NULL,
+#endif
+		test8,
+#else
+		NULL, NULL, NULL, /* these need the background thread */
+#endif
+		test9, test10, test11, test12,
+#if defined(MQTT_TASK)
+		test13,
+#else
+		NULL,
+#endif
+#if defined(MQTT_URING)
+		test14,
+#else
+		NULL,
+#endif
+#if defined(MQTT_ZEROCOPY)
+		test15,
+#else
+		NULL,
+#endif
+		test16,
+#if defined(MQTT_TLS)
+		test17,
+#else
+		NULL,
+#endif
+		test18, test19,
+#if defined(MQTT_TASK)
+		test20,
+#else
+		NULL,
+#endif
+	};
 	int i;
 
 	xml = fopen("TEST-test1.xml", "w");
@@ -1033,9 +3949,10 @@ int main(int argc, char** argv)
 	 	if (options.test_no == 0)
 		{ /* run all the tests */
  		   	for (options.test_no = 1; options.test_no < ARRAY_SIZE(tests); ++options.test_no)
-				rc += tests[options.test_no](options); /* return number of failures.  0 = test succeeded */
+				if (tests[options.test_no])
+					rc += tests[options.test_no](options); /* return number of failures.  0 = test succeeded */
 		}
-		else
+		else if (tests[options.test_no])
  		   	rc = tests[options.test_no](options); /* run just the selected test */
 	}
 
@@ -0,0 +1,774 @@
+/*******************************************************************************
+ * Copyright (c) 2009, 2023 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    Ian Craggs - initial implementation for embedded C client
+ *******************************************************************************/
+
+
+/**
+ * @file
+ * Benchmarks for the Paho embedded C client: durable QoS 1 publishing from
+ * several threads, through the write-ahead log, the client's own CPU
+ * cost for each message, publish to acknowledgement latency with
+ * the socket options, and throughput through a connection group
+ */
+
+
+#include "MQTTClient.h"
+#include "MQTTWalPersistence.h"
+#include "MQTTLoopback.h"
+#include "MQTTGroup.h"
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <time.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
+
+void usage(void)
+{
+	printf("options:\n  --host <hostname>\n  --port <port>\n  --threads <number of publishing threads>\n"
+			"  --seconds <how long to publish for at each commit interval>\n"
+			"  --messages <how many to send at each QoS to measure CPU per message>\n"
+			"  --samples <how many acknowledgements to time with each set of socket options>\n  --verbose\n");
+	exit(EXIT_FAILURE);
+}
+
+struct Options
+{
+	char* host;         /**< connection to system under test. */
+	int port;
+	int verbose;
+	int test_no;
+	int MQTTVersion;
+	int threads;
+	int seconds;
+	int messages;
+	int samples;
+} options =
+{
+	"localhost",
+	1883,
+	0,
+	0,
+	4,
+	8,
+	2,
+	20000,
+	100,
+};
+
+void getopts(int argc, char** argv)
+{
+	int count = 1;
+
+	while (count < argc)
+	{
+		if (strcmp(argv[count], "--test_no") == 0)
+		{
+			if (++count < argc)
+				options.test_no = atoi(argv[count]);
+			else
+				usage();
+		}
+		else if (strcmp(argv[count], "--host") == 0)
+		{
+			if (++count < argc)
+			{
+				options.host = argv[count];
+				printf("\nSetting host to %s\n", options.host);
+			}
+			else
+				usage();
+		}
+		else if (strcmp(argv[count], "--port") == 0)
+		{
+			if (++count < argc)
+			{
+				options.port = atoi(argv[count]);
+				printf("\nSetting port to %d\n", options.port);
+			}
+			else
+				usage();
+		}
+		else if (strcmp(argv[count], "--threads") == 0)
+		{
+			if (++count < argc)
+				options.threads = atoi(argv[count]);
+			else
+				usage();
+		}
+		else if (strcmp(argv[count], "--seconds") == 0)
+		{
+			if (++count < argc)
+				options.seconds = atoi(argv[count]);
+			else
+				usage();
+		}
+		else if (strcmp(argv[count], "--messages") == 0)
+		{
+			if (++count < argc)
+				options.messages = atoi(argv[count]);
+			else
+				usage();
+		}
+		else if (strcmp(argv[count], "--samples") == 0)
+		{
+			if (++count < argc)
+				options.samples = atoi(argv[count]);
+			else
+				usage();
+		}
+		else if (strcmp(argv[count], "--MQTTversion") == 0)
+		{
+			if (++count < argc)
+			{
+				options.MQTTVersion = atoi(argv[count]);
+				printf("setting MQTT version to %d\n", options.MQTTVersion);
+			}
+			else
+				usage();
+		}
+		else if (strcmp(argv[count], "--verbose") == 0)
+		{
+			options.verbose = 1;
+			printf("\nSetting verbose on\n");
+		}
+		else
+			usage();
+		count++;
+	}
+}
+
+
+#define LOGA_DEBUG 0
+#define LOGA_INFO 1
+void MyLog(int LOGA_level, char* format, ...)
+{
+	static char msg_buf[256];
+	va_list args;
+	struct timeval ts;
+	struct tm *timeinfo;
+
+	if (LOGA_level == LOGA_DEBUG && options.verbose == 0)
+	  return;
+
+	gettimeofday(&ts, NULL);
+	timeinfo = localtime(&ts.tv_sec);
+	strftime(msg_buf, 80, "%Y%m%d %H%M%S", timeinfo);
+
+	sprintf(&msg_buf[strlen(msg_buf)], ".%.3ld ", (long)ts.tv_usec / 1000);
+
+	va_start(args, format);
+	vsnprintf(&msg_buf[strlen(msg_buf)], sizeof(msg_buf) - strlen(msg_buf), format, args);
+	va_end(args);
+
+	printf("%s\n", msg_buf);
+	fflush(stdout);
+}
+
+
+#define START_TIME_TYPE struct timespec
+START_TIME_TYPE start_clock(void)
+{
+	struct timespec start_time;
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+	return start_time;
+}
+
+
+long elapsed(START_TIME_TYPE start_time)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start_time.tv_sec) * 1000L + (now.tv_nsec - start_time.tv_nsec) / 1000000L;
+}
+
+
+#define assert(a, b, c, d) myassert(__FILE__, __LINE__, a, b, c, d)
+
+int tests = 0;
+int failures = 0;
+FILE* xml;
+START_TIME_TYPE global_start_time;
+char output[3000];
+char* cur_output = output;
+
+
+void write_test_result(void)
+{
+	long duration = elapsed(global_start_time);
+
+	fprintf(xml, " time=\"%ld.%.3ld\" >\n", duration / 1000, duration % 1000);
+	if (cur_output != output)
+	{
+		fprintf(xml, "%s", output);
+		cur_output = output;
+	}
+	fprintf(xml, "</testcase>\n");
+}
+
+
+void myassert(char* filename, int lineno, char* description, int value, char* format, ...)
+{
+	++tests;
+	if (!value)
+	{
+		va_list args;
+
+		++failures;
+		MyLog(LOGA_INFO, "Assertion failed, file %s, line %d, description: %s\n", filename, lineno, description);
+
+		va_start(args, format);
+		vprintf(format, args);
+		va_end(args);
+
+		if (cur_output < &output[sizeof(output) - 200])
+			cur_output += sprintf(cur_output, "<failure type=\"%s\">file %s, line %d </failure>\n",
+                        description, filename, lineno);
+	}
+	else
+		MyLog(LOGA_DEBUG, "Assertion succeeded, file %s, line %d, description: %s", filename, lineno, description);
+}
+
+
+/*********************************************************************
+
+Test1: QoS 1 publishing throughput against the commit interval.  The
+longer the thread committing waits, the more publishes share each
+fdatasync, up to the point where the wait costs more than the disk.
+
+*********************************************************************/
+struct test1_publisher
+{
+	MQTTClient* c;
+	int id;
+	volatile int* stop;
+	int published;
+	int failures;
+};
+
+void test1_publish(void* parm)
+{
+	struct test1_publisher* p = (struct test1_publisher*)parm;
+	MQTTMessage msg;
+	char payload[30];
+
+	memset(&msg, '\0', sizeof(msg));
+	msg.payload = payload;
+	msg.qos = QOS1;
+	while (!*p->stop)
+	{
+		sprintf(payload, "thread %d message %d", p->id, p->published);
+		msg.payloadlen = strlen(payload);
+		if (MQTTPublish(p->c, "C client benchmark", &msg) == SUCCESS)
+			p->published++;
+		else
+			p->failures++;
+	}
+}
+
+
+/* publish from threads through one client for a while, and say how fast it went */
+static int test1_run(struct Options options, int threads, unsigned int commit_us)
+{
+	Network n;
+	MQTTClient c;
+	MQTTWalPersistence w;
+	MQTTWalMetrics metrics;
+	Thread* thread = malloc(sizeof(Thread) * threads);
+	struct test1_publisher* publishers = malloc(sizeof(struct test1_publisher) * threads);
+	volatile int stop = 0;
+	static unsigned int table[16 * 1024];
+	unsigned char buf[200];
+	unsigned char readbuf[200];
+	char* path = "test2.wal";
+	int published = 0;
+	long ms = 0;
+	int rc = 0;
+	int i = 0;
+	START_TIME_TYPE start;
+
+	unlink(path);
+	rc = MQTTWalPersistenceOpen(&w, path, (unsigned char*)table, sizeof(table), sizeof(buf), commit_us);
+	assert("Good rc from log open", rc == SUCCESS, "rc was %d", rc);
+	if (rc != SUCCESS)
+		goto exit;
+
+	NetworkInit(&n);
+	rc = NetworkConnect(&n, options.host, options.port);
+	assert("Good rc from TCP connect", rc == SUCCESS, "rc was %d", rc);
+	if (rc != SUCCESS)
+		goto close;
+	MQTTClientInit(&c, &n, 5000, buf, sizeof(buf), readbuf, sizeof(readbuf));
+	MQTTSetPersistence(&c, &w.persistence);
+	rc = MQTTStartTask(&c);
+	assert("Good rc from start task", rc == SUCCESS, "rc was %d", rc);
+	if (rc != SUCCESS)
+		goto close;
+
+	MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+	data.MQTTVersion = options.MQTTVersion;
+	data.clientID.cstring = "c-wal-bench";
+	data.cleansession = 1;
+	rc = MQTTConnect(&c, &data);
+	assert("Good rc from connect", rc == SUCCESS, "rc was %d", rc);
+	if (rc != SUCCESS)
+		goto stop;
+
+	start = start_clock();
+	for (i = 0; i < threads; ++i)
+	{
+		publishers[i].c = &c;
+		publishers[i].id = i;
+		publishers[i].stop = &stop;
+		publishers[i].published = 0;
+		publishers[i].failures = 0;
+		ThreadStart(&thread[i], test1_publish, &publishers[i]);
+	}
+	sleep(options.seconds);
+	stop = 1;
+	for (i = 0; i < threads; ++i)
+	{
+		ThreadJoin(&thread[i]);
+		assert("All publishes succeeded", publishers[i].failures == 0, "failures was %d", publishers[i].failures);
+		published += publishers[i].published;
+	}
+	ms = elapsed(start);
+
+	MQTTWalPersistenceGetMetrics(&w, &metrics);
+	MyLog(LOGA_INFO, "%d threads, commit interval %u us: %ld publishes/s, %.1f publishes per commit, %u checkpoints",
+			threads, commit_us, (ms > 0) ? published * 1000L / ms : 0L,
+			(metrics.commits > 0) ? (double)published / metrics.commits : 0.0, metrics.checkpoints);
+	assert("Publishes were made", published > 0, "published was %d", published);
+
+	MQTTDisconnect(&c);
+stop:
+	MQTTStopTask(&c);
+	NetworkDisconnect(&n);
+close:
+	MQTTWalPersistenceClose(&w);
+	unlink(path);
+exit:
+	free(publishers);
+	free(thread);
+	return rc;
+}
+
+
+int test1(struct Options options)
+{
+	unsigned int intervals[] = {0, 100, 1000, 5000};
+	int i = 0;
+
+	fprintf(xml, "<testcase classname=\"test1\" name=\"group commit throughput\"");
+	global_start_time = start_clock();
+	failures = 0;
+	MyLog(LOGA_INFO, "Starting test 1 - group commit throughput for %d threads", options.threads);
+
+	test1_run(options, 1, 0); /* the baseline: an fdatasync for every publish */
+	for (i = 0; i < ARRAY_SIZE(intervals); ++i)
+		test1_run(options, options.threads, intervals[i]);
+
+	MyLog(LOGA_INFO, "TEST1: test %s. %d tests run, %d failures.",
+			(failures == 0) ? "passed" : "failed", tests, failures);
+	write_test_result();
+	return failures;
+}
+
+
+/*********************************************************************
+
+Test2: the client's CPU time for each message, against the in-process
+responder so that neither a broker nor a socket is measured with it.
+Each publish comes back, so a message is one PUBLISH each way, and the
+QoS 1 and 2 acknowledgements.  The client runs on this thread, driven
+by polling the network as an application would, and the responder's
+time is shown separately.
+
+*********************************************************************/
+static volatile int test2_arrived = 0;
+
+void test2_messageArrived(MessageData* md)
+{
+	++test2_arrived;
+}
+
+
+static long cputime_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+
+int test2(struct Options options)
+{
+	static LoopbackNetwork l;
+	MQTTClient c;
+	MQTTMessage msg;
+	char* test_topic = "C client benchmark loopback";
+	char payload[30] = "loopback message";
+	unsigned char buf[200];
+	unsigned char readbuf[200];
+	clockid_t responder_clock;
+	int next_ms = 0;
+	int rc = 0;
+	int qos = 0;
+	int i = 0;
+
+	fprintf(xml, "<testcase classname=\"test2\" name=\"client CPU per message\"");
+	global_start_time = start_clock();
+	failures = 0;
+	MyLog(LOGA_INFO, "Starting test 2 - client CPU per message, over the loopback network");
+
+	LoopbackNetworkInit(&l);
+	rc = LoopbackNetworkConnect(&l);
+	assert("Good rc from loopback connect", rc == SUCCESS, "rc was %d", rc);
+	if (rc != SUCCESS)
+		goto exit;
+	pthread_getcpuclockid(l.responder, &responder_clock);
+	MQTTClientInit(&c, &l.net, 5000, buf, sizeof(buf), readbuf, sizeof(readbuf));
+
+	MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+	data.MQTTVersion = options.MQTTVersion;
+	data.clientID.cstring = "c-loopback-bench";
+	data.cleansession = 1;
+	rc = MQTTConnect(&c, &data);
+	assert("Good rc from connect", rc == SUCCESS, "rc was %d", rc);
+	if (rc != SUCCESS)
+		goto disconnect;
+	rc = MQTTSubscribe(&c, test_topic, QOS2, test2_messageArrived);
+	assert("Good rc from subscribe", rc == SUCCESS, "rc was %d", rc);
+
+	memset(&msg, '\0', sizeof(msg));
+	msg.payload = payload;
+	msg.payloadlen = strlen(payload);
+	for (qos = QOS0; qos <= QOS2 && rc == SUCCESS; ++qos)
+	{
+		long client_ns = cputime_ns(CLOCK_THREAD_CPUTIME_ID);
+		long responder_ns = cputime_ns(responder_clock);
+		START_TIME_TYPE start = start_clock();
+		long ms = 0;
+
+		msg.qos = qos;
+		test2_arrived = 0;
+		for (i = 0; i < options.messages && rc == SUCCESS; ++i)
+		{
+			rc = MQTTPublish(&c, test_topic, &msg);
+			while (test2_arrived <= i && rc == SUCCESS)
+			{
+				struct pollfd pfd = {l.net.my_socket, POLLIN, 0};
+
+				if (poll(&pfd, 1, 1000) <= 0)
+					rc = FAILURE;
+				else
+					rc = MQTTYieldNoWait(&c, &next_ms);
+			}
+		}
+		client_ns = cputime_ns(CLOCK_THREAD_CPUTIME_ID) - client_ns;
+		responder_ns = cputime_ns(responder_clock) - responder_ns;
+		ms = elapsed(start);
+		assert("All messages came back", rc == SUCCESS && test2_arrived == options.messages,
+				"arrived was %d", test2_arrived);
+
+		MyLog(LOGA_INFO, "QoS %d: %.2f us client CPU per message, %.2f us responder CPU, %ld messages/s",
+				qos, client_ns / 1000.0 / options.messages, responder_ns / 1000.0 / options.messages,
+				(ms > 0) ? options.messages * 1000L / ms : 0L);
+	}
+
+	MQTTDisconnect(&c);
+disconnect:
+	LoopbackNetworkDisconnect(&l);
+exit:
+	MyLog(LOGA_INFO, "TEST2: test %s. %d tests run, %d failures.",
+			(failures == 0) ? "passed" : "failed", tests, failures);
+	write_test_result();
+	return failures;
+}
+
+
+/*********************************************************************
+
+Test3: publish to acknowledgement latency, with Nagle's algorithm and
+delayed acknowledgements and then with TCP_NODELAY and TCP_QUICKACK.  Each
+QoS 1 publish follows a QoS 0 one, as telemetry and events are sent
+together: with Nagle the second waits for the first to be acknowledged,
+which the broker, having nothing to reply, delays.
+
+*********************************************************************/
+static int compare_longs(const void* a, const void* b)
+{
+	long x = *(const long*)a, y = *(const long*)b;
+
+	return (x > y) - (x < y);
+}
+
+
+/* time samples QoS 1 publishes with these socket options, and sort the times in us */
+static int test3_run(struct Options options, NetworkSocketOptions* so, long* us)
+{
+	Network n;
+	MQTTClient c;
+	MQTTMessage telemetry, event;
+	char* test_topic = "C client benchmark latency";
+	unsigned char buf[200];
+	unsigned char readbuf[200];
+	int rc = 0;
+	int i = 0;
+
+	NetworkInit(&n);
+	NetworkSetSocketOptions(&n, so);
+	rc = NetworkConnect(&n, options.host, options.port);
+	assert("Good rc from TCP connect", rc == SUCCESS, "rc was %d", rc);
+	if (rc != SUCCESS)
+		return rc;
+	MQTTClientInit(&c, &n, 5000, buf, sizeof(buf), readbuf, sizeof(readbuf));
+	rc = MQTTStartTask(&c);
+	assert("Good rc from start task", rc == SUCCESS, "rc was %d", rc);
+	if (rc != SUCCESS)
+		goto close;
+
+	MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+	data.MQTTVersion = options.MQTTVersion;
+	data.clientID.cstring = "c-latency-bench";
+	data.cleansession = 1;
+	rc = MQTTConnect(&c, &data);
+	assert("Good rc from connect", rc == SUCCESS, "rc was %d", rc);
+	if (rc != SUCCESS)
+		goto stop;
+
+	memset(&telemetry, '\0', sizeof(telemetry));
+	telemetry.payload = "telemetry";
+	telemetry.payloadlen = 9;
+	telemetry.qos = QOS0;
+	event = telemetry;
+	event.payload = "event";
+	event.payloadlen = 5;
+	event.qos = QOS1;
+	for (i = 0; i < options.samples && rc == SUCCESS; ++i)
+	{
+		START_TIME_TYPE start;
+		struct timespec now;
+
+		if ((rc = MQTTPublish(&c, test_topic, &telemetry)) != SUCCESS)
+			break;
+		start = start_clock();
+		rc = MQTTPublish(&c, test_topic, &event);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		us[i] = (now.tv_sec - start.tv_sec) * 1000000L + (now.tv_nsec - start.tv_nsec) / 1000L;
+	}
+	assert("All publishes acknowledged", rc == SUCCESS, "rc was %d", rc);
+	qsort(us, options.samples, sizeof(long), compare_longs);
+
+	MQTTDisconnect(&c);
+stop:
+	MQTTStopTask(&c);
+close:
+	NetworkDisconnect(&n);
+	return rc;
+}
+
+
+int test3(struct Options options)
+{
+	NetworkSocketOptions nagle = NetworkSocketOptions_initializer;
+	NetworkSocketOptions latency = NetworkSocketOptions_initializer;
+	long* us = malloc(sizeof(long) * options.samples);
+	long p99[2] = {0, 0};
+	int i = 0;
+
+	fprintf(xml, "<testcase classname=\"test3\" name=\"publish to acknowledgement latency\"");
+	global_start_time = start_clock();
+	failures = 0;
+	MyLog(LOGA_INFO, "Starting test 3 - publish to acknowledgement latency with the socket options");
+
+	nagle.nodelay = 0;
+	latency.quickack = 1;
+	for (i = 0; i < 2; ++i)
+	{
+		memset(us, '\0', sizeof(long) * options.samples);
+		if (test3_run(options, (i == 0) ? &nagle : &latency, us) != SUCCESS)
+			break;
+		p99[i] = us[options.samples * 99 / 100];
+		MyLog(LOGA_INFO, "%s: QoS 1 acknowledged in p50 %ld us, p99 %ld us, max %ld us",
+				(i == 0) ? "Nagle, delayed acks" : "TCP_NODELAY, TCP_QUICKACK",
+				us[options.samples / 2], p99[i], us[options.samples - 1]);
+	}
+	if (i == 2)
+		MyLog(LOGA_INFO, "p99 latency %.1f times lower with TCP_NODELAY and TCP_QUICKACK", (p99[1] > 0) ? (double)p99[0] / p99[1] : 0.0);
+
+	free(us);
+	MyLog(LOGA_INFO, "TEST3: test %s. %d tests run, %d failures.",
+			(failures == 0) ? "passed" : "failed", tests, failures);
+	write_test_result();
+	return failures;
+}
+
+
+/*********************************************************************
+
+Test4: QoS 1 publishing throughput through a connection group, with one
+shard and then with a shard for each publishing thread.  Each thread
+publishes on its own topic, so with as many shards as threads, and the
+topics hashing to different ones, no two threads wait on the same
+connection's acknowledgements.
+
+*********************************************************************/
+struct test4_publisher
+{
+	MQTTGroup* g;
+	int id;
+	volatile int* stop;
+	int published;
+	int failures;
+};
+
+void test4_publish(void* parm)
+{
+	struct test4_publisher* p = (struct test4_publisher*)parm;
+	MQTTMessage msg;
+	char topic[40];
+	char payload[30];
+
+	sprintf(topic, "C client benchmark group/%d", p->id);
+	memset(&msg, '\0', sizeof(msg));
+	msg.payload = payload;
+	msg.qos = QOS1;
+	while (!*p->stop)
+	{
+		sprintf(payload, "message %d", p->published);
+		msg.payloadlen = strlen(payload);
+		if (MQTTGroupPublish(p->g, topic, &msg) == SUCCESS)
+			p->published++;
+		else
+			p->failures++;
+	}
+}
+
+
+/* publish from threads through a group for a while, and return the messages per second */
+static long test4_run(struct Options options, int shards)
+{
+	static MQTTGroup g;
+	static unsigned char buf[MQTT_GROUP_MAX_SHARDS * 200];
+	static unsigned char readbuf[MQTT_GROUP_MAX_SHARDS * 200];
+	Thread* thread = malloc(sizeof(Thread) * options.threads);
+	struct test4_publisher* publishers = malloc(sizeof(struct test4_publisher) * options.threads);
+	MQTTGroupMetrics metrics;
+	volatile int stop = 0;
+	long rate = 0;
+	long ms = 0;
+	int published = 0;
+	int rc = 0;
+	int i = 0;
+
+	MQTTGroupInit(&g, shards, 5000, buf, sizeof(buf), readbuf, sizeof(readbuf));
+	MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+	data.MQTTVersion = options.MQTTVersion;
+	data.clientID.cstring = "c-group-bench";
+	data.cleansession = 1;
+	rc = MQTTGroupConnect(&g, options.host, options.port, &data);
+	assert("Good rc from group connect", rc == SUCCESS, "rc was %d", rc);
+	if (rc != SUCCESS)
+		goto exit;
+	MQTTGroupPin(&g, 0);
+
+	START_TIME_TYPE start = start_clock();
+	for (i = 0; i < options.threads; ++i)
+	{
+		publishers[i].g = &g;
+		publishers[i].id = i;
+		publishers[i].stop = &stop;
+		publishers[i].published = publishers[i].failures = 0;
+		ThreadStart(&thread[i], test4_publish, &publishers[i]);
+	}
+	sleep(options.seconds);
+	stop = 1;
+	for (i = 0; i < options.threads; ++i)
+	{
+		ThreadJoin(&thread[i]);
+		published += publishers[i].published;
+		assert("No failed publishes", publishers[i].failures == 0, "failures were %d", publishers[i].failures);
+	}
+	ms = elapsed(start);
+	rate = (ms > 0) ? published * 1000L / ms : 0L;
+
+	MQTTGroupGetMetrics(&g, &metrics);
+	MyLog(LOGA_INFO, "%d shard%s: %d messages in %ld ms, %ld messages/s", shards, (shards == 1) ? "" : "s",
+			published, ms, rate);
+	for (i = 0; i < shards; ++i)
+		MyLog(LOGA_INFO, "  shard %d: %lu publishes", i, metrics.shard_published[i]);
+	MQTTGroupDisconnect(&g);
+exit:
+	free(publishers);
+	free(thread);
+	return rate;
+}
+
+
+int test4(struct Options options)
+{
+	int shards = (options.threads < MQTT_GROUP_MAX_SHARDS) ? options.threads : MQTT_GROUP_MAX_SHARDS;
+	long one = 0, many = 0;
+
+	fprintf(xml, "<testcase classname=\"test4\" name=\"connection group throughput\"");
+	global_start_time = start_clock();
+	failures = 0;
+	MyLog(LOGA_INFO, "Starting test 4 - QoS 1 throughput from %d threads through a connection group", options.threads);
+
+	one = test4_run(options, 1);
+	many = test4_run(options, shards);
+	if (one > 0 && many > 0)
+		MyLog(LOGA_INFO, "%.2f times the throughput with %d shards, on %ld CPUs", (double)many / one, shards,
+				sysconf(_SC_NPROCESSORS_ONLN));
+
+	MyLog(LOGA_INFO, "TEST4: test %s. %d tests run, %d failures.",
+			(failures == 0) ? "passed" : "failed", tests, failures);
+	write_test_result();
+	return failures;
+}
+
+
+int main(int argc, char** argv)
+{
+	int rc = 0;
+ 	int (*tests[])() = {NULL, test1, test2, test3, test4};
+
+	xml = fopen("TEST-test2.xml", "w");
+	fprintf(xml, "<testsuite name=\"test2\" tests=\"%d\">\n", (int)(ARRAY_SIZE(tests) - 1));
+
+	getopts(argc, argv);
+
+	if (options.test_no == 0)
+	{ /* run all the tests */
+		for (options.test_no = 1; options.test_no < ARRAY_SIZE(tests); ++options.test_no)
+			rc += tests[options.test_no](options); /* return number of failures.  0 = test succeeded */
+	}
+	else
+		rc = tests[options.test_no](options); /* run just the selected test */
+
+ 	if (rc == 0)
+		MyLog(LOGA_INFO, "verdict pass");
+	else
+		MyLog(LOGA_INFO, "verdict fail");
+
+	fprintf(xml, "</testsuite>\n");
+	fclose(xml);
+	return rc;
+}
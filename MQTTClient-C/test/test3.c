@@ -0,0 +1,596 @@
+/*******************************************************************************
+ * Copyright (c) 2009, 2023 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    Ian Craggs - initial implementation for embedded C client
+ *******************************************************************************/
+
+
+/**
+ * @file
+ * Tests for the Paho embedded C client on the simulated platform: keepalive,
+ * reconnecting, latency, bandwidth, loss and reordering, against a virtual
+ * clock, so that they need no broker and take no time to speak of
+ */
+
+
+#include "MQTTClient.h"
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <time.h>
+#include <sys/time.h>
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
+
+void usage(void)
+{
+	printf("options:\n  --seed <for the simulated links' jitter and loss>\n  --verbose\n");
+	exit(EXIT_FAILURE);
+}
+
+struct Options
+{
+	int verbose;
+	int test_no;
+	int MQTTVersion;
+	unsigned int seed;
+} options =
+{
+	0,
+	0,
+	4,
+	1,
+};
+
+void getopts(int argc, char** argv)
+{
+	int count = 1;
+
+	while (count < argc)
+	{
+		if (strcmp(argv[count], "--test_no") == 0)
+		{
+			if (++count < argc)
+				options.test_no = atoi(argv[count]);
+			else
+				usage();
+		}
+		else if (strcmp(argv[count], "--seed") == 0)
+		{
+			if (++count < argc)
+				options.seed = (unsigned int)atoi(argv[count]);
+			else
+				usage();
+		}
+		else if (strcmp(argv[count], "--MQTTversion") == 0)
+		{
+			if (++count < argc)
+			{
+				options.MQTTVersion = atoi(argv[count]);
+				printf("setting MQTT version to %d\n", options.MQTTVersion);
+			}
+			else
+				usage();
+		}
+		else if (strcmp(argv[count], "--verbose") == 0)
+		{
+			options.verbose = 1;
+			printf("\nSetting verbose on\n");
+		}
+		else
+			usage();
+		count++;
+	}
+}
+
+
+#define LOGA_DEBUG 0
+#define LOGA_INFO 1
+void MyLog(int LOGA_level, char* format, ...)
+{
+	static char msg_buf[256];
+	va_list args;
+	struct timeval ts;
+	struct tm *timeinfo;
+
+	if (LOGA_level == LOGA_DEBUG && options.verbose == 0)
+	  return;
+
+	gettimeofday(&ts, NULL);
+	timeinfo = localtime(&ts.tv_sec);
+	strftime(msg_buf, 80, "%Y%m%d %H%M%S", timeinfo);
+
+	sprintf(&msg_buf[strlen(msg_buf)], ".%.3ld ", (long)ts.tv_usec / 1000);
+
+	va_start(args, format);
+	vsnprintf(&msg_buf[strlen(msg_buf)], sizeof(msg_buf) - strlen(msg_buf), format, args);
+	va_end(args);
+
+	printf("%s\n", msg_buf);
+	fflush(stdout);
+}
+
+
+#define START_TIME_TYPE struct timespec
+START_TIME_TYPE start_clock(void)
+{
+	struct timespec start_time;
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+	return start_time;
+}
+
+
+long elapsed(START_TIME_TYPE start_time)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start_time.tv_sec) * 1000L + (now.tv_nsec - start_time.tv_nsec) / 1000000L;
+}
+
+
+#define assert(a, b, c, d) myassert(__FILE__, __LINE__, a, b, c, d)
+
+int tests = 0;
+int failures = 0;
+FILE* xml;
+START_TIME_TYPE global_start_time;
+char output[3000];
+char* cur_output = output;
+
+
+void write_test_result(void)
+{
+	long duration = elapsed(global_start_time);
+
+	fprintf(xml, " time=\"%ld.%.3ld\" >\n", duration / 1000, duration % 1000);
+	if (cur_output != output)
+	{
+		fprintf(xml, "%s", output);
+		cur_output = output;
+	}
+	fprintf(xml, "</testcase>\n");
+}
+
+
+void myassert(char* filename, int lineno, char* description, int value, char* format, ...)
+{
+	++tests;
+	if (!value)
+	{
+		va_list args;
+
+		++failures;
+		MyLog(LOGA_INFO, "Assertion failed, file %s, line %d, description: %s\n", filename, lineno, description);
+
+		va_start(args, format);
+		vprintf(format, args);
+		va_end(args);
+
+		if (cur_output < &output[sizeof(output) - 200])
+			cur_output += sprintf(cur_output, "<failure type=\"%s\">file %s, line %d </failure>\n",
+                        description, filename, lineno);
+	}
+	else
+		MyLog(LOGA_DEBUG, "Assertion succeeded, file %s, line %d, description: %s", filename, lineno, description);
+}
+
+
+#define SECONDS 1000000ULL
+
+static SimNetwork s;
+static unsigned char buf[2000];
+static unsigned char readbuf[2000];
+
+
+/* a client connected to the simulated broker, over links with these options each way */
+static int connect_client(MQTTClient* c, SimLinkOptions* link, int keepalive, char* clientid)
+{
+	MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+	int rc = 0;
+
+	SimNetworkInit(&s, options.seed);
+	SimNetworkSetLinks(&s, link, link);
+	MQTTClientInit(c, &s.net, 5000, buf, sizeof(buf), readbuf, sizeof(readbuf));
+	rc = SimNetworkConnect(&s);
+	assert("Good rc from simulated connect", rc == SUCCESS, "rc was %d", rc);
+	if (rc != SUCCESS)
+		return rc;
+
+	data.MQTTVersion = options.MQTTVersion;
+	data.clientID.cstring = clientid;
+	data.keepAliveInterval = keepalive;
+	data.cleansession = 1;
+	rc = MQTTConnect(c, &data);
+	assert("Good rc from connect", rc == SUCCESS, "rc was %d", rc);
+	return rc;
+}
+
+
+/* Yield in a loop, as an application would, sleeping until the next attempt while the client backs
+ * off from reconnecting: MQTTYield returns straight away then, and the virtual clock wouldn't move */
+static void yield(MQTTClient* c)
+{
+	if (MQTTYield(c, 1000) != SUCCESS)
+	{
+		int next = MQTTNextDeadline(c);
+
+		SimClockAdvance(((next > 0) ? next : 1) * 1000ULL);
+	}
+}
+
+
+/*********************************************************************
+
+Test1: an hour of keepalive, which should take a fraction of a second.
+
+*********************************************************************/
+int test1(struct Options options)
+{
+	SimLinkOptions link = SimLinkOptions_initializer;
+	MQTTClient c;
+	START_TIME_TYPE start;
+	unsigned long long virtual_start = 0;
+	long ms = 0;
+	int rc = 0;
+
+	fprintf(xml, "<testcase classname=\"test1\" name=\"an hour of keepalive\"");
+	global_start_time = start_clock();
+	failures = 0;
+	MyLog(LOGA_INFO, "Starting test 1 - an hour of keepalive");
+
+	link.latency_us = 20000;
+	if (connect_client(&c, &link, 60, "c-sim-keepalive") != SUCCESS)
+		goto exit;
+
+	start = start_clock();
+	virtual_start = SimClockNow();
+	while (rc == SUCCESS && SimClockNow() - virtual_start < 3600 * SECONDS)
+		rc = MQTTYield(&c, 1000);
+	ms = elapsed(start);
+	assert("Good rc from yield", rc == SUCCESS, "rc was %d", rc);
+	assert("Still connected", MQTTIsConnected(&c), "isconnected was %d", MQTTIsConnected(&c));
+	assert("A ping a minute", s.received[PINGREQ] >= 59 && s.received[PINGREQ] <= 60,
+			"pings were %u", s.received[PINGREQ]);
+	assert("Faster than real time", ms < 10000, "took %ld ms", ms);
+	MyLog(LOGA_INFO, "%u pings in a virtual hour, in %ld ms", s.received[PINGREQ], ms);
+
+	MQTTDisconnect(&c);
+	SimNetworkDisconnect(&s);
+	assert("DISCONNECT reached the broker", s.received[DISCONNECT] == 1, "disconnects were %u", s.received[DISCONNECT]);
+
+exit:
+	MyLog(LOGA_INFO, "TEST1: test %s. %d tests run, %d failures.",
+			(failures == 0) ? "passed" : "failed", tests, failures);
+	write_test_result();
+	return failures;
+}
+
+
+/*********************************************************************
+
+Test2: the broker stops answering pings, so the client reconnects, then
+the broker goes down and the client backs off until it comes back.
+
+*********************************************************************/
+static int test2_silent = 0;
+static int test2_attempts = 0;
+static int test2_arrived = 0;
+
+static int test2_script(SimNetwork* s, unsigned char* packet, int len, void* context)
+{
+	MQTTHeader header = {0};
+
+	header.byte = packet[0];
+	return (header.bits.type == PINGREQ && test2_silent) ? SIM_IGNORE : SIM_RESPOND;
+}
+
+
+static int test2_reconnect(Network* n, void* context)
+{
+	test2_attempts++;
+	return SimNetworkConnect((SimNetwork*)n);
+}
+
+
+void test2_messageArrived(MessageData* md)
+{
+	test2_arrived++;
+}
+
+
+int test2(struct Options options)
+{
+	SimLinkOptions link = SimLinkOptions_initializer;
+	MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+	MQTTClient c;
+	MQTTMessage msg;
+	char* test_topic = "C client sim test2";
+	unsigned long long silent_at = 0, limit = 0;
+	int rc = 0;
+
+	fprintf(xml, "<testcase classname=\"test2\" name=\"keepalive failure and reconnect\"");
+	global_start_time = start_clock();
+	failures = 0;
+	MyLog(LOGA_INFO, "Starting test 2 - keepalive failure and reconnect");
+
+	test2_silent = test2_attempts = test2_arrived = 0;
+	link.latency_us = 20000;
+	if (connect_client(&c, &link, 20, "c-sim-reconnect") != SUCCESS)
+		goto exit;
+	SimNetworkSetScript(&s, test2_script, NULL);
+	rc = MQTTSubscribe(&c, test_topic, QOS1, test2_messageArrived);
+	assert("Good rc from subscribe", rc == SUCCESS, "rc was %d", rc);
+	data.MQTTVersion = options.MQTTVersion;
+	data.clientID.cstring = "c-sim-reconnect";
+	data.keepAliveInterval = 20;
+	data.cleansession = 1;
+	rc = MQTTSetAutoReconnect(&c, &data, test2_reconnect, NULL, 1000, 60000);
+	assert("Good rc from set auto reconnect", rc == SUCCESS, "rc was %d", rc);
+
+	limit = SimClockNow() + 30 * SECONDS;
+	while (SimClockNow() < limit)
+		yield(&c);
+	test2_silent = 1;
+	silent_at = SimClockNow();
+	limit = silent_at + 600 * SECONDS;
+	while (s.connects < 2 && SimClockNow() < limit)
+		yield(&c);
+	test2_silent = 0;
+	MyLog(LOGA_INFO, "Reconnected %llu ms after the broker stopped answering pings", (SimClockNow() - silent_at) / 1000);
+	assert("Reconnected", s.connects == 2 && test2_attempts == 1, "connects were %u", s.connects);
+	/* a ping is due within the keepalive interval, and has the interval again to be answered */
+	assert("Within twice the keepalive interval", SimClockNow() - silent_at <= 41 * SECONDS,
+			"took %llu ms", (SimClockNow() - silent_at) / 1000);
+	yield(&c);
+	assert("Subscribed again", s.received[SUBSCRIBE] == 2, "subscribes were %u", s.received[SUBSCRIBE]);
+
+	s.unreachable = 1;
+	SimNetworkBreak(&s);
+	limit = SimClockNow() + 300 * SECONDS;
+	while (SimClockNow() < limit)
+		yield(&c);
+	MyLog(LOGA_INFO, "%d attempts to reconnect in 5 virtual minutes, with backoff", test2_attempts - 1);
+	assert("Backed off", test2_attempts - 1 >= 5 && test2_attempts - 1 <= 15, "attempts were %d", test2_attempts - 1);
+	assert("Not connected while the broker is down", !MQTTIsConnected(&c), "isconnected was %d", MQTTIsConnected(&c));
+
+	s.unreachable = 0;
+	limit = SimClockNow() + 61 * SECONDS;
+	while (!MQTTIsConnected(&c) && SimClockNow() < limit)
+		yield(&c);
+	assert("Reconnected when the broker came back", MQTTIsConnected(&c) && s.connects == 3, "connects were %u", s.connects);
+
+	memset(&msg, '\0', sizeof(msg));
+	msg.payload = "after reconnecting";
+	msg.payloadlen = strlen(msg.payload);
+	msg.qos = QOS1;
+	rc = MQTTPublish(&c, test_topic, &msg);
+	assert("Good rc from publish", rc == SUCCESS, "rc was %d", rc);
+	limit = SimClockNow() + 10 * SECONDS;
+	while (test2_arrived == 0 && SimClockNow() < limit)
+		yield(&c);
+	assert("Message arrived on the subscription made again", test2_arrived == 1, "arrived was %d", test2_arrived);
+
+	MQTTDisconnect(&c);
+	SimNetworkDisconnect(&s);
+
+exit:
+	MyLog(LOGA_INFO, "TEST2: test %s. %d tests run, %d failures.",
+			(failures == 0) ? "passed" : "failed", tests, failures);
+	write_test_result();
+	return failures;
+}
+
+
+/*********************************************************************
+
+Test3: QoS 1 publishes over a slow link take exactly the time the link
+says, and over a lossy one the same time again for the same seed.
+
+*********************************************************************/
+#define TEST3_MESSAGES 20
+#define TEST3_LATENCY_US 25000
+#define TEST3_BANDWIDTH 125000 /* 1 Mbit/s */
+
+/* @return the virtual time the publishes took, in us */
+static unsigned long long test3_run(unsigned int loss_ppm, unsigned long* lost)
+{
+	SimLinkOptions link = SimLinkOptions_initializer;
+	MQTTClient c;
+	MQTTMessage msg;
+	char payload[1000];
+	unsigned long long start = 0;
+	int rc = 0;
+	int i = 0;
+
+	link.latency_us = TEST3_LATENCY_US;
+	link.bandwidth = TEST3_BANDWIDTH;
+	link.loss_ppm = loss_ppm;
+	if (connect_client(&c, &link, 0, "c-sim-link") != SUCCESS)
+		return 0;
+
+	memset(payload, 'x', sizeof(payload));
+	memset(&msg, '\0', sizeof(msg));
+	msg.payload = payload;
+	msg.payloadlen = sizeof(payload);
+	msg.qos = QOS1;
+	start = SimClockNow();
+	for (i = 0; i < TEST3_MESSAGES && rc == SUCCESS; ++i)
+		rc = MQTTPublish(&c, "C client sim test3", &msg);
+	assert("Good rc from publish", rc == SUCCESS, "rc was %d", rc);
+	start = SimClockNow() - start;
+	*lost = s.to_broker.lost + s.to_client.lost;
+
+	MQTTDisconnect(&c);
+	SimNetworkDisconnect(&s);
+	return start;
+}
+
+
+int test3(struct Options options)
+{
+	MQTTString topic = MQTTString_initializer;
+	unsigned char packet[1100];
+	unsigned char payload[1000];
+	unsigned long long took = 0, lossy = 0, again = 0, expected = 0;
+	unsigned long lost = 0, lost_again = 0;
+	int len = 0;
+
+	fprintf(xml, "<testcase classname=\"test3\" name=\"latency, bandwidth and loss\"");
+	global_start_time = start_clock();
+	failures = 0;
+	MyLog(LOGA_INFO, "Starting test 3 - latency, bandwidth and loss");
+
+	/* each publish leaves at the bandwidth and arrives the latency later, and so does its PUBACK */
+	topic.cstring = "C client sim test3";
+	len = MQTTSerialize_publish(packet, sizeof(packet), 0, 1, 0, 1, topic, payload, sizeof(payload));
+	expected = TEST3_MESSAGES * (2ULL * TEST3_LATENCY_US + len * SECONDS / TEST3_BANDWIDTH + 4 * SECONDS / TEST3_BANDWIDTH);
+
+	took = test3_run(0, &lost);
+	MyLog(LOGA_INFO, "%d publishes took %llu us, with nothing lost", TEST3_MESSAGES, took);
+	assert("The time the link takes", took == expected, "took %llu us", took);
+
+	lossy = test3_run(50000, &lost);
+	again = test3_run(50000, &lost_again);
+	MyLog(LOGA_INFO, "%d publishes took %llu us, losing %lu segments", TEST3_MESSAGES, lossy, lost);
+	assert("Longer for any retransmissions", (lost > 0) ? lossy > took : lossy == took, "took %llu us", lossy);
+	assert("The same run again for the same seed", lossy == again && lost == lost_again,
+			"took %llu us the second time", again);
+
+	MyLog(LOGA_INFO, "TEST3: test %s. %d tests run, %d failures.",
+			(failures == 0) ? "passed" : "failed", tests, failures);
+	write_test_result();
+	return failures;
+}
+
+
+/*********************************************************************
+
+Test4: the broker sends each message back before acknowledging it, and
+the link has jitter, so segments overtake each other: the messages still
+arrive, in order, and each publish completes.
+
+*********************************************************************/
+#define TEST4_MESSAGES 10
+
+static int test4_next = 0;
+static int test4_out_of_order = 0;
+
+static int test4_script(SimNetwork* s, unsigned char* packet, int len, void* context)
+{
+	MQTTString topicName = MQTTString_initializer;
+	unsigned char dup = 0, retained = 0;
+	unsigned short packetid = 0;
+	unsigned char* payload = NULL;
+	unsigned char out[200];
+	int payloadlen = 0;
+	int qos = 0;
+
+	if (MQTTDeserialize_publish(&dup, &qos, &retained, &packetid, &topicName, &payload, &payloadlen, packet, len) != 1)
+		return SIM_RESPOND;
+	len = MQTTSerialize_publish(out, sizeof(out), 0, qos, 0, packetid, topicName, payload, payloadlen);
+	if (SimNetworkSend(s, out, len) != SUCCESS)
+		return SIM_CLOSE;
+	len = MQTTSerialize_puback(out, sizeof(out), packetid);
+	return (SimNetworkSend(s, out, len) == SUCCESS) ? SIM_IGNORE : SIM_CLOSE;
+}
+
+
+void test4_messageArrived(MessageData* md)
+{
+	char payload[20];
+
+	snprintf(payload, sizeof(payload), "%.*s", (int)md->message->payloadlen, (char*)md->message->payload);
+	if (atoi(payload) != test4_next)
+		test4_out_of_order++;
+	test4_next = atoi(payload) + 1;
+}
+
+
+int test4(struct Options options)
+{
+	SimLinkOptions link = SimLinkOptions_initializer;
+	MQTTClient c;
+	MQTTMessage msg;
+	char* test_topic = "C client sim test4";
+	char payload[20];
+	int rc = 0;
+	int i = 0;
+
+	fprintf(xml, "<testcase classname=\"test4\" name=\"reordering\"");
+	global_start_time = start_clock();
+	failures = 0;
+	MyLog(LOGA_INFO, "Starting test 4 - reordering");
+
+	test4_next = test4_out_of_order = 0;
+	link.latency_us = 20000;
+	link.jitter_us = 30000;
+	if (connect_client(&c, &link, 0, "c-sim-reorder") != SUCCESS)
+		goto exit;
+	rc = MQTTSubscribe(&c, test_topic, QOS1, test4_messageArrived);
+	assert("Good rc from subscribe", rc == SUCCESS, "rc was %d", rc);
+	SimNetworkSetScript(&s, test4_script, NULL);
+
+	memset(&msg, '\0', sizeof(msg));
+	msg.payload = payload;
+	msg.qos = QOS1;
+	for (i = 0; i < TEST4_MESSAGES && rc == SUCCESS; ++i)
+	{
+		sprintf(payload, "%d", i);
+		msg.payloadlen = strlen(payload);
+		rc = MQTTPublish(&c, test_topic, &msg);
+	}
+	assert("Good rc from publish", rc == SUCCESS, "rc was %d", rc);
+	MQTTYield(&c, 1000);
+	assert("All messages arrived", test4_next == TEST4_MESSAGES, "next was %d", test4_next);
+	assert("In order", test4_out_of_order == 0, "out of order were %d", test4_out_of_order);
+	assert("Each acknowledged", s.received[PUBACK] == TEST4_MESSAGES, "acknowledged were %u", s.received[PUBACK]);
+
+	MQTTDisconnect(&c);
+	SimNetworkDisconnect(&s);
+
+exit:
+	MyLog(LOGA_INFO, "TEST4: test %s. %d tests run, %d failures.",
+			(failures == 0) ? "passed" : "failed", tests, failures);
+	write_test_result();
+	return failures;
+}
+
+
+int main(int argc, char** argv)
+{
+	int rc = 0;
+ 	int (*tests[])() = {NULL, test1, test2, test3, test4};
+
+	xml = fopen("TEST-test3.xml", "w");
+	fprintf(xml, "<testsuite name=\"test3\" tests=\"%d\">\n", (int)(ARRAY_SIZE(tests) - 1));
+
+	getopts(argc, argv);
+
+	if (options.test_no == 0)
+	{ /* run all the tests */
+		for (options.test_no = 1; options.test_no < ARRAY_SIZE(tests); ++options.test_no)
+			rc += tests[options.test_no](options); /* return number of failures.  0 = test succeeded */
+	}
+	else
+		rc = tests[options.test_no](options); /* run just the selected test */
+
+ 	if (rc == 0)
+		MyLog(LOGA_INFO, "verdict pass");
+	else
+		MyLog(LOGA_INFO, "verdict fail");
+
+	fprintf(xml, "</testsuite>\n");
+	fclose(xml);
+	return rc;
+}
@@ -35,6 +35,9 @@
 #if !defined(MQTTCLIENT_QOS2)
     #define MQTTCLIENT_QOS2 0
 #endif
+#if !defined(MQTTCLIENT_PUBLISH_QUEUE)
+    #define MQTTCLIENT_PUBLISH_QUEUE 0
+#endif
 
 namespace MQTT
 {
@@ -45,6 +48,11 @@ enum QoS { QOS0, QOS1, QOS2 };
 // all failure return codes must be negative
 enum returnCode { BUFFER_OVERFLOW = -2, FAILURE = -1, SUCCESS = 0 };
 
+// A Timer class can share one reading of the clock across each cycle by overloading this for itself,
+// in its own namespace.  By default, timers read the clock every time.
+template<class Timer>
+inline void cacheClock(Timer*, bool on) {}
+
 
 struct Message
 {
@@ -79,6 +87,20 @@ struct subackData
     int grantedQoS;
 };
 
+// What to do with a publish made while disconnected when the offline buffer is full
+enum OfflinePolicy { OFFLINE_REJECT, OFFLINE_DROP_OLDEST };
+
+struct offlineMetrics
+{
+    unsigned int count;           // publishes waiting to be sent now
+    unsigned int bytes;           // and the space they take
+    unsigned int high_water;      // the most space they have taken
+    unsigned int stored;          // publishes accepted while disconnected, in all
+    unsigned int sent;
+    unsigned int dropped;         // the oldest, to make room, with OFFLINE_DROP_OLDEST
+    unsigned int rejected;        // turned away, with OFFLINE_REJECT
+};
+
 
 class PacketId
 {
@@ -134,6 +156,56 @@ public:
             defaultMessageHandler.detach();
     }
 
+    /** Collect QoS 0 publishes in a buffer and write them to the network together.  The buffer is written
+     *  when it is full, when the oldest packet in it has waited for the time budget, or when any other packet
+     *  is sent or the client waits for incoming data (yield, or any blocking call).
+     *  @param buf - the buffer to collect packets in, or 0 to stop coalescing
+     *  @param buf_size - the size of the buffer
+     *  @param budget_us - the longest time, in microseconds, a packet may wait in the buffer
+     *  @return success code -
+     */
+    int setWriteCoalescing(unsigned char* buf, int buf_size, unsigned long budget_us);
+
+    /** Keep publishes made while the client is disconnected, rather than fail them, and send them in order
+     *  once it has connected again.  They are held serialized in a ring buffer and written straight from it.
+     *  QoS 1 and 2 publishes are given their packet ids when they are stored, and their acknowledgements are
+     *  not waited for.
+     *  @param buf - the buffer to keep publishes in, or 0 to stop keeping them.  Anything in the old buffer is discarded.
+     *  @param buf_size - the size of the buffer
+     *  @param policy - what to do when the buffer is full: reject the new publish, or drop the oldest
+     *  @return success code -
+     */
+    int setOfflineBuffer(unsigned char* buf, size_t buf_size, OfflinePolicy policy = OFFLINE_REJECT);
+
+    /** How the offline buffer is being used
+     *  @return the occupancy and counters
+     */
+    offlineMetrics getOfflineMetrics()
+    {
+        offlineMetrics metrics = offline_metrics;
+        metrics.bytes = offline_len;
+        return metrics;
+    }
+
+#if MQTTCLIENT_PUBLISH_QUEUE
+    /** Set a queue which other threads can add QoS 0 publishes to without a lock, with enqueuePublish.  The queue
+     *  is written out in batches at the start of each cycle, by the thread calling yield or any blocking call.
+     *  Set it before starting the threads which use it.
+     *  @param buf - the buffer to hold the queue, or 0 to stop queueing
+     *  @param buf_size - the size of the buffer
+     *  @param slot_size - the space for each serialized publish, including an 8 byte header
+     *  @return success code -
+     */
+    int setPublishQueue(unsigned char* buf, size_t buf_size, size_t slot_size);
+
+    /** Serialize a QoS 0 publish into a free queue slot.  This can be called from any thread.
+     *  @param topic - the topic to publish to
+     *  @param message - the message to send, which must be QoS 0
+     *  @return success code - FAILURE if the queue is full, BUFFER_OVERFLOW if the message is too large
+     */
+    int enqueuePublish(const char* topicName, Message& message);
+#endif
+
     /** Set a message handling callback.  This can be used outside of the the subscribe method.
      *  @param topicFilter - a topic pattern which can include wildcards
      *  @param mh - pointer to the callback function. If 0, removes the callback if any
@@ -190,6 +262,34 @@ public:
      */
     int publish(const char* topicName, void* payload, size_t payloadlen, unsigned short& id, enum QoS qos = QOS1, bool retained = false);
 
+    /** MQTT Publish from a file - send an MQTT publish whose payload is written to the network straight from
+     *  a file, so it can be much larger than MAX_MQTT_PACKET_SIZE, and wait for all acks to complete for all QoSs.
+     *  The Network needs a sendfile(fd, offset, len, timeout_ms) method.  The file shouldn't change while the
+     *  publish is in flight.  The payload isn't kept, so the publish fails if the client is disconnected, and
+     *  isn't sent again if the connection is lost before it completes.
+     *  @param topic - the topic to publish to
+     *  @param fd - the file to send the payload from
+     *  @param offset - where the payload starts in the file
+     *  @param payloadlen - the length of the payload
+     *  @param qos - the QoS to send the publish at
+     *  @param retained - whether the message should be retained
+     *  @return success code -
+     */
+    int publishFile(const char* topicName, int fd, size_t offset, size_t payloadlen, enum QoS qos = QOS0, bool retained = false);
+
+    /** MQTT Publish without copying - send an MQTT publish whose payload is written to the network straight from
+     *  memory rather than through the send buffer, and wait for all acks to complete for all QoSs.  The Network
+     *  needs a writeZeroCopy(buffer, len, timeout_ms) method, which returns once the kernel has finished with the
+     *  data, so the payload can be changed or freed straight after.  It fails in the same cases as publishFile.
+     *  @param topic - the topic to publish to
+     *  @param payload - the data to send
+     *  @param payloadlen - the length of the data
+     *  @param qos - the QoS to send the publish at
+     *  @param retained - whether the message should be retained
+     *  @return success code -
+     */
+    int publishZeroCopy(const char* topicName, void* payload, size_t payloadlen, enum QoS qos = QOS0, bool retained = false);
+
     /** MQTT Subscribe - send an MQTT subscribe packet and wait for the suback
      *  @param topicFilter - a topic pattern which can include wildcards
      *  @param qos - the MQTT QoS to subscribe at
@@ -226,6 +326,20 @@ public:
      */
     int yield(unsigned long timeout_ms = 1000L);
 
+    /** Process everything which has already arrived, and any keepalive which is due, without waiting for
+     *  more.  This lets the client be driven from an application's own poll loop: call it when the network's
+     *  socket is readable, or when next_ms has passed.
+     *  @param next_ms - returned: milliseconds until the client next has timed work to do, or -1 if none
+     *  @return success code - on failure, this means the client has disconnected
+     */
+    int yieldNoWait(int* next_ms = 0);
+
+    /** How long until the client has timed work to do: a keepalive, or coalesced or queued packets to write.
+     *  This changes when anything is sent, so check it again before waiting.
+     *  @return milliseconds, or -1 if nothing is scheduled
+     */
+    int nextDeadline();
+
     /** Is the client connected?
      *  @return flag - is the client connected or not?
      */
@@ -241,10 +355,21 @@ private:
     int cycle(Timer& timer);
     int waitfor(int packet_type, Timer& timer);
     int keepalive();
-    int publish(int len, Timer& timer, enum QoS qos);
+    int publish(int len, Timer& timer, enum QoS qos, unsigned short id);
+    int waitforAck(Timer& timer, enum QoS qos, unsigned short id);
+    int publishBody(const char* topicName, int fd, size_t offset, void* payload, size_t payloadlen, enum QoS qos, bool retained);
 
-    int decodePacket(int* value, int timeout);
     int readPacket(Timer& timer);
+    int writePacket(unsigned char* buf, int length, Timer& timer);
+    int flushPackets(Timer& timer);
+    int coalescePacket(int length, Timer& timer);
+    size_t offlinePacketLen(size_t offset);
+    void offlineRemove(size_t len);
+    int storeOffline(int len);
+    int drainOffline(Timer& timer);
+#if MQTTCLIENT_PUBLISH_QUEUE
+    int drainQueue(Timer& timer);
+#endif
     int sendPacket(int length, Timer& timer);
     int deliverMessage(MQTTString& topicName, Message& message);
     bool isTopicMatched(char* topicFilter, MQTTString& topicName);
@@ -254,8 +379,42 @@ private:
 
     unsigned char sendbuf[MAX_MQTT_PACKET_SIZE];
     unsigned char readbuf[MAX_MQTT_PACKET_SIZE];
+    int read_len, read_packet_len;   // how much of the packet in readbuf has arrived, and its full length
+
+    unsigned char* coalescebuf;  // outbound packets waiting to be written together
+    int coalescebuf_size, coalesce_len;
+    unsigned long coalesce_budget_us;
+    Timer coalesce_timer;
+
+    unsigned char* offlinebuf;   // a ring of publishes made while disconnected, serialized back to back
+    size_t offlinebuf_size, offline_head, offline_len;
+    OfflinePolicy offline_policy;
+    offlineMetrics offline_metrics;
+
+#if MQTTCLIENT_PUBLISH_QUEUE
+    // Each queue slot starts with this header, followed by the serialized packet.  A producer may fill the slot
+    // for position pos when seq == pos, and the packet is ready to be written out when seq == pos + 1.
+    struct QueueSlot
+    {
+        unsigned int seq;
+        int len;
+    };
+    QueueSlot* queueSlot(unsigned int pos)
+    {
+        return (QueueSlot*)&queuebuf[(pos & (queue_slots - 1)) * queue_slot_size];
+    }
+    bool queueReady()
+    {
+        return queuebuf != 0 && __atomic_load_n(&queueSlot(queue_head)->seq, __ATOMIC_ACQUIRE) == queue_head + 1;
+    }
+    unsigned char* queuebuf;
+    unsigned int queue_slots, queue_slot_size;
+    unsigned int queue_head;     // the next slot to be written out, only used by the thread doing the I/O
+    unsigned int queue_tail;     // the next slot to be filled, claimed atomically
+#endif
 
     Timer last_sent, last_received;
+    Timer ping_sent;             // the server has until this expires to respond to our PINGREQ
     unsigned int keepAliveInterval;
     bool ping_outstanding;
     bool cleansession;
@@ -317,6 +476,7 @@ void MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS>::cleanSession()
 template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS>
 void MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS>::closeSession()
 {
+    coalesce_len = 0;
     ping_outstanding = false;
     isconnected = false;
     if (cleansession)
@@ -328,6 +488,16 @@ template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS>
 MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS>::Client(Network& network, unsigned int command_timeout_ms)  : ipstack(network), packetid()
 {
     this->command_timeout_ms = command_timeout_ms;
+    coalescebuf = 0;
+    coalescebuf_size = coalesce_len = 0;
+    coalesce_budget_us = 0;
+    setOfflineBuffer(0, 0);
+    read_len = 0;
+    read_packet_len = -1;
+#if MQTTCLIENT_PUBLISH_QUEUE
+    queuebuf = 0;
+    queue_slots = queue_slot_size = queue_head = queue_tail = 0;
+#endif
     cleansession = true;
 	  closeSession();
 }
@@ -377,14 +547,14 @@ void MQTT::Client<Network, Timer, a, b>::freeQoS2msgid(unsigned short id)
 
 
 template<class Network, class Timer, int a, int b>
-int MQTT::Client<Network, Timer, a, b>::sendPacket(int length, Timer& timer)
+int MQTT::Client<Network, Timer, a, b>::writePacket(unsigned char* buf, int length, Timer& timer)
 {
     int rc = FAILURE,
         sent = 0;
 
     while (sent < length)
     {
-        rc = ipstack.write(&sendbuf[sent], length - sent, timer.left_ms());
+        rc = ipstack.write(&buf[sent], length - sent, timer.left_ms());
         if (rc < 0)  // there was an error writing the data
             break;
         sent += rc;
@@ -399,78 +569,271 @@ int MQTT::Client<Network, Timer, a, b>::sendPacket(int length, Timer& timer)
     }
     else
         rc = FAILURE;
+    return rc;
+}
 
-#if defined(MQTT_DEBUG)
-    char printbuf[150];
-    DEBUG("Rc %d from sending packet %s\r\n", rc,
-        MQTTFormat_toServerString(printbuf, sizeof(printbuf), sendbuf, length));
-#endif
+
+// write out any coalesced packets
+template<class Network, class Timer, int a, int b>
+int MQTT::Client<Network, Timer, a, b>::flushPackets(Timer& timer)
+{
+    int rc = SUCCESS;
+
+    if (coalesce_len > 0)
+    {
+        rc = writePacket(coalescebuf, coalesce_len, timer);
+        coalesce_len = 0;
+    }
     return rc;
 }
 
 
+// the length of the packet at offset from the oldest in the offline buffer - its header may wrap around
 template<class Network, class Timer, int a, int b>
-int MQTT::Client<Network, Timer, a, b>::decodePacket(int* value, int timeout)
+size_t MQTT::Client<Network, Timer, a, b>::offlinePacketLen(size_t offset)
 {
-    unsigned char c;
-    int multiplier = 1;
-    int len = 0;
-    const int MAX_NO_OF_REMAINING_LENGTH_BYTES = 4;
+    unsigned char header[5];
+    int rem_len = 0;
 
-    *value = 0;
-    do
+    for (size_t i = 0; i < sizeof(header) && offset + i < offline_len; ++i)
+        header[i] = offlinebuf[(offline_head + offset + i) % offlinebuf_size];
+    return 1 + MQTTPacket_decodeBuf(&header[1], &rem_len) + rem_len;
+}
+
+
+template<class Network, class Timer, int a, int b>
+void MQTT::Client<Network, Timer, a, b>::offlineRemove(size_t len)
+{
+    offline_head = (offline_head + len) % offlinebuf_size;
+    offline_len -= len;
+    offline_metrics.count--;
+    if (offline_len == 0)
+        offline_head = 0; // so the next packets are more likely to be contiguous
+}
+
+
+// keep the publish serialized in sendbuf for when the client connects again
+template<class Network, class Timer, int a, int b>
+int MQTT::Client<Network, Timer, a, b>::storeOffline(int len)
+{
+    if ((size_t)len > offlinebuf_size)
+        return BUFFER_OVERFLOW;
+    while (offline_len + len > offlinebuf_size && offline_policy == OFFLINE_DROP_OLDEST)
+    {
+        offlineRemove(offlinePacketLen(0));
+        offline_metrics.dropped++;
+    }
+    if (offline_len + len > offlinebuf_size)
     {
-        int rc = MQTTPACKET_READ_ERROR;
+        offline_metrics.rejected++;
+        return FAILURE;
+    }
+
+    size_t tail = (offline_head + offline_len) % offlinebuf_size;
+    size_t first = (tail + len > offlinebuf_size) ? offlinebuf_size - tail : len;
+    memcpy(&offlinebuf[tail], sendbuf, first);
+    memcpy(offlinebuf, &sendbuf[first], len - first); // the rest wraps around to the start
+    offline_len += len;
+    offline_metrics.count++;
+    offline_metrics.stored++;
+    if (offline_len > offline_metrics.high_water)
+        offline_metrics.high_water = offline_len;
+    return SUCCESS;
+}
 
-        if (++len > MAX_NO_OF_REMAINING_LENGTH_BYTES)
+
+// send the publishes kept while disconnected, oldest first, written straight from the buffer
+template<class Network, class Timer, int a, int b>
+int MQTT::Client<Network, Timer, a, b>::drainOffline(Timer& timer)
+{
+    int rc = SUCCESS;
+
+    while (rc == SUCCESS && offline_len > 0)
+    {
+        size_t len = 0, count = 0, packet_len = 0;
+
+        while (len < offline_len)
         {
-            rc = MQTTPACKET_READ_ERROR; /* bad data */
+            size_t end = offline_head + len + (packet_len = offlinePacketLen(len));
+            if (end > offlinebuf_size)
+                break; // this one wraps around
+            len += packet_len;
+            ++count;
+            if (end == offlinebuf_size)
+                break; // the next starts again at the beginning of the buffer
+        }
+
+        if (count > 0)
+            rc = writePacket(&offlinebuf[offline_head], len, timer);
+        else
+        {   // only a packet which wraps around is copied
+            size_t first = offlinebuf_size - offline_head;
+            len = packet_len;
+            memcpy(sendbuf, &offlinebuf[offline_head], first);
+            memcpy(&sendbuf[first], offlinebuf, len - first);
+            rc = writePacket(sendbuf, len, timer);
+            count = 1;
+        }
+        if (rc == SUCCESS)
+        {
+            offline_head = (offline_head + len) % offlinebuf_size;
+            offline_len -= len;
+            offline_metrics.count -= count;
+            offline_metrics.sent += count;
+        }
+    }
+    if (offline_len == 0)
+        offline_head = 0;
+    return rc;
+}
+
+
+#if MQTTCLIENT_PUBLISH_QUEUE
+// write out the queued publishes, batched in sendbuf
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::drainQueue(Timer& timer)
+{
+    int rc = SUCCESS,
+        len = 0;
+
+    while (rc == SUCCESS)
+    {
+        QueueSlot* slot = (queuebuf == 0) ? 0 : queueSlot(queue_head);
+        bool ready = queueReady();
+
+        if (len > 0 && (!ready || len + slot->len > MAX_MQTT_PACKET_SIZE))
+        {   // write out the batch so far
+            rc = writePacket(sendbuf, len, timer);
+            len = 0;
+        }
+        else if (!ready)
+            break;
+        else
+        {
+            if (slot->len > MAX_MQTT_PACKET_SIZE) // too big to batch
+                rc = writePacket((unsigned char*)(slot + 1), slot->len, timer);
+            else
+            {
+                memcpy(&sendbuf[len], slot + 1, slot->len);
+                len += slot->len;
+            }
+            __atomic_store_n(&slot->seq, queue_head + queue_slots, __ATOMIC_RELEASE); // free the slot
+            ++queue_head;
+        }
+    }
+    return rc;
+}
+#endif
+
+
+// add the packet in sendbuf to the coalescing buffer, writing it out when full or over the time budget
+template<class Network, class Timer, int a, int b>
+int MQTT::Client<Network, Timer, a, b>::coalescePacket(int length, Timer& timer)
+{
+    if (coalesce_len + length > coalescebuf_size && flushPackets(timer) != SUCCESS)
+        return FAILURE;
+    if (length > coalescebuf_size)
+        return writePacket(sendbuf, length, timer);
+
+    if (coalesce_len == 0)
+        coalesce_timer.countdown_us(coalesce_budget_us);
+    memcpy(&coalescebuf[coalesce_len], sendbuf, length);
+    coalesce_len += length;
+
+    if (coalesce_len == coalescebuf_size || coalesce_timer.expired())
+        return flushPackets(timer);
+    return SUCCESS;
+}
+
+
+template<class Network, class Timer, int a, int b>
+int MQTT::Client<Network, Timer, a, b>::sendPacket(int length, Timer& timer)
+{
+    int rc = FAILURE;
+
+    if (coalesce_len > 0)
+    {   // anything sent this way is needed on the wire now, so take the coalesced packets with it
+        if (coalesce_len + length <= coalescebuf_size)
+        {
+            memcpy(&coalescebuf[coalesce_len], sendbuf, length);
+            coalesce_len += length;
+            rc = flushPackets(timer);
             goto exit;
         }
-        rc = ipstack.read(&c, 1, timeout);
-        if (rc != 1)
+        if (flushPackets(timer) != SUCCESS)
             goto exit;
-        *value += (c & 127) * multiplier;
-        multiplier *= 128;
-    } while ((c & 128) != 0);
+    }
+    rc = writePacket(sendbuf, length, timer);
+
 exit:
-    return len;
+#if defined(MQTT_DEBUG)
+    char printbuf[150];
+    DEBUG("Rc %d from sending packet %s\r\n", rc,
+        MQTTFormat_toServerString(printbuf, sizeof(printbuf), sendbuf, length));
+#endif
+    return rc;
 }
 
 
 /**
  * If any read fails in this method, then we should disconnect from the network, as on reconnect
- * the packets can be retried.
- * @param timeout the max time to wait for the packet read to complete, in milliseconds
- * @return the MQTT packet type, 0 if none, -1 if error
+ * the packets can be retried.  A packet which is not complete when the timer expires is kept,
+ * and the next call carries on where this one left off.
+ * @param timer the time to wait for the packet read to complete
+ * @return the MQTT packet type, 0 if no complete packet yet, negative on error
  */
 template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
 int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::readPacket(Timer& timer)
 {
-    int rc = FAILURE;
+    int rc = 0;
     MQTTHeader header = {0};
-    int len = 0;
-    int rem_len = 0;
+    const int MAX_NO_OF_REMAINING_LENGTH_BYTES = 4;
 
     /* 1. read the header byte.  This has the packet type in it */
-    rc = ipstack.read(readbuf, 1, timer.left_ms());
-    if (rc != 1)
-        goto exit;
+    if (read_len == 0)
+    {
+        if ((rc = ipstack.read(readbuf, 1, timer.left_ms())) != 1)
+            goto exit;
+        read_len = 1;
+    }
 
-    len = 1;
     /* 2. read the remaining length.  This is variable in itself */
-    decodePacket(&rem_len, timer.left_ms());
-    len += MQTTPacket_encode(readbuf + 1, rem_len); /* put the original remaining length into the buffer */
-
-    if (rem_len > (MAX_MQTT_PACKET_SIZE - len))
+    while (read_packet_len < 0)
     {
-        rc = BUFFER_OVERFLOW;
-        goto exit;
+        if (read_len > MAX_NO_OF_REMAINING_LENGTH_BYTES)
+        {
+            rc = MQTTPACKET_READ_ERROR; /* bad data */
+            goto exit;
+        }
+        if ((rc = ipstack.read(&readbuf[read_len], 1, timer.left_ms())) != 1)
+            goto exit;
+        if ((readbuf[read_len++] & 128) == 0)
+        {
+            int rem_len = 0, multiplier = 1;
+
+            for (int i = 1; i < read_len; ++i, multiplier *= 128)
+                rem_len += (readbuf[i] & 127) * multiplier;
+            if (rem_len > (MAX_MQTT_PACKET_SIZE - read_len))
+            {
+                rc = BUFFER_OVERFLOW;
+                goto exit;
+            }
+            read_packet_len = read_len + rem_len;
+        }
     }
 
     /* 3. read the rest of the buffer using a callback to supply the rest of the data */
-    if (rem_len > 0 && (ipstack.read(readbuf + len, rem_len, timer.left_ms()) != rem_len))
-        goto exit;
+    if (read_len < read_packet_len)
+    {
+        if ((rc = ipstack.read(&readbuf[read_len], read_packet_len - read_len, timer.left_ms())) < 0)
+            goto exit;
+        read_len += rc;
+        if (read_len < read_packet_len)
+        {
+            rc = 0;
+            goto exit;
+        }
+    }
 
     header.byte = readbuf[0];
     rc = header.bits.type;
@@ -479,13 +842,18 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::readPacket(Timer& tim
 exit:
 
 #if defined(MQTT_DEBUG)
-    if (rc >= 0)
+    if (rc > 0)
     {
         char printbuf[50];
         DEBUG("Rc %d receiving packet %s\r\n", rc,
-            MQTTFormat_toClientString(printbuf, sizeof(printbuf), readbuf, len));
+            MQTTFormat_toClientString(printbuf, sizeof(printbuf), readbuf, read_len));
     }
 #endif
+    if (rc != 0)
+    {   // finished with this packet, one way or another
+        read_len = 0;
+        read_packet_len = -1;
+    }
     return rc;
 }
 
@@ -575,14 +943,75 @@ int MQTT::Client<Network, Timer, a, b>::yield(unsigned long timeout_ms)
 }
 
 
+template<class Network, class Timer, int a, int b>
+int MQTT::Client<Network, Timer, a, b>::yieldNoWait(int* next_ms)
+{
+    int rc = SUCCESS;
+    Timer timer;
+
+    timer.countdown_ms(0);
+    // a packet may have brought the rest of the socket's data into the read-ahead buffer with it,
+    // where polling the socket won't see it, so carry on until there is no complete packet left
+    do
+        rc = cycle(timer);
+    while (rc > 0 && isconnected);
+
+    rc = (rc < 0 || !isconnected) ? FAILURE : SUCCESS;
+    if (next_ms)
+        *next_ms = nextDeadline();
+    return rc;
+}
+
+
+template<class Network, class Timer, int a, int b>
+int MQTT::Client<Network, Timer, a, b>::nextDeadline()
+{
+    int left = -1;
+
+    if (keepAliveInterval > 0 && ping_outstanding)
+        left = ping_sent.left_ms(); // the only keepalive work left is to give up waiting for the PINGRESP
+    else if (keepAliveInterval > 0)
+    {
+        int sent = last_sent.left_ms(), received = last_received.left_ms();
+        left = (sent < received) ? sent : received;
+    }
+    if (coalesce_len > 0)
+    {
+        int coalesce = coalesce_timer.left_ms();
+        if (left == -1 || coalesce < left)
+            left = coalesce;
+    }
+#if MQTTCLIENT_PUBLISH_QUEUE
+    if (queueReady())
+        left = 0;
+#endif
+    return left;
+}
+
+
 template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
 int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::cycle(Timer& timer)
 {
     // get one piece of work off the wire and one pass through
     int len = 0,
-        rc = SUCCESS;
+        rc = SUCCESS,
+        packet_type = 0;
 
-    int packet_type = readPacket(timer);    // read the socket, see what work is due
+    cacheClock((Timer*)0, true); // one clock reading for the whole cycle, if the timer can
+    if (flushPackets(timer) != SUCCESS) // don't leave coalesced packets waiting while we read
+    {
+        rc = FAILURE;
+        goto exit;
+    }
+#if MQTTCLIENT_PUBLISH_QUEUE
+    if (isconnected && drainQueue(timer) != SUCCESS) // nor queued ones
+    {
+        rc = FAILURE;
+        goto exit;
+    }
+#endif
+
+    packet_type = readPacket(timer);    // read the socket, see what work is due
 
     switch (packet_type)
     {
@@ -672,6 +1101,7 @@ exit:
         rc = packet_type;
     else if (isconnected)
         closeSession();
+    cacheClock((Timer*)0, false);
     return rc;
 }
 
@@ -680,7 +1110,6 @@ template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
 int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::keepalive()
 {
     int rc = SUCCESS;
-    static Timer ping_sent;
 
     if (keepAliveInterval == 0)
         goto exit;
@@ -740,6 +1169,8 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::connect(MQTTPacket_co
 
     this->keepAliveInterval = options.keepAliveInterval;
     this->cleansession = options.cleansession;
+    read_len = 0; // a new connection, so nothing of a packet has arrived yet
+    read_packet_len = -1;
     if ((len = MQTTSerialize_connect(sendbuf, MAX_MQTT_PACKET_SIZE, &options)) <= 0)
         goto exit;
     if ((rc = sendPacket(len, connect_timer)) != SUCCESS)  // send the connect packet
@@ -768,7 +1199,7 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::connect(MQTTPacket_co
         if ((len = MQTTSerialize_ack(sendbuf, MAX_MQTT_PACKET_SIZE, PUBREL, 0, inflightMsgid)) <= 0)
             rc = FAILURE;
         else
-            rc = publish(len, connect_timer, inflightQoS);
+            rc = publish(len, connect_timer, inflightQoS, inflightMsgid);
     }
     else
 #endif
@@ -776,7 +1207,7 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::connect(MQTTPacket_co
     if (inflightMsgid > 0)
     {
         memcpy(sendbuf, pubbuf, MAX_MQTT_PACKET_SIZE);
-        rc = publish(inflightLen, connect_timer, inflightQoS);
+        rc = publish(inflightLen, connect_timer, inflightQoS, inflightMsgid);
     }
 #endif
 
@@ -785,6 +1216,8 @@ exit:
     {
         isconnected = true;
         ping_outstanding = false;
+        if (offline_len > 0 && drainOffline(connect_timer) != SUCCESS)
+            closeSession(); // connected, but the next call finds the session has failed
     }
     return rc;
 }
@@ -806,6 +1239,108 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::connect()
 }
 
 
+template<class Network, class Timer, int a, int b>
+int MQTT::Client<Network, Timer, a, b>::setWriteCoalescing(unsigned char* buf, int buf_size, unsigned long budget_us)
+{
+    int rc = SUCCESS;
+    Timer timer(command_timeout_ms);
+
+    if (isconnected)
+        rc = flushPackets(timer); // don't lose anything collected in the old buffer
+    coalesce_len = 0;
+    coalescebuf = buf;
+    coalescebuf_size = (buf == 0) ? 0 : buf_size;
+    coalesce_budget_us = budget_us;
+    return rc;
+}
+
+
+template<class Network, class Timer, int a, int b>
+int MQTT::Client<Network, Timer, a, b>::setOfflineBuffer(unsigned char* buf, size_t buf_size, OfflinePolicy policy)
+{
+    offlinebuf = buf;
+    offlinebuf_size = (buf == 0) ? 0 : buf_size;
+    offline_head = offline_len = 0;
+    offline_policy = policy;
+    memset(&offline_metrics, '\0', sizeof(offline_metrics));
+    return SUCCESS;
+}
+
+
+#if MQTTCLIENT_PUBLISH_QUEUE
+template<class Network, class Timer, int a, int b>
+int MQTT::Client<Network, Timer, a, b>::setPublishQueue(unsigned char* buf, size_t buf_size, size_t slot_size)
+{
+    int rc = SUCCESS;
+    Timer timer(command_timeout_ms);
+    const size_t align = sizeof(QueueSlot);
+
+    if (isconnected)
+        rc = drainQueue(timer); // don't lose anything in the old queue
+    queuebuf = 0;
+    if (buf != 0)
+    {
+        size_t skip = (align - ((size_t)buf % align)) % align; // slot headers have to be aligned
+        unsigned int slots = 1;
+
+        slot_size = (slot_size + align - 1) / align * align;
+        if (slot_size <= align || buf_size < skip + slot_size)
+            return FAILURE;
+        while (slots * 2 <= (buf_size - skip) / slot_size)
+            slots *= 2; // a power of two, so that the positions can wrap around
+        queue_slots = slots;
+        queue_slot_size = (unsigned int)slot_size;
+        queue_head = queue_tail = 0;
+        queuebuf = buf + skip;
+        for (unsigned int i = 0; i < slots; ++i)
+            queueSlot(i)->seq = i;
+    }
+    return rc;
+}
+
+
+template<class Network, class Timer, int a, int b>
+int MQTT::Client<Network, Timer, a, b>::enqueuePublish(const char* topicName, Message& message)
+{
+    MQTTString topic = MQTTString_initializer;
+    QueueSlot* slot = 0;
+    unsigned int pos = 0;
+
+    topic.cstring = (char*)topicName;
+    if (queuebuf == 0 || message.qos != QOS0 || !isconnected)
+        return FAILURE;
+
+    // claim the slot at the tail
+    pos = __atomic_load_n(&queue_tail, __ATOMIC_RELAXED);
+    while (true)
+    {
+        slot = queueSlot(pos);
+        int diff = (int)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&queue_tail, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0)
+            return FAILURE; // the queue is full
+        else
+            pos = __atomic_load_n(&queue_tail, __ATOMIC_RELAXED);
+    }
+
+    int rc = SUCCESS;
+    slot->len = MQTTSerialize_publish((unsigned char*)(slot + 1), queue_slot_size - sizeof(QueueSlot), 0, 0,
+              message.retained, 0, topic, (unsigned char*)message.payload, message.payloadlen);
+    if (slot->len <= 0)
+    {   // the slot still has to be passed on, so leave it empty
+        slot->len = 0;
+        rc = BUFFER_OVERFLOW;
+    }
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    return rc;
+}
+#endif
+
+
 template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS>
 int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::setMessageHandler(const char* topicFilter, messageHandler messageHandler)
 {
@@ -932,47 +1467,56 @@ exit:
 
 
 template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publish(int len, Timer& timer, enum QoS qos)
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publish(int len, Timer& timer, enum QoS qos, unsigned short id)
 {
     int rc;
 
-    if ((rc = sendPacket(len, timer)) != SUCCESS) // send the publish packet
-        goto exit; // there was a problem
+    if (qos == QOS0 && coalescebuf != 0)
+        rc = coalescePacket(len, timer);
+    else
+        rc = sendPacket(len, timer); // send the publish packet
+    if (rc == SUCCESS)
+        rc = waitforAck(timer, qos, id);
+    else
+        closeSession(); // there was a problem
+    return rc;
+}
+
+
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::waitforAck(Timer& timer, enum QoS qos, unsigned short id)
+{
+    int rc = SUCCESS;
 
 #if MQTTCLIENT_QOS1
     if (qos == QOS1)
     {
-        if (waitfor(PUBACK, timer) == PUBACK)
+        unsigned short mypacketid = 0;
+        while (rc == SUCCESS && mypacketid != id) // acks for publishes sent from the offline buffer aren't ours
         {
-            unsigned short mypacketid;
             unsigned char dup, type;
-            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, readbuf, MAX_MQTT_PACKET_SIZE) != 1)
+            if (waitfor(PUBACK, timer) != PUBACK || MQTTDeserialize_ack(&type, &dup, &mypacketid, readbuf, MAX_MQTT_PACKET_SIZE) != 1)
                 rc = FAILURE;
-            else if (inflightMsgid == mypacketid)
-                inflightMsgid = 0;
         }
-        else
-            rc = FAILURE;
+        if (rc == SUCCESS && inflightMsgid == mypacketid)
+            inflightMsgid = 0;
     }
 #endif
 #if MQTTCLIENT_QOS2
     else if (qos == QOS2)
     {
-        if (waitfor(PUBCOMP, timer) == PUBCOMP)
+        unsigned short mypacketid = 0;
+        while (rc == SUCCESS && mypacketid != id) // acks for publishes sent from the offline buffer aren't ours
         {
-            unsigned short mypacketid;
             unsigned char dup, type;
-            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, readbuf, MAX_MQTT_PACKET_SIZE) != 1)
+            if (waitfor(PUBCOMP, timer) != PUBCOMP || MQTTDeserialize_ack(&type, &dup, &mypacketid, readbuf, MAX_MQTT_PACKET_SIZE) != 1)
                 rc = FAILURE;
-            else if (inflightMsgid == mypacketid)
-                inflightMsgid = 0;
         }
-        else
-            rc = FAILURE;
+        if (rc == SUCCESS && inflightMsgid == mypacketid)
+            inflightMsgid = 0;
     }
 #endif
 
-exit:
     if (rc != SUCCESS)
         closeSession();
     return rc;
@@ -988,7 +1532,7 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publish(const char* t
     MQTTString topicString = MQTTString_initializer;
     int len = 0;
 
-    if (!isconnected)
+    if (!isconnected && offlinebuf == 0)
         goto exit;
 
     topicString.cstring = (char*)topicName;
@@ -998,6 +1542,22 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publish(const char* t
         id = packetid.getNext();
 #endif
 
+    if (!isconnected)
+    {   // keep it for when the client connects again
+        if ((len = MQTTSerialize_publish(sendbuf, MAX_MQTT_PACKET_SIZE, 0, qos, retained, id,
+              topicString, (unsigned char*)payload, payloadlen)) <= 0)
+            rc = BUFFER_OVERFLOW;
+        else
+            rc = storeOffline(len);
+        goto exit;
+    }
+
+    if (offline_len > 0 && drainOffline(timer) != SUCCESS) // the older publishes go first
+    {
+        closeSession();
+        goto exit;
+    }
+
     len = MQTTSerialize_publish(sendbuf, MAX_MQTT_PACKET_SIZE, 0, qos, retained, id,
               topicString, (unsigned char*)payload, payloadlen);
     if (len <= 0)
@@ -1016,7 +1576,7 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publish(const char* t
     }
 #endif
 
-    rc = publish(len, timer, qos);
+    rc = publish(len, timer, qos, id);
 exit:
     return rc;
 }
@@ -1037,6 +1597,77 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publish(const char* t
 }
 
 
+// send a publish whose payload is written by the network from a file, or from memory, rather than from sendbuf
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publishBody(const char* topicName, int fd, size_t offset,
+        void* payload, size_t payloadlen, enum QoS qos, bool retained)
+{
+    int rc = FAILURE;
+    Timer timer(command_timeout_ms);
+    MQTTString topicString = MQTTString_initializer;
+    unsigned short id = 0;
+    size_t sent = 0;
+    int len = 0;
+
+    if (!isconnected)
+        goto exit;
+    topicString.cstring = (char*)topicName;
+#if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
+    if (qos == QOS1 || qos == QOS2)
+        id = packetid.getNext();
+#endif
+
+    if (offline_len > 0 && drainOffline(timer) != SUCCESS) // the older publishes go first
+    {
+        closeSession();
+        goto exit;
+    }
+    if ((len = MQTTSerialize_publishHeader(sendbuf, MAX_MQTT_PACKET_SIZE, 0, qos, retained, id, topicString, (int)payloadlen)) <= 0)
+        goto exit;
+    // not kept in pubbuf to be sent again, as the payload isn't there
+    if ((rc = sendPacket(len, timer)) == SUCCESS)
+    {
+        while (sent < payloadlen)
+        {
+            rc = (fd >= 0) ? ipstack.sendfile(fd, offset + sent, (int)(payloadlen - sent), timer.left_ms()) :
+                ipstack.writeZeroCopy((unsigned char*)payload + sent, (int)(payloadlen - sent), timer.left_ms());
+            if (rc < 0)
+                break;
+            sent += rc;
+            if (timer.expired())
+                break;
+        }
+        rc = (sent == payloadlen) ? SUCCESS : FAILURE;
+    }
+    if (rc == SUCCESS)
+    {
+        if (this->keepAliveInterval > 0)
+            last_sent.countdown(this->keepAliveInterval);
+        rc = waitforAck(timer, qos, id);
+    }
+    else
+        closeSession();
+exit:
+    return rc;
+}
+
+
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publishFile(const char* topicName, int fd, size_t offset,
+        size_t payloadlen, enum QoS qos, bool retained)
+{
+    return (fd < 0) ? FAILURE : publishBody(topicName, fd, offset, 0, payloadlen, qos, retained);
+}
+
+
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publishZeroCopy(const char* topicName, void* payload,
+        size_t payloadlen, enum QoS qos, bool retained)
+{
+    return publishBody(topicName, -1, 0, payload, payloadlen, qos, retained);
+}
+
+
 template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
 int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::disconnect()
 {
@@ -20,6 +20,8 @@
 #include <sys/param.h>
 #include <sys/time.h>
 #include <sys/select.h>
+#include <poll.h>
+#include <time.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
@@ -32,124 +34,663 @@
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <pthread.h>
+#include <sys/sendfile.h>
+#include <sys/un.h>
+#include <linux/errqueue.h>
+
+// The clock timers are measured against.  It is not set back when the system time is
+#if defined(MQTT_LINUX_COARSE_CLOCK)
+#define LINUX_TIMER_CLOCK CLOCK_MONOTONIC_COARSE // cheaper to read, at a few milliseconds resolution
+#else
+#define LINUX_TIMER_CLOCK CLOCK_MONOTONIC
+#endif
+
+// While a cycle is in progress, the thread running it reads the clock once and the timers share
+// that reading.  Time only moves on noticeably while waiting for the network, so the reading is
+// updated after each wait.
+static __thread struct timespec linux_now;
+static __thread bool linux_now_cached = false;
+
+static inline void linux_clock(struct timespec& now)
+{
+	if (linux_now_cached)
+		now = linux_now;
+	else
+		clock_gettime(LINUX_TIMER_CLOCK, &now);
+}
+
+static inline void linux_add(struct timespec& ts, time_t sec, long nsec)
+{
+	ts.tv_sec += sec;
+	ts.tv_nsec += nsec;
+	if (ts.tv_nsec >= 1000000000L)
+	{
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+}
+
+#if !defined(LINUX_READ_BUFFER_SIZE)
+#define LINUX_READ_BUFFER_SIZE 1024 // redefinable - size of the socket read-ahead buffer
+#endif
+
+#if !defined(LINUX_ZEROCOPY_MIN)
+#define LINUX_ZEROCOPY_MIN 16384 // redefinable - smaller writes are copied: pinning pages costs more than copying them
+#endif
+
+#if !defined(LINUX_CONNECT_TIMEOUT_MS)
+#define LINUX_CONNECT_TIMEOUT_MS 10000 // redefinable - the longest connect tries the addresses of a host for
+#endif
+
+#if !defined(LINUX_CONNECT_ATTEMPT_DELAY_MS)
+#define LINUX_CONNECT_ATTEMPT_DELAY_MS 250 // redefinable - how long one address has before the next is tried alongside it (RFC 8305)
+#endif
+
+#if !defined(LINUX_DNS_ADDRESSES)
+#define LINUX_DNS_ADDRESSES 8 // redefinable - the most addresses of a host name connect tries
+#endif
+
+#if !defined(LINUX_DNS_CACHE_SIZE)
+#define LINUX_DNS_CACHE_SIZE 4 // redefinable - host names whose addresses are kept, or 0 to resolve every time
+#endif
+
+#if !defined(LINUX_DNS_CACHE_TTL_S)
+#define LINUX_DNS_CACHE_TTL_S 60 // redefinable - how long they are kept: getaddrinfo doesn't give the records' own TTLs
+#endif
+
+// the addresses of a host name, IPv4 or IPv6
+union linux_address
+{
+	struct sockaddr sa;
+	struct sockaddr_in in;
+	struct sockaddr_in6 in6;
+};
+
+#if LINUX_DNS_CACHE_SIZE > 0
+// The addresses of the host names connected to most recently, so that reconnecting doesn't wait
+// for the resolver.  They are shared by all threads, so the cache has a lock; getaddrinfo is
+// called without it.
+static struct
+{
+	char host[256];
+	time_t expires;
+	int count;
+	linux_address addrs[LINUX_DNS_ADDRESSES];
+} linux_dns[LINUX_DNS_CACHE_SIZE];
+static unsigned int linux_dns_next; // the entry to replace next
+static pthread_mutex_t linux_dns_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+// Take up to max addresses from getaddrinfo's, in the order to try them.  getaddrinfo has sorted
+// them by preference (RFC 6724): the families are interleaved, starting with the preferred one, so
+// that a dead family holds up the other by no more than one attempt delay (RFC 8305).
+static int linux_interleave(struct addrinfo* result, linux_address* addrs, int max)
+{
+	struct addrinfo* next[2] = {result, result};
+	int family[2] = {AF_INET6, AF_INET};
+	int count = 0, turn = 0, exhausted = 0;
+
+	if (result != NULL && result->ai_family == AF_INET)
+	{
+		family[0] = AF_INET;
+		family[1] = AF_INET6;
+	}
+	while (count < max && exhausted < 2)
+	{
+		struct addrinfo* res = next[turn];
+		while (res != NULL && res->ai_family != family[turn])
+			res = res->ai_next;
+		if (res != NULL && res->ai_addrlen <= sizeof(linux_address))
+		{
+			memcpy(&addrs[count++], res->ai_addr, res->ai_addrlen);
+			next[turn] = res->ai_next;
+			exhausted = 0;
+		}
+		else
+		{
+			next[turn] = NULL;
+			exhausted++;
+		}
+		turn ^= 1;
+	}
+	return count;
+}
+
+// resolve a host name, or take its addresses from the cache
+// return the number of addresses, 0 if it can't be resolved
+static int linux_resolve(const char* host, linux_address* addrs)
+{
+	struct addrinfo hints = {0, AF_UNSPEC, SOCK_STREAM, IPPROTO_TCP, 0, NULL, NULL, NULL};
+	struct addrinfo* result = NULL;
+	int count = 0;
+#if LINUX_DNS_CACHE_SIZE > 0
+	struct timespec now;
+	clock_gettime(LINUX_TIMER_CLOCK, &now);
+	pthread_mutex_lock(&linux_dns_mutex);
+	for (int i = 0; i < LINUX_DNS_CACHE_SIZE && count == 0; ++i)
+	{
+		if (linux_dns[i].count > 0 && strcmp(linux_dns[i].host, host) == 0)
+		{
+			if (now.tv_sec < linux_dns[i].expires)
+			{
+				count = linux_dns[i].count;
+				memcpy(addrs, linux_dns[i].addrs, sizeof(linux_address) * count);
+			}
+			else
+				linux_dns[i].count = 0; // stale
+		}
+	}
+	pthread_mutex_unlock(&linux_dns_mutex);
+	if (count > 0)
+		return count;
+#endif
+	if (getaddrinfo(host, NULL, &hints, &result) != 0)
+		return 0;
+	count = linux_interleave(result, addrs, LINUX_DNS_ADDRESSES);
+	freeaddrinfo(result);
+#if LINUX_DNS_CACHE_SIZE > 0
+	if (count > 0 && strlen(host) < sizeof(linux_dns[0].host))
+	{
+		pthread_mutex_lock(&linux_dns_mutex);
+		int i = linux_dns_next++ % LINUX_DNS_CACHE_SIZE;
+		strcpy(linux_dns[i].host, host);
+		linux_dns[i].expires = now.tv_sec + LINUX_DNS_CACHE_TTL_S;
+		linux_dns[i].count = count;
+		memcpy(linux_dns[i].addrs, addrs, sizeof(linux_address) * count);
+		pthread_mutex_unlock(&linux_dns_mutex);
+	}
+#endif
+	return count;
+}
+
+// forget the cached addresses of a host name, none of which could be connected to, so that it is
+// resolved again next time
+static void linux_forget(const char* host)
+{
+#if LINUX_DNS_CACHE_SIZE > 0
+	pthread_mutex_lock(&linux_dns_mutex);
+	for (int i = 0; i < LINUX_DNS_CACHE_SIZE; ++i)
+	{
+		if (linux_dns[i].count > 0 && strcmp(linux_dns[i].host, host) == 0)
+			linux_dns[i].count = 0;
+	}
+	pthread_mutex_unlock(&linux_dns_mutex);
+#endif
+}
+
+
+// options for the socket, set by IPStack::connect before it connects, and by connectUnix as far
+// as they apply to a Unix domain socket.  Each is best effort: one the kernel doesn't have, or
+// won't allow without privilege, is left as it was.  The defaults turn Nagle's algorithm off, and
+// leave the rest to the kernel.
+struct SocketOptions
+{
+  SocketOptions() : nodelay(true), quickack(false), sndbuf(0), rcvbuf(0), user_timeout_ms(0), busy_poll_us(0) {}
+
+  bool nodelay;                 // TCP_NODELAY: send each packet at once, rather than hold it back for the last to be acknowledged
+  bool quickack;                // TCP_QUICKACK: acknowledge what arrives at once rather than delay it.  Set again before each wait to read, a system call each time, so off unless latency matters most
+  int sndbuf, rcvbuf;           // SO_SNDBUF and SO_RCVBUF in bytes, or 0 to leave the kernel to size them
+  unsigned int user_timeout_ms; // TCP_USER_TIMEOUT: fail the connection when what was sent goes unacknowledged this long, or 0 for the kernel's default
+  int busy_poll_us;             // SO_BUSY_POLL: spin on the device queue this long when reading finds nothing, or 0 not to
+};
 
 
 class IPStack
 {
 public:
-  IPStack()
+  IPStack(const SocketOptions& options = SocketOptions()) : readbuf_start(0), readbuf_end(0), zerocopy(false),
+		options(options), tcp(false)
   {
 		signal(SIGPIPE, SIG_IGN);
   }
 
+  // for the next connect
+  void setSocketOptions(const SocketOptions& options)
+  {
+		this->options = options;
+  }
+
+  // connect over IPv6 or IPv4, racing the addresses of the host name
   int connect(const char* hostname, int port)
   {
-		int type = SOCK_STREAM;
-		struct sockaddr_in address;
+		linux_address addrs[LINUX_DNS_ADDRESSES];
+		int count = linux_resolve(hostname, addrs);
+		int rc = -1;
+
+		readbuf_start = readbuf_end = 0;
+		zerocopy = false;
+		zerocopy_sent = zerocopy_done = 0;
+		tcp = true;
+		mysock = (count > 0) ? race(addrs, count, port) : -1;
+		if (mysock != -1)
+			rc = 0; // connected, and left non-blocking: all further waiting is done in ppoll, with a deadline for each operation
+		else if (count > 0)
+			linux_forget(hostname); // the addresses may have moved
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+		if (rc == 0)
+		{
+			int opt = 1;
+			zerocopy = (setsockopt(mysock, SOL_SOCKET, SO_ZEROCOPY, &opt, sizeof(opt)) == 0);
+		}
+#endif
+		return rc;
+  }
+
+  // connect to a broker on the same host through a Unix domain socket, which skips the TCP/IP stack
+  int connectUnix(const char* path)
+  {
+		struct sockaddr_un address;
 		int rc = -1;
-		sa_family_t family = AF_INET;
-		struct addrinfo *result = NULL;
-		struct addrinfo hints = {0, AF_UNSPEC, SOCK_STREAM, IPPROTO_TCP, 0, NULL, NULL, NULL};
 
-		if ((rc = getaddrinfo(hostname, NULL, &hints, &result)) == 0)
+		if (strlen(path) >= sizeof(address.sun_path))
+			return -1;
+		memset(&address, '\0', sizeof(address));
+		address.sun_family = AF_UNIX;
+		strcpy(address.sun_path, path);
+
+		readbuf_start = readbuf_end = 0;
+		zerocopy = false; // MSG_ZEROCOPY doesn't apply, so writeZeroCopy copies
+		zerocopy_sent = zerocopy_done = 0;
+		mysock = socket(AF_UNIX, SOCK_STREAM, 0);
+		tcp = false;
+		if (mysock != -1)
+		{
+			setOptions(mysock);
+			rc = ::connect(mysock, (struct sockaddr*)&address, sizeof(address));
+		}
+		if (rc == 0)
+			rc = fcntl(mysock, F_SETFL, fcntl(mysock, F_GETFL) | O_NONBLOCK);
+		else if (mysock != -1)
+		{
+			::close(mysock);
+			mysock = -1;
+		}
+		return rc;
+  }
+
+  // return -1 on error, or the number of bytes read
+  // which could be 0 on a read timeout
+  int read(unsigned char* buffer, int len, int timeout_ms)
+  {
+		struct timespec deadline;
+		bool deadline_set = false;
+		int bytes = 0;
+		while (bytes < len)
 		{
-			struct addrinfo* res = result;
+			int rc = readbuf_end - readbuf_start;
+			if (rc > 0)
+			{ // serve as much as we can from the read-ahead buffer
+				if (rc > len - bytes)
+					rc = len - bytes;
+				memcpy(&buffer[bytes], &readbuf[readbuf_start], rc);
+				readbuf_start += rc;
+				bytes += rc;
+				continue;
+			}
+			readbuf_start = readbuf_end = 0;
 
-			/* prefer ip4 addresses */
-			while (res)
+			// large reads go straight to the caller's buffer, anything else fills the read-ahead buffer
+			bool direct = (len - bytes >= READ_BUFFER_SIZE);
+			if (direct)
+				rc = ::recv(mysock, &buffer[bytes], (size_t)(len - bytes), 0);
+			else
+				rc = ::recv(mysock, readbuf, READ_BUFFER_SIZE, 0);
+			if (rc == -1)
 			{
-				if (res->ai_family == AF_INET)
+				if (errno == EINTR)
+					continue;
+				if (errno != EAGAIN && errno != EWOULDBLOCK)
+				{
+					bytes = -1;
+					break;
+				}
+				if (!deadline_set)
+				{
+					set_deadline(deadline, timeout_ms);
+					deadline_set = true;
+				}
+#if defined(TCP_QUICKACK)
+				if (tcp && options.quickack)
+				{ // the kernel drops back to delaying acknowledgements, so ask again for what comes next
+					int on = 1;
+					setsockopt(mysock, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+				}
+#endif
+				if ((rc = wait(POLLIN, deadline)) <= 0)
 				{
-					result = res;
+					if (rc < 0)
+						bytes = -1;
 					break;
 				}
-				res = res->ai_next;
 			}
+			else if (rc == 0)
+			{ // the connection has been closed
+				if (bytes == 0)
+					bytes = -1;
+				break;
+			}
+			else if (direct)
+				bytes += rc;
+			else
+				readbuf_end = rc;
+		}
+		return bytes;
+  }
 
-			if (result->ai_family == AF_INET)
+  // return -1 on error, or the number of bytes written
+  // which could be less than len on a write timeout
+  int write(unsigned char* buffer, int len, int timeout)
+  {
+		struct timespec deadline;
+		bool deadline_set = false;
+		int bytes = 0;
+		while (bytes < len)
+		{
+			int rc = ::write(mysock, &buffer[bytes], (size_t)(len - bytes));
+			if (rc >= 0)
+				bytes += rc;
+			else if (errno == EINTR)
+				continue;
+			else if (errno != EAGAIN && errno != EWOULDBLOCK)
 			{
-				address.sin_port = htons(port);
-				address.sin_family = family = AF_INET;
-				address.sin_addr = ((struct sockaddr_in*)(result->ai_addr))->sin_addr;
+				if (bytes == 0)
+					bytes = -1;
+				break;
 			}
 			else
-				rc = -1;
-
-			freeaddrinfo(result);
+			{
+				if (!deadline_set)
+				{
+					set_deadline(deadline, timeout);
+					deadline_set = true;
+				}
+				if (wait(POLLOUT, deadline) <= 0)
+					break;
+			}
 		}
+		return bytes;
+  }
 
-		if (rc == 0)
+	// write len bytes of the file fd from offset, without copying them through user space
+	// return -1 on error, or the number of bytes written, which could be less than len on a timeout
+	int sendfile(int fd, size_t offset, int len, int timeout_ms)
+	{
+		struct timespec deadline;
+		bool deadline_set = false;
+		off_t off = (off_t)offset;
+		int bytes = 0;
+		while (bytes < len)
 		{
-			mysock = socket(family, type, 0);
-			if (mysock != -1)
+			ssize_t rc = ::sendfile(mysock, fd, &off, (size_t)(len - bytes));
+			if (rc > 0)
+				bytes += rc;
+			else if (rc == 0 || (errno != EINTR && errno != EAGAIN))
+			{ // the file ends before len, or can't be read
+				if (bytes == 0)
+					bytes = -1;
+				break;
+			}
+			else if (errno == EAGAIN)
 			{
-				int opt = 1;
-
-				//if (setsockopt(mysock, SOL_SOCKET, SO_NOSIGPIPE, (void*)&opt, sizeof(opt)) != 0)
-				//	printf("Could not set SO_NOSIGPIPE for socket %d", mysock);
+				if (!deadline_set)
+				{
+					set_deadline(deadline, timeout_ms);
+					deadline_set = true;
+				}
+				if (wait(POLLOUT, deadline) <= 0)
+					break;
+			}
+		}
+		return bytes;
+	}
 
-				rc = ::connect(mysock, (struct sockaddr*)&address, sizeof(address));
+	// write straight from the caller's buffer, with MSG_ZEROCOPY if it is large enough, and return only once
+	// the kernel has finished with it
+	// return -1 on error, or the number of bytes written, which could be less than len on a timeout
+	int writeZeroCopy(unsigned char* buffer, int len, int timeout_ms)
+	{
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+		struct timespec deadline;
+		int bytes = 0;
+		if (!zerocopy || len < LINUX_ZEROCOPY_MIN)
+			return write(buffer, len, timeout_ms);
+		set_deadline(deadline, timeout_ms);
+		while (bytes < len)
+		{
+			ssize_t rc = ::send(mysock, &buffer[bytes], (size_t)(len - bytes), MSG_ZEROCOPY);
+			if (rc >= 0)
+			{
+				bytes += rc;
+				zerocopy_sent++;
 			}
+			else if (errno == EINTR)
+				continue;
+			else if (errno == EAGAIN || errno == ENOBUFS)
+			{ // the socket is full, or the pages pinned for it are at the limit
+				if (reapZeroCopy() != 0 || wait(POLLOUT, deadline) <= 0)
+					break;
+			}
+			else
+				break;
 		}
+		// the data has been handed over, but is still being read from the buffer until it is acknowledged
+		while (zerocopy_done != zerocopy_sent)
+		{
+			if (reapZeroCopy() != 0)
+				return -1;
+			if (zerocopy_done != zerocopy_sent && wait(0, deadline) <= 0)
+				return -1; // it can't be said that the buffer is free
+		}
+		return (bytes == 0) ? -1 : bytes;
+#else
+		return write(buffer, len, timeout_ms);
+#endif
+	}
 
-        return rc;
-    }
+	// the socket, for an application's own poll loop
+	int getSocket()
+	{
+		return mysock;
+	}
 
-  // return -1 on error, or the number of bytes read
-  // which could be 0 on a read timeout
-  int read(unsigned char* buffer, int len, int timeout_ms)
+	int disconnect()
+	{
+		readbuf_start = readbuf_end = 0;
+		return ::close(mysock);
+	}
+
+private:
+
+  // set the options on a new socket, before it connects so that the buffer sizes are taken into
+  // account for the window offered; failures are ignored, as each option is a preference
+  void setOptions(int sock)
   {
-		struct timeval interval = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
-		if (interval.tv_sec < 0 || (interval.tv_sec == 0 && interval.tv_usec <= 0))
-		{
-			interval.tv_sec = 0;
-			interval.tv_usec = 100;
-		}
+		int on = 1;
+		if (options.sndbuf > 0)
+			setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &options.sndbuf, sizeof(options.sndbuf));
+		if (options.rcvbuf > 0)
+			setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &options.rcvbuf, sizeof(options.rcvbuf));
+#if defined(SO_BUSY_POLL)
+		if (options.busy_poll_us > 0)
+			setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &options.busy_poll_us, sizeof(options.busy_poll_us));
+#endif
+		if (!tcp)
+			return;
+		if (options.nodelay)
+			setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+#if defined(TCP_QUICKACK)
+		if (options.quickack)
+			setsockopt(sock, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+#endif
+#if defined(TCP_USER_TIMEOUT)
+		if (options.user_timeout_ms > 0)
+			setsockopt(sock, IPPROTO_TCP, TCP_USER_TIMEOUT, &options.user_timeout_ms, sizeof(options.user_timeout_ms));
+#endif
+  }
 
-		setsockopt(mysock, SOL_SOCKET, SO_RCVTIMEO, (char *)&interval, sizeof(struct timeval));
+  // Connect to the first of the addresses that will take a connection, racing them (RFC 8305): each
+  // attempt is started when the one before it fails, or after an attempt delay if it hasn't
+  // finished, and the first to connect is kept.
+  // return the connected socket, which is non-blocking, or -1
+  int race(linux_address* addrs, int count, int port)
+  {
+		struct pollfd pending[LINUX_DNS_ADDRESSES];
+		struct timespec deadline, delay;
+		int npending = 0, started = 0, sock = -1;
 
-		int bytes = 0;
-    int i = 0; const int max_tries = 10;
-		while (bytes < len)
+		set_deadline(deadline, LINUX_CONNECT_TIMEOUT_MS);
+		while (sock == -1)
 		{
-			int rc = ::recv(mysock, &buffer[bytes], (size_t)(len - bytes), 0);
-			if (rc == -1)
+			struct timespec* until = &deadline;
+			if (started < count)
 			{
-        if (errno != EAGAIN && errno != EWOULDBLOCK)
-          bytes = -1;
-        break;
+				linux_address* a = &addrs[started++];
+				socklen_t len = (a->sa.sa_family == AF_INET6) ? sizeof(a->in6) : sizeof(a->in);
+				int fd = socket(a->sa.sa_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+
+				if (a->sa.sa_family == AF_INET6)
+					a->in6.sin6_port = htons(port);
+				else
+					a->in.sin_port = htons(port);
+				if (fd == -1)
+					continue;
+				setOptions(fd);
+				if (::connect(fd, &a->sa, len) == 0)
+				{
+					sock = fd;
+					continue;
+				}
+				if (errno != EINPROGRESS)
+				{
+					::close(fd); // refused, or unreachable: go straight on to the next
+					continue;
+				}
+				pending[npending].fd = fd;
+				pending[npending++].events = POLLOUT;
+				if (started < count)
+				{
+					set_deadline(delay, LINUX_CONNECT_ATTEMPT_DELAY_MS);
+					if (delay.tv_sec < deadline.tv_sec || (delay.tv_sec == deadline.tv_sec && delay.tv_nsec < deadline.tv_nsec))
+						until = &delay;
+				}
+			}
+			else if (npending == 0)
+				break; // every address has failed
+
+			int rc = poll(pending, npending, *until);
+			if (rc < 0 || (rc == 0 && until == &deadline))
+				break;
+			for (int i = 0; i < npending && rc > 0; ++i)
+			{
+				int err = 0;
+				socklen_t errlen = sizeof(err);
+
+				if (pending[i].revents == 0)
+					continue;
+				rc--;
+				if (sock == -1 && getsockopt(pending[i].fd, SOL_SOCKET, SO_ERROR, &err, &errlen) == 0 && err == 0)
+					sock = pending[i].fd;
+				else
+					::close(pending[i].fd);
+				pending[i--] = pending[--npending];
 			}
-			else
-				bytes += rc;
-      if (++i >= max_tries)
-        break;
-      if (rc == 0)
-        break;
 		}
-		return bytes;
+		for (int i = 0; i < npending; ++i)
+			::close(pending[i].fd); // the attempts which lost
+		return sock;
   }
 
-  int write(unsigned char* buffer, int len, int timeout)
+  // a zero or negative timeout means don't wait
+  static void set_deadline(struct timespec& deadline, int timeout_ms)
   {
-		struct timeval tv;
+		linux_clock(deadline);
+		if (timeout_ms > 0)
+			linux_add(deadline, timeout_ms / 1000, (timeout_ms % 1000) * 1000000L);
+  }
 
-		tv.tv_sec = 0;  /* 30 Secs Timeout */
-		tv.tv_usec = timeout * 1000;  // Not init'ing this can cause strange errors
+  // poll until the deadline
+  // return the number of descriptors ready, 0 on timeout, -1 on error
+  static int poll(struct pollfd* pfds, int count, const struct timespec& deadline)
+  {
+		struct timespec now, left;
+		int rc;
+		linux_clock(now);
+		do
+		{
+			left.tv_sec = deadline.tv_sec - now.tv_sec;
+			left.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+			if (left.tv_nsec < 0)
+			{
+				left.tv_sec--;
+				left.tv_nsec += 1000000000L;
+			}
+			if (left.tv_sec < 0)
+				return 0;
+			rc = ::ppoll(pfds, count, &left, NULL);
+			clock_gettime(LINUX_TIMER_CLOCK, &now); // time has moved on while we waited
+			if (linux_now_cached)
+				linux_now = now;
+		} while (rc == -1 && errno == EINTR);
+		return rc;
+  }
 
-		setsockopt(mysock, SOL_SOCKET, SO_SNDTIMEO, (char *)&tv,sizeof(struct timeval));
-		int	rc = ::write(mysock, buffer, len);
-		//printf("write rc %d\n", rc);
+  // return 1 if the socket is ready, 0 on timeout, -1 on error
+  int wait(short events, const struct timespec& deadline)
+  {
+		struct pollfd pfd = {mysock, events, 0};
+		int rc = poll(&pfd, 1, deadline);
+
+		if (rc > 0 && (pfd.revents & POLLERR) && zerocopy)
+		{ // it may only be a zerocopy notification, on the error queue
+			int err = 0;
+			socklen_t errlen = sizeof(err);
+			if (getsockopt(mysock, SOL_SOCKET, SO_ERROR, &err, &errlen) == 0 && err == 0)
+				pfd.revents &= ~POLLERR;
+		}
+		if (rc > 0 && (pfd.revents & (POLLERR | POLLNVAL)))
+			rc = -1;
 		return rc;
   }
 
-	int disconnect()
-	{
-		return ::close(mysock);
-	}
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+  // read the kernel's notifications that it has finished with data sent with MSG_ZEROCOPY
+  // return 0, or -1 if the socket has failed
+  int reapZeroCopy()
+  {
+		char control[128];
+		struct msghdr msg;
+		while (zerocopy_done != zerocopy_sent)
+		{
+			memset(&msg, '\0', sizeof(msg));
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+			if (::recvmsg(mysock, &msg, MSG_ERRQUEUE) == -1)
+				return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+			for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm))
+			{
+				struct sock_extended_err* err = (struct sock_extended_err*)CMSG_DATA(cm);
+				if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+						!(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+					continue;
+				if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY || err->ee_errno != 0)
+					return -1;
+				zerocopy_done = err->ee_data + 1; // completes the sends from ee_info to ee_data, in order for TCP
+			}
+		}
+		return 0;
+  }
+#endif
 
-private:
+    static const int READ_BUFFER_SIZE = LINUX_READ_BUFFER_SIZE;
 
     int mysock;
+    unsigned char readbuf[READ_BUFFER_SIZE]; // filled by one recv, drained by read
+    int readbuf_start, readbuf_end;
+    bool zerocopy; // the socket takes MSG_ZEROCOPY
+    unsigned int zerocopy_sent, zerocopy_done; // sends made with it, and how many of those the kernel has finished with
+    SocketOptions options; // for the next connect
+    bool tcp; // mysock is TCP, which the TCP options apply to
 };
 
 
@@ -158,7 +699,7 @@ class Countdown
 public:
   Countdown()
   {
-
+		end_time.tv_sec = end_time.tv_nsec = 0;
   }
 
   Countdown(int ms)
@@ -169,45 +710,56 @@ public:
 
   bool expired()
   {
-		struct timeval now, res;
-		gettimeofday(&now, NULL);
-		timersub(&end_time, &now, &res);
-		//printf("left %d ms\n", (res.tv_sec < 0) ? 0 : res.tv_sec * 1000 + res.tv_usec / 1000);
-		//if (res.tv_sec > 0 || res.tv_usec > 0)
-		//	printf("expired %d %d\n", res.tv_sec, res.tv_usec);
-        return res.tv_sec < 0 || (res.tv_sec == 0 && res.tv_usec <= 0);
+		struct timespec now;
+		linux_clock(now);
+		return now.tv_sec > end_time.tv_sec || (now.tv_sec == end_time.tv_sec && now.tv_nsec >= end_time.tv_nsec);
   }
 
 
   void countdown_ms(int ms)
   {
-		struct timeval now;
-		gettimeofday(&now, NULL);
-		struct timeval interval = {ms / 1000, (ms % 1000) * 1000};
-		//printf("interval %d %d\n", interval.tv_sec, interval.tv_usec);
-		timeradd(&now, &interval, &end_time);
+		linux_clock(end_time);
+		linux_add(end_time, ms / 1000, (ms % 1000) * 1000000L);
+  }
+
+
+  void countdown_us(unsigned long us)
+  {
+		linux_clock(end_time);
+		linux_add(end_time, (time_t)(us / 1000000), (long)(us % 1000000) * 1000L);
   }
 
 
   void countdown(int seconds)
   {
-		struct timeval now;
-		gettimeofday(&now, NULL);
-		struct timeval interval = {seconds, 0};
-		timeradd(&now, &interval, &end_time);
+		linux_clock(end_time);
+		linux_add(end_time, seconds, 0);
   }
 
 
   int left_ms()
   {
-		struct timeval now, res;
-		gettimeofday(&now, NULL);
-		timersub(&end_time, &now, &res);
-		//printf("left %d ms\n", (res.tv_sec < 0) ? 0 : res.tv_sec * 1000 + res.tv_usec / 1000);
-        return (res.tv_sec < 0) ? 0 : res.tv_sec * 1000 + res.tv_usec / 1000;
+		struct timespec now;
+		linux_clock(now);
+		long sec = end_time.tv_sec - now.tv_sec, nsec = end_time.tv_nsec - now.tv_nsec;
+		if (nsec < 0)
+		{
+			sec--;
+			nsec += 1000000000L;
+		}
+		return (sec < 0) ? 0 : sec * 1000 + nsec / 1000000L;
   }
 
 private:
 
-	struct timeval end_time;
+	struct timespec end_time; // on LINUX_TIMER_CLOCK
 };
+
+
+// found by MQTT::Client for its Countdown timers: share one clock reading across each cycle
+inline void cacheClock(Countdown*, bool on)
+{
+	if (on)
+		clock_gettime(LINUX_TIMER_CLOCK, &linux_now);
+	linux_now_cached = on;
+}
@@ -0,0 +1,580 @@
+/*******************************************************************************
+ * Copyright (c) 2014, 2023 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+// A Network for MQTT::Client to a responder on a thread of its own in the same process, with no
+// sockets or kernel buffers in between, for measuring what the client itself costs and for testing
+// without a broker.  Include it after linux.cpp, whose clock it shares.  The responder is built on
+// the MQTTPacket server functions, so link with MQTTPacketServer and pthread.
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+
+#if !defined(MQTT_LOOPBACK_RING_SIZE)
+#define MQTT_LOOPBACK_RING_SIZE 65536 // redefinable - bytes each direction holds, a power of 2
+#endif
+
+#if !defined(MQTT_LOOPBACK_PACKET_SIZE)
+#define MQTT_LOOPBACK_PACKET_SIZE 16384 // redefinable - the largest packet the responder takes, or sends
+#endif
+
+#if !defined(MQTT_LOOPBACK_SUBSCRIPTIONS)
+#define MQTT_LOOPBACK_SUBSCRIPTIONS 16 // redefinable - topic filters the responder keeps for its client
+#endif
+
+#if !defined(MQTT_LOOPBACK_TOPIC_SIZE)
+#define MQTT_LOOPBACK_TOPIC_SIZE 128 // redefinable - the longest topic filter or client id kept, with its terminator
+#endif
+
+// The responder answers CONNECT, SUBSCRIBE, UNSUBSCRIBE, PINGREQ and the QoS 1 and 2 flows, and
+// sends each PUBLISH back if its topic matches one of the client's subscriptions.  It keeps one
+// session, for the last client id to connect, while cleansession is 0.  It has no other clients, no
+// retained messages and no will messages.
+//
+// getSocket returns an eventfd which is readable while there is data for the client, so the
+// network can be driven from an application's own poll loop like IPStack.
+class LoopbackStack
+{
+public:
+	LoopbackStack() : running(false), session(false), cleansession(false), next_packetid(0)
+	{
+		to_responder.fd = to_client.fd = -1;
+		clientID[0] = '\0';
+		forget();
+	}
+
+	~LoopbackStack()
+	{
+		disconnect();
+	}
+
+	// start a responder and connect to it, closing any connection already made
+	// return 0 on success, or -1 on failure
+	int connect()
+	{
+		disconnect();
+		cleansession = false; // until a CONNECT says otherwise
+		if (to_responder.open() != 0 || to_client.open() != 0 ||
+				pthread_create(&responder, NULL, run, this) != 0)
+		{
+			to_responder.release();
+			to_client.release();
+			return -1;
+		}
+		running = true;
+		return 0;
+	}
+
+	// return -1 on error, or the number of bytes read
+	// which could be 0 on a read timeout
+	int read(unsigned char* buffer, int len, int timeout_ms)
+	{
+		Countdown timer;
+		bool timer_set = false;
+		int bytes = 0;
+
+		while (bytes < len)
+		{
+			int rc = to_client.take(&buffer[bytes], len - bytes);
+			if (rc > 0)
+				bytes += rc;
+			else if (to_client.ended())
+			{ // the responder has closed the connection
+				if (bytes == 0)
+					bytes = -1;
+				break;
+			}
+			else
+			{
+				if (!timer_set)
+				{
+					timer.countdown_ms((timeout_ms > 0) ? timeout_ms : 0);
+					timer_set = true;
+				}
+				if ((rc = to_client.wait(timer.left_ms())) <= 0)
+				{
+					if (rc < 0)
+						bytes = -1;
+					break;
+				}
+			}
+		}
+		return bytes;
+	}
+
+	// return -1 on error, or the number of bytes written
+	// which could be less than len on a write timeout
+	int write(unsigned char* buffer, int len, int timeout)
+	{
+		Countdown timer;
+		bool timer_set = false;
+		int bytes = 0;
+
+		while (bytes < len)
+		{
+			int rc = 0;
+			if (__atomic_load_n(&to_responder.closed, __ATOMIC_ACQUIRE))
+			{ // the responder has gone
+				if (bytes == 0)
+					bytes = -1;
+				break;
+			}
+			if ((rc = to_responder.put(&buffer[bytes], len - bytes)) > 0)
+				bytes += rc;
+			else
+			{
+				if (!timer_set)
+				{
+					timer.countdown_ms((timeout > 0) ? timeout : 0);
+					timer_set = true;
+				}
+				if (timer.expired())
+					break;
+				usleep(FULL_US);
+				refreshClock();
+			}
+		}
+		return bytes;
+	}
+
+	// the eventfd, for an application's own poll loop
+	int getSocket()
+	{
+		return to_client.fd;
+	}
+
+	// the responder thread, to measure the CPU time it takes with pthread_getcpuclockid
+	pthread_t getResponder()
+	{
+		return responder;
+	}
+
+	// close the connection and wait for the responder to finish
+	int disconnect()
+	{
+		if (running)
+		{
+			to_responder.close(); // the responder takes what was written, then finds the end
+			to_client.close();    // or gives up sending, if the client has stopped reading
+			pthread_join(responder, NULL);
+			running = false;
+		}
+		to_responder.release();
+		to_client.release();
+		return 0;
+	}
+
+private:
+
+	static const int FULL_US = 100;  // how long a writer sleeps on a full ring: the taker catches up without being asked
+	static const int LENGTH_BYTES = 4; // the most a remaining length can take
+
+	static void refreshClock()
+	{
+		if (linux_now_cached)
+			clock_gettime(LINUX_TIMER_CLOCK, &linux_now); // time has moved on while we waited
+	}
+
+	// Bytes going one way.  One thread puts, one thread takes, and neither takes a lock: the head
+	// and tail run freely, and only their owners move them.
+	struct Ring
+	{
+		unsigned char buf[MQTT_LOOPBACK_RING_SIZE];
+		unsigned int head, // where the next byte is taken from
+			tail;            // where the next byte is put
+		int fd;            // an eventfd, readable whenever the ring holds data
+		bool closed;       // no more will be put: taking finds the end once the ring is empty
+
+		int open()
+		{
+			head = tail = 0;
+			closed = false;
+			fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			return (fd == -1) ? -1 : 0;
+		}
+
+		void release()
+		{
+			if (fd != -1)
+				::close(fd);
+			fd = -1;
+		}
+
+		void signal()
+		{
+			uint64_t one = 1;
+			if (::write(fd, &one, sizeof(one)) == -1)
+				return; // the count can go no higher, and the fd is readable anyway
+		}
+
+		// put as much of data as there is room for, waking the taker if it had emptied the ring
+		// return the number of bytes put
+		int put(unsigned char* data, int len)
+		{
+			unsigned int t = tail;
+			unsigned int space = MQTT_LOOPBACK_RING_SIZE - (t - __atomic_load_n(&head, __ATOMIC_ACQUIRE));
+			unsigned int offset = t & (MQTT_LOOPBACK_RING_SIZE - 1);
+			int first = MQTT_LOOPBACK_RING_SIZE - offset;
+
+			if (len > (int)space)
+				len = (int)space;
+			if (len == 0)
+				return 0;
+			if (first > len)
+				first = len;
+			memcpy(&buf[offset], data, first);
+			memcpy(buf, &data[first], len - first);
+			__atomic_store_n(&tail, t + len, __ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&head, __ATOMIC_SEQ_CST) == t)
+				signal();
+			return len;
+		}
+
+		// return the number of bytes taken, up to len
+		int take(unsigned char* data, int len)
+		{
+			unsigned int h = head;
+			unsigned int avail = __atomic_load_n(&tail, __ATOMIC_ACQUIRE) - h;
+			unsigned int offset = h & (MQTT_LOOPBACK_RING_SIZE - 1);
+			int first = MQTT_LOOPBACK_RING_SIZE - offset;
+
+			if (len > (int)avail)
+				len = (int)avail;
+			if (len == 0)
+				return 0;
+			if (first > len)
+				first = len;
+			memcpy(data, &buf[offset], first);
+			memcpy(&data[first], buf, len - first);
+			__atomic_store_n(&head, h + len, __ATOMIC_SEQ_CST);
+			return len;
+		}
+
+		void close()
+		{
+			__atomic_store_n(&closed, true, __ATOMIC_RELEASE);
+			signal();
+		}
+
+		// nothing more will come: the ring has been closed, and everything put before that taken
+		bool ended()
+		{
+			return __atomic_load_n(&closed, __ATOMIC_ACQUIRE) &&
+				__atomic_load_n(&tail, __ATOMIC_ACQUIRE) == head;
+		}
+
+		// wait for the ring to have something in it, having found it empty.  The fd is only cleared
+		// here, so a poll loop outside sees it readable for as long as there is anything to take.
+		// return 1 if there may be, 0 on timeout, -1 on error
+		int wait(int timeout_ms)
+		{
+			struct pollfd pfd = {fd, POLLIN, 0};
+			uint64_t count;
+			int rc;
+
+			if (::read(fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+				return -1;
+			if (__atomic_load_n(&tail, __ATOMIC_SEQ_CST) != head || __atomic_load_n(&closed, __ATOMIC_ACQUIRE))
+			{ // put after the ring was found empty, and the signal cleared with the old ones
+				signal();
+				return 1;
+			}
+			do
+				rc = ::poll(&pfd, 1, timeout_ms);
+			while (rc == -1 && errno == EINTR);
+			refreshClock();
+			return rc;
+		}
+	};
+
+	struct Subscription
+	{
+		char topicFilter[MQTT_LOOPBACK_TOPIC_SIZE]; // empty if the entry is free
+		int qos;
+	};
+
+	static void* run(void* parm)
+	{
+		LoopbackStack* l = (LoopbackStack*)parm;
+		int len = 0;
+
+		while ((len = l->readPacket()) > 0 && l->handle(len) == 0)
+			;
+		if (l->cleansession)
+			l->forget();
+		l->to_client.close();    // the client reads what was sent, then finds the end
+		l->to_responder.close(); // and can't write any more
+		return NULL;
+	}
+
+	// take exactly len bytes for the responder, waiting for as long as that takes
+	// return len, or -1 if the connection has ended
+	int take(unsigned char* buf, int len)
+	{
+		int bytes = 0;
+		while (bytes < len)
+		{
+			int rc = to_responder.take(&buf[bytes], len - bytes);
+			if (rc > 0)
+				bytes += rc;
+			else if (to_responder.ended() || to_responder.wait(-1) < 0)
+				return -1;
+		}
+		return bytes;
+	}
+
+	// return 0, or -1 once the client has closed the connection
+	int send(unsigned char* buf, int len)
+	{
+		int bytes = 0;
+		if (len <= 0)
+			return -1;
+		while (bytes < len)
+		{
+			if (__atomic_load_n(&to_client.closed, __ATOMIC_ACQUIRE))
+				return -1;
+			bytes += to_client.put(&buf[bytes], len - bytes);
+			if (bytes < len)
+				usleep(FULL_US);
+		}
+		return 0;
+	}
+
+	// read the next packet into inbuf
+	// return its length, or -1 if the connection has ended or the packet is too big to take
+	int readPacket()
+	{
+		int len = 1;
+		int rem_len = 0;
+		int multiplier = 1;
+		unsigned char c;
+
+		if (take(inbuf, 1) != 1)
+			return -1;
+		do
+		{
+			if (len > LENGTH_BYTES || take(&c, 1) != 1)
+				return -1;
+			inbuf[len++] = c;
+			rem_len += (c & 127) * multiplier;
+			multiplier *= 128;
+		} while (c & 128);
+		if (len + rem_len > MQTT_LOOPBACK_PACKET_SIZE || take(&inbuf[len], rem_len) != rem_len)
+			return -1;
+		return len + rem_len;
+	}
+
+	// topic filters are matched as the client matches them to message handlers, after trying them as they are
+	static bool matched(char* topicFilter, MQTTString& topicName)
+	{
+		char* curf = topicFilter;
+		char* curn = topicName.lenstring.data;
+		char* curn_end = curn + topicName.lenstring.len;
+
+		while (*curf && curn < curn_end)
+		{
+			if (*curn == '/' && *curf != '/')
+				break;
+			if (*curf != '+' && *curf != '#' && *curf != *curn)
+				break;
+			if (*curf == '+')
+			{ // skip until we meet the next separator, or end of string
+				char* nextpos = curn + 1;
+				while (nextpos < curn_end && *nextpos != '/')
+					nextpos = ++curn + 1;
+			}
+			else if (*curf == '#')
+				curn = curn_end - 1; // skip until end of string
+			curf++;
+			curn++;
+		};
+
+		return (curn == curn_end) && (*curf == '\0');
+	}
+
+	Subscription* find(MQTTString* topicFilter)
+	{
+		for (int i = 0; i < MQTT_LOOPBACK_SUBSCRIPTIONS; ++i)
+		{
+			if (subscriptions[i].topicFilter[0] != '\0' && MQTTPacket_equals(topicFilter, subscriptions[i].topicFilter))
+				return &subscriptions[i];
+		}
+		return NULL;
+	}
+
+	void forget()
+	{
+		memset(subscriptions, '\0', sizeof(subscriptions));
+	}
+
+	int handleConnect(int len)
+	{
+		MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+		unsigned char sessionPresent = 0;
+		int idlen = 0;
+
+		if (MQTTDeserialize_connect(&data, inbuf, len) != 1)
+			return -1;
+		idlen = data.clientID.lenstring.len;
+		if (idlen >= MQTT_LOOPBACK_TOPIC_SIZE)
+			idlen = MQTT_LOOPBACK_TOPIC_SIZE - 1;
+		if (session && !data.cleansession && (int)strlen(clientID) == idlen &&
+				memcmp(clientID, data.clientID.lenstring.data, idlen) == 0)
+			sessionPresent = 1;
+		else
+			forget();
+		memcpy(clientID, data.clientID.lenstring.data, idlen);
+		clientID[idlen] = '\0';
+		session = !data.cleansession;
+		cleansession = data.cleansession;
+		return send(outbuf, MQTTSerialize_connack(outbuf, sizeof(outbuf), 0, sessionPresent));
+	}
+
+	int handleSubscribe(int len)
+	{
+		MQTTString topicFilters[MQTT_LOOPBACK_SUBSCRIPTIONS];
+		int qoss[MQTT_LOOPBACK_SUBSCRIPTIONS];
+		unsigned char dup = 0;
+		unsigned short packetid = 0;
+		int count = 0;
+
+		if (MQTTDeserialize_subscribe(&dup, &packetid, MQTT_LOOPBACK_SUBSCRIPTIONS, &count, topicFilters, qoss,
+				inbuf, len) != 1)
+			return -1;
+		for (int i = 0; i < count; ++i)
+		{
+			Subscription* s = find(&topicFilters[i]);
+			int flen = topicFilters[i].lenstring.len;
+
+			for (int j = 0; s == NULL && flen > 0 && flen < MQTT_LOOPBACK_TOPIC_SIZE && j < MQTT_LOOPBACK_SUBSCRIPTIONS; ++j)
+			{
+				if (subscriptions[j].topicFilter[0] == '\0')
+					s = &subscriptions[j];
+			}
+			if (s == NULL)
+				qoss[i] = 0x80; // the failure return code
+			else
+			{
+				memcpy(s->topicFilter, topicFilters[i].lenstring.data, flen);
+				s->topicFilter[flen] = '\0';
+				s->qos = qoss[i];
+			}
+		}
+		return send(outbuf, MQTTSerialize_suback(outbuf, sizeof(outbuf), packetid, count, qoss));
+	}
+
+	int handleUnsubscribe(int len)
+	{
+		MQTTString topicFilters[MQTT_LOOPBACK_SUBSCRIPTIONS];
+		unsigned char dup = 0;
+		unsigned short packetid = 0;
+		int count = 0;
+
+		if (MQTTDeserialize_unsubscribe(&dup, &packetid, MQTT_LOOPBACK_SUBSCRIPTIONS, &count, topicFilters,
+				inbuf, len) != 1)
+			return -1;
+		for (int i = 0; i < count; ++i)
+		{
+			Subscription* s = find(&topicFilters[i]);
+			if (s != NULL)
+				s->topicFilter[0] = '\0';
+		}
+		return send(outbuf, MQTTSerialize_unsuback(outbuf, sizeof(outbuf), packetid));
+	}
+
+	// acknowledge a publish, then send it back once, at the highest QoS of the subscriptions it
+	// matches but no higher than it was sent at.  QoS 2 publishes go back on arrival, not on PUBREL.
+	int handlePublish(int len)
+	{
+		MQTTString topicName = MQTTString_initializer;
+		unsigned char dup = 0, retained = 0;
+		unsigned short packetid = 0;
+		unsigned char* payload = NULL;
+		int payloadlen = 0;
+		int qos = 0;
+		int maxqos = -1;
+
+		if (MQTTDeserialize_publish(&dup, &qos, &retained, &packetid, &topicName, &payload, &payloadlen,
+				inbuf, len) != 1)
+			return -1;
+		if (qos > 0 && send(outbuf, MQTTSerialize_ack(outbuf, sizeof(outbuf), (qos == 1) ? PUBACK : PUBREC, 0, packetid)) != 0)
+			return -1;
+		for (int i = 0; i < MQTT_LOOPBACK_SUBSCRIPTIONS; ++i)
+		{
+			if (subscriptions[i].topicFilter[0] != '\0' && subscriptions[i].qos > maxqos &&
+					(MQTTPacket_equals(&topicName, subscriptions[i].topicFilter) || matched(subscriptions[i].topicFilter, topicName)))
+				maxqos = subscriptions[i].qos;
+		}
+		if (maxqos < 0)
+			return 0;
+		if (qos > maxqos)
+			qos = maxqos;
+		if (qos > 0 && ++next_packetid == 0)
+			next_packetid = 1;
+		return send(outbuf, MQTTSerialize_publish(outbuf, sizeof(outbuf), 0, qos, 0, next_packetid, topicName,
+			payload, payloadlen));
+	}
+
+	// return 0 to carry on, -1 to end the connection, for a DISCONNECT or anything unexpected
+	int handle(int len)
+	{
+		MQTTHeader header = {0};
+		unsigned char type = 0, dup = 0;
+		unsigned short packetid = 0;
+		int rc = -1;
+
+		header.byte = inbuf[0];
+		switch (header.bits.type)
+		{
+			case CONNECT:
+				rc = handleConnect(len);
+				break;
+			case SUBSCRIBE:
+				rc = handleSubscribe(len);
+				break;
+			case UNSUBSCRIBE:
+				rc = handleUnsubscribe(len);
+				break;
+			case PUBLISH:
+				rc = handlePublish(len);
+				break;
+			case PUBREC:
+			case PUBREL:
+				if (MQTTDeserialize_ack(&type, &dup, &packetid, inbuf, len) == 1)
+					rc = send(outbuf, MQTTSerialize_ack(outbuf, sizeof(outbuf), (type == PUBREC) ? PUBREL : PUBCOMP, 0, packetid));
+				break;
+			case PUBACK:
+			case PUBCOMP:
+				rc = 0;
+				break;
+			case PINGREQ:
+				header.byte = 0;
+				header.bits.type = PINGRESP;
+				outbuf[0] = header.byte;
+				outbuf[1] = 0;
+				rc = send(outbuf, 2);
+				break;
+		}
+		return rc;
+	}
+
+	Ring to_responder, to_client;
+	pthread_t responder;
+	bool running;                   // the responder thread has been started, and not joined
+	char clientID[MQTT_LOOPBACK_TOPIC_SIZE]; // the session, kept between connections
+	bool session,                   // subscriptions are being kept for clientID
+		cleansession;                 // and will be forgotten when this connection ends
+	Subscription subscriptions[MQTT_LOOPBACK_SUBSCRIPTIONS];
+	unsigned short next_packetid;   // for publishes the responder sends
+	unsigned char inbuf[MQTT_LOOPBACK_PACKET_SIZE], outbuf[MQTT_LOOPBACK_PACKET_SIZE];
+};
@@ -0,0 +1,368 @@
+/*******************************************************************************
+ * Copyright (c) 2014, 2023 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+// A Network for MQTT::Client over TLS, with OpenSSL.  Include it after linux.cpp, whose IPStack
+// makes the connection and whose clock it shares, and link with libssl and libcrypto.
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+#if !defined(MQTT_TLS_HANDSHAKE_MS)
+#define MQTT_TLS_HANDSHAKE_MS 10000 // redefinable - the longest connect waits for the handshake
+#endif
+
+#if !defined(MQTT_TLS_SENDFILE_CHUNK)
+#define MQTT_TLS_SENDFILE_CHUNK 16384 // redefinable - file data read at a time to encrypt, without kernel TLS
+#endif
+
+// The server's certificate is verified against the CA file and the host name connected to.  The
+// session ticket the server sends is kept, and offered on the next connect, so that reconnecting
+// resumes the session with an abbreviated handshake rather than a full one.
+//
+// With kernel TLS asked for, and where the kernel and OpenSSL both have it, record encryption is
+// done by the kernel once the handshake is over, and sendfile is used as it is in the clear.
+// Otherwise the file is read and encrypted a chunk at a time.  writeZeroCopy always copies, since
+// the data is encrypted into a buffer of OpenSSL's before being sent.
+//
+// OpenSSL reads ahead, so when getSocket is readable it may bring in more than one packet: yieldNoWait
+// keeps going until none is left.
+class TLSStack
+{
+public:
+	TLSStack(const char* CAfile = NULL, bool ktls = false) : ssl(NULL), session(NULL), resumed(false),
+		ktls_send(false), ktls_recv(false)
+	{
+		ctx = SSL_CTX_new(TLS_client_method());
+		if (ctx == NULL)
+			return;
+		SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+		SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+		if ((CAfile ? SSL_CTX_load_verify_locations(ctx, CAfile, NULL) : SSL_CTX_set_default_verify_paths(ctx)) != 1)
+		{
+			SSL_CTX_free(ctx);
+			ctx = NULL; // so connect fails
+			return;
+		}
+		// sessions are kept here, not in the context's cache, to be offered on the next connect
+		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+		SSL_CTX_sess_set_new_cb(ctx, newSession);
+		SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+		SSL_CTX_set_read_ahead(ctx, 1); // a read from the socket for each record, not one for its header then another
+#if defined(SSL_OP_ENABLE_KTLS)
+		if (ktls)
+			SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+	}
+
+	~TLSStack()
+	{
+		disconnect();
+		if (session != NULL)
+			SSL_SESSION_free(session);
+		if (ctx != NULL)
+			SSL_CTX_free(ctx);
+	}
+
+	// connect and make the handshake, resuming the last session if there is one
+	// return 0 on success, or -1 on failure
+	int connect(const char* hostname, int port)
+	{
+		struct timespec deadline;
+		int rc = -1;
+
+		disconnect();
+		if (ctx == NULL || ipstack.connect(hostname, port) != 0)
+			return -1;
+		if ((ssl = SSL_new(ctx)) == NULL)
+			goto exit;
+		SSL_set_app_data(ssl, this);
+		if (SSL_set_fd(ssl, ipstack.getSocket()) != 1)
+			goto exit;
+		if (X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), hostname) != 1)
+		{ // a host name, rather than an address
+			if (SSL_set_tlsext_host_name(ssl, hostname) != 1 || SSL_set1_host(ssl, hostname) != 1)
+				goto exit;
+		}
+		if (session != NULL)
+			SSL_set_session(ssl, session);
+
+		linux_clock(deadline);
+		linux_add(deadline, MQTT_TLS_HANDSHAKE_MS / 1000, (MQTT_TLS_HANDSHAKE_MS % 1000) * 1000000L);
+		ERR_clear_error();
+		while ((rc = SSL_connect(ssl)) != 1)
+		{
+			rc = SSL_get_error(ssl, rc);
+			if ((rc != SSL_ERROR_WANT_READ && rc != SSL_ERROR_WANT_WRITE) || wait(rc, deadline) <= 0)
+			{
+				rc = -1;
+				goto exit;
+			}
+			ERR_clear_error();
+		}
+		resumed = SSL_session_reused(ssl);
+		ktls_send = BIO_get_ktls_send(SSL_get_wbio(ssl));
+		ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(ssl));
+		rc = 0;
+	exit:
+		if (rc != 0)
+		{
+			if (ssl != NULL)
+				SSL_free(ssl);
+			ssl = NULL;
+			ipstack.disconnect();
+		}
+		return rc;
+	}
+
+	// return -1 on error, or the number of bytes read
+	// which could be 0 on a read timeout
+	int read(unsigned char* buffer, int len, int timeout_ms)
+	{
+		struct timespec deadline;
+		bool deadline_set = false;
+		int bytes = 0;
+
+		while (bytes < len)
+		{
+			size_t got = 0;
+			int rc = 0;
+			ERR_clear_error();
+			if ((rc = SSL_read_ex(ssl, &buffer[bytes], (size_t)(len - bytes), &got)) == 1)
+			{
+				bytes += (int)got;
+				continue;
+			}
+			rc = SSL_get_error(ssl, rc);
+			if (rc != SSL_ERROR_WANT_READ && rc != SSL_ERROR_WANT_WRITE)
+			{ // the connection has been closed, or has failed
+				if (bytes == 0)
+					bytes = -1;
+				break;
+			}
+			if (!deadline_set)
+			{
+				set_deadline(deadline, timeout_ms);
+				deadline_set = true;
+			}
+			if ((rc = wait(rc, deadline)) <= 0)
+			{
+				if (rc < 0)
+					bytes = -1;
+				break;
+			}
+		}
+		return bytes;
+	}
+
+	// return -1 on error, or the number of bytes written
+	// which could be less than len on a write timeout
+	int write(unsigned char* buffer, int len, int timeout)
+	{
+		struct timespec deadline;
+		bool deadline_set = false;
+		int bytes = 0;
+
+		while (bytes < len)
+		{
+			size_t put = 0;
+			int rc = 0;
+			ERR_clear_error();
+			if ((rc = SSL_write_ex(ssl, &buffer[bytes], (size_t)(len - bytes), &put)) == 1)
+			{
+				bytes += (int)put;
+				continue;
+			}
+			rc = SSL_get_error(ssl, rc);
+			if (rc != SSL_ERROR_WANT_READ && rc != SSL_ERROR_WANT_WRITE)
+			{
+				if (bytes == 0)
+					bytes = -1;
+				break;
+			}
+			if (!deadline_set)
+			{
+				set_deadline(deadline, timeout);
+				deadline_set = true;
+			}
+			if (wait(rc, deadline) <= 0)
+				break;
+		}
+		return bytes;
+	}
+
+	// write len bytes of the file fd from offset: with sendfile if the kernel is encrypting, otherwise
+	// read and written a chunk at a time
+	int sendfile(int fd, off_t offset, int len, int timeout_ms)
+	{
+		unsigned char chunk[MQTT_TLS_SENDFILE_CHUNK];
+		int bytes = 0;
+
+#if defined(SSL_OP_ENABLE_KTLS)
+		if (ktls_send)
+		{
+			struct timespec deadline;
+			bool deadline_set = false;
+			while (bytes < len)
+			{
+				ERR_clear_error();
+				ossl_ssize_t rc = SSL_sendfile(ssl, fd, offset + bytes, (size_t)(len - bytes), 0);
+				if (rc > 0)
+				{
+					bytes += (int)rc;
+					continue;
+				}
+				int err = SSL_get_error(ssl, (int)rc);
+				if (err != SSL_ERROR_WANT_WRITE)
+				{ // the file ends before len, or can't be read
+					if (bytes == 0)
+						bytes = -1;
+					break;
+				}
+				if (!deadline_set)
+				{
+					set_deadline(deadline, timeout_ms);
+					deadline_set = true;
+				}
+				if (wait(err, deadline) <= 0)
+					break;
+			}
+			return bytes;
+		}
+#endif
+		while (bytes < len)
+		{
+			int want = (len - bytes < (int)sizeof(chunk)) ? len - bytes : (int)sizeof(chunk);
+			ssize_t got = pread(fd, chunk, (size_t)want, offset + bytes);
+			if (got == -1 && errno == EINTR)
+				continue;
+			int rc = (got > 0) ? write(chunk, (int)got, timeout_ms) : -1;
+			if (rc > 0)
+				bytes += rc;
+			if (rc != got)
+			{
+				if (bytes == 0)
+					bytes = -1;
+				break;
+			}
+		}
+		return bytes;
+	}
+
+	// encrypting copies the data, so the buffer is free once this returns
+	int writeZeroCopy(unsigned char* buffer, int len, int timeout_ms)
+	{
+		return write(buffer, len, timeout_ms);
+	}
+
+	// the socket, for an application's own poll loop
+	int getSocket()
+	{
+		return ipstack.getSocket();
+	}
+
+	// close the connection, keeping the session to resume
+	int disconnect()
+	{
+		int rc = 0;
+		if (ssl != NULL)
+		{
+			SSL_shutdown(ssl); // send close_notify, without waiting for the server's
+			SSL_free(ssl);
+			ssl = NULL;
+			rc = ipstack.disconnect();
+		}
+		resumed = ktls_send = ktls_recv = false;
+		return rc;
+	}
+
+	// for any further settings, such as a client certificate, before connecting
+	SSL_CTX* getContext()
+	{
+		return ctx;
+	}
+
+	// this connection resumed the last session, without a full handshake
+	bool isResumed()
+	{
+		return resumed;
+	}
+
+	// the kernel encrypts what is sent on this connection
+	bool isKernelTLS()
+	{
+		return ktls_send;
+	}
+
+	// for the socket of the next connect
+	void setSocketOptions(const SocketOptions& options)
+	{
+		ipstack.setSocketOptions(options);
+	}
+
+private:
+
+	static void set_deadline(struct timespec& deadline, int timeout_ms)
+	{
+		linux_clock(deadline);
+		if (timeout_ms > 0)
+			linux_add(deadline, timeout_ms / 1000, (timeout_ms % 1000) * 1000000L);
+	}
+
+	// keep each session the server sends, replacing the last: TLS 1.3 servers send them after the
+	// handshake, so this is called while reading
+	static int newSession(SSL* ssl, SSL_SESSION* session)
+	{
+		TLSStack* t = (TLSStack*)SSL_get_app_data(ssl);
+		if (t->session != NULL)
+			SSL_SESSION_free(t->session);
+		t->session = session;
+		return 1; // the reference is ours now
+	}
+
+	// wait for the socket to be ready for what OpenSSL wants to do next
+	// return 1 if it is, 0 on timeout, -1 on error
+	int wait(int err, const struct timespec& deadline)
+	{
+		struct pollfd pfd = {ipstack.getSocket(), (short)((err == SSL_ERROR_WANT_WRITE) ? POLLOUT : POLLIN), 0};
+		struct timespec now, left;
+		int rc;
+		linux_clock(now);
+		do
+		{
+			left.tv_sec = deadline.tv_sec - now.tv_sec;
+			left.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+			if (left.tv_nsec < 0)
+			{
+				left.tv_sec--;
+				left.tv_nsec += 1000000000L;
+			}
+			if (left.tv_sec < 0)
+				return 0;
+			rc = ::ppoll(&pfd, 1, &left, NULL);
+			clock_gettime(LINUX_TIMER_CLOCK, &now); // time has moved on while we waited
+			if (linux_now_cached)
+				linux_now = now;
+		} while (rc == -1 && errno == EINTR);
+		if (rc > 0 && (pfd.revents & (POLLERR | POLLNVAL)))
+			rc = -1;
+		return rc;
+	}
+
+	IPStack ipstack;
+	SSL_CTX* ctx;
+	SSL* ssl;               // the connection, NULL when there is none
+	SSL_SESSION* session;   // the latest from the server, offered on the next connect
+	bool resumed;           // this connection resumed the last session
+	bool ktls_send, ktls_recv; // the kernel encrypts, or decrypts, on this connection
+};
@@ -0,0 +1,549 @@
+/*******************************************************************************
+ * Copyright (c) 2014, 2023 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+// A Network for MQTT::Client which uses io_uring, for Linux 5.19 and later.  Include it after
+// linux.cpp, whose IPStack makes the connection and whose clock it shares.
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#if defined(IORING_RECV_MULTISHOT) // the kernel headers know about multishot receive and provided buffer rings
+#define MQTT_URING 1
+
+#if !defined(MQTT_URING_RECV_BUFFERS)
+#define MQTT_URING_RECV_BUFFERS 16 // redefinable - buffers the kernel fills as data arrives, a power of 2
+#endif
+
+#if !defined(MQTT_URING_RECV_BUFFER_SIZE)
+#define MQTT_URING_RECV_BUFFER_SIZE 4096 // redefinable - the most one receive completion can hold
+#endif
+
+#if !defined(MQTT_URING_SEND_BUFFER_SIZE)
+#define MQTT_URING_SEND_BUFFER_SIZE 16384 // redefinable - each half of the registered send buffer
+#endif
+
+// One multishot receive stays armed on the socket, and the kernel completes it into buffers from a
+// ring provided here, so while data keeps arriving reading it costs no system calls.  Packets are
+// written into one half of a registered send buffer, submitted straight away if no send is in
+// flight, otherwise collected to go out together when it completes.  With batching on they wait
+// for the next read even when nothing is in flight, and are submitted in the same system call as
+// its wait, so yield must be called regularly.
+class UringStack
+{
+public:
+	struct Metrics
+	{
+		unsigned int enters,  // io_uring_enter system calls
+			writes,             // calls from the client to write
+			sends,              // writes to the socket, each of which may hold many packets
+			recvs;              // completions from the multishot receive
+	};
+
+	UringStack() : ring_fd(-1), sq_ring(NULL), cq_ring(NULL), sqes(NULL), mem(NULL), batching(false)
+	{
+	}
+
+	~UringStack()
+	{
+		release();
+	}
+
+	// return 0 on success, or -1 if the connection or the ring couldn't be set up
+	int connect(const char* hostname, int port)
+	{
+		int rc = ipstack.connect(hostname, port);
+
+		pending = 0;
+		buf_tail = 0;
+		ready_head = ready_count = ready_offset = 0;
+		fill = fill_len = 0;
+		inflight = -1;
+		recv_armed = closed = error = false;
+		memset(&metrics, '\0', sizeof(metrics));
+		if (rc != 0)
+			return rc;
+		// the ring does the waiting now: on a non-blocking socket it would hand EAGAIN back instead
+		mysock = ipstack.getSocket();
+		if (fcntl(mysock, F_SETFL, fcntl(mysock, F_GETFL) & ~O_NONBLOCK) == -1 || setup() != 0)
+		{
+			release();
+			ipstack.disconnect();
+			return -1;
+		}
+		return 0;
+	}
+
+	// return -1 on error, or the number of bytes read
+	// which could be 0 on a read timeout
+	int read(unsigned char* buffer, int len, int timeout_ms)
+	{
+		struct timespec deadline;
+		bool deadline_set = false;
+		int bytes = 0;
+
+		if (inflight == -1 && fill_len > 0)
+			startSend(); // held by batching, to go with this read's wait
+		while (bytes < len)
+		{
+			if (ready_count > 0)
+			{ // serve as much as we can from the oldest buffer received
+				int i = ready_head;
+				int rc = ready_len[i] - ready_offset;
+				if (rc > len - bytes)
+					rc = len - bytes;
+				memcpy(&buffer[bytes], recvBuffer(ready_bid[i]) + ready_offset, rc);
+				bytes += rc;
+				if ((ready_offset += rc) == ready_len[i])
+				{
+					recycle(ready_bid[i]);
+					ready_head = (i + 1) % MQTT_URING_RECV_BUFFERS;
+					ready_count--;
+					ready_offset = 0;
+				}
+				continue;
+			}
+			reap();
+			if (ready_count > 0)
+				continue;
+			if (error || closed)
+			{
+				if (bytes == 0)
+					bytes = -1;
+				break;
+			}
+			if (!recv_armed)
+				armRecv();
+			if (!deadline_set)
+			{
+				linux_clock(deadline);
+				if (timeout_ms > 0)
+					linux_add(deadline, timeout_ms / 1000, (timeout_ms % 1000) * 1000000L);
+				deadline_set = true;
+			}
+			int rc = wait(deadline);
+			if (rc <= 0)
+			{
+				if (rc < 0)
+					bytes = -1;
+				break;
+			}
+		}
+		if (submit() != 0)
+			bytes = -1;
+		return bytes;
+	}
+
+	// return -1 on error, or the number of bytes written
+	// which could be less than len on a write timeout
+	int write(unsigned char* buffer, int len, int timeout)
+	{
+		struct timespec deadline;
+		bool deadline_set = false;
+		int bytes = 0;
+
+		metrics.writes++;
+		while (bytes < len && !error)
+		{
+			int rc = MQTT_URING_SEND_BUFFER_SIZE - fill_len;
+			if (rc > 0)
+			{ // collect it with anything else waiting to go
+				if (rc > len - bytes)
+					rc = len - bytes;
+				memcpy(&sendbuf[fill][fill_len], &buffer[bytes], rc);
+				fill_len += rc;
+				bytes += rc;
+				continue;
+			}
+			reap();
+			if (inflight == -1)
+			{
+				startSend();
+				continue;
+			}
+			if (!deadline_set)
+			{
+				linux_clock(deadline);
+				if (timeout > 0)
+					linux_add(deadline, timeout / 1000, (timeout % 1000) * 1000000L);
+				deadline_set = true;
+			}
+			if (wait(deadline) <= 0)
+				break;
+		}
+		reap();
+		if (inflight == -1 && fill_len > 0 && !batching)
+			startSend();
+		if (submit() != 0 || (error && bytes == 0))
+			bytes = -1;
+		return bytes;
+	}
+
+	// hold what is written until the next read, or until half the send buffer is full
+	void setBatching(bool on)
+	{
+		batching = on;
+	}
+
+	Metrics getMetrics()
+	{
+		return metrics;
+	}
+
+	// for the socket of the next connect
+	void setSocketOptions(const SocketOptions& options)
+	{
+		ipstack.setSocketOptions(options);
+	}
+
+	// the socket, which epoll or poll won't find readable: the ring has taken the data already
+	int getSocket()
+	{
+		return mysock;
+	}
+
+	// finish sending what has been written, then release the ring and close the socket
+	int disconnect()
+	{
+		struct timespec deadline;
+
+		linux_clock(deadline);
+		linux_add(deadline, 1, 0);
+		while (ring_fd != -1 && !error && (inflight != -1 || fill_len > 0))
+		{
+			reap();
+			if (inflight == -1 && fill_len > 0)
+				startSend();
+			else if (wait(deadline) <= 0)
+				break;
+		}
+		release();
+		return ipstack.disconnect();
+	}
+
+private:
+	enum { URING_ENTRIES = 8, URING_RECV = 1, URING_SEND };
+
+	// map the queues the kernel shares with us, and give it the buffers
+	int setup()
+	{
+		struct io_uring_params p;
+		struct io_uring_buf_reg reg;
+		struct iovec iov[2];
+
+		memset(&p, '\0', sizeof(p));
+		if ((ring_fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) == -1)
+			return -1;
+		if (!(p.features & IORING_FEAT_EXT_ARG))
+			return -1; // for the timeout on waiting
+
+		sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+		cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+		if (p.features & IORING_FEAT_SINGLE_MMAP)
+		{ // the two queues share one mapping
+			if (cq_ring_size > sq_ring_size)
+				sq_ring_size = cq_ring_size;
+			cq_ring_size = 0;
+		}
+		if ((sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+				IORING_OFF_SQ_RING)) == MAP_FAILED)
+		{
+			sq_ring = NULL;
+			return -1;
+		}
+		if (cq_ring_size == 0)
+			cq_ring = sq_ring;
+		else if ((cq_ring = mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+				IORING_OFF_CQ_RING)) == MAP_FAILED)
+		{
+			cq_ring = NULL;
+			return -1;
+		}
+		sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+		void* map = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+		if (map == MAP_FAILED)
+			return -1;
+		sqes = (struct io_uring_sqe*)map;
+
+		unsigned char* sq = (unsigned char*)sq_ring;
+		unsigned char* cq = (unsigned char*)cq_ring;
+		sq_head = (unsigned int*)(sq + p.sq_off.head);
+		sq_tail = (unsigned int*)(sq + p.sq_off.tail);
+		sq_mask = *(unsigned int*)(sq + p.sq_off.ring_mask);
+		sq_entries = *(unsigned int*)(sq + p.sq_off.ring_entries);
+		sq_array = (unsigned int*)(sq + p.sq_off.array);
+		cq_head = (unsigned int*)(cq + p.cq_off.head);
+		cq_tail = (unsigned int*)(cq + p.cq_off.tail);
+		cq_mask = *(unsigned int*)(cq + p.cq_off.ring_mask);
+		cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+		// one page for the buffer ring, then the receive buffers, then the two halves of the send buffer
+		mem_size = getpagesize() + MQTT_URING_RECV_BUFFERS * MQTT_URING_RECV_BUFFER_SIZE + 2 * MQTT_URING_SEND_BUFFER_SIZE;
+		if ((map = mmap(NULL, mem_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+			return -1;
+		mem = (unsigned char*)map;
+		buf_ring = (struct io_uring_buf*)mem;
+		memset(&reg, '\0', sizeof(reg));
+		reg.ring_addr = (unsigned long)buf_ring;
+		reg.ring_entries = MQTT_URING_RECV_BUFFERS;
+		reg.bgid = 0;
+		if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+			return -1;
+		for (int i = 0; i < MQTT_URING_RECV_BUFFERS; ++i)
+			recycle(i);
+
+		for (int i = 0; i < 2; ++i)
+		{
+			sendbuf[i] = &mem[mem_size - (2 - i) * MQTT_URING_SEND_BUFFER_SIZE];
+			iov[i].iov_base = sendbuf[i];
+			iov[i].iov_len = MQTT_URING_SEND_BUFFER_SIZE;
+		}
+		if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, iov, 2) != 0)
+			return -1;
+		return 0;
+	}
+
+	void release()
+	{
+		if (ring_fd != -1)
+			::close(ring_fd); // which cancels anything still outstanding
+		ring_fd = -1;
+		if (sqes != NULL)
+			munmap(sqes, sqes_size);
+		if (cq_ring != NULL && cq_ring != sq_ring)
+			munmap(cq_ring, cq_ring_size);
+		if (sq_ring != NULL)
+			munmap(sq_ring, sq_ring_size);
+		if (mem != NULL)
+			munmap(mem, mem_size);
+		sqes = NULL;
+		sq_ring = cq_ring = NULL;
+		mem = NULL;
+	}
+
+	// the next free submission queue entry, cleared, or NULL if the kernel hasn't taken the ones before
+	struct io_uring_sqe* getSqe()
+	{
+		unsigned int tail = *sq_tail;
+
+		if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+			return NULL;
+		struct io_uring_sqe* sqe = &sqes[tail & sq_mask];
+		memset(sqe, '\0', sizeof(*sqe));
+		return sqe;
+	}
+
+	// make the entry from getSqe visible to the kernel, for the next io_uring_enter to submit
+	void pushSqe()
+	{
+		unsigned int tail = *sq_tail;
+
+		sq_array[tail & sq_mask] = tail & sq_mask;
+		__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+		pending++;
+	}
+
+	// give the kernel what has been queued, without waiting for anything
+	int submit()
+	{
+		if (pending == 0)
+			return 0;
+		int rc = (int)syscall(__NR_io_uring_enter, ring_fd, pending, 0, 0, NULL, 0);
+		metrics.enters++;
+		if (rc >= 0)
+			pending = 0;
+		else if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+			rc = 0; // they stay queued for the next time
+		return (rc < 0) ? -1 : 0;
+	}
+
+	// submit what is queued, and wait for a completion until the deadline
+	// return 1 if there may be something new, 0 on timeout, -1 on error
+	int wait(const struct timespec& deadline)
+	{
+		struct io_uring_getevents_arg arg;
+		struct __kernel_timespec ts;
+		struct timespec now;
+
+		linux_clock(now);
+		ts.tv_sec = deadline.tv_sec - now.tv_sec;
+		ts.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+		if (ts.tv_nsec < 0)
+		{
+			ts.tv_sec--;
+			ts.tv_nsec += 1000000000L;
+		}
+		if (ts.tv_sec < 0 || (ts.tv_sec == 0 && ts.tv_nsec == 0))
+			return (submit() == 0) ? 0 : -1;
+
+		memset(&arg, '\0', sizeof(arg));
+		arg.ts = (unsigned long)&ts;
+		int rc = (int)syscall(__NR_io_uring_enter, ring_fd, pending, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+				&arg, sizeof(arg));
+		clock_gettime(LINUX_TIMER_CLOCK, &now); // time has moved on while we waited
+		if (linux_now_cached)
+			linux_now = now;
+		metrics.enters++;
+		if (rc >= 0 || errno == ETIME)
+			pending = 0;
+		reap();
+		if (rc < 0 && errno == ETIME)
+			return 0;
+		return (rc < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) ? -1 : 1;
+	}
+
+	// arm the multishot receive, which completes once for each buffer the kernel fills
+	void armRecv()
+	{
+		struct io_uring_sqe* sqe = getSqe();
+
+		if (sqe == NULL)
+			return; // the next time round
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = mysock;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = 0;
+		sqe->user_data = URING_RECV;
+		pushSqe();
+		recv_armed = true;
+	}
+
+	// send the rest of the half in flight, from the registered buffer
+	void queueSend()
+	{
+		struct io_uring_sqe* sqe = getSqe();
+
+		if (sqe == NULL)
+		{
+			error = true; // can't happen: there are more entries than operations we have outstanding
+			return;
+		}
+		sqe->opcode = IORING_OP_WRITE_FIXED;
+		sqe->fd = mysock;
+		sqe->addr = (unsigned long)&sendbuf[inflight][inflight_sent];
+		sqe->len = inflight_len - inflight_sent;
+		sqe->buf_index = inflight;
+		sqe->user_data = URING_SEND;
+		pushSqe();
+		metrics.sends++;
+	}
+
+	// start sending the packets collected so far, and collect any more in the other half
+	void startSend()
+	{
+		inflight = fill;
+		inflight_len = fill_len;
+		inflight_sent = 0;
+		fill ^= 1;
+		fill_len = 0;
+		queueSend();
+	}
+
+	// the receive buffers follow the page holding the buffer ring
+	unsigned char* recvBuffer(unsigned short bid)
+	{
+		return &mem[getpagesize() + bid * MQTT_URING_RECV_BUFFER_SIZE];
+	}
+
+	// give a receive buffer the client has finished with back to the kernel
+	void recycle(unsigned short bid)
+	{
+		struct io_uring_buf* buf = &buf_ring[buf_tail & (MQTT_URING_RECV_BUFFERS - 1)];
+
+		buf->addr = (unsigned long)recvBuffer(bid);
+		buf->len = MQTT_URING_RECV_BUFFER_SIZE;
+		buf->bid = bid;
+		__atomic_store_n(&buf_ring[0].resv, ++buf_tail, __ATOMIC_RELEASE); // where the kernel keeps the tail
+	}
+
+	void complete(struct io_uring_cqe* cqe)
+	{
+		if (cqe->user_data == URING_RECV)
+		{
+			if (!(cqe->flags & IORING_CQE_F_MORE))
+				recv_armed = false; // the kernel is done with it, and it's armed again when next needed
+			if (cqe->res > 0)
+			{
+				int i = (ready_head + ready_count++) % MQTT_URING_RECV_BUFFERS;
+				ready_bid[i] = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+				ready_len[i] = cqe->res;
+				metrics.recvs++;
+			}
+			else if (cqe->res == 0)
+				closed = true;
+			else if (cqe->res != -ENOBUFS && cqe->res != -EINTR && cqe->res != -ECANCELED)
+				error = true; // out of buffers, or cancelled, just rearm
+		}
+		else if (cqe->user_data == URING_SEND)
+		{
+			if (cqe->res > 0)
+				inflight_sent += cqe->res;
+			else if (cqe->res != -EINTR && cqe->res != -EAGAIN && cqe->res != -ECANCELED)
+			{
+				error = true;
+				inflight = -1;
+				return;
+			}
+			if (inflight_sent < inflight_len)
+				queueSend(); // a short write
+			else
+			{
+				inflight = -1;
+				if (fill_len > 0)
+					startSend(); // everything written while that one was in flight, together
+			}
+		}
+	}
+
+	// deal with everything the kernel has completed
+	void reap()
+	{
+		unsigned int head = *cq_head;
+		unsigned int tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+		while (head != tail)
+			complete(&cqes[head++ & cq_mask]);
+		__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	IPStack ipstack; // makes the connection
+	int mysock;
+	int ring_fd;
+	void* sq_ring;
+	size_t sq_ring_size;
+	void* cq_ring;
+	size_t cq_ring_size;
+	struct io_uring_sqe* sqes;
+	size_t sqes_size;
+	unsigned int *sq_head, *sq_tail, *sq_array, sq_mask, sq_entries,
+		*cq_head, *cq_tail, cq_mask;
+	struct io_uring_cqe* cqes;
+	unsigned int pending; // submission queue entries made ready, not yet given to the kernel
+	unsigned char* mem;   // the provided buffer ring, the receive buffers and the send buffer
+	size_t mem_size;
+	// not the header's struct io_uring_buf_ring, whose bufs member C++ puts after the tail, not over it
+	struct io_uring_buf* buf_ring;
+	unsigned short buf_tail;
+	unsigned short ready_bid[MQTT_URING_RECV_BUFFERS]; // received, in order, not yet read by the client
+	int ready_len[MQTT_URING_RECV_BUFFERS];
+	int ready_head, ready_count, ready_offset;
+	unsigned char* sendbuf[2];
+	int fill, fill_len; // the half collecting packets
+	int inflight, inflight_len, inflight_sent; // the half being sent, -1 for none
+	bool recv_armed, closed, error, batching;
+	Metrics metrics;
+};
+
+#endif
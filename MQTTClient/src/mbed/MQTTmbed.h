@@ -47,6 +47,11 @@ public:
         t.start();
     }
 
+    void countdown_us(unsigned long us)
+    {
+        countdown_ms((us + 999L) / 1000L);
+    }
+
     void countdown(int seconds)
     {
         countdown_ms((unsigned long)seconds * 1000L);
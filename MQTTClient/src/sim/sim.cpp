@@ -0,0 +1,770 @@
+/*******************************************************************************
+ * Copyright (c) 2014, 2023 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+// A Network and Timer for MQTT::Client to test it without a broker, a network or the passage of
+// real time: MQTT::Client<SimStack, SimCountdown>.  The broker is built on the MQTTPacket server
+// functions, so link with MQTTPacketServer.
+//
+// SimCountdown runs on a virtual clock, which only moves when the client waits for the network with
+// nothing due before its deadline, and then jumps straight to whatever happens next.  An hour of
+// keepalives takes as long as the packets take to handle, and a run with the same options and seed
+// gives the same packets at the same virtual times every time.  There is one clock for the process,
+// and the client and SimStack must be used from one thread.
+
+#include <string.h>
+
+#if !defined(MQTT_SIM_RING_SIZE)
+#define MQTT_SIM_RING_SIZE 65536 // redefinable - bytes in flight each way, a power of 2
+#endif
+
+#if !defined(MQTT_SIM_SEGMENTS)
+#define MQTT_SIM_SEGMENTS 1024 // redefinable - segments in flight each way, a power of 2
+#endif
+
+#if !defined(MQTT_SIM_MSS)
+#define MQTT_SIM_MSS 1460 // redefinable - the most data one segment carries
+#endif
+
+#if !defined(MQTT_SIM_PACKET_SIZE)
+#define MQTT_SIM_PACKET_SIZE 16384 // redefinable - the largest packet the broker takes, or sends
+#endif
+
+#if !defined(MQTT_SIM_SUBSCRIPTIONS)
+#define MQTT_SIM_SUBSCRIPTIONS 16 // redefinable - topic filters the broker keeps for its client
+#endif
+
+#if !defined(MQTT_SIM_TOPIC_SIZE)
+#define MQTT_SIM_TOPIC_SIZE 128 // redefinable - the longest topic filter or client id kept, with its terminator
+#endif
+
+class SimClock
+{
+public:
+	static const unsigned long long NEVER = ~0ULL;
+
+	// microseconds since the process started
+	static unsigned long long now()
+	{
+		return us();
+	}
+
+	// move the clock on, as the application doing other work would
+	static void advance(unsigned long long by)
+	{
+		us() += by;
+	}
+
+private:
+	friend class SimStack;
+
+	static unsigned long long& us()
+	{
+		static unsigned long long now_us = 0;
+		return now_us;
+	}
+};
+
+
+class SimCountdown
+{
+public:
+	SimCountdown() : end_us(0)
+	{
+	}
+
+	SimCountdown(int ms)
+	{
+		countdown_ms(ms);
+	}
+
+	bool expired()
+	{
+		return SimClock::now() >= end_us;
+	}
+
+	void countdown_ms(int ms)
+	{
+		end_us = SimClock::now() + ms * 1000ULL;
+	}
+
+	void countdown_us(unsigned long us)
+	{
+		end_us = SimClock::now() + us;
+	}
+
+	void countdown(int seconds)
+	{
+		end_us = SimClock::now() + seconds * 1000000ULL;
+	}
+
+	// rounded up, so that waiting that long reaches the deadline
+	int left_ms()
+	{
+		unsigned long long now = SimClock::now();
+		return (now >= end_us) ? 0 : (int)((end_us - now + 999) / 1000);
+	}
+
+private:
+
+	unsigned long long end_us; // on the virtual clock
+};
+
+
+// How one direction of the connection behaves.  Data is cut into segments of MQTT_SIM_MSS, which
+// leave one after another at the bandwidth, and arrive the latency later.  Jitter and retransmission
+// let a segment arrive after the ones behind it, but like TCP the link delivers them in order, so
+// those have to wait for it.
+struct SimLinkOptions
+{
+	// the defaults: instant, with nothing lost
+	SimLinkOptions() : latency_us(0), jitter_us(0), bandwidth(0), loss_ppm(0), rto_us(200000)
+	{
+	}
+
+	unsigned int latency_us; // one way, for every segment
+	unsigned int jitter_us;  // up to this much longer, at random
+	unsigned long bandwidth; // bytes per second, or 0 for no limit
+	unsigned int loss_ppm;   // segments lost in a million, each sent again after the retransmission timeout
+	unsigned int rto_us;     // the retransmission timeout, doubled each time the same segment is lost again
+};
+
+
+// A Network to a simulated broker over a simulated link.  The broker answers CONNECT, SUBSCRIBE,
+// UNSUBSCRIBE, PINGREQ and the QoS 1 and 2 flows, and sends each PUBLISH back if its topic matches
+// one of the client's subscriptions.  It keeps one session, for the last client id to connect, while
+// cleansession is 0.  A script can change what it does with any packet, to hold back
+// acknowledgements, send them out of order or stop answering pings, say.
+//
+// The broker handles each packet when it arrives, as reading the client's network catches up with
+// the virtual time.  If the data for the client would overflow the link, the broker closes the
+// connection, as one does to a client which falls too far behind.
+class SimStack
+{
+public:
+	// what the broker does with a packet, as a script decides
+	enum Action
+	{
+		RESPOND, // as a broker would, the same as having no script
+		IGNORE,  // nothing: the script may have responded itself with send
+		CLOSE    // close the connection without responding
+	};
+
+	// called with each packet the broker receives, at the virtual time it arrives
+	// return an Action
+	typedef int (*Script)(SimStack&, unsigned char* packet, int len, void* context);
+
+	// One direction of the connection
+	struct Link
+	{
+		SimLinkOptions options;
+		unsigned long bytes,  // sent over the link, in all
+			segments_sent,
+			lost;               // of those, how many had to be sent again, counting each time
+
+	private:
+		friend class SimStack;
+
+		struct Segment
+		{
+			unsigned long long arrival_us;
+			unsigned int end; // the ring position after its last byte
+		};
+
+		unsigned char buf[MQTT_SIM_RING_SIZE];
+		Segment segments[MQTT_SIM_SEGMENTS];
+		unsigned int head,  // where the next byte is taken from
+			delivered,        // the end of the data which has arrived
+			tail,             // where the next byte is put
+			seg_head, seg_tail; // the segments still in flight
+		unsigned long long free_us, // when the data given to the link so far has all left
+			last_us,          // when the last segment arrives, which those after it can't arrive before
+			closed_us;        // when the end of the connection arrives, or NEVER
+
+		void open()
+		{
+			head = delivered = tail = seg_head = seg_tail = 0;
+			free_us = last_us = SimClock::now();
+			closed_us = SimClock::NEVER;
+		}
+
+		// lose everything in flight, and end the connection at time at
+		void drop(unsigned long long at)
+		{
+			head = delivered = tail;
+			seg_head = seg_tail;
+			if (at < closed_us)
+				closed_us = at;
+		}
+
+		bool fits(int len)
+		{
+			return MQTT_SIM_RING_SIZE - (tail - head) >= (unsigned int)len &&
+				MQTT_SIM_SEGMENTS - (seg_tail - seg_head) >= (unsigned int)((len + MQTT_SIM_MSS - 1) / MQTT_SIM_MSS);
+		}
+
+		// when the next segment arrives, or NEVER if none is in flight
+		unsigned long long next()
+		{
+			return (seg_head == seg_tail) ? SimClock::NEVER : segments[seg_head & SEGMENT_MASK].arrival_us;
+		}
+
+		// deliver the segments which have arrived by now
+		// return when the next one arrives, or NEVER
+		unsigned long long arrive()
+		{
+			while (seg_head != seg_tail && segments[seg_head & SEGMENT_MASK].arrival_us <= SimClock::now())
+				delivered = segments[seg_head++ & SEGMENT_MASK].end;
+			return next();
+		}
+	};
+
+	Link to_broker, to_client;
+	bool unreachable;         // set to make connect fail, as if the broker were down
+	unsigned int connects,    // successful calls to connect
+		received[16];           // packets the broker has had, by type
+
+	// seed is for the random jitter and loss: the same seed gives the same run
+	SimStack(unsigned int seed = 1) : unreachable(false), connects(0), connected(false), script(NULL),
+		script_context(NULL), seed(seed == 0 ? 1 : seed), now_us(0), handling(false), session(false),
+		cleansession(false), next_packetid(0), inlen(0), packet_len(0)
+	{
+		to_broker.bytes = to_broker.segments_sent = to_broker.lost = 0;
+		to_client.bytes = to_client.segments_sent = to_client.lost = 0;
+		to_broker.open();
+		to_client.open();
+		memset(received, '\0', sizeof(received));
+		clientID[0] = '\0';
+		forget();
+	}
+
+	// set how the links behave, for the data sent from now on
+	void setLinks(const SimLinkOptions& to_broker_options, const SimLinkOptions& to_client_options)
+	{
+		to_broker.options = to_broker_options;
+		to_client.options = to_client_options;
+	}
+
+	// set the script the broker follows, or NULL to respond to everything
+	void setScript(Script s, void* context)
+	{
+		script = s;
+		script_context = context;
+	}
+
+	// connect to the broker, which takes a round trip of virtual time, closing any connection already made
+	// return 0 on success, or -1 if the broker has been made unreachable
+	int connect()
+	{
+		disconnect();
+		SimClock::advance(to_broker.options.latency_us + to_client.options.latency_us); // the SYN and SYN-ACK
+		if (unreachable)
+			return -1;
+		to_broker.open();
+		to_client.open();
+		inlen = packet_len = 0;
+		cleansession = false; // until a CONNECT says otherwise
+		connected = true;
+		connects++;
+		return 0;
+	}
+
+	// return -1 on error, or the number of bytes read
+	// which could be 0 on a read timeout
+	int read(unsigned char* buffer, int len, int timeout_ms)
+	{
+		unsigned long long deadline = SimClock::now() + ((timeout_ms > 0) ? timeout_ms : 0) * 1000ULL;
+		int bytes = 0;
+
+		if (!connected)
+			return -1;
+		while (bytes < len)
+		{
+			run(SimClock::now());
+			unsigned long long next = to_client.arrive();
+			while (bytes < len && to_client.head != to_client.delivered)
+				buffer[bytes++] = to_client.buf[to_client.head++ & MASK];
+			if (bytes == len)
+				break;
+			if (SimClock::now() >= to_client.closed_us)
+			{ // the connection has been closed, and everything sent before that read
+				if (bytes == 0)
+					bytes = -1;
+				break;
+			}
+			// wait for whatever happens next, by jumping to it
+			if (to_broker.next() < next)
+				next = to_broker.next();
+			if (to_client.closed_us < next)
+				next = to_client.closed_us;
+			if (next > deadline)
+			{
+				SimClock::us() = deadline;
+				break;
+			}
+			SimClock::us() = next;
+		}
+		return bytes;
+	}
+
+	// return -1 on error, or the number of bytes written
+	// which could be less than len on a write timeout
+	int write(unsigned char* buffer, int len, int timeout)
+	{
+		unsigned long long deadline = SimClock::now() + ((timeout > 0) ? timeout : 0) * 1000ULL;
+		int bytes = 0;
+
+		if (!connected)
+			return -1;
+		while (bytes < len)
+		{
+			run(SimClock::now());
+			if (SimClock::now() >= to_client.closed_us)
+			{ // the client has seen the connection close
+				if (bytes == 0)
+					bytes = -1;
+				break;
+			}
+			if (to_broker.closed_us != SimClock::NEVER)
+			{ // the broker has stopped reading, though the client doesn't know yet
+				bytes = len;
+				break;
+			}
+			int rc = put(to_broker, SimClock::now(), &buffer[bytes], len - bytes);
+			if (rc > 0)
+				bytes += rc;
+			else if (to_broker.next() > deadline)
+			{ // the link is full until the broker takes the next segment
+				SimClock::us() = deadline;
+				break;
+			}
+			else
+				SimClock::us() = to_broker.next();
+		}
+		return bytes;
+	}
+
+	// send a packet from the broker to the client: from a script, it leaves at the time the packet
+	// being handled arrived, otherwise now
+	// return 0 on success, or -1 on failure
+	int send(unsigned char* packet, int len)
+	{
+		if (!connected)
+			return -1;
+		if (!handling)
+		{ // the broker catches up first, so that what it sends is in time order
+			run(SimClock::now());
+			now_us = SimClock::now();
+		}
+		return brokerSend(packet, len);
+	}
+
+	// break the connection now, losing whatever is in flight, as when the broker restarts
+	// the client finds out when it next reads or writes
+	void breakConnection()
+	{
+		if (connected)
+		{
+			run(SimClock::now());
+			to_client.drop(SimClock::now());
+			close(SimClock::now());
+		}
+	}
+
+	// close the connection from the client's end: the broker still gets what was in flight, a
+	// DISCONNECT say, but sends nothing back
+	int disconnect()
+	{
+		if (connected)
+		{
+			run(SimClock::NEVER);
+			if (cleansession)
+				forget();
+			cleansession = false;
+			connected = false;
+		}
+		to_broker.open();
+		to_client.open();
+		return 0;
+	}
+
+private:
+
+	static const unsigned int MASK = MQTT_SIM_RING_SIZE - 1;
+	static const unsigned int SEGMENT_MASK = MQTT_SIM_SEGMENTS - 1;
+	static const int RETRIES = 15;     // the most times one segment is lost, as with tcp_retries2
+	static const int LENGTH_BYTES = 4; // the most a remaining length can take
+
+	struct Subscription
+	{
+		char topicFilter[MQTT_SIM_TOPIC_SIZE]; // empty if the entry is free
+		int qos;
+	};
+
+	bool connected;          // connected, and not yet disconnected by the client
+	Script script;
+	void* script_context;
+	unsigned int seed;       // for jitter and loss
+	unsigned long long now_us; // the time the packet the broker is handling arrived
+	bool handling;
+	char clientID[MQTT_SIM_TOPIC_SIZE]; // the session, kept between connections
+	bool session,            // subscriptions are being kept for clientID
+		cleansession;          // and will be forgotten when this connection ends
+	Subscription subscriptions[MQTT_SIM_SUBSCRIPTIONS];
+	unsigned short next_packetid; // for publishes the broker sends
+	unsigned char inbuf[MQTT_SIM_PACKET_SIZE],
+		outbuf[MQTT_SIM_PACKET_SIZE];
+	int inlen,               // received so far of the next packet
+		packet_len;            // its length, or 0 until the remaining length has been read
+
+	unsigned int random()
+	{
+		unsigned int x = seed; // xorshift, as the C client's reconnect jitter
+
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		return seed = x;
+	}
+
+	// send data from time at, a segment at a time
+	// return the number of bytes put, which is less than len if the link is full
+	int put(Link& l, unsigned long long at, unsigned char* buf, int len)
+	{
+		int bytes = 0;
+
+		while (bytes < len && l.seg_tail - l.seg_head < MQTT_SIM_SEGMENTS)
+		{
+			unsigned int space = MQTT_SIM_RING_SIZE - (l.tail - l.head);
+			unsigned int offset = l.tail & MASK;
+			unsigned long long rto = l.options.rto_us;
+			int seglen = len - bytes;
+			int first = MQTT_SIM_RING_SIZE - offset;
+
+			if (seglen > MQTT_SIM_MSS)
+				seglen = MQTT_SIM_MSS;
+			if (seglen > (int)space)
+				seglen = (int)space;
+			if (seglen == 0)
+				break;
+			if (first > seglen)
+				first = seglen;
+			memcpy(&l.buf[offset], &buf[bytes], first);
+			memcpy(l.buf, &buf[bytes + first], seglen - first);
+			l.tail += seglen;
+
+			if (l.free_us < at)
+				l.free_us = at;
+			if (l.options.bandwidth > 0)
+				l.free_us += (unsigned long long)seglen * 1000000 / l.options.bandwidth;
+			Link::Segment& seg = l.segments[l.seg_tail++ & SEGMENT_MASK];
+			seg.arrival_us = l.free_us + l.options.latency_us;
+			if (l.options.jitter_us > 0)
+				seg.arrival_us += random() % (l.options.jitter_us + 1);
+			for (int retries = 0; l.options.loss_ppm > 0 && retries < RETRIES && random() % 1000000 < l.options.loss_ppm; ++retries)
+			{
+				seg.arrival_us += rto;
+				rto *= 2;
+				l.lost++;
+			}
+			if (seg.arrival_us < l.last_us)
+				seg.arrival_us = l.last_us; // held back until the segment before it has arrived
+			l.last_us = seg.arrival_us;
+			seg.end = l.tail;
+			l.bytes += seglen;
+			l.segments_sent++;
+			bytes += seglen;
+		}
+		return bytes;
+	}
+
+	void forget()
+	{
+		memset(subscriptions, '\0', sizeof(subscriptions));
+	}
+
+	// the broker closes the connection at time at: the client finds the end after the data sent before it
+	void close(unsigned long long at)
+	{
+		to_broker.drop(at);
+		at += to_client.options.latency_us;
+		if (at < to_client.last_us)
+			at = to_client.last_us;
+		if (at < to_client.closed_us)
+			to_client.closed_us = at;
+		if (cleansession)
+			forget();
+		cleansession = false;
+	}
+
+	// return 0 on success, or -1 if the link has no room, and the broker should close the connection
+	int brokerSend(unsigned char* buf, int len)
+	{
+		if (len <= 0 || to_client.closed_us != SimClock::NEVER || !to_client.fits(len))
+			return -1;
+		put(to_client, now_us, buf, len);
+		return 0;
+	}
+
+	// topic filters are matched as the client matches them to message handlers, after trying them as they are
+	static bool matched(char* topicFilter, MQTTString* topicName)
+	{
+		char* curf = topicFilter;
+		char* curn = topicName->lenstring.data;
+		char* curn_end = curn + topicName->lenstring.len;
+
+		while (*curf && curn < curn_end)
+		{
+			if (*curn == '/' && *curf != '/')
+				break;
+			if (*curf != '+' && *curf != '#' && *curf != *curn)
+				break;
+			if (*curf == '+')
+			{ // skip until we meet the next separator, or end of string
+				char* nextpos = curn + 1;
+				while (nextpos < curn_end && *nextpos != '/')
+					nextpos = ++curn + 1;
+			}
+			else if (*curf == '#')
+				curn = curn_end - 1; // skip until end of string
+			curf++;
+			curn++;
+		};
+
+		return (curn == curn_end) && (*curf == '\0');
+	}
+
+	Subscription* find(MQTTString* topicFilter)
+	{
+		for (int i = 0; i < MQTT_SIM_SUBSCRIPTIONS; ++i)
+		{
+			if (subscriptions[i].topicFilter[0] != '\0' && MQTTPacket_equals(topicFilter, subscriptions[i].topicFilter))
+				return &subscriptions[i];
+		}
+		return NULL;
+	}
+
+	int brokerConnect(int len)
+	{
+		MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+		unsigned char sessionPresent = 0;
+
+		if (MQTTDeserialize_connect(&data, inbuf, len) != 1)
+			return -1;
+		int idlen = data.clientID.lenstring.len;
+		if (idlen >= MQTT_SIM_TOPIC_SIZE)
+			idlen = MQTT_SIM_TOPIC_SIZE - 1;
+		if (session && !data.cleansession && (int)strlen(clientID) == idlen &&
+				memcmp(clientID, data.clientID.lenstring.data, idlen) == 0)
+			sessionPresent = 1;
+		else
+			forget();
+		memcpy(clientID, data.clientID.lenstring.data, idlen);
+		clientID[idlen] = '\0';
+		session = !data.cleansession;
+		cleansession = data.cleansession;
+		len = MQTTSerialize_connack(outbuf, sizeof(outbuf), 0, sessionPresent);
+		return brokerSend(outbuf, len);
+	}
+
+	int brokerSubscribe(int len)
+	{
+		MQTTString topicFilters[MQTT_SIM_SUBSCRIPTIONS];
+		int qoss[MQTT_SIM_SUBSCRIPTIONS];
+		unsigned char dup = 0;
+		unsigned short packetid = 0;
+		int count = 0;
+
+		if (MQTTDeserialize_subscribe(&dup, &packetid, MQTT_SIM_SUBSCRIPTIONS, &count, topicFilters, qoss, inbuf, len) != 1)
+			return -1;
+		for (int i = 0; i < count; ++i)
+		{
+			Subscription* s = find(&topicFilters[i]);
+			int flen = topicFilters[i].lenstring.len;
+
+			for (int j = 0; s == NULL && flen > 0 && flen < MQTT_SIM_TOPIC_SIZE && j < MQTT_SIM_SUBSCRIPTIONS; ++j)
+			{
+				if (subscriptions[j].topicFilter[0] == '\0')
+					s = &subscriptions[j];
+			}
+			if (s == NULL)
+				qoss[i] = 0x80; // the failure return code
+			else
+			{
+				memcpy(s->topicFilter, topicFilters[i].lenstring.data, flen);
+				s->topicFilter[flen] = '\0';
+				s->qos = qoss[i];
+			}
+		}
+		len = MQTTSerialize_suback(outbuf, sizeof(outbuf), packetid, count, qoss);
+		return brokerSend(outbuf, len);
+	}
+
+	int brokerUnsubscribe(int len)
+	{
+		MQTTString topicFilters[MQTT_SIM_SUBSCRIPTIONS];
+		unsigned char dup = 0;
+		unsigned short packetid = 0;
+		int count = 0;
+
+		if (MQTTDeserialize_unsubscribe(&dup, &packetid, MQTT_SIM_SUBSCRIPTIONS, &count, topicFilters, inbuf, len) != 1)
+			return -1;
+		for (int i = 0; i < count; ++i)
+		{
+			Subscription* s = find(&topicFilters[i]);
+			if (s != NULL)
+				s->topicFilter[0] = '\0';
+		}
+		len = MQTTSerialize_unsuback(outbuf, sizeof(outbuf), packetid);
+		return brokerSend(outbuf, len);
+	}
+
+	// acknowledge a publish, then send it back once, at the highest QoS of the subscriptions it
+	// matches but no higher than it was sent at.  QoS 2 publishes go back on arrival, not on PUBREL.
+	int brokerPublish(int len)
+	{
+		MQTTString topicName = MQTTString_initializer;
+		unsigned char dup = 0, retained = 0;
+		unsigned short packetid = 0;
+		unsigned char* payload = NULL;
+		int payloadlen = 0;
+		int qos = 0;
+		int maxqos = -1;
+
+		if (MQTTDeserialize_publish(&dup, &qos, &retained, &packetid, &topicName, &payload, &payloadlen, inbuf, len) != 1)
+			return -1;
+		if (qos > 0)
+		{
+			len = MQTTSerialize_ack(outbuf, sizeof(outbuf), (qos == 1) ? PUBACK : PUBREC, 0, packetid);
+			if (brokerSend(outbuf, len) != 0)
+				return -1;
+		}
+		for (int i = 0; i < MQTT_SIM_SUBSCRIPTIONS; ++i)
+		{
+			if (subscriptions[i].topicFilter[0] != '\0' && subscriptions[i].qos > maxqos &&
+					(MQTTPacket_equals(&topicName, subscriptions[i].topicFilter) || matched(subscriptions[i].topicFilter, &topicName)))
+				maxqos = subscriptions[i].qos;
+		}
+		if (maxqos < 0)
+			return 0;
+		if (qos > maxqos)
+			qos = maxqos;
+		if (qos > 0 && ++next_packetid == 0)
+			next_packetid = 1;
+		len = MQTTSerialize_publish(outbuf, sizeof(outbuf), 0, qos, 0, next_packetid, topicName, payload, payloadlen);
+		return brokerSend(outbuf, len);
+	}
+
+	// return 0 to carry on, -1 to close the connection, for a DISCONNECT or anything unexpected
+	int handle(int len)
+	{
+		MQTTHeader header = {0};
+		unsigned char type = 0, dup = 0;
+		unsigned short packetid = 0;
+		int rc = -1;
+
+		header.byte = inbuf[0];
+		received[header.bits.type]++;
+		if (script != NULL && (rc = script(*this, inbuf, len, script_context)) != RESPOND)
+			return (rc == IGNORE) ? 0 : -1;
+		rc = -1;
+		switch (header.bits.type)
+		{
+			case CONNECT:
+				rc = brokerConnect(len);
+				break;
+			case SUBSCRIBE:
+				rc = brokerSubscribe(len);
+				break;
+			case UNSUBSCRIBE:
+				rc = brokerUnsubscribe(len);
+				break;
+			case PUBLISH:
+				rc = brokerPublish(len);
+				break;
+			case PUBREC:
+			case PUBREL:
+				if (MQTTDeserialize_ack(&type, &dup, &packetid, inbuf, len) == 1)
+				{
+					len = MQTTSerialize_ack(outbuf, sizeof(outbuf), (type == PUBREC) ? PUBREL : PUBCOMP, 0, packetid);
+					rc = brokerSend(outbuf, len);
+				}
+				break;
+			case PUBACK:
+			case PUBCOMP:
+				rc = 0;
+				break;
+			case PINGREQ:
+				header.byte = 0;
+				header.bits.type = PINGRESP;
+				outbuf[0] = header.byte;
+				outbuf[1] = 0;
+				rc = brokerSend(outbuf, 2);
+				break;
+		}
+		return rc;
+	}
+
+	// add the next byte from the client to the packet being received, and handle the packet once it is complete
+	// return 0, or -1 to close the connection
+	int take(unsigned char c)
+	{
+		int rc = 0;
+
+		inbuf[inlen++] = c;
+		if (inlen > 1 && packet_len == 0)
+		{ // the remaining length
+			if ((c & 128) == 0)
+			{
+				int rem_len = 0, multiplier = 1;
+				for (int i = 1; i < inlen; ++i, multiplier *= 128)
+					rem_len += (inbuf[i] & 127) * multiplier;
+				packet_len = inlen + rem_len;
+				if (packet_len > MQTT_SIM_PACKET_SIZE)
+					return -1;
+			}
+			else if (inlen > LENGTH_BYTES)
+				return -1;
+		}
+		if (packet_len > 0 && inlen == packet_len)
+		{
+			rc = handle(inlen);
+			inlen = packet_len = 0;
+		}
+		return rc;
+	}
+
+	// the broker handles what has arrived from the client by time until, a segment at a time so that
+	// it responds at the time each arrived
+	void run(unsigned long long until)
+	{
+		while (to_broker.seg_head != to_broker.seg_tail)
+		{
+			Link::Segment& seg = to_broker.segments[to_broker.seg_head & SEGMENT_MASK];
+
+			if (seg.arrival_us > until)
+				break;
+			to_broker.seg_head++;
+			now_us = seg.arrival_us;
+			handling = true;
+			while (to_broker.head != seg.end)
+			{
+				if (take(to_broker.buf[to_broker.head++ & MASK]) != 0)
+				{
+					close(now_us);
+					break;
+				}
+			}
+			handling = false;
+		}
+	}
+};
@@ -0,0 +1,836 @@
+/*******************************************************************************
+ * Copyright (c) 2009, 2023 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    Ian Craggs - initial implementation for embedded C client
+ *******************************************************************************/
+
+
+/**
+ * @file
+ * Benchmarks for the Paho embedded C++ client: many clients in one process,
+ * kept alive from one thread against the simulated broker, or a real one
+ * with --broker, round trip latency over TCP and a Unix
+ * domain socket, and the client's CPU per message over the loopback network
+ */
+
+ #include <stdio.h>
+ #include <string.h>
+ #include <memory.h>
+ //#define MQTT_DEBUG
+ #include "MQTTClient.h"
+
+ #define DEFAULT_STACK_SIZE -1
+
+ #include "linux.cpp"
+ #include "loopback.cpp"
+
+ // small buffers, for a simulated broker for each of the many clients
+ #define MQTT_SIM_RING_SIZE 1024
+ #define MQTT_SIM_SEGMENTS 16
+ #define MQTT_SIM_PACKET_SIZE 256
+ #define MQTT_SIM_SUBSCRIPTIONS 1
+ #include "sim.cpp"
+
+ #include <sys/time.h>
+ #include <sys/resource.h>
+ #include <stdlib.h>
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
+
+void usage(void)
+{
+	printf("options:\n  --host <hostname>\n  --port <port>\n  --broker <keep the clients alive against the broker, not the simulated one>\n"
+			"  --clients <number of clients>\n"
+			"  --seconds <how long to keep them alive>\n  --keepalive <seconds>\n"
+			"  --unix_path <a Unix domain socket the broker also listens on>\n  --round_trips <number>\n"
+			"  --messages <how many to send at each QoS to measure CPU per message>\n  --verbose\n");
+	exit(EXIT_FAILURE);
+}
+
+struct Options
+{
+	char* host;         /**< connection to system under test. */
+	int port;
+	int verbose;
+	int test_no;
+	int MQTTVersion;
+	int clients;
+	int seconds;
+	int keepalive;
+	char* unix_path;
+	int round_trips;
+	int messages;
+	int broker;
+} options =
+{
+	(char*)"localhost",
+	1883,
+	0,
+	0,
+	4,
+	1000,
+	7,
+	2,
+	NULL,
+	2000,
+	20000,
+	0,
+};
+
+void getopts(int argc, char** argv)
+{
+	int count = 1;
+
+	while (count < argc)
+	{
+		if (strcmp(argv[count], "--test_no") == 0)
+		{
+			if (++count < argc)
+				options.test_no = atoi(argv[count]);
+			else
+				usage();
+		}
+		else if (strcmp(argv[count], "--host") == 0)
+		{
+			if (++count < argc)
+			{
+				options.host = argv[count];
+				printf("\nSetting host to %s\n", options.host);
+			}
+			else
+				usage();
+		}
+		else if (strcmp(argv[count], "--port") == 0)
+		{
+			if (++count < argc)
+			{
+				options.port = atoi(argv[count]);
+				printf("\nSetting port to %d\n", options.port);
+			}
+			else
+				usage();
+		}
+		else if (strcmp(argv[count], "--clients") == 0)
+		{
+			if (++count < argc)
+				options.clients = atoi(argv[count]);
+			else
+				usage();
+		}
+		else if (strcmp(argv[count], "--seconds") == 0)
+		{
+			if (++count < argc)
+				options.seconds = atoi(argv[count]);
+			else
+				usage();
+		}
+		else if (strcmp(argv[count], "--keepalive") == 0)
+		{
+			if (++count < argc)
+				options.keepalive = atoi(argv[count]);
+			else
+				usage();
+		}
+		else if (strcmp(argv[count], "--unix_path") == 0)
+		{
+			if (++count < argc)
+				options.unix_path = argv[count];
+			else
+				usage();
+		}
+		else if (strcmp(argv[count], "--round_trips") == 0)
+		{
+			if (++count < argc)
+				options.round_trips = atoi(argv[count]);
+			else
+				usage();
+		}
+		else if (strcmp(argv[count], "--messages") == 0)
+		{
+			if (++count < argc)
+				options.messages = atoi(argv[count]);
+			else
+				usage();
+		}
+		else if (strcmp(argv[count], "--MQTTversion") == 0)
+		{
+			if (++count < argc)
+			{
+				options.MQTTVersion = atoi(argv[count]);
+				printf("setting MQTT version to %d\n", options.MQTTVersion);
+			}
+			else
+				usage();
+		}
+		else if (strcmp(argv[count], "--broker") == 0)
+			options.broker = 1;
+		else if (strcmp(argv[count], "--verbose") == 0)
+		{
+			options.verbose = 1;
+			printf("\nSetting verbose on\n");
+		}
+		else
+			usage();
+		count++;
+	}
+}
+
+
+#define LOGA_DEBUG 0
+#define LOGA_INFO 1
+#include <stdarg.h>
+#include <time.h>
+void MyLog(int LOGA_level, const char* format, ...)
+{
+	static char msg_buf[256];
+	va_list args;
+	struct timeval ts;
+	struct tm *timeinfo;
+
+	if (LOGA_level == LOGA_DEBUG && options.verbose == 0)
+	  return;
+
+	gettimeofday(&ts, NULL);
+	timeinfo = localtime(&ts.tv_sec);
+	strftime(msg_buf, 80, "%Y%m%d %H%M%S", timeinfo);
+
+	sprintf(&msg_buf[strlen(msg_buf)], ".%.3ld ", (long)ts.tv_usec / 1000);
+
+	va_start(args, format);
+	vsnprintf(&msg_buf[strlen(msg_buf)], sizeof(msg_buf) - strlen(msg_buf), format, args);
+	va_end(args);
+
+	printf("%s\n", msg_buf);
+	fflush(stdout);
+}
+
+
+#define START_TIME_TYPE struct timespec
+START_TIME_TYPE start_clock(void)
+{
+	struct timespec start_time;
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+	return start_time;
+}
+
+
+long elapsed_us(START_TIME_TYPE start_time)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start_time.tv_sec) * 1000000L + (now.tv_nsec - start_time.tv_nsec) / 1000L;
+}
+
+
+long elapsed(START_TIME_TYPE start_time)
+{
+	return elapsed_us(start_time) / 1000L;
+}
+
+
+#define assert(a, b, c, d) myassert(__FILE__, __LINE__, a, b, c, d)
+#define assert1(a, b, c, d, e) myassert(__FILE__, __LINE__, a, b, c, d, e)
+
+int tests = 0;
+int failures = 0;
+FILE* xml;
+START_TIME_TYPE global_start_time;
+char output[3000];
+char* cur_output = output;
+
+
+void write_test_result(void)
+{
+	long duration = elapsed(global_start_time);
+
+	fprintf(xml, " time=\"%ld.%.3ld\" >\n", duration / 1000, duration % 1000);
+	if (cur_output != output)
+	{
+		fprintf(xml, "%s", output);
+		cur_output = output;
+	}
+	fprintf(xml, "</testcase>\n");
+}
+
+
+void myassert(const char* filename, int lineno, const char* description, int value, const char* format, ...)
+{
+	++tests;
+	if (!value)
+	{
+		va_list args;
+
+		++failures;
+		MyLog(LOGA_INFO, (char*)"Assertion failed, file %s, line %d, description: %s\n", filename, lineno, description);
+
+		va_start(args, format);
+		vprintf(format, args);
+		va_end(args);
+
+		if (cur_output < &output[sizeof(output) - 200])
+			cur_output += sprintf(cur_output, "<failure type=\"%s\">file %s, line %d </failure>\n",
+                        description, filename, lineno);
+	}
+	else
+		MyLog(LOGA_DEBUG, "Assertion succeeded, file %s, line %d, description: %s", filename, lineno, description);
+}
+
+
+static int compare_longs(const void* a, const void* b)
+{
+	long x = *(const long*)a, y = *(const long*)b;
+	return (x > y) - (x < y);
+}
+
+
+/*********************************************************************
+
+Test1: many clients kept alive from one thread.  Each client has its own
+ping timer, so a PINGREQ from one doesn't move another's PINGRESP deadline.
+The clients have simulated brokers, or with --broker, the one at --host.
+
+*********************************************************************/
+typedef MQTT::Client<IPStack, Countdown, 100> BenchClient;
+
+// against the broker at --host, serving each client when poll says it has something to read or its
+// keepalive work is due
+static void test1_broker(struct Options options)
+{
+	IPStack* ipstacks = new IPStack[options.clients];
+	BenchClient** clients = new BenchClient*[options.clients];
+	Countdown* due = new Countdown[options.clients];
+	struct pollfd* fds = new struct pollfd[options.clients];
+	long* pass_us = NULL;
+	int connected = 0, alive = 0;
+	int passes = 0, max_passes = 0;
+	long deadline_services = 0, read_services = 0;
+	int rc = MQTT::SUCCESS;
+	int i = 0;
+	Countdown run;
+	START_TIME_TYPE start;
+
+	start = start_clock();
+	for (connected = 0; connected < options.clients; ++connected)
+	{
+		MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+		char clientid[30];
+		int next_ms = -1;
+
+		i = connected;
+		clients[i] = new BenchClient(ipstacks[i]);
+		rc = ipstacks[i].connect(options.host, options.port);
+		assert("Good rc from TCP connect", rc == MQTT::SUCCESS, "rc was %d", rc);
+		if (rc != MQTT::SUCCESS)
+		{
+			delete clients[i];
+			break;
+		}
+
+		sprintf(clientid, "cpp-bench-%d", i);
+		data.MQTTVersion = options.MQTTVersion;
+		data.clientID.cstring = clientid;
+		data.keepAliveInterval = options.keepalive;
+		data.cleansession = 1;
+		rc = clients[i]->connect(data);
+		assert("Good rc from connect", rc == MQTT::SUCCESS, "rc was %d", rc);
+		if (rc != MQTT::SUCCESS)
+		{
+			ipstacks[i].disconnect();
+			delete clients[i];
+			break;
+		}
+		clients[i]->yieldNoWait(&next_ms);
+		due[i].countdown_ms(next_ms < 0 ? 0 : next_ms);
+		fds[i].fd = ipstacks[i].getSocket();
+		fds[i].events = POLLIN;
+	}
+	MyLog(LOGA_INFO, "%d clients connected in %ld ms", connected, elapsed(start));
+	if (rc != MQTT::SUCCESS)
+		goto exit;
+
+	// one thread serves all the clients, for a few keepalive intervals
+	max_passes = options.seconds * 1000 + 1000;
+	pass_us = new long[max_passes];
+	run.countdown(options.seconds);
+	while (!run.expired() && passes < max_passes)
+	{
+		int timeout = run.left_ms();
+
+		for (i = 0; i < connected; ++i)
+		{
+			int left = due[i].left_ms();
+			if (fds[i].fd >= 0 && left < timeout)
+				timeout = left;
+		}
+		if (poll(fds, connected, timeout) < 0)
+			continue;
+
+		start = start_clock();
+		for (i = 0; i < connected; ++i)
+		{
+			bool ready = (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) != 0;
+			int next_ms = -1;
+
+			if (fds[i].fd < 0 || (!ready && !due[i].expired()))
+				continue;
+			if (ready)
+				++read_services;
+			else
+				++deadline_services;
+			if (clients[i]->yieldNoWait(&next_ms) != MQTT::SUCCESS)
+			{
+				MyLog(LOGA_INFO, "Client %d lost its connection", i);
+				fds[i].fd = -1; // poll ignores it from now on
+				continue;
+			}
+			due[i].countdown_ms(next_ms < 0 ? options.keepalive * 1000 : next_ms);
+		}
+		pass_us[passes++] = elapsed_us(start);
+	}
+
+	for (i = 0; i < connected; ++i)
+	{
+		if (fds[i].fd >= 0 && clients[i]->isConnected())
+			++alive;
+	}
+	assert1("Keepalive kept all clients connected", alive == connected, "%d of %d clients connected\n", alive, connected);
+	assert("Keepalive work was done", deadline_services >= connected, "deadline services were %ld\n", deadline_services);
+
+	if (passes > 0)
+	{
+		qsort(pass_us, passes, sizeof(long), compare_longs);
+		MyLog(LOGA_INFO, "%d passes over %d clients: %ld deadline and %ld read services, "
+				"service time per pass p50 %ld us, p99 %ld us, max %ld us", passes, connected,
+				deadline_services, read_services, pass_us[passes / 2], pass_us[passes * 99 / 100], pass_us[passes - 1]);
+	}
+
+exit:
+	for (i = 0; i < connected; ++i)
+	{
+		if (fds[i].fd >= 0 && clients[i]->isConnected())
+		{
+			rc = clients[i]->disconnect();
+			assert("Disconnect successful", rc == MQTT::SUCCESS, "rc was %d", rc);
+		}
+		ipstacks[i].disconnect();
+		delete clients[i];
+	}
+	delete [] pass_us;
+	delete [] fds;
+	delete [] due;
+	delete [] clients;
+	delete [] ipstacks;
+}
+
+
+typedef MQTT::Client<SimStack, SimCountdown, 100> SimBenchClient;
+
+#define TEST1_SILENT_EVERY 100 // the broker of one client in this many stops answering its pings
+
+int test1_silent(SimStack&, unsigned char* packet, int, void*)
+{
+	MQTTHeader header = {0};
+
+	header.byte = packet[0];
+	return (header.bits.type == PINGREQ) ? SimStack::IGNORE : SimStack::RESPOND;
+}
+
+// against a simulated broker for each client, on the virtual clock, which jumps from one client's
+// deadline to the next.  The clients connect spread over a keepalive interval, so their pings
+// interleave, and the clients whose pings go unanswered must notice, however many others are answered.
+static void test1_sim(struct Options options)
+{
+	SimStack* sims = new SimStack[options.clients];
+	SimBenchClient** clients = new SimBenchClient*[options.clients];
+	SimCountdown* due = new SimCountdown[options.clients];
+	bool* lost = new bool[options.clients];
+	long* pass_us = NULL;
+	int connected = 0, alive = 0, silent = 0, noticed = 0;
+	int passes = 0, max_passes = 0;
+	long deadline_services = 0;
+	unsigned int pings = ~0U; // the fewest an answered client sent
+	int rc = MQTT::SUCCESS;
+	int i = 0;
+	SimCountdown run;
+	START_TIME_TYPE start;
+
+	start = start_clock();
+	for (connected = 0; connected < options.clients; ++connected)
+	{
+		MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+		char clientid[30];
+		int next_ms = -1;
+
+		i = connected;
+		clients[i] = new SimBenchClient(sims[i]);
+		if (sims[i].connect() != 0)
+			rc = MQTT::FAILURE;
+		else
+		{
+			sprintf(clientid, "cpp-bench-%d", i);
+			data.MQTTVersion = options.MQTTVersion;
+			data.clientID.cstring = clientid;
+			data.keepAliveInterval = options.keepalive;
+			data.cleansession = 1;
+			rc = clients[i]->connect(data);
+		}
+		assert("Good rc from connect", rc == MQTT::SUCCESS, "rc was %d", rc);
+		if (rc != MQTT::SUCCESS)
+		{
+			delete clients[i];
+			break;
+		}
+		if (i % TEST1_SILENT_EVERY == 0)
+			sims[i].setScript(test1_silent, NULL);
+		clients[i]->yieldNoWait(&next_ms);
+		due[i].countdown_ms(next_ms < 0 ? 0 : next_ms);
+		lost[i] = false;
+		SimClock::advance(options.keepalive * 1000000ULL / options.clients);
+	}
+	MyLog(LOGA_INFO, "%d clients connected in %ld ms", connected, elapsed(start));
+	if (rc != MQTT::SUCCESS)
+		goto exit;
+
+	max_passes = options.seconds * 1000 + 1000;
+	pass_us = new long[max_passes];
+	run.countdown(options.seconds);
+	while (!run.expired() && passes < max_passes)
+	{
+		int timeout = run.left_ms();
+
+		for (i = 0; i < connected; ++i)
+		{
+			int left = due[i].left_ms();
+			if (!lost[i] && left < timeout)
+				timeout = left;
+		}
+		SimClock::advance(timeout * 1000ULL);
+
+		start = start_clock();
+		for (i = 0; i < connected; ++i)
+		{
+			int next_ms = -1;
+
+			if (lost[i] || !due[i].expired())
+				continue;
+			++deadline_services;
+			// the links are instant, so a PINGRESP is there to read as soon as the PINGREQ has gone
+			if (clients[i]->yieldNoWait(&next_ms) != MQTT::SUCCESS || clients[i]->yieldNoWait(&next_ms) != MQTT::SUCCESS)
+			{
+				lost[i] = true;
+				continue;
+			}
+			due[i].countdown_ms(next_ms < 0 ? options.keepalive * 1000 : next_ms);
+		}
+		pass_us[passes++] = elapsed_us(start);
+	}
+
+	for (i = 0; i < connected; ++i)
+	{
+		if (i % TEST1_SILENT_EVERY == 0)
+		{
+			++silent;
+			if (lost[i] && !clients[i]->isConnected())
+				++noticed;
+		}
+		else
+		{
+			if (!lost[i] && clients[i]->isConnected())
+				++alive;
+			if (sims[i].received[PINGREQ] < pings)
+				pings = sims[i].received[PINGREQ];
+		}
+	}
+	assert1("Keepalive kept the answered clients connected", alive == connected - silent,
+			"%d of %d clients connected\n", alive, connected - silent);
+	assert1("Clients whose pings went unanswered noticed", noticed == silent,
+			"%d of %d clients noticed\n", noticed, silent);
+	assert("Each answered client sent its own pings", connected == silent || pings >= (unsigned int)(options.seconds / options.keepalive),
+			"the fewest pings were %u\n", pings);
+
+	if (passes > 0)
+	{
+		qsort(pass_us, passes, sizeof(long), compare_longs);
+		MyLog(LOGA_INFO, "%d passes over %d clients: %ld deadline services, at least %u pings each, "
+				"service time per pass p50 %ld us, p99 %ld us, max %ld us", passes, connected,
+				deadline_services, pings, pass_us[passes / 2], pass_us[passes * 99 / 100], pass_us[passes - 1]);
+	}
+
+exit:
+	for (i = 0; i < connected; ++i)
+	{
+		if (!lost[i] && clients[i]->isConnected())
+		{
+			rc = clients[i]->disconnect();
+			assert("Disconnect successful", rc == MQTT::SUCCESS, "rc was %d", rc);
+		}
+		sims[i].disconnect();
+		delete clients[i];
+	}
+	delete [] pass_us;
+	delete [] lost;
+	delete [] due;
+	delete [] clients;
+	delete [] sims;
+}
+
+
+int test1(struct Options options)
+{
+	fprintf(xml, "<testcase classname=\"test1\" name=\"keepalive for %d clients\"", options.clients);
+	global_start_time = start_clock();
+	failures = 0;
+	MyLog(LOGA_INFO, "Starting test 1 - keepalive for %d clients, against %s", options.clients,
+			options.broker ? "the broker" : "simulated brokers");
+
+	if (options.broker)
+		test1_broker(options);
+	else
+		test1_sim(options);
+
+	MyLog(LOGA_INFO, "TEST1: test %s. %d tests run, %d failures.",
+			(failures == 0) ? "passed" : "failed", tests, failures);
+	write_test_result();
+	return failures;
+}
+
+
+/*********************************************************************
+
+Test2: round trip latency of a QoS 0 publish to the client's own
+subscription, over TCP and, with --unix_path, over a Unix domain socket
+to the same broker.
+
+*********************************************************************/
+typedef MQTT::Client<IPStack, Countdown, 100> LatencyClient;
+
+static int test2_arrived = 0;
+
+void test2_messageArrived(MQTT::MessageData& md)
+{
+	++test2_arrived;
+}
+
+
+static void test2_run(struct Options options, bool unix_socket)
+{
+	const char* transport = unix_socket ? "Unix domain socket" : "TCP";
+	const char* test_topic = "C++ client latency";
+	IPStack ipstack = IPStack();
+	LatencyClient client = LatencyClient(ipstack);
+	MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+	long* trip_us = new long[options.round_trips];
+	int trips = 0;
+	int rc = 0;
+
+	rc = unix_socket ? ipstack.connectUnix(options.unix_path) : ipstack.connect(options.host, options.port);
+	assert("Good rc from connect", rc == MQTT::SUCCESS, "rc was %d", rc);
+	if (rc != MQTT::SUCCESS)
+		goto exit;
+	data.MQTTVersion = options.MQTTVersion;
+	data.clientID.cstring = (char*)"cpp-latency";
+	data.cleansession = 1;
+	rc = client.connect(data);
+	assert("Good rc from MQTT connect", rc == MQTT::SUCCESS, "rc was %d", rc);
+	if (rc == MQTT::SUCCESS)
+		rc = client.subscribe(test_topic, MQTT::QOS0, test2_messageArrived);
+	assert("Good rc from subscribe", rc == MQTT::SUCCESS, "rc was %d", rc);
+
+	while (rc == MQTT::SUCCESS && trips < options.round_trips)
+	{
+		START_TIME_TYPE start = start_clock();
+		Countdown timer(5000);
+
+		test2_arrived = 0;
+		rc = client.publish(test_topic, (void*)"ping", 4, MQTT::QOS0);
+		while (rc == MQTT::SUCCESS && test2_arrived == 0 && !timer.expired())
+		{
+			struct pollfd pfd = {ipstack.getSocket(), POLLIN, 0};
+			poll(&pfd, 1, timer.left_ms());
+			rc = client.yieldNoWait();
+		}
+		if (test2_arrived == 0)
+			break;
+		trip_us[trips++] = elapsed_us(start);
+	}
+	assert("All round trips completed", trips == options.round_trips, "trips were %d", trips);
+	if (trips > 0)
+	{
+		qsort(trip_us, trips, sizeof(long), compare_longs);
+		MyLog(LOGA_INFO, "%s: %d round trips, p50 %ld us, p99 %ld us, max %ld us",
+				transport, trips, trip_us[trips / 2], trip_us[trips * 99 / 100], trip_us[trips - 1]);
+	}
+	client.disconnect();
+	ipstack.disconnect();
+exit:
+	delete [] trip_us;
+}
+
+
+int test2(struct Options options)
+{
+	fprintf(xml, "<testcase classname=\"test2\" name=\"round trip latency\"");
+	global_start_time = start_clock();
+	failures = 0;
+	MyLog(LOGA_INFO, "Starting test 2 - round trip latency");
+
+	test2_run(options, false);
+	if (options.unix_path != NULL)
+		test2_run(options, true);
+	else
+		MyLog(LOGA_INFO, "No --unix_path for the broker, measuring TCP only");
+
+	MyLog(LOGA_INFO, "TEST2: test %s. %d tests run, %d failures.",
+			(failures == 0) ? "passed" : "failed", tests, failures);
+	write_test_result();
+	return failures;
+}
+
+
+/*********************************************************************
+
+Test3: the client's CPU time per message, over the loopback network.
+Each publish comes back, so a message is one PUBLISH each way, and the
+QoS 1 and 2 acknowledgements.  The client runs on this thread, driven
+by polling the network as an application would, and the responder's
+time is shown separately.
+
+*********************************************************************/
+typedef MQTT::Client<LoopbackStack, Countdown, 100> LoopbackClient;
+
+static int test3_arrived = 0;
+
+void test3_messageArrived(MQTT::MessageData& md)
+{
+	++test3_arrived;
+}
+
+
+static long cputime_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+
+int test3(struct Options options)
+{
+	static LoopbackStack loopback;
+	LoopbackClient client = LoopbackClient(loopback);
+	MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+	const char* test_topic = "C++ client benchmark loopback";
+	char payload[] = "loopback message";
+	clockid_t responder_clock;
+	int next_ms = 0;
+	int rc = 0;
+	int qos = 0;
+
+	fprintf(xml, "<testcase classname=\"test3\" name=\"client CPU per message\"");
+	global_start_time = start_clock();
+	failures = 0;
+	MyLog(LOGA_INFO, "Starting test 3 - client CPU per message, over the loopback network");
+
+	rc = loopback.connect();
+	assert("Good rc from loopback connect", rc == MQTT::SUCCESS, "rc was %d", rc);
+	if (rc != MQTT::SUCCESS)
+		goto exit;
+	pthread_getcpuclockid(loopback.getResponder(), &responder_clock);
+
+	data.MQTTVersion = options.MQTTVersion;
+	data.clientID.cstring = (char*)"cpp-loopback-bench";
+	data.cleansession = 1;
+	rc = client.connect(data);
+	assert("Good rc from connect", rc == MQTT::SUCCESS, "rc was %d", rc);
+	if (rc == MQTT::SUCCESS)
+		rc = client.subscribe(test_topic, MQTT::QOS2, test3_messageArrived);
+	assert("Good rc from subscribe", rc == MQTT::SUCCESS, "rc was %d", rc);
+
+	for (qos = MQTT::QOS0; qos <= MQTT::QOS2 && rc == MQTT::SUCCESS; ++qos)
+	{
+		long client_ns = cputime_ns(CLOCK_THREAD_CPUTIME_ID);
+		long responder_ns = cputime_ns(responder_clock);
+		START_TIME_TYPE start = start_clock();
+		long ms = 0;
+
+		test3_arrived = 0;
+		for (int i = 0; i < options.messages && rc == MQTT::SUCCESS; ++i)
+		{
+			rc = client.publish(test_topic, payload, strlen(payload), (MQTT::QoS)qos);
+			while (test3_arrived <= i && rc == MQTT::SUCCESS)
+			{
+				struct pollfd pfd = {loopback.getSocket(), POLLIN, 0};
+				if (poll(&pfd, 1, 1000) <= 0)
+					rc = MQTT::FAILURE;
+				else
+					rc = client.yieldNoWait(&next_ms);
+			}
+		}
+		client_ns = cputime_ns(CLOCK_THREAD_CPUTIME_ID) - client_ns;
+		responder_ns = cputime_ns(responder_clock) - responder_ns;
+		ms = elapsed(start);
+		assert("All messages came back", rc == MQTT::SUCCESS && test3_arrived == options.messages,
+				"arrived was %d", test3_arrived);
+
+		MyLog(LOGA_INFO, "QoS %d: %.2f us client CPU per message, %.2f us responder CPU, %ld messages/s",
+				qos, client_ns / 1000.0 / options.messages, responder_ns / 1000.0 / options.messages,
+				(ms > 0) ? options.messages * 1000L / ms : 0L);
+	}
+
+	client.disconnect();
+	loopback.disconnect();
+exit:
+	MyLog(LOGA_INFO, "TEST3: test %s. %d tests run, %d failures.",
+			(failures == 0) ? "passed" : "failed", tests, failures);
+	write_test_result();
+	return failures;
+}
+
+
+int main(int argc, char** argv)
+{
+	int rc = 0;
+ 	int (*tests[])(Options) = {NULL, test1, test2, test3};
+	struct rlimit limit;
+
+	xml = fopen("TEST-test2.xml", "w");
+	fprintf(xml, "<testsuite name=\"test2\" tests=\"%d\">\n", (int)(ARRAY_SIZE(tests) - 1));
+
+	getopts(argc, argv);
+
+	// a socket for each client
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t)options.clients + 64)
+	{
+		limit.rlim_cur = (limit.rlim_max < (rlim_t)options.clients + 64) ? limit.rlim_max : options.clients + 64;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	if (options.test_no == 0)
+	{ /* run all the tests */
+		for (options.test_no = 1; options.test_no < ARRAY_SIZE(tests); ++options.test_no)
+			rc += tests[options.test_no](options); /* return number of failures.  0 = test succeeded */
+	}
+	else
+		rc = tests[options.test_no](options); /* run just the selected test */
+
+ 	if (rc == 0)
+		MyLog(LOGA_INFO, "verdict pass");
+	else
+		MyLog(LOGA_INFO, "verdict fail");
+
+	fprintf(xml, "</testsuite>\n");
+	fclose(xml);
+	return rc;
+}
@@ -110,10 +110,27 @@ int bufchar(unsigned char* c, int count)
 }
 
 
+/**
+ * Decodes the message length from a buffer.  Done here rather than through bufchar, whose
+ * position is shared, so that threads can deserialize packets at the same time.
+ * @param buf the remaining length bytes
+ * @param value the decoded length returned
+ * @return the number of bytes read from the buffer
+ */
 int MQTTPacket_decodeBuf(unsigned char* buf, int* value)
 {
-	bufptr = buf;
-	return MQTTPacket_decode(bufchar, value);
+	int multiplier = 1;
+	int len = 0;
+
+	*value = 0;
+	do
+	{
+		if (++len > MAX_NO_OF_REMAINING_LENGTH_BYTES)
+			break;	/* bad data */
+		*value += (buf[len - 1] & 127) * multiplier;
+		multiplier *= 128;
+	} while ((buf[len - 1] & 128) != 0);
+	return len;
 }
 
 
@@ -40,20 +40,20 @@ int MQTTSerialize_publishLength(int qos, MQTTString topicName, int payloadlen)
 
 
 /**
-  * Serializes the supplied publish data into the supplied buffer, ready for sending
-  * @param buf the buffer into which the packet will be serialized
+  * Serializes everything in a publish packet but the payload, for a payload which is written out
+  * separately, straight after it
+  * @param buf the buffer into which the header will be serialized
   * @param buflen the length in bytes of the supplied buffer
   * @param dup integer - the MQTT dup flag
   * @param qos integer - the MQTT QoS value
   * @param retained integer - the MQTT retained flag
   * @param packetid integer - the MQTT packet identifier
   * @param topicName MQTTString - the MQTT topic in the publish
-  * @param payload byte buffer - the MQTT publish payload
-  * @param payloadlen integer - the length of the MQTT payload
+  * @param payloadlen integer - the length of the MQTT payload which will follow
   * @return the length of the serialized data.  <= 0 indicates error
   */
-int MQTTSerialize_publish(unsigned char* buf, int buflen, unsigned char dup, int qos, unsigned char retained, unsigned short packetid,
-		MQTTString topicName, unsigned char* payload, int payloadlen)
+int MQTTSerialize_publishHeader(unsigned char* buf, int buflen, unsigned char dup, int qos, unsigned char retained,
+		unsigned short packetid, MQTTString topicName, int payloadlen)
 {
 	unsigned char *ptr = buf;
 	MQTTHeader header = {0};
@@ -61,7 +61,8 @@ int MQTTSerialize_publish(unsigned char* buf, int buflen, unsigned char dup, int
 	int rc = 0;
 
 	FUNC_ENTRY;
-	if (MQTTPacket_len(rem_len = MQTTSerialize_publishLength(qos, topicName, payloadlen)) > buflen)
+	rem_len = MQTTSerialize_publishLength(qos, topicName, payloadlen);
+	if (MQTTPacket_len(rem_len) - payloadlen > buflen)
 	{
 		rc = MQTTPACKET_BUFFER_TOO_SHORT;
 		goto exit;
@@ -80,9 +81,6 @@ int MQTTSerialize_publish(unsigned char* buf, int buflen, unsigned char dup, int
 	if (qos > 0)
 		writeInt(&ptr, packetid);
 
-	memcpy(ptr, payload, payloadlen);
-	ptr += payloadlen;
-
 	rc = ptr - buf;
 
 exit:
@@ -91,6 +89,41 @@ exit:
 }
 
 
+/**
+  * Serializes the supplied publish data into the supplied buffer, ready for sending
+  * @param buf the buffer into which the packet will be serialized
+  * @param buflen the length in bytes of the supplied buffer
+  * @param dup integer - the MQTT dup flag
+  * @param qos integer - the MQTT QoS value
+  * @param retained integer - the MQTT retained flag
+  * @param packetid integer - the MQTT packet identifier
+  * @param topicName MQTTString - the MQTT topic in the publish
+  * @param payload byte buffer - the MQTT publish payload
+  * @param payloadlen integer - the length of the MQTT payload
+  * @return the length of the serialized data.  <= 0 indicates error
+  */
+int MQTTSerialize_publish(unsigned char* buf, int buflen, unsigned char dup, int qos, unsigned char retained, unsigned short packetid,
+		MQTTString topicName, unsigned char* payload, int payloadlen)
+{
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (MQTTPacket_len(MQTTSerialize_publishLength(qos, topicName, payloadlen)) > buflen)
+	{
+		rc = MQTTPACKET_BUFFER_TOO_SHORT;
+		goto exit;
+	}
+
+	rc = MQTTSerialize_publishHeader(buf, buflen, dup, qos, retained, packetid, topicName, payloadlen);
+	memcpy(&buf[rc], payload, payloadlen);
+	rc += payloadlen;
+
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
 
 /**
   * Serializes the ack packet into the supplied buffer.
@@ -366,7 +366,9 @@ int test1(struct Options options)
 int test2(struct Options options)
 {
 	int rc = 0;
+	int len = 0;
 	unsigned char buf[100];
+	unsigned char buf2[100];
 	int buflen = sizeof(buf);
 
 	unsigned char dup = 0;
@@ -391,7 +393,7 @@ int test2(struct Options options)
 	MyLog(LOGA_INFO, "Starting test 2 - serialization of publish and back");
 
 	topicString.cstring = "mytopic";
-	rc = MQTTSerialize_publish(buf, buflen, dup, qos, retained, msgid, topicString,
+	rc = len = MQTTSerialize_publish(buf, buflen, dup, qos, retained, msgid, topicString,
 			payload, payloadlen);
 	assert("good rc from serialize publish", rc > 0, "rc was %d\n", rc);
 
@@ -414,6 +416,12 @@ int test2(struct Options options)
 	assert("payloads should be the same",
 						memcmp(payload, payload2, payloadlen) == 0, "payloads were different %s\n", "");
 
+	/* the header on its own is the packet without its payload */
+	rc = MQTTSerialize_publishHeader(buf2, sizeof(buf2), dup, qos, retained, msgid, topicString, payloadlen);
+	assert("good rc from serialize publish header", rc > 0, "rc was %d\n", rc);
+	assert("header should be the start of the packet",
+				rc == len - payloadlen && memcmp(buf, buf2, rc) == 0, "rc was %d\n", rc);
+
 /*exit:*/
 	MyLog(LOGA_INFO, "TEST2: test %s. %d tests run, %d failures.",
 			(failures == 0) ? "passed" : "failed", tests, failures);